@@ -0,0 +1,649 @@
+// Headless load generator for the chat server. Opens a crowd of bot clients
+// that speak the real protocol, measures join storms, broadcast fan-out
+// latency (idle, and again while uploads saturate the server) and upload
+// throughput, and prints the results as one JSON object on stdout.
+// Progress and errors go to stderr.
+
+#include <iostream>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <csignal>
+#include <cstdlib>
+#include <iomanip>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <vector>
+
+#include "../shared/platform.h"
+#ifndef _WIN32
+    #include <netinet/tcp.h>
+#endif
+#include "../shared/constants.h"
+#include "../shared/protocol.h"
+#include "../shared/hello.h"
+#include "../shared/xxhash64.h"
+
+using Clock = std::chrono::steady_clock;
+
+// Cross-platform socket initialization
+class SocketInitializer {
+public:
+    SocketInitializer() {
+#ifdef _WIN32
+        WSADATA wsaData;
+        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+            throw std::runtime_error("WSAStartup failed");
+        }
+#endif
+    }
+
+    ~SocketInitializer() {
+#ifdef _WIN32
+        WSACleanup();
+#endif
+    }
+};
+
+// Bench messages carry this marker followed by their scheduled send time
+constexpr const char* BENCH_MARKER = "~bench~";
+
+// How long to wait for joins, stragglers and upload replies
+constexpr auto JOIN_TIMEOUT = std::chrono::seconds(30);
+constexpr auto DRAIN_TIMEOUT = std::chrono::seconds(5);
+constexpr auto REPLY_TIMEOUT = std::chrono::seconds(60);
+
+// Background uploads of the loaded chat phase cycle over a file of this
+// size in pieces, never sending its last piece, so they never finish
+constexpr size_t LOAD_FILE_SIZE = 16 * 1024 * 1024;
+constexpr size_t LOAD_PIECE_SIZE = 1024 * 1024;
+
+struct BenchConfig {
+    std::string host = "127.0.0.1";
+    int clients = 50;             // Bots in the room
+    int senders = 5;              // Bots that send chat messages
+    double rate = 1000;           // Messages per second, all senders together
+    double duration = 5;          // Seconds of chat traffic
+    size_t message_size = 64;     // Chat payload bytes, padded after the timestamp
+    size_t upload_size = 64 * 1024 * 1024;  // 0 skips the upload phase
+    int load_uploads = 2;         // Uploads running through the loaded chat phase; 0 skips it
+    bool batching = false;        // Chat bots log in with HELLO and CAP_BATCHING, not USERNAME_SET
+};
+
+struct Bot {
+    std::string name;
+    SOCKET socket = INVALID_SOCKET;
+    RingBuffer input;
+    FrameParser parser;
+    bool joined = false;
+};
+
+int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now().time_since_epoch()).count();
+}
+
+bool send_all(SOCKET socket, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(socket, data, static_cast<int>(len), 0);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+bool send_frame(SOCKET socket, const std::string& frame) {
+    return send_all(socket, frame.data(), frame.size());
+}
+
+// Connect to the server, retrying for a while so a server that is still
+// starting up can be benchmarked straight away
+SOCKET connect_to(const std::string& host, bool retry) {
+    struct sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(PORT);
+    if (inet_pton(AF_INET, host.c_str(), &address.sin_addr) <= 0) {
+        throw std::runtime_error("Invalid server address: " + host);
+    }
+
+    auto deadline = Clock::now() + std::chrono::seconds(retry ? 5 : 0);
+    while (true) {
+        SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (s == INVALID_SOCKET) {
+            return INVALID_SOCKET;
+        }
+        if (connect(s, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == 0) {
+            int nodelay = 1;
+            setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&nodelay), sizeof(nodelay));
+            return s;
+        }
+        closesocket(s);
+        if (Clock::now() >= deadline) {
+            return INVALID_SOCKET;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+}
+
+// Latency samples and counters, owned by the receiver thread until it stops.
+// Messages due from loaded_since_ns on belong to the loaded phase.
+struct ReceiveStats {
+    std::vector<double> latencies_us;
+    std::vector<double> loaded_latencies_us;
+    std::atomic<int64_t> loaded_since_ns{INT64_MAX};
+    std::atomic<int64_t> deliveries{0};
+    std::atomic<int> joined{0};
+    std::atomic<int64_t> last_join_ns{0};
+    std::atomic<int> stats_replies{0};
+    std::atomic<int64_t> heap_allocs{-1};   // From the latest STATS reply, -1 if it has none
+};
+
+// Read every bot's socket until stop is set: record join notifications and
+// the latency of every bench message
+void receive_loop(std::vector<Bot>& bots, ReceiveStats& stats, std::atomic<bool>& stop) {
+    std::vector<struct pollfd> fds(bots.size());
+    for (size_t i = 0; i < bots.size(); i++) {
+        fds[i].fd = bots[i].socket;
+        fds[i].events = POLLIN;
+    }
+
+    size_t marker_length = std::strlen(BENCH_MARKER);
+    while (!stop) {
+        int ready = poll(fds.data(), static_cast<unsigned long>(fds.size()), 50);
+        if (ready <= 0) {
+            continue;
+        }
+        int64_t arrival = now_ns();
+
+        for (size_t i = 0; i < bots.size(); i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            Bot& bot = bots[i];
+            bot.input.prepare(BUFFER_SIZE);
+            ssize_t bytes_received = recv(bot.socket, bot.input.write_ptr(),
+                                          static_cast<int>(bot.input.writable()), 0);
+            if (bytes_received <= 0) {
+                fds[i].fd = -1;     // Ignored by poll() from now on
+                continue;
+            }
+            bot.input.commit(bytes_received);
+
+            FrameView frame;
+            while (bot.parser.next(bot.input, frame) == ParseResult::FRAME) {
+                if (frame.header.type == MESSAGE) {
+                    std::string_view text = frame.view();
+                    size_t marker = text.find(BENCH_MARKER);
+                    if (marker != std::string_view::npos) {
+                        int64_t sent = std::strtoll(text.data() + marker + marker_length, nullptr, 10);
+                        auto& samples = sent >= stats.loaded_since_ns ? stats.loaded_latencies_us
+                                                                      : stats.latencies_us;
+                        samples.push_back((arrival - sent) / 1000.0);
+                        stats.deliveries++;
+                    } else if (!bot.joined && text == "*** " + bot.name + " joined the chat ***") {
+                        bot.joined = true;
+                        stats.last_join_ns = arrival;
+                        stats.joined++;
+                    }
+                } else if (frame.header.type == STATS) {
+                    std::string_view report = frame.view();
+                    size_t line = report.find("\nheap_allocs ");
+                    stats.heap_allocs = line == std::string_view::npos
+                                            ? -1
+                                            : std::strtoll(report.data() + line + 13, nullptr, 10);
+                    stats.stats_replies++;
+                }
+            }
+        }
+    }
+}
+
+double percentile(const std::vector<double>& sorted, double q) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = static_cast<size_t>(q * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+// Wait on a dedicated connection for the next upload reply, skipping chat;
+// id receives the transfer ID it carries
+bool read_reply(SOCKET socket, RingBuffer& input, FrameParser& parser, uint8_t& type, uint64_t& id) {
+    auto deadline = Clock::now() + REPLY_TIMEOUT;
+    while (Clock::now() < deadline) {
+        FrameView frame;
+        ParseResult result = parser.next(input, frame);
+        if (result == ParseResult::INVALID) {
+            return false;
+        }
+        if (result == ParseResult::FRAME) {
+            type = frame.header.type;
+            if ((type == FILE_READY || type == FILE_DONE || type == FILE_ERROR) &&
+                frame.header.length >= sizeof(uint64_t)) {
+                id = get_u64(frame.payload);
+                return true;
+            }
+            continue;
+        }
+        input.prepare(BUFFER_SIZE);
+        ssize_t bytes_received = recv(socket, input.write_ptr(), static_cast<int>(input.writable()), 0);
+        if (bytes_received <= 0) {
+            return false;
+        }
+        input.commit(bytes_received);
+    }
+    return false;
+}
+
+// Upload size bytes of random data over one connection; returns MB/s, or
+// a negative value on failure
+double run_upload(const BenchConfig& config) {
+    std::string data(config.upload_size, '\0');
+    std::mt19937_64 generator{std::random_device{}()};
+    for (size_t i = 0; i + sizeof(uint64_t) <= data.size(); i += sizeof(uint64_t)) {
+        uint64_t word = generator();
+        std::memcpy(&data[i], &word, sizeof(word));
+    }
+
+    SOCKET socket = connect_to(config.host, false);
+    if (socket == INVALID_SOCKET) {
+        return -1;
+    }
+    std::string name = "bench-upload-" + std::to_string(generator() % 1000000);
+    send_frame(socket, make_frame(USERNAME_SET, name));
+
+    RingBuffer input;
+    FrameParser parser;
+    uint8_t type = 0;
+    uint64_t transfer_id = 0;
+    auto start = Clock::now();
+
+    std::string header(2 * sizeof(uint64_t), '\0');
+    put_u64(&header[0], data.size());
+    put_u64(&header[sizeof(uint64_t)], XxHash64::hash(data.data(), data.size()));
+    header += name + ".bin";
+    if (!send_frame(socket, make_frame(FILE_TRANSFER, header)) ||
+        !read_reply(socket, input, parser, type, transfer_id) || type != FILE_READY) {
+        closesocket(socket);
+        return -1;
+    }
+
+    for (size_t offset = 0; offset < data.size(); offset += FILE_CHUNK_SIZE) {
+        size_t length = std::min<size_t>(FILE_CHUNK_SIZE, data.size() - offset);
+        char chunk_header[FRAME_HEADER_SIZE + STREAMED_META_SIZE];
+        FrameHeader frame_header;
+        frame_header.type = FILE_CHUNK;
+        frame_header.flags = FRAME_FLAG_STREAMED;
+        frame_header.length = static_cast<uint32_t>(STREAMED_META_SIZE + length);
+        encode_header(chunk_header, frame_header);
+        put_u64(chunk_header + FRAME_HEADER_SIZE, transfer_id);
+        put_u64(chunk_header + FRAME_HEADER_SIZE + sizeof(uint64_t), offset);
+        if (!send_all(socket, chunk_header, sizeof(chunk_header)) ||
+            !send_all(socket, data.data() + offset, length)) {
+            closesocket(socket);
+            return -1;
+        }
+    }
+
+    uint64_t done_id = 0;
+    bool done = read_reply(socket, input, parser, type, done_id) && type == FILE_DONE &&
+                done_id == transfer_id;
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    send_frame(socket, make_frame(DISCONNECT));
+    closesocket(socket);
+    return done ? data.size() / 1024.0 / 1024.0 / seconds : -1;
+}
+
+// Keep uploading over one connection until stop is set; adds the file
+// bytes sent to bytes. The transfer is offered in full but its last piece
+// is never sent, so the server stores the same pieces again and again.
+void run_load(const BenchConfig& config, std::atomic<bool>& stop, std::atomic<int64_t>& bytes) {
+    std::string data(LOAD_FILE_SIZE, '\0');
+    std::mt19937_64 generator{std::random_device{}()};
+    for (size_t i = 0; i + sizeof(uint64_t) <= data.size(); i += sizeof(uint64_t)) {
+        uint64_t word = generator();
+        std::memcpy(&data[i], &word, sizeof(word));
+    }
+
+    SOCKET socket = connect_to(config.host, false);
+    if (socket == INVALID_SOCKET) {
+        return;
+    }
+    // A blocked send gives up now and then to look at stop
+#ifdef _WIN32
+    DWORD timeout = 200;
+#else
+    struct timeval timeout = {0, 200000};
+#endif
+    setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+
+    std::string name = "bench-load-" + std::to_string(generator() % 1000000);
+    send_frame(socket, make_frame(USERNAME_SET, name));
+
+    RingBuffer input;
+    FrameParser parser;
+    uint8_t type = 0;
+    uint64_t transfer_id = 0;
+    std::string header(2 * sizeof(uint64_t), '\0');
+    put_u64(&header[0], data.size());
+    put_u64(&header[sizeof(uint64_t)], XxHash64::hash(data.data(), data.size()));
+    header += name + ".bin";
+    if (!send_frame(socket, make_frame(FILE_TRANSFER, header)) ||
+        !read_reply(socket, input, parser, type, transfer_id) || type != FILE_READY) {
+        closesocket(socket);
+        return;
+    }
+
+    std::string piece(FRAME_HEADER_SIZE + STREAMED_META_SIZE + LOAD_PIECE_SIZE, '\0');
+    size_t offset = 0;
+    while (!stop) {
+        FrameHeader frame_header;
+        frame_header.type = FILE_CHUNK;
+        frame_header.flags = FRAME_FLAG_STREAMED;
+        frame_header.length = static_cast<uint32_t>(STREAMED_META_SIZE + LOAD_PIECE_SIZE);
+        encode_header(&piece[0], frame_header);
+        put_u64(&piece[FRAME_HEADER_SIZE], transfer_id);
+        put_u64(&piece[FRAME_HEADER_SIZE + sizeof(uint64_t)], offset);
+        std::memcpy(&piece[FRAME_HEADER_SIZE + STREAMED_META_SIZE], data.data() + offset, LOAD_PIECE_SIZE);
+
+        // Whole pieces only: a timed-out send carries on with the rest
+        const char* next = piece.data();
+        size_t left = piece.size();
+        while (left > 0) {
+            ssize_t sent = send(socket, next, static_cast<int>(left), 0);
+            if (sent > 0) {
+                next += sent;
+                left -= sent;
+            } else if (!socket_would_block()) {
+                closesocket(socket);
+                return;
+            } else if (stop && left == piece.size()) {
+                break;
+            }
+        }
+        bytes += LOAD_PIECE_SIZE - std::min(left, LOAD_PIECE_SIZE);
+        offset = (offset + LOAD_PIECE_SIZE) % (data.size() - LOAD_PIECE_SIZE);
+    }
+    closesocket(socket);
+}
+
+struct ChatPhase {
+    int64_t sent = 0;
+    int64_t expected = 0;        // Deliveries the phase should make
+    int64_t deliveries = 0;
+    double send_seconds = 0;
+    double seconds = 0;          // Until the last delivery or the drain timeout
+};
+
+// Send chat for config.duration seconds and wait for it to be delivered;
+// delivered_before is the delivery count of earlier phases. Messages are
+// paced on a fixed schedule and stamped with the time they were due, so a
+// stalled server can't hide its backlog.
+ChatPhase run_chat(std::vector<Bot>& bots, const BenchConfig& config, ReceiveStats& stats,
+                   int64_t delivered_before) {
+    ChatPhase phase;
+    int64_t total = static_cast<int64_t>(config.rate * config.duration);
+    double interval_ns = 1e9 / config.rate;
+    int64_t start = now_ns();
+    for (; phase.sent < total; phase.sent++) {
+        int64_t due = start + static_cast<int64_t>(phase.sent * interval_ns);
+        int64_t wait = due - now_ns();
+        if (wait > 0) {
+            std::this_thread::sleep_for(std::chrono::nanoseconds(wait));
+        }
+
+        std::string message = BENCH_MARKER + std::to_string(due) + " ";
+        if (message.size() < config.message_size) {
+            message.append(config.message_size - message.size(), 'x');
+        }
+        if (!send_frame(bots[phase.sent % config.senders].socket, make_frame(MESSAGE, message))) {
+            throw std::runtime_error("Send failed");
+        }
+    }
+    phase.send_seconds = (now_ns() - start) / 1e9;
+
+    // Senders don't get their own messages back
+    phase.expected = phase.sent * (config.clients - 1);
+    auto drain_deadline = Clock::now() + DRAIN_TIMEOUT;
+    while (stats.deliveries - delivered_before < phase.expected && Clock::now() < drain_deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    phase.deliveries = stats.deliveries - delivered_before;
+    phase.seconds = (now_ns() - start) / 1e9;
+    return phase;
+}
+
+// The server's heap allocation count so far, asked for over the first
+// bot's connection; -1 if the server does not report it
+int64_t server_heap_allocs(std::vector<Bot>& bots, ReceiveStats& stats) {
+    int replies = stats.stats_replies;
+    if (!send_frame(bots[0].socket, make_frame(STATS))) {
+        return -1;
+    }
+    auto deadline = Clock::now() + REPLY_TIMEOUT;
+    while (stats.stats_replies == replies && Clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return stats.stats_replies == replies ? -1 : stats.heap_allocs.load();
+}
+
+// Percentiles of sorted latency samples as a JSON object
+std::string latency_json(const std::vector<double>& sorted) {
+    std::ostringstream json;
+    json << std::fixed << std::setprecision(1);
+    json << "{\"p50\":" << percentile(sorted, 0.5)
+         << ",\"p99\":" << percentile(sorted, 0.99)
+         << ",\"p999\":" << percentile(sorted, 0.999)
+         << ",\"max\":" << (sorted.empty() ? 0 : sorted.back()) << "}";
+    return json.str();
+}
+
+void show_usage(const char* program) {
+    std::cerr << "Usage: " << program << " [options]" << std::endl;
+    std::cerr << "  --host=ADDRESS       Server address (default 127.0.0.1)" << std::endl;
+    std::cerr << "  --clients=N          Bots in the room (default 50)" << std::endl;
+    std::cerr << "  --senders=N          Bots sending chat messages (default 5)" << std::endl;
+    std::cerr << "  --rate=N             Messages per second in total (default 1000)" << std::endl;
+    std::cerr << "  --duration=SECONDS   Length of the chat phase (default 5)" << std::endl;
+    std::cerr << "  --message-size=N     Chat payload bytes (default 64)" << std::endl;
+    std::cerr << "  --upload=BYTES       Upload size, 0 to skip (default 67108864)" << std::endl;
+    std::cerr << "  --load=N             Uploads running through a second, loaded chat phase," << std::endl;
+    std::cerr << "                       0 to skip (default 2)" << std::endl;
+    std::cerr << "  --batching           Bots ask for batched output in HELLO (epoll servers)" << std::endl;
+}
+
+// Match "--name=value" and return the value part
+bool option_value(const std::string& arg, const std::string& name, std::string& value) {
+    if (arg.compare(0, name.size() + 1, name + "=") != 0) {
+        return false;
+    }
+    value = arg.substr(name.size() + 1);
+    return true;
+}
+
+bool parse_args(int argc, char* argv[], BenchConfig& config) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        std::string value;
+        if (option_value(arg, "--host", value)) {
+            config.host = value;
+        } else if (option_value(arg, "--clients", value)) {
+            config.clients = std::atoi(value.c_str());
+        } else if (option_value(arg, "--senders", value)) {
+            config.senders = std::atoi(value.c_str());
+        } else if (option_value(arg, "--rate", value)) {
+            config.rate = std::atof(value.c_str());
+        } else if (option_value(arg, "--duration", value)) {
+            config.duration = std::atof(value.c_str());
+        } else if (option_value(arg, "--message-size", value)) {
+            config.message_size = std::strtoull(value.c_str(), nullptr, 10);
+        } else if (option_value(arg, "--upload", value)) {
+            config.upload_size = std::strtoull(value.c_str(), nullptr, 10);
+        } else if (option_value(arg, "--load", value)) {
+            config.load_uploads = std::atoi(value.c_str());
+        } else if (arg == "--batching") {
+            config.batching = true;
+        } else {
+            return false;
+        }
+    }
+    return config.clients >= 2 && config.senders >= 1 && config.senders <= config.clients &&
+           config.rate > 0 && config.duration > 0 && config.load_uploads >= 0 &&
+           config.message_size <= static_cast<size_t>(MAX_MESSAGE_LENGTH);
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    if (!parse_args(argc, argv, config)) {
+        show_usage(argv[0]);
+        return 1;
+    }
+
+    try {
+        SocketInitializer socket_init;
+#ifndef _WIN32
+        // Failed sends are reported through send() instead
+        std::signal(SIGPIPE, SIG_IGN);
+#endif
+
+        // Connect everyone first, so the storm measures the server alone
+        std::vector<Bot> bots(config.clients);
+        std::string run_tag = std::to_string(std::random_device{}() % 100000);
+        for (int i = 0; i < config.clients; i++) {
+            bots[i].name = "bot" + std::to_string(i) + "-" + run_tag;
+            bots[i].socket = connect_to(config.host, i == 0);
+            if (bots[i].socket == INVALID_SOCKET) {
+                throw std::runtime_error("Cannot connect bot " + std::to_string(i) + " to " + config.host);
+            }
+        }
+
+        ReceiveStats stats;
+        std::atomic<bool> stop{false};
+        std::thread receiver(receive_loop, std::ref(bots), std::ref(stats), std::ref(stop));
+
+        // Join storm: every bot logs in at once; done when each has seen
+        // its own join announced
+        std::cerr << "Join storm: " << config.clients << " clients..." << std::endl;
+        int64_t storm_start = now_ns();
+        for (Bot& bot : bots) {
+            std::string login = make_frame(USERNAME_SET, bot.name);
+            if (config.batching) {
+                Hello hello;
+                hello.capabilities = CAP_BATCHING;
+                hello.username = bot.name;
+                login = make_frame(HELLO, encode_hello(hello, false));
+            }
+            if (!send_frame(bot.socket, login)) {
+                throw std::runtime_error("Login failed for " + bot.name);
+            }
+        }
+        auto join_deadline = Clock::now() + JOIN_TIMEOUT;
+        while (stats.joined < config.clients && Clock::now() < join_deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (stats.joined < config.clients) {
+            throw std::runtime_error("Only " + std::to_string(stats.joined) + " of " +
+                                     std::to_string(config.clients) + " clients joined");
+        }
+        double join_storm_ms = (stats.last_join_ns - storm_start) / 1e6;
+
+        std::cerr << "Chat: " << config.rate << " msg/s from " << config.senders
+                  << " senders for " << config.duration << "s..." << std::endl;
+        // Two STATS requests back to back first: the difference is what
+        // answering one costs, and is taken off the chat phase's count
+        int64_t allocs_before = server_heap_allocs(bots, stats);
+        int64_t allocs_start = server_heap_allocs(bots, stats);
+        ChatPhase chat = run_chat(bots, config, stats, 0);
+        int64_t allocs_end = server_heap_allocs(bots, stats);
+        double allocs_per_message = -1;
+        if (allocs_before >= 0 && allocs_start >= 0 && allocs_end >= 0) {
+            int64_t allocs = (allocs_end - allocs_start) - (allocs_start - allocs_before);
+            allocs_per_message = std::max<int64_t>(allocs, 0) / static_cast<double>(chat.sent);
+        }
+
+        // The same chat again while uploads keep the server busy moving
+        // file data
+        ChatPhase loaded;
+        double load_rate = 0;
+        if (config.load_uploads > 0) {
+            std::cerr << "Loaded chat: the same with " << config.load_uploads << " uploads running..." << std::endl;
+            std::atomic<bool> stop_load{false};
+            std::atomic<int64_t> load_bytes{0};
+            std::vector<std::thread> loaders;
+            for (int i = 0; i < config.load_uploads; i++) {
+                loaders.emplace_back(run_load, std::cref(config), std::ref(stop_load), std::ref(load_bytes));
+            }
+            // Let the uploads get going first
+            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+            int64_t load_start = now_ns();
+            stats.loaded_since_ns = load_start;
+            load_bytes = 0;
+            loaded = run_chat(bots, config, stats, stats.deliveries);
+            load_rate = load_bytes / 1024.0 / 1024.0 / ((now_ns() - load_start) / 1e9);
+            stop_load = true;
+            for (std::thread& loader : loaders) {
+                loader.join();
+            }
+        }
+
+        double upload_rate = 0;
+        if (config.upload_size > 0) {
+            std::cerr << "Upload: " << config.upload_size << " bytes..." << std::endl;
+            upload_rate = run_upload(config);
+            if (upload_rate < 0) {
+                std::cerr << "Upload failed" << std::endl;
+            }
+        }
+
+        stop = true;
+        receiver.join();
+        for (Bot& bot : bots) {
+            send_frame(bot.socket, make_frame(DISCONNECT));
+            closesocket(bot.socket);
+        }
+
+        std::vector<double>& latencies = stats.latencies_us;
+        std::sort(latencies.begin(), latencies.end());
+        std::vector<double>& loaded_latencies = stats.loaded_latencies_us;
+        std::sort(loaded_latencies.begin(), loaded_latencies.end());
+
+        std::ostringstream json;
+        json << std::fixed << std::setprecision(1);
+        json << "{\"clients\":" << config.clients
+             << ",\"senders\":" << config.senders
+             << ",\"batching\":" << (config.batching ? "true" : "false")
+             << ",\"join_storm_ms\":" << join_storm_ms
+             << ",\"messages_sent\":" << chat.sent
+             << ",\"send_rate\":" << chat.sent / chat.send_seconds
+             << ",\"deliveries\":" << chat.deliveries
+             << ",\"expected_deliveries\":" << chat.expected
+             << ",\"msgs_per_sec\":" << chat.deliveries / chat.seconds
+             << ",\"fanout_latency_us\":" << latency_json(latencies);
+        if (allocs_per_message >= 0) {
+            json << std::setprecision(3) << ",\"server_heap_allocs_per_message\":" << allocs_per_message
+                 << std::setprecision(1);
+        }
+        if (config.load_uploads > 0) {
+            json << ",\"loaded_deliveries\":" << loaded.deliveries
+                 << ",\"loaded_expected_deliveries\":" << loaded.expected
+                 << ",\"loaded_fanout_latency_us\":" << latency_json(loaded_latencies)
+                 << ",\"load_mb_per_s\":" << load_rate;
+        }
+        json << ",\"upload_bytes\":" << config.upload_size
+             << ",\"upload_mb_per_s\":" << upload_rate << "}";
+        std::cout << json.str() << std::endl;
+        return upload_rate < 0 ? 1 : 0;
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
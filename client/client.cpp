@@ -1,34 +1,31 @@
 #include <iostream>
+#include <algorithm>
 #include <string>
 #include <fstream>
+#include <sstream>
 #include <thread>
 #include <atomic>
 #include <chrono>
 #include <cstring>
 #include <csignal>
+#include <cstdlib>
 #include <iomanip>
+#include <memory>
 
-// Platform-specific includes
+#include "../shared/platform.h"
 #ifdef _WIN32
-    #include <winsock2.h>
-    #include <ws2tcpip.h>
     #include <conio.h>
-    #pragma comment(lib, "ws2_32.lib")
-    typedef int socklen_t;
 #else
-    #include <sys/socket.h>
-    #include <netinet/in.h>
-    #include <arpa/inet.h>
-    #include <unistd.h>
-    #include <fcntl.h>
     #include <termios.h>
-    #define SOCKET int
-    #define INVALID_SOCKET -1
-    #define SOCKET_ERROR -1
-    #define closesocket close
 #endif
 
 #include "../shared/constants.h"
+#include "../shared/protocol.h"
+#include "../shared/hello.h"
+#include "connection.h"
+#include "file_downloader.h"
+#include "presence.h"
+#include "peer_transfer.h"
 
 // Cross-platform socket initialization
 class SocketInitializer {
@@ -49,10 +46,26 @@ public:
     }
 };
 
+// Offered in HELLO
+constexpr uint32_t CLIENT_CAPABILITIES = CAP_COMPRESSION | CAP_BATCHING | CAP_RESUME;
+constexpr uint32_t RECEIVE_WINDOW = 1024 * 1024;   // File data queued for us per turn, at most
+
+// A lost connection is retried for about as long as the server keeps the
+// session (its default), backing off between attempts
+constexpr auto RECONNECT_PERIOD = std::chrono::seconds(30);
+constexpr auto RECONNECT_MAX_DELAY = std::chrono::seconds(2);
+
 // Global state
 std::atomic<bool> client_running{true};
 std::atomic<bool> connected{false};
+std::atomic<bool> reconnecting{false};
 SOCKET client_socket = INVALID_SOCKET;
+struct sockaddr_in server_address;
+
+DownloadManager downloads;
+Roster roster;
+std::unique_ptr<PeerTransfers> peers;         // Set up before the I/O loop starts
+std::unique_ptr<ChatConnection> connection;   // Everything sent goes through it
 
 // Utility function to get error message
 std::string get_socket_error() {
@@ -72,129 +85,70 @@ std::string get_timestamp() {
     return ss.str();
 }
 
-// Receive messages from server
-void receive_messages(SOCKET socket) {
-    char buffer[BUFFER_SIZE];
-    
-    while (client_running && connected) {
-        ssize_t bytes_received = recv(socket, buffer, BUFFER_SIZE - 1, 0);
-        
-        if (bytes_received <= 0) {
-            if (client_running) {
-                std::cout << "\n✗ Disconnected from server" << std::endl;
-                connected = false;
-                client_running = false;
-            }
-            break;
-        }
-        
-        buffer[bytes_received] = '\0';
-        std::cout << "\r" << get_timestamp() << " " << buffer << std::endl;
-        std::cout << "> " << std::flush;
-    }
+// The login: a HELLO offering our capabilities, resuming session unless
+// it is 0
+std::string hello_frame(const std::string& username, uint64_t session) {
+    Hello hello;
+    hello.capabilities = CLIENT_CAPABILITIES;
+    hello.receive_window = RECEIVE_WINDOW;
+    hello.session = session;
+    hello.username = username;
+    return make_frame(HELLO, encode_hello(hello, false));
 }
 
-// Send file to server
-bool send_file(SOCKET socket, const std::string& filepath, const std::string& username) {
-    std::ifstream file(filepath, std::ios::binary | std::ios::ate);
-    
-    if (!file.is_open()) {
-        std::cerr << "✗ Failed to open file: " << filepath << std::endl;
-        return false;
+// Frames from the server that the connection leaves to us; runs on its
+// I/O loop
+void handle_frame(const FrameView& frame) {
+    if (frame.header.type == HELLO) {
+        Hello hello;
+        if (!reconnecting.exchange(false) || !decode_hello(frame, hello)) {
+            return;
+        }
+        if (hello.resumed) {
+            // Same room and roster entry; only the roster may have moved on
+            std::cout << "\r✓ Reconnected, session resumed" << std::endl;
+            connection->send(roster.resync_request());
+        } else {
+            std::cout << "\r✓ Reconnected as a new session, back in " << DEFAULT_ROOM << std::endl;
+        }
+        std::cout << "> " << std::flush;
     }
-
-    // Extract filename from path
-    std::string filename = filepath;
-    size_t last_slash = filepath.find_last_of("/\\");
-    if (last_slash != std::string::npos) {
-        filename = filepath.substr(last_slash + 1);
+    else if (frame.header.type == MESSAGE) {
+        std::cout << "\r" << get_timestamp() << " " << frame.text() << std::endl;
+        std::cout << "> " << std::flush;
     }
-    
-    int64_t file_size = file.tellg();
-    file.seekg(0, std::ios::beg);
-
-    // Prepare header
-    char header[BUFFER_SIZE];
-    int32_t message_type = FILE_TRANSFER;
-    int32_t filename_length = filename.size();
-
-    std::memcpy(header, &message_type, sizeof(int32_t));
-    std::memcpy(header + sizeof(int32_t), &filename_length, sizeof(int32_t));
-    std::memcpy(header + sizeof(int32_t) * 2, filename.c_str(), filename_length);
-    std::memcpy(header + sizeof(int32_t) * 2 + filename_length, &file_size, sizeof(int64_t));
-
-    int header_size = sizeof(int32_t) * 2 + filename_length + sizeof(int64_t);
-    
-    // Send header
-    if (send(socket, header, header_size, 0) <= 0) {
-        std::cerr << "✗ Failed to send file header" << std::endl;
-        file.close();
-        return false;
+    else if (frame.header.type == CLIENT_LIST) {
+        roster.apply_snapshot(frame);
     }
-
-    // Wait for acknowledgment
-    char ack[6];
-    if (recv(socket, ack, 5, 0) <= 0) {
-        std::cerr << "✗ Failed to receive acknowledgment" << std::endl;
-        file.close();
-        return false;
+    else if (frame.header.type == PRESENCE) {
+        if (roster.apply_delta(frame) == Roster::Update::OUT_OF_SYNC) {
+            connection->send(roster.resync_request());
+        }
     }
-
-    // Send file data
-    char buffer[FILE_BUFFER_SIZE];
-    int64_t total_sent = 0;
-    auto start_time = std::chrono::steady_clock::now();
-    
-    std::cout << "Uploading " << filename << " (" << file_size << " bytes)..." << std::endl;
-    
-    while (!file.eof()) {
-        file.read(buffer, FILE_BUFFER_SIZE);
-        std::streamsize bytes_read = file.gcount();
-        
-        if (bytes_read > 0) {
-            ssize_t sent = send(socket, buffer, bytes_read, 0);
-            if (sent <= 0) {
-                std::cerr << "✗ Failed to send file data" << std::endl;
-                file.close();
-                return false;
-            }
-            total_sent += sent;
-            
-            // Show progress
-            int progress = (total_sent * 100) / file_size;
-            std::cout << "\rProgress: " << progress << "% (" 
-                     << total_sent << "/" << file_size << " bytes)" << std::flush;
+    else if (frame.header.type == PEER_OFFER) {
+        if (frame.header.flags & FRAME_FLAG_REPLY) {
+            peers->on_offer_reply(frame);
+        } else {
+            peers->on_offer(frame);
         }
     }
-
-    file.close();
-    
-    auto end_time = std::chrono::steady_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
-    double speed = (total_sent / 1024.0 / 1024.0) / (duration.count() / 1000.0);
-    
-    std::cout << "\n✓ File sent: " << filename << " (" << total_sent << " bytes, " 
-             << speed << " MB/s)" << std::endl;
-    
-    return true;
+    else if (frame.header.type == PEER_RELAY) {
+        peers->on_relay(frame);
+    }
+    else if (frame.header.type == STATS) {
+        std::cout << "\r── Server stats ──\n" << frame.text() << "> " << std::flush;
+    }
 }
 
 // Send text message to server
-bool send_message(SOCKET socket, const std::string& text) {
-    char message[BUFFER_SIZE];
-    int32_t message_type = MESSAGE;
-    int32_t message_length = text.size();
-    
-    if (message_length > MAX_MESSAGE_LENGTH) {
+bool send_message(const std::string& text) {
+    if (text.size() > static_cast<size_t>(MAX_MESSAGE_LENGTH)) {
         std::cerr << "✗ Message too long (max " << MAX_MESSAGE_LENGTH << " characters)" << std::endl;
         return false;
     }
     
-    std::memcpy(message, &message_type, sizeof(int32_t));
-    std::memcpy(message + sizeof(int32_t), text.c_str(), message_length);
-    
-    ssize_t sent = send(socket, message, sizeof(int32_t) + message_length, 0);
-    return sent > 0;
+    connection->send(make_frame(MESSAGE, text));
+    return true;
 }
 
 // Display help information
@@ -204,12 +158,50 @@ void show_help() {
     std::cout << "╠════════════════════════════════════════════════╣" << std::endl;
     std::cout << "║ /help               - Show this help message   ║" << std::endl;
     std::cout << "║ /sendfile <path>    - Send a file to server    ║" << std::endl;
+    std::cout << "║ /sendfile -n N <path> - ... over N connections ║" << std::endl;
+    std::cout << "║ /getfile <name>     - Download a shared file   ║" << std::endl;
+    std::cout << "║ /sendto <user> <path> - Send to one person     ║" << std::endl;
+    std::cout << "║ /uploads            - Show uploads in progress ║" << std::endl;
+    std::cout << "║ /join #room         - Chat in another room     ║" << std::endl;
+    std::cout << "║ /part               - Go back to #lobby        ║" << std::endl;
+    std::cout << "║ /who                - List who is online       ║" << std::endl;
+    std::cout << "║ /stats              - Show server metrics      ║" << std::endl;
     std::cout << "║ /quit or /exit      - Disconnect from server   ║" << std::endl;
     std::cout << "║ Any other text      - Send as chat message     ║" << std::endl;
     std::cout << "╚════════════════════════════════════════════════╝" << std::endl;
     std::cout << std::endl;
 }
 
+// Get a lost connection back, resuming its session: true once a new one
+// has sent the login
+bool reconnect(const std::string& username) {
+    uint64_t session = connection->session();
+    if (session == 0) {
+        return false;
+    }
+
+    std::cout << "\r✗ Connection lost, reconnecting..." << std::endl;
+    auto deadline = std::chrono::steady_clock::now() + RECONNECT_PERIOD;
+    std::chrono::milliseconds delay(100);
+    while (client_running && std::chrono::steady_clock::now() < deadline) {
+        SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (s != INVALID_SOCKET &&
+            connect(s, (struct sockaddr*)&server_address, sizeof(server_address)) != SOCKET_ERROR) {
+            closesocket(client_socket);
+            client_socket = s;
+            reconnecting = true;
+            connection->reconnect(s, hello_frame(username, session));
+            return true;
+        }
+        if (s != INVALID_SOCKET) {
+            closesocket(s);
+        }
+        std::this_thread::sleep_for(delay);
+        delay = std::min<std::chrono::milliseconds>(delay * 2, RECONNECT_MAX_DELAY);
+    }
+    return false;
+}
+
 // Signal handler
 void signal_handler(int signal) {
     std::cout << "\n✗ Disconnecting..." << std::endl;
@@ -218,8 +210,13 @@ void signal_handler(int signal) {
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <server_ip>" << std::endl;
+    // --relay-only: behind a firewall, so /sendto never waits for a
+    // direct connection
+    bool accept_direct = true;
+    if (argc == 3 && std::string(argv[2]) == "--relay-only") {
+        accept_direct = false;
+    } else if (argc != 2) {
+        std::cerr << "Usage: " << argv[0] << " <server_ip> [--relay-only]" << std::endl;
         std::cerr << "Example: " << argv[0] << " 192.168.1.100" << std::endl;
         return 1;
     }
@@ -233,6 +230,10 @@ int main(int argc, char* argv[]) {
     // Setup signal handlers
     std::signal(SIGINT, signal_handler);
     std::signal(SIGTERM, signal_handler);
+#ifndef _WIN32
+    // A peer hanging up mid-transfer is an error to report, not a reason to exit
+    std::signal(SIGPIPE, SIG_IGN);
+#endif
 
     try {
         // Initialize sockets
@@ -245,7 +246,7 @@ int main(int argc, char* argv[]) {
         }
 
         // Setup server address
-        struct sockaddr_in server_addr;
+        struct sockaddr_in& server_addr = server_address;
         std::memset(&server_addr, 0, sizeof(server_addr));
         server_addr.sin_family = AF_INET;
         server_addr.sin_port = htons(PORT);
@@ -276,24 +277,41 @@ int main(int argc, char* argv[]) {
             throw std::runtime_error("Invalid username");
         }
         
-        // Send username to server
-        char message[BUFFER_SIZE];
-        int32_t message_type = USERNAME_SET;
-        int32_t username_length = username.size();
-        
-        std::memcpy(message, &message_type, sizeof(int32_t));
-        std::memcpy(message + sizeof(int32_t), &username_length, sizeof(int32_t));
-        std::memcpy(message + sizeof(int32_t) * 2, username.c_str(), username_length);
-        
-        if (send(client_socket, message, sizeof(int32_t) * 2 + username_length, 0) <= 0) {
-            throw std::runtime_error("Failed to send username");
-        }
+        // Ready before the I/O loop can hand it a peer frame
+        PeerTransfers::Hooks hooks;
+        hooks.send = [](const std::string& frame) {
+            connection->send(frame);
+            return true;
+        };
+        hooks.upload = [](const std::string& filepath) { return connection->upload(filepath, 1).get(); };
+        hooks.download = [](const std::string& filename) {
+            std::string request = downloads.request(filename);
+            if (request.empty()) {
+                return false;
+            }
+            connection->send(request);
+            return true;
+        };
+        peers = std::make_unique<PeerTransfers>(hooks, accept_direct);
+
+        // Everything from here on goes through the connection's I/O loop,
+        // starting with the login
+        connection = std::make_unique<ChatConnection>(client_socket, server_address, downloads, handle_frame);
+        connection->send(hello_frame(username, 0));
+        std::thread io_thread([username] {
+            while (!connection->run() && client_running) {
+                if (!reconnect(username)) {
+                    std::cout << "\n✗ Disconnected from server" << std::endl;
+                    connected = false;
+                    client_running = false;
+                    return;
+                }
+            }
+        });
 
         std::cout << "\n✓ Logged in as '" << username << "'" << std::endl;
-        show_help();
 
-        // Start receiver thread
-        std::thread receiver_thread(receive_messages, client_socket);
+        show_help();
 
         // Main input loop
         std::string input;
@@ -316,40 +334,98 @@ int main(int argc, char* argv[]) {
             else if (input == "/help") {
                 show_help();
             }
-            else if (input.substr(0, 9) == "/sendfile") {
-                if (input.length() > 10) {
-                    std::string filepath = input.substr(10);
-                    // Remove leading/trailing whitespace
-                    size_t start = filepath.find_first_not_of(" \t");
-                    size_t end = filepath.find_last_not_of(" \t");
-                    if (start != std::string::npos && end != std::string::npos) {
-                        filepath = filepath.substr(start, end - start + 1);
-                        send_file(client_socket, filepath, username);
+            else if (input == "/join" || input.compare(0, 6, "/join ") == 0 || input == "/part") {
+                std::string room = input.length() > 6 ? input.substr(6) : "";
+                room.erase(0, room.find_first_not_of(" \t"));
+                room.erase(room.find_last_not_of(" \t") + 1);
+                if (input != "/part" && room.empty()) {
+                    std::cout << "Usage: /join #room" << std::endl;
+                } else {
+                    connection->send(make_frame(ROOM_JOIN, room));
+                }
+            }
+            else if (input == "/who") {
+                std::cout << roster.describe();
+            }
+            else if (input == "/uploads") {
+                std::cout << connection->describe_uploads();
+            }
+            else if (input == "/stats") {
+                connection->send(make_frame(STATS));
+            }
+            else if (input.substr(0, 8) == "/getfile") {
+                std::string filename = input.length() > 9 ? input.substr(9) : "";
+                size_t start = filename.find_first_not_of(" \t");
+                size_t end = filename.find_last_not_of(" \t");
+                if (start != std::string::npos) {
+                    filename = filename.substr(start, end - start + 1);
+                    std::string request = downloads.request(filename);
+                    if (request.empty()) {
+                        std::cerr << "✗ Cannot create " << DOWNLOADS_DIR << "/" << filename << std::endl;
+                    } else {
+                        connection->send(request);
                     }
                 } else {
-                    std::cout << "Usage: /sendfile <path/to/file>" << std::endl;
+                    std::cout << "Usage: /getfile <name>" << std::endl;
+                }
+            }
+            else if (input.compare(0, 8, "/sendto ") == 0) {
+                // The recipient's name, then the path
+                std::string args = input.substr(8);
+                args.erase(0, args.find_first_not_of(" \t"));
+                size_t name_end = args.find_first_of(" \t");
+                std::string recipient = args.substr(0, name_end);
+                std::string filepath = name_end == std::string::npos ? "" : args.substr(name_end);
+                filepath.erase(0, filepath.find_first_not_of(" \t"));
+                filepath.erase(filepath.find_last_not_of(" \t") + 1);
+                if (recipient.empty() || recipient.size() > MAX_USERNAME_LENGTH || filepath.empty()) {
+                    std::cout << "Usage: /sendto <user> <path/to/file>" << std::endl;
+                } else {
+                    std::string offer = peers->offer(recipient, filepath);
+                    if (!offer.empty()) {
+                        connection->send(offer);
+                    }
+                }
+            }
+            else if (input.substr(0, 9) == "/sendfile") {
+                std::string filepath = input.length() > 10 ? input.substr(10) : "";
+                int streams = 1;
+                // Optional "-n N": stripe the file across N connections
+                if (filepath.compare(0, 3, "-n ") == 0) {
+                    size_t count_end = filepath.find(' ', 3);
+                    streams = std::atoi(filepath.substr(3, count_end - 3).c_str());
+                    filepath = count_end == std::string::npos ? "" : filepath.substr(count_end + 1);
+                }
+                // Remove leading/trailing whitespace
+                size_t start = filepath.find_first_not_of(" \t");
+                size_t end = filepath.find_last_not_of(" \t");
+                if (start != std::string::npos && streams >= 1 && streams <= MAX_TRANSFER_STREAMS) {
+                    // Runs alongside chat and any other transfers; the
+                    // outcome is reported when the server confirms it
+                    filepath = filepath.substr(start, end - start + 1);
+                    connection->upload(filepath, streams);
+                } else {
+                    std::cout << "Usage: /sendfile [-n 1-" << MAX_TRANSFER_STREAMS
+                              << "] <path/to/file>" << std::endl;
                 }
             }
             else {
                 // Send as regular message
-                if (!send_message(client_socket, input)) {
-                    std::cerr << "✗ Failed to send message" << std::endl;
-                    break;
-                }
+                send_message(input);
             }
         }
 
-        // Send disconnect message
-        int32_t disconnect_type = DISCONNECT;
-        send(client_socket, (char*)&disconnect_type, sizeof(int32_t), 0);
+        // Send disconnect message once everything queued is out
+        connection->close();
 
         // Cleanup
         client_running = false;
         connected = false;
         
-        if (receiver_thread.joinable()) {
-            receiver_thread.join();
+        if (io_thread.joinable()) {
+            io_thread.join();
         }
+        peers->stop();
         
         closesocket(client_socket);
         
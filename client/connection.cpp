@@ -0,0 +1,892 @@
+#include "connection.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef __linux__
+    #include <sys/sendfile.h>
+#endif
+
+#include "../shared/constants.h"
+#include "../shared/hello.h"
+
+namespace {
+
+// Status lines share the terminal with the input prompt
+void print_status(const std::string& line) {
+    std::cout << "\r" << line << std::endl;
+    std::cout << "> " << std::flush;
+}
+
+// A pipe, or on Windows (where poll() only takes sockets) a pair of
+// loopback UDP sockets, that polls readable once written to
+bool open_wakeup(SOCKET& read_end, SOCKET& write_end) {
+#ifdef _WIN32
+    read_end = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    write_end = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t address_length = sizeof(address);
+    if (read_end == INVALID_SOCKET || write_end == INVALID_SOCKET ||
+        bind(read_end, (struct sockaddr*)&address, sizeof(address)) == SOCKET_ERROR ||
+        getsockname(read_end, (struct sockaddr*)&address, &address_length) == SOCKET_ERROR ||
+        connect(write_end, (struct sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
+        return false;
+    }
+#else
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return false;
+    }
+    read_end = fds[0];
+    write_end = fds[1];
+    for (int fd : fds) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+    set_nonblocking(read_end);
+    set_nonblocking(write_end);
+    return true;
+}
+
+void drain_wakeup(SOCKET read_end) {
+    char buffer[64];
+#ifdef _WIN32
+    while (recv(read_end, buffer, sizeof(buffer), 0) > 0) {
+    }
+#else
+    while (read(read_end, buffer, sizeof(buffer)) > 0) {
+    }
+#endif
+}
+
+void close_wakeup(SOCKET end) {
+    if (end != INVALID_SOCKET) {
+        ::closesocket(end);
+    }
+}
+
+} // namespace
+
+ChatConnection::Upload::~Upload() {
+#ifdef __linux__
+    if (fd >= 0) {
+        ::close(fd);
+    }
+#endif
+}
+
+ChatConnection::ChatConnection(SOCKET socket, const sockaddr_in& server_address,
+                               DownloadManager& downloads, FrameHandler on_frame)
+    : server_address_(server_address), downloads_(downloads), on_frame_(std::move(on_frame)) {
+    main_.socket = socket;
+    set_nonblocking(socket);
+    if (!open_wakeup(wake_read_, wake_write_)) {
+        close_wakeup(wake_read_);
+        close_wakeup(wake_write_);
+        throw std::runtime_error("Failed to set up the connection");
+    }
+}
+
+ChatConnection::~ChatConnection() {
+    for (auto& link : data_links_) {
+        if (link->socket != INVALID_SOCKET) {
+            ::closesocket(link->socket);
+        }
+    }
+    close_wakeup(wake_read_);
+    close_wakeup(wake_write_);
+}
+
+void ChatConnection::wake() {
+    char byte = 0;
+    // A full pipe already has a wakeup pending
+#ifdef _WIN32
+    ::send(wake_write_, &byte, 1, 0);
+#else
+    ssize_t ignored = write(wake_write_, &byte, 1);
+    (void)ignored;
+#endif
+}
+
+void ChatConnection::send(std::string frame) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopped_ || closing_) {
+            return;
+        }
+        queued_frames_.push_back(std::move(frame));
+    }
+    wake();
+}
+
+std::future<bool> ChatConnection::upload(const std::string& filepath, int streams) {
+    auto upload = std::make_shared<Upload>();
+    std::future<bool> result = upload->result.get_future();
+    upload->filepath = filepath;
+    upload->streams = streams;
+
+    // Extract filename from path
+    size_t last_slash = filepath.find_last_of("/\\");
+    upload->filename = last_slash == std::string::npos ? filepath : filepath.substr(last_slash + 1);
+
+    std::ifstream file(filepath, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        std::cerr << "✗ Failed to open file: " << filepath << std::endl;
+        upload->result.set_value(false);
+        return result;
+    }
+    upload->size = file.tellg();
+    file.close();
+
+    if (!hash_file(filepath, upload->hash)) {
+        std::cerr << "✗ Failed to read file: " << filepath << std::endl;
+        upload->result.set_value(false);
+        return result;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopped_ || closing_) {
+            upload->result.set_value(false);
+            return result;
+        }
+        // Stream IDs are reused once their upload is over; 0 is the
+        // control stream
+        auto in_use = [this](uint16_t stream) {
+            return uploads_.count(stream) > 0 ||
+                   std::any_of(queued_uploads_.begin(), queued_uploads_.end(),
+                               [stream](const std::shared_ptr<Upload>& queued) { return queued->stream == stream; });
+        };
+        do {
+            upload->stream = next_stream_++;
+            if (next_stream_ == 0) {
+                next_stream_ = 1;
+            }
+        } while (in_use(upload->stream));
+        queued_uploads_.push_back(upload);
+    }
+    wake();
+    return result;
+}
+
+std::string ChatConnection::describe_uploads() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (uploads_.empty() && queued_uploads_.empty()) {
+        return "No uploads in progress\n";
+    }
+
+    std::ostringstream out;
+    for (const auto& queued : queued_uploads_) {
+        out << "  " << queued->filename << ": starting\n";
+    }
+    for (const auto& entry : uploads_) {
+        const Upload& upload = *entry.second;
+        out << "  " << upload.filename << ": ";
+        switch (upload.state.load()) {
+        case Upload::State::REQUESTED:
+            out << "waiting for the server\n";
+            break;
+        case Upload::State::SENDING: {
+            int64_t sent = upload.sent.load();
+            out << (upload.size > 0 ? sent * 100 / upload.size : 100) << "% (" << sent << "/"
+                << upload.size << " bytes)\n";
+            break;
+        }
+        default:
+            out << "sent, waiting for the server to confirm\n";
+            break;
+        }
+    }
+    return out.str();
+}
+
+void ChatConnection::close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopped_ || closing_) {
+            return;
+        }
+        closing_ = true;
+        queued_frames_.push_back(make_frame(DISCONNECT));
+    }
+    wake();
+}
+
+bool ChatConnection::run() {
+    std::vector<struct pollfd> fds;
+    bool closed = false;
+
+    while (true) {
+        take_queued();
+
+        // Write whatever the sockets take
+        if (flush(main_) == Link::Flush::FAILED) {
+            break;
+        }
+        for (auto& link : data_links_) {
+            if (flush(*link) == Link::Flush::FAILED) {
+                drop_link(*link, true);
+            }
+        }
+        data_links_.erase(std::remove_if(data_links_.begin(), data_links_.end(),
+                                         [](const std::unique_ptr<Link>& link) {
+                                             return link->socket == INVALID_SOCKET;
+                                         }),
+                          data_links_.end());
+
+        if (draining_ && main_.frames.empty() && !main_.piece.upload) {
+            closed = true;
+            break;
+        }
+
+        fds.clear();
+        fds.push_back({wake_read_, POLLIN, 0});
+        fds.push_back({main_.socket, static_cast<short>(POLLIN | (main_.blocked ? POLLOUT : 0)), 0});
+        for (auto& link : data_links_) {
+            short events = link->state == Link::State::CONNECTING
+                               ? POLLOUT
+                               : static_cast<short>(POLLIN | (link->blocked ? POLLOUT : 0));
+            fds.push_back({link->socket, events, 0});
+        }
+
+        if (poll(fds.data(), static_cast<unsigned long>(fds.size()), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (fds[0].revents) {
+            drain_wakeup(wake_read_);
+        }
+        if (fds[1].revents & POLLOUT) {
+            main_.blocked = false;
+        }
+        if ((fds[1].revents & (POLLIN | POLLHUP | POLLERR)) && !receive()) {
+            break;
+        }
+        // Links opened meanwhile come after the polled ones
+        for (size_t i = 2; i < fds.size(); i++) {
+            on_data_link_event(*data_links_[i - 2], fds[i].revents);
+        }
+    }
+
+    std::vector<std::shared_ptr<Upload>> unfinished;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopped_ = true;
+        unfinished.swap(queued_uploads_);
+        for (const auto& entry : uploads_) {
+            unfinished.push_back(entry.second);
+        }
+    }
+    for (const auto& upload : unfinished) {
+        if (upload->state != Upload::State::REQUESTED || uploads_.count(upload->stream)) {
+            print_status("✗ Upload of " + upload->filename + " interrupted; /sendfile again to resume");
+        }
+        finish_upload(upload, false);
+    }
+    if (!closed) {
+        downloads_.interrupt();
+    }
+    return closed;
+}
+
+void ChatConnection::reconnect(SOCKET socket, std::string hello) {
+    data_links_.clear();
+    last_served_ = 0;
+    main_ = Link();
+    main_.socket = socket;
+    set_nonblocking(socket);
+    main_.frames.push_back(std::move(hello));
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = false;
+}
+
+void ChatConnection::take_queued() {
+    std::vector<std::string> frames;
+    std::vector<std::shared_ptr<Upload>> uploads;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        frames.swap(queued_frames_);
+        uploads.swap(queued_uploads_);
+        for (const auto& upload : uploads) {
+            uploads_[upload->stream] = upload;
+        }
+        draining_ = closing_;
+    }
+
+    for (auto& frame : frames) {
+        main_.frames.push_back(std::move(frame));
+    }
+
+    // Header: u64 file size, u64 content hash, then the file name, on the
+    // upload's own stream
+    for (const auto& upload : uploads) {
+        std::string header(2 * sizeof(uint64_t), '\0');
+        put_u64(&header[0], static_cast<uint64_t>(upload->size));
+        put_u64(&header[sizeof(uint64_t)], upload->hash);
+        header += upload->filename;
+        main_.frames.push_back(make_frame(FILE_TRANSFER, header.data(), header.size(), 0, upload->stream));
+    }
+}
+
+bool ChatConnection::receive() {
+    ssize_t bytes_received;
+    bool direct = downloads_.in_chunk();
+    if (direct) {
+        // Download data skips the ring and goes straight to its file
+        bytes_received = downloads_.receive_chunk(main_.socket);
+    } else {
+        main_.input.prepare();
+        bytes_received = recv(main_.socket, main_.input.write_ptr(), main_.input.writable(), 0);
+    }
+    if (bytes_received < 0 && socket_would_block()) {
+        return true;
+    }
+    if (bytes_received <= 0) {
+        return false;
+    }
+    if (!direct) {
+        main_.input.commit(bytes_received);
+    }
+
+    FrameView frame;
+    ParseResult result = ParseResult::NEED_MORE;
+    while (true) {
+        // Chunk data that arrived behind its header
+        if (downloads_.in_chunk()) {
+            main_.input.consume(downloads_.write_chunk(main_.input.data(), main_.input.size()));
+            if (downloads_.in_chunk()) {
+                return true;
+            }
+        }
+
+        result = main_.parser.next(main_.input, frame);
+        if (result != ParseResult::FRAME) {
+            break;
+        }
+        if (!dispatch(frame)) {
+            return false;
+        }
+    }
+
+    if (result == ParseResult::INVALID) {
+        print_status("✗ Malformed data from server");
+        return false;
+    }
+    return true;
+}
+
+// Act on a frame from the server; false if the connection can't go on
+bool ChatConnection::dispatch(const FrameView& frame) {
+    switch (frame.header.type) {
+    case PING:
+        // Answered ahead of any file data
+        if (!(frame.header.flags & FRAME_FLAG_REPLY)) {
+            main_.frames.push_back(make_frame(PING, frame.payload, frame.header.length, FRAME_FLAG_REPLY));
+        }
+        break;
+    case FILE_CHUNK:
+        if (frame.streamed()) {
+            downloads_.begin_chunk(get_u64(frame.payload),
+                                   static_cast<int64_t>(get_u64(frame.payload + sizeof(uint64_t))),
+                                   frame.body_length);
+        }
+        break;
+    case FILE_READY:
+    case FILE_DONE:
+    case FILE_ERROR:
+        on_transfer_reply(frame);
+        break;
+    case HELLO: {
+        Hello hello;
+        if ((frame.header.flags & FRAME_FLAG_REPLY) && decode_hello(frame, hello)) {
+            if (hello.version < MIN_PROTOCOL_VERSION || hello.version > PROTOCOL_VERSION) {
+                // No use reconnecting either
+                print_status("✗ The server speaks protocol version " + std::to_string(hello.version) +
+                             ", this client " + std::to_string(MIN_PROTOCOL_VERSION) + " to " +
+                             std::to_string(PROTOCOL_VERSION));
+                session_ = 0;
+                return false;
+            }
+            capabilities_ = hello.capabilities;
+            session_ = hello.session;
+        }
+        on_frame_(frame);
+        break;
+    }
+    default:
+        on_frame_(frame);
+        break;
+    }
+    return true;
+}
+
+void ChatConnection::on_transfer_reply(const FrameView& frame) {
+    uint8_t type = frame.header.type;
+    if (frame.header.length < sizeof(uint64_t) ||
+        (type == FILE_READY && frame.header.length < 2 * sizeof(uint64_t))) {
+        return;
+    }
+    uint64_t id = get_u64(frame.payload);
+    int64_t offset = 0;
+    int64_t size = -1;
+    std::string reason;
+    if (type == FILE_READY) {
+        offset = static_cast<int64_t>(get_u64(frame.payload + sizeof(uint64_t)));
+        if (frame.header.length >= 3 * sizeof(uint64_t)) {
+            size = static_cast<int64_t>(get_u64(frame.payload + 2 * sizeof(uint64_t)));
+        }
+    } else if (type == FILE_ERROR) {
+        reason.assign(frame.payload + sizeof(uint64_t), frame.header.length - sizeof(uint64_t));
+    }
+
+    // The first reply about an upload comes on its stream; later ones
+    // carry its transfer ID. Either way the upload is held here, as
+    // finishing it takes it out of uploads_.
+    auto requested = frame.header.stream != 0 ? uploads_.find(frame.header.stream) : uploads_.end();
+    if (requested != uploads_.end() && requested->second->state == Upload::State::REQUESTED) {
+        std::shared_ptr<Upload> upload = requested->second;
+        on_upload_reply(upload, type, id, offset, reason);
+        return;
+    }
+
+    bool handled = type == FILE_READY ? downloads_.on_ready(id, offset, size)
+                   : type == FILE_DONE ? downloads_.on_done(id)
+                                       : downloads_.on_error(id, reason);
+    if (handled) {
+        return;
+    }
+    for (const auto& entry : uploads_) {
+        if (entry.second->state != Upload::State::REQUESTED && entry.second->id == id) {
+            std::shared_ptr<Upload> upload = entry.second;
+            on_upload_reply(upload, type, id, offset, reason);
+            return;
+        }
+    }
+}
+
+void ChatConnection::on_upload_reply(const std::shared_ptr<Upload>& upload, uint8_t type, uint64_t id,
+                                     int64_t offset, const std::string& reason) {
+    if (upload->state == Upload::State::REQUESTED) {
+        // The server answers with the transfer ID and how much it already
+        // has, or straight away with FILE_DONE if it holds these contents
+        if (type == FILE_READY) {
+            start_sending(upload, id, offset);
+        } else if (type == FILE_DONE) {
+            print_status("✓ File sent: " + upload->filename + " (" + std::to_string(upload->size) +
+                         " bytes, already on the server, nothing to upload)");
+            finish_upload(upload, true);
+        } else {
+            print_status("✗ Upload of " + upload->filename + " refused: " + reason);
+            finish_upload(upload, false);
+        }
+        return;
+    }
+
+    if (type == FILE_ERROR) {
+        print_status("✗ Upload of " + upload->filename + " failed: " + reason +
+                     "; /sendfile again to resume");
+        finish_upload(upload, false);
+        return;
+    }
+    if (type != FILE_DONE) {
+        return;
+    }
+
+    // The server confirms once every chunk is on disk
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - upload->start_time);
+    double seconds = std::max<int64_t>(duration.count(), 1) / 1e6;
+    int64_t file_bytes = upload->size - upload->offset;
+
+    std::ostringstream line;
+    line << "✓ File sent: " << upload->filename << " (" << upload->size << " bytes, "
+         << (file_bytes / 1024.0 / 1024.0) / seconds << " MB/s";
+    if (!upload->method.empty()) {
+        line << " via " << upload->method;
+    }
+    if (upload->connections > 1) {
+        line << " over " << upload->connections << " streams";
+    }
+    if (upload->compressed_pieces > 0 && upload->wire_bytes > 0) {
+        line << ", " << static_cast<double>(file_bytes) / upload->wire_bytes << "x compressed, "
+             << (upload->wire_bytes / 1024.0 / 1024.0) / seconds << " MB/s on the wire";
+    }
+    line << ")";
+    print_status(line.str());
+    finish_upload(upload, true);
+}
+
+void ChatConnection::start_sending(const std::shared_ptr<Upload>& upload, uint64_t id, int64_t offset) {
+    upload->id = id;
+    upload->offset = upload->next = std::min(offset, upload->size);
+    upload->sent = upload->offset;
+    upload->start_time = std::chrono::steady_clock::now();
+    upload->compressing = (capabilities_ & CAP_COMPRESSION) != 0;
+#ifdef __linux__
+    upload->fd = open(upload->filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (upload->fd >= 0) {
+        posix_fadvise(upload->fd, upload->offset, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    upload->zero_copy = upload->fd >= 0;
+#else
+    upload->zero_copy = false;
+#endif
+    upload->state = Upload::State::SENDING;
+
+    if (upload->offset > 0) {
+        print_status("Resuming " + upload->filename + " at byte " + std::to_string(upload->offset) +
+                     " of " + std::to_string(upload->size));
+    } else {
+        print_status("Uploading " + upload->filename + " (" + std::to_string(upload->size) + " bytes)...");
+    }
+
+    if (upload->has_pieces()) {
+        for (int i = 1; i < upload->streams; i++) {
+            open_data_link(upload);
+        }
+    }
+    check_sent(upload);
+}
+
+void ChatConnection::finish_upload(const std::shared_ptr<Upload>& upload, bool ok) {
+    if (upload->state == Upload::State::FINISHED) {
+        return;
+    }
+    upload->state = Upload::State::FINISHED;
+    for (auto& link : data_links_) {
+        if (link->upload == upload) {
+            drop_link(*link, false);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = uploads_.find(upload->stream);
+        if (it != uploads_.end() && it->second == upload) {
+            uploads_.erase(it);
+        }
+    }
+    upload->result.set_value(ok);
+}
+
+void ChatConnection::check_sent(const std::shared_ptr<Upload>& upload) {
+    if (upload->state != Upload::State::SENDING || upload->has_pieces() || upload->in_flight > 0) {
+        return;
+    }
+    upload->state = Upload::State::CONFIRMING;
+
+    // Every byte is out: let the data connections go
+    for (auto& link : data_links_) {
+        if (link->upload != upload) {
+            continue;
+        }
+        if (link->state == Link::State::READY) {
+            link->frames.push_back(make_frame(DISCONNECT));
+            link->state = Link::State::CLOSING;
+        } else if (link->state != Link::State::CLOSING) {
+            drop_link(*link, false);
+        }
+    }
+}
+
+ChatConnection::Link::Flush ChatConnection::flush(Link& link) {
+    if (link.socket == INVALID_SOCKET || link.state == Link::State::CONNECTING) {
+        return Link::Flush::IDLE;
+    }
+
+    while (true) {
+        if (link.piece.upload) {
+            Link::Flush result = write_piece(link);
+            if (result != Link::Flush::IDLE) {
+                return result;
+            }
+            piece_written(link);
+            continue;
+        }
+
+        if (!link.frames.empty()) {
+            const std::string& frame = link.frames.front();
+            ssize_t sent = ::send(link.socket, frame.data() + link.frame_sent,
+                                  frame.size() - link.frame_sent, 0);
+            if (sent < 0 && socket_would_block()) {
+                link.blocked = true;
+                return Link::Flush::BLOCKED;
+            }
+            if (sent <= 0) {
+                return Link::Flush::FAILED;
+            }
+            link.frame_sent += sent;
+            if (link.frame_sent == frame.size()) {
+                link.frames.pop_front();
+                link.frame_sent = 0;
+            }
+            continue;
+        }
+
+        if (link.state == Link::State::CLOSING) {
+            drop_link(link, false);
+            return Link::Flush::IDLE;
+        }
+        if (link.state != Link::State::READY || !next_piece(link)) {
+            return Link::Flush::IDLE;
+        }
+    }
+}
+
+bool ChatConnection::next_piece(Link& link) {
+    while (true) {
+        std::shared_ptr<Upload> upload;
+        if (draining_) {
+            return false;
+        }
+        if (link.upload) {
+            if (link.upload->state == Upload::State::SENDING && link.upload->has_pieces()) {
+                upload = link.upload;
+            }
+        } else if (!uploads_.empty()) {
+            // Round robin: the first upload with pieces left after the one
+            // served last
+            auto it = uploads_.upper_bound(last_served_);
+            for (size_t i = 0; i < uploads_.size() && !upload; i++, ++it) {
+                if (it == uploads_.end()) {
+                    it = uploads_.begin();
+                }
+                if (it->second->state == Upload::State::SENDING && it->second->has_pieces()) {
+                    upload = it->second;
+                }
+            }
+        }
+        if (!upload) {
+            return false;
+        }
+        if (!link.upload) {
+            last_served_ = upload->stream;
+        }
+
+        Piece& piece = link.piece;
+        piece.upload = upload;
+        if (!upload->retry.empty()) {
+            piece.offset = upload->retry.front().first;
+            piece.length = upload->retry.front().second;
+            upload->retry.pop_front();
+        } else {
+            piece.offset = upload->next;
+            piece.length = std::min(UPLOAD_PIECE_SIZE, upload->size - upload->next);
+            upload->next += piece.length;
+        }
+        upload->in_flight++;
+        if (fill_piece(piece)) {
+            return true;
+        }
+
+        piece.upload.reset();
+        upload->in_flight--;
+        print_status("✗ Failed to read " + upload->filepath + "; upload stopped");
+        finish_upload(upload, false);
+    }
+}
+
+bool ChatConnection::fill_piece(Piece& piece) {
+    Upload& upload = *piece.upload;
+    piece.bytes.assign(CHUNK_HEADER_SIZE, '\0');
+    piece.bytes_sent = 0;
+    piece.file_offset = piece.offset;
+    piece.file_remaining = 0;
+
+    // Compressible pieces are compressed; the rest go out zero-copy where
+    // the platform allows, otherwise through a buffer
+    uint8_t flags = 0;
+    if (encoder_.encode(upload.filepath, piece.offset, piece.length, upload.compressing, piece.bytes)) {
+        flags = FRAME_FLAG_COMPRESSED;
+        upload.compressed_pieces++;
+        upload.method = "lz4";
+    } else if (upload.zero_copy) {
+        piece.file_remaining = piece.length;
+        upload.method = "sendfile";
+    } else {
+        piece.bytes.resize(CHUNK_HEADER_SIZE + piece.length);
+        if (!read_file_range(upload.filepath, piece.offset, &piece.bytes[CHUNK_HEADER_SIZE],
+                             static_cast<size_t>(piece.length))) {
+            return false;
+        }
+        upload.method = "read";
+    }
+
+    int64_t body_length = static_cast<int64_t>(piece.bytes.size()) - CHUNK_HEADER_SIZE + piece.file_remaining;
+    put_chunk_header(&piece.bytes[0], upload.id, piece.offset, body_length, flags);
+    upload.wire_bytes += body_length;
+    return true;
+}
+
+ChatConnection::Link::Flush ChatConnection::write_piece(Link& link) {
+    Piece& piece = link.piece;
+    while (piece.bytes_sent < piece.bytes.size()) {
+        int flags = 0;
+#ifdef MSG_MORE
+        // Let the header share a segment with the start of the data
+        if (piece.file_remaining > 0) {
+            flags = MSG_MORE;
+        }
+#endif
+        ssize_t sent = ::send(link.socket, piece.bytes.data() + piece.bytes_sent,
+                              piece.bytes.size() - piece.bytes_sent, flags);
+        if (sent < 0 && socket_would_block()) {
+            link.blocked = true;
+            return Link::Flush::BLOCKED;
+        }
+        if (sent <= 0) {
+            return Link::Flush::FAILED;
+        }
+        piece.bytes_sent += sent;
+    }
+
+#ifdef __linux__
+    // Zero-copy: the kernel copies page-cache pages straight into the socket
+    while (piece.file_remaining > 0) {
+        off_t position = piece.file_offset;
+        ssize_t sent = sendfile(link.socket, piece.upload->fd, &position, piece.file_remaining);
+        if (sent < 0 && socket_would_block()) {
+            link.blocked = true;
+            return Link::Flush::BLOCKED;
+        }
+        if (sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            // Not for this file after all: buffer the rest of the piece
+            piece.upload->zero_copy = false;
+            piece.bytes.resize(piece.bytes_sent + piece.file_remaining);
+            if (!read_file_range(piece.upload->filepath, piece.file_offset, &piece.bytes[piece.bytes_sent],
+                                 static_cast<size_t>(piece.file_remaining))) {
+                return Link::Flush::FAILED;
+            }
+            piece.file_remaining = 0;
+            return write_piece(link);
+        }
+        if (sent <= 0) {
+            return Link::Flush::FAILED;
+        }
+        piece.file_offset += sent;
+        piece.file_remaining -= sent;
+    }
+#endif
+    return Link::Flush::IDLE;
+}
+
+void ChatConnection::piece_written(Link& link) {
+    std::shared_ptr<Upload> upload = std::move(link.piece.upload);
+    link.piece.bytes.clear();
+    upload->in_flight--;
+    upload->sent += link.piece.length;
+    check_sent(upload);
+}
+
+void ChatConnection::open_data_link(const std::shared_ptr<Upload>& upload) {
+    auto link = std::make_unique<Link>();
+    link->upload = upload;
+    link->socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (link->socket == INVALID_SOCKET) {
+        print_status("✗ Could not open another stream for " + upload->filename);
+        return;
+    }
+    set_nonblocking(link->socket);
+    link->state = Link::State::CONNECTING;
+    if (connect(link->socket, (struct sockaddr*)&server_address_, sizeof(server_address_)) == SOCKET_ERROR) {
+#ifdef _WIN32
+        bool pending = WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+        bool pending = errno == EINPROGRESS;
+#endif
+        if (!pending) {
+            drop_link(*link, true);
+            return;
+        }
+    }
+    data_links_.push_back(std::move(link));
+}
+
+void ChatConnection::on_data_link_event(Link& link, short revents) {
+    if (link.socket == INVALID_SOCKET || revents == 0) {
+        return;
+    }
+
+    if (link.state == Link::State::CONNECTING) {
+        int error = 0;
+        socklen_t error_length = sizeof(error);
+        if (getsockopt(link.socket, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&error), &error_length) < 0 ||
+            error != 0) {
+            drop_link(link, true);
+            return;
+        }
+        // Join the transfer; its chunks follow once the server says READY
+        char id[sizeof(uint64_t)];
+        put_u64(id, link.upload->id);
+        link.frames.push_back(make_frame(FILE_ATTACH, id, sizeof(id)));
+        link.state = Link::State::ATTACHING;
+        return;
+    }
+
+    if (revents & POLLOUT) {
+        link.blocked = false;
+    }
+    if (!(revents & (POLLIN | POLLHUP | POLLERR))) {
+        return;
+    }
+
+    link.input.prepare();
+    ssize_t bytes_received = recv(link.socket, link.input.write_ptr(), link.input.writable(), 0);
+    if (bytes_received < 0 && socket_would_block()) {
+        return;
+    }
+    if (bytes_received <= 0) {
+        drop_link(link, link.state != Link::State::CLOSING);
+        return;
+    }
+    link.input.commit(bytes_received);
+
+    FrameView frame;
+    ParseResult result;
+    while ((result = link.parser.next(link.input, frame)) == ParseResult::FRAME) {
+        if (link.state != Link::State::ATTACHING) {
+            continue;
+        }
+        if (frame.header.type != FILE_READY) {
+            drop_link(link, true);
+            return;
+        }
+        link.state = Link::State::READY;
+        link.upload->connections++;
+    }
+    if (result == ParseResult::INVALID) {
+        drop_link(link, true);
+    }
+}
+
+void ChatConnection::drop_link(Link& link, bool failed) {
+    if (link.socket == INVALID_SOCKET) {
+        return;
+    }
+    ::closesocket(link.socket);
+    link.socket = INVALID_SOCKET;
+    link.frames.clear();
+
+    std::shared_ptr<Upload>& upload = link.upload;
+    if (link.piece.upload) {
+        // A chunk cut short goes out again over another connection; the
+        // server merges whatever overlaps
+        upload->retry.emplace_back(link.piece.offset, link.piece.length);
+        upload->in_flight--;
+        link.piece.upload.reset();
+    }
+    if (failed && upload->state == Upload::State::SENDING) {
+        print_status(link.state == Link::State::READY
+                         ? "✗ Lost a stream of " + upload->filename + "; carrying on without it"
+                         : "✗ Could not open another stream for " + upload->filename);
+    }
+}
@@ -0,0 +1,192 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "../shared/platform.h"
+#include "../shared/protocol.h"
+#include "file_downloader.h"
+#include "file_sender.h"
+
+// Uploads go out in pieces of this size, taken in turn from every upload
+// in progress, so a chat line waits behind at most one piece
+constexpr int64_t UPLOAD_PIECE_SIZE = 1024 * 1024;
+
+// The chat connection, driven by one I/O loop.
+//
+// The loop owns the socket, which is non-blocking. It reads everything the
+// server sends: chat and other frames go to the client's handler, replies
+// about transfers to the upload or download they belong to, and download
+// data straight into its file. Other threads never touch the socket; they
+// queue frames and uploads and wake the loop.
+//
+// Everything sent is multiplexed. Chat and control frames (PING answers,
+// requests) always go first; file data follows in pieces, round-robin
+// across uploads. Each upload has a stream ID of its own, carried by its
+// FILE_TRANSFER and echoed on the server's reply, so any number of uploads
+// can be started at once. Extra data connections (/sendfile -n) are run by
+// the same loop.
+//
+// The server's HELLO reply says what the connection may use: uploads are
+// compressed only if it granted CAP_COMPRESSION. A lost connection can be
+// replaced with reconnect(), which resumes the session the reply named.
+class ChatConnection {
+public:
+    // Called on the loop thread for every frame the connection does not
+    // handle itself
+    using FrameHandler = std::function<void(const FrameView& frame)>;
+
+    // socket must be connected; the login is the first frame sent
+    ChatConnection(SOCKET socket, const sockaddr_in& server_address, DownloadManager& downloads,
+                   FrameHandler on_frame);
+    ~ChatConnection();
+
+    // Run the loop: true once close() has flushed everything, false if the
+    // connection was lost. Unfinished uploads then fail.
+    bool run();
+
+    // Any thread: queue a frame for the server
+    void send(std::string frame);
+
+    // Any thread: upload a file, with streams - 1 extra data connections.
+    // Hashes the file first; the result turns true once the server has all
+    // of it.
+    std::future<bool> upload(const std::string& filepath, int streams);
+
+    // Any thread: a line for each upload in progress
+    std::string describe_uploads();
+
+    // Any thread: send DISCONNECT after whatever is queued, then stop.
+    // Uploads are abandoned midway; /sendfile resumes them later.
+    void close();
+
+    // After run() has returned false: carry on over a new connected socket,
+    // logging in with hello ahead of anything queued since. The uploads and
+    // downloads that were in progress have been reported interrupted.
+    void reconnect(SOCKET socket, std::string hello);
+
+    // From the server's HELLO reply: what it granted, and the token of the
+    // session to resume (0 if none). The token is read between runs.
+    uint32_t capabilities() const { return capabilities_; }
+    uint64_t session() const { return session_; }
+
+private:
+    struct Upload {
+        enum class State { REQUESTED, SENDING, CONFIRMING, FINISHED };
+
+        uint16_t stream = 0;
+        std::string filepath;
+        std::string filename;
+        int64_t size = 0;
+        uint64_t hash = 0;
+        int streams = 1;
+        std::promise<bool> result;
+
+        std::atomic<State> state{State::REQUESTED};
+        uint64_t id = 0;                 // Transfer ID, from FILE_READY
+        int fd = -1;                     // For sendfile(), where available
+        int64_t offset = 0;              // Where this session started
+        int64_t next = 0;                // Start of the next piece
+        std::deque<std::pair<int64_t, int64_t>> retry;   // Pieces lost with a data connection
+        std::atomic<int64_t> sent{0};    // File bytes fully written
+        int in_flight = 0;               // Pieces being written
+        int connections = 1;
+        bool compressing = true;
+        bool zero_copy = true;
+        std::string method;
+        int64_t wire_bytes = 0;
+        int64_t compressed_pieces = 0;
+        std::chrono::steady_clock::time_point start_time;
+
+        ~Upload();
+        bool has_pieces() const { return !retry.empty() || next < size; }
+    };
+
+    // A FILE_CHUNK on its way out: bytes (header, then the compressed or
+    // buffered body) and then file_remaining bytes sent from the file
+    struct Piece {
+        std::shared_ptr<Upload> upload;
+        int64_t offset = 0;
+        int64_t length = 0;
+        std::string bytes;
+        size_t bytes_sent = 0;
+        int64_t file_offset = 0;
+        int64_t file_remaining = 0;
+    };
+
+    // The chat connection or a data connection, and its write side. Whole
+    // frames go before any new piece but never inside one.
+    struct Link {
+        enum class State { CONNECTING, ATTACHING, READY, CLOSING };
+        enum class Flush { IDLE, BLOCKED, FAILED };
+
+        SOCKET socket = INVALID_SOCKET;
+        State state = State::READY;
+        std::shared_ptr<Upload> upload;    // Data connections: the upload carried
+        std::deque<std::string> frames;
+        size_t frame_sent = 0;
+        Piece piece;
+        bool blocked = false;              // Waiting to be writable
+        RingBuffer input;
+        FrameParser parser;
+    };
+
+    void take_queued();
+    bool receive();
+    bool dispatch(const FrameView& frame);
+    void on_transfer_reply(const FrameView& frame);
+    void on_upload_reply(const std::shared_ptr<Upload>& upload, uint8_t type, uint64_t id,
+                         int64_t offset, const std::string& reason);
+    void start_sending(const std::shared_ptr<Upload>& upload, uint64_t id, int64_t offset);
+    void finish_upload(const std::shared_ptr<Upload>& upload, bool ok);
+    void check_sent(const std::shared_ptr<Upload>& upload);
+
+    Link::Flush flush(Link& link);
+    bool next_piece(Link& link);
+    bool fill_piece(Piece& piece);
+    Link::Flush write_piece(Link& link);
+    void piece_written(Link& link);
+
+    void open_data_link(const std::shared_ptr<Upload>& upload);
+    void on_data_link_event(Link& link, short revents);
+    void drop_link(Link& link, bool failed);
+
+    Link main_;
+    sockaddr_in server_address_;
+    DownloadManager& downloads_;
+    FrameHandler on_frame_;
+
+    // Loop thread only
+    std::vector<std::unique_ptr<Link>> data_links_;
+    uint16_t last_served_ = 0;         // Stream of the upload that got the last piece
+    bool draining_ = false;            // close() was called: no new pieces
+    ChunkEncoder encoder_;
+    std::atomic<uint32_t> capabilities_{0};
+    uint64_t session_ = 0;
+
+    // Woken through a pipe (a loopback socket pair on Windows)
+    SOCKET wake_read_ = INVALID_SOCKET;
+    SOCKET wake_write_ = INVALID_SOCKET;
+    void wake();
+
+    // Handed over by other threads
+    std::mutex mutex_;
+    std::map<uint16_t, std::shared_ptr<Upload>> uploads_;   // By stream ID; changed by the loop only
+    std::vector<std::string> queued_frames_;
+    std::vector<std::shared_ptr<Upload>> queued_uploads_;
+    uint16_t next_stream_ = 1;
+    bool closing_ = false;
+    bool stopped_ = false;
+};
+
+#endif
@@ -0,0 +1,210 @@
+#include "file_downloader.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include <sys/stat.h>
+#ifdef _WIN32
+    #include <direct.h>
+    #include <io.h>
+#endif
+
+#include "../shared/constants.h"
+#include "../shared/protocol.h"
+
+namespace {
+
+// Largest single read of chunk data from the socket
+constexpr size_t DOWNLOAD_BUFFER_SIZE = 256 * 1024;
+
+// Status lines share the terminal with the input prompt
+void print_status(const std::string& line) {
+    std::cout << "\r" << line << std::endl;
+    std::cout << "> " << std::flush;
+}
+
+} // namespace
+
+int open_local_file(const std::string& path, int64_t& existing) {
+#ifdef _WIN32
+    _mkdir(DOWNLOADS_DIR);
+    int fd = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+    existing = fd >= 0 ? _filelengthi64(fd) : 0;
+#else
+    mkdir(DOWNLOADS_DIR, 0755);
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    struct stat info;
+    existing = fd >= 0 && fstat(fd, &info) == 0 ? info.st_size : 0;
+#endif
+    return fd;
+}
+
+bool write_at(int fd, const char* data, size_t len, int64_t offset) {
+#ifdef _WIN32
+    if (_lseeki64(fd, offset, SEEK_SET) < 0) {
+        return false;
+    }
+#endif
+    while (len > 0) {
+#ifdef _WIN32
+        int written = _write(fd, data, static_cast<unsigned int>(len));
+#else
+        ssize_t written = pwrite(fd, data, len, offset);
+#endif
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        len -= written;
+        offset += written;
+    }
+    return true;
+}
+
+void close_local_file(int fd) {
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+}
+
+std::string DownloadManager::request(const std::string& filename) {
+    Download download;
+    download.filename = filename;
+    download.path = std::string(DOWNLOADS_DIR) + "/" + filename;
+    download.fd = open_local_file(download.path, download.offset);
+    if (download.fd < 0) {
+        return std::string();
+    }
+    download.start_time = std::chrono::steady_clock::now();
+
+    uint64_t id;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        id = next_id_++;
+        downloads_[id] = download;
+    }
+
+    // u64 ID, u64 offset, u64 length (0 = to the end), then the name
+    std::string payload(3 * sizeof(uint64_t), '\0');
+    put_u64(&payload[0], id);
+    put_u64(&payload[sizeof(uint64_t)], static_cast<uint64_t>(download.offset));
+    payload += filename;
+    return make_frame(FILE_DOWNLOAD, payload);
+}
+
+DownloadManager::Download* DownloadManager::find(uint64_t id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = downloads_.find(id);
+    return it != downloads_.end() ? &it->second : nullptr;
+}
+
+void DownloadManager::close_download(Download& download) {
+    if (download.fd >= 0) {
+        close_local_file(download.fd);
+        download.fd = -1;
+    }
+}
+
+bool DownloadManager::on_ready(uint64_t id, int64_t offset, int64_t size) {
+    Download* download = find(id);
+    if (!download) {
+        return false;
+    }
+    download->size = size;
+    download->start_time = std::chrono::steady_clock::now();
+    if (offset > 0 && offset < size) {
+        print_status("Resuming " + download->filename + " at byte " + std::to_string(offset) +
+                     " of " + std::to_string(size));
+    } else if (offset < size) {
+        print_status("Downloading " + download->filename + " (" + std::to_string(size) + " bytes)...");
+    }
+    return true;
+}
+
+bool DownloadManager::on_done(uint64_t id) {
+    Download* download = find(id);
+    if (!download) {
+        return false;
+    }
+    close_download(*download);
+
+    if (download->failed) {
+        print_status("✗ Failed to write " + download->path);
+    } else if (download->received == 0) {
+        print_status("✓ Already downloaded: " + download->path);
+    } else {
+        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - download->start_time);
+        double speed = (download->received / 1024.0 / 1024.0) /
+                       (std::max<int64_t>(duration.count(), 1) / 1e6);
+        print_status("✓ File downloaded: " + download->path + " (" + std::to_string(download->size) +
+                     " bytes, " + std::to_string(speed) + " MB/s)");
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    downloads_.erase(id);
+    return true;
+}
+
+bool DownloadManager::on_error(uint64_t id, const std::string& reason) {
+    Download* download = find(id);
+    if (!download) {
+        return false;
+    }
+    close_download(*download);
+    print_status("✗ Download of " + download->filename + " failed: " + reason);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    downloads_.erase(id);
+    return true;
+}
+
+void DownloadManager::begin_chunk(uint64_t id, int64_t offset, uint32_t length) {
+    chunk_download_ = find(id);
+    if (chunk_download_ && chunk_download_->received == 0) {
+        // Queued downloads are timed from their first byte
+        chunk_download_->start_time = std::chrono::steady_clock::now();
+    }
+    chunk_offset_ = offset;
+    chunk_remaining_ = length;
+}
+
+size_t DownloadManager::write_chunk(const char* data, size_t len) {
+    len = static_cast<size_t>(std::min<int64_t>(len, chunk_remaining_));
+    Download* download = chunk_download_;
+    if (download && !download->failed) {
+        if (write_at(download->fd, data, len, chunk_offset_)) {
+            download->received += len;
+        } else {
+            download->failed = true;
+        }
+    }
+    chunk_offset_ += len;
+    chunk_remaining_ -= len;
+    return len;
+}
+
+void DownloadManager::interrupt() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& entry : downloads_) {
+        close_download(entry.second);
+        print_status("✗ Download of " + entry.second.filename + " interrupted; /getfile again to resume");
+    }
+    downloads_.clear();
+    chunk_download_ = nullptr;
+    chunk_remaining_ = 0;
+}
+
+ssize_t DownloadManager::receive_chunk(SOCKET socket) {
+    if (!buffer_) {
+        buffer_.reset(new char[DOWNLOAD_BUFFER_SIZE]);
+    }
+    size_t want = static_cast<size_t>(std::min<int64_t>(chunk_remaining_, DOWNLOAD_BUFFER_SIZE));
+    ssize_t bytes_received = recv(socket, buffer_.get(), static_cast<int>(want), 0);
+    if (bytes_received > 0) {
+        write_chunk(buffer_.get(), bytes_received);
+    }
+    return bytes_received;
+}
@@ -0,0 +1,79 @@
+#ifndef FILE_DOWNLOADER_H
+#define FILE_DOWNLOADER_H
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "../shared/platform.h"
+
+constexpr const char* DOWNLOADS_DIR = "downloads";
+
+// Open (or create) a file in downloads/ without truncating it; returns the
+// descriptor and sets existing to its current size
+int open_local_file(const std::string& path, int64_t& existing);
+bool write_at(int fd, const char* data, size_t len, int64_t offset);
+void close_local_file(int fd);
+
+// Downloads requested with /getfile. Requests are made on the input thread;
+// the server's replies and the chunk data are handled on the connection's
+// I/O loop, so downloads run while the user keeps chatting.
+class DownloadManager {
+public:
+    // Start a download, or resume it if part of the file is already in
+    // downloads/. Returns the FILE_DOWNLOAD frame to send, or an empty
+    // string if the local file cannot be opened.
+    std::string request(const std::string& filename);
+
+    // I/O loop: replies to a request; false when the ID isn't a
+    // download (it belongs to an upload instead)
+    bool on_ready(uint64_t id, int64_t offset, int64_t size);
+    bool on_done(uint64_t id);
+    bool on_error(uint64_t id, const std::string& reason);
+
+    // I/O loop: a FILE_CHUNK header has been parsed; its body is
+    // then fed through write_chunk() and receive_chunk() until in_chunk()
+    // turns false. Data for unknown downloads is consumed and dropped.
+    void begin_chunk(uint64_t id, int64_t offset, uint32_t length);
+    bool in_chunk() const { return chunk_remaining_ > 0; }
+
+    // Store buffered body bytes; returns how many were used
+    size_t write_chunk(const char* data, size_t len);
+
+    // Read body bytes straight from the socket into the file
+    ssize_t receive_chunk(SOCKET socket);
+
+    // I/O loop: the connection was lost. Downloads in progress are given
+    // up; /getfile resumes them from what is on disk.
+    void interrupt();
+
+private:
+    struct Download {
+        std::string filename;
+        std::string path;
+        int fd = -1;
+        int64_t offset = 0;       // Where this session started
+        int64_t size = -1;        // Known once the server replies
+        int64_t received = 0;
+        bool failed = false;
+        std::chrono::steady_clock::time_point start_time;
+    };
+
+    Download* find(uint64_t id);
+    void close_download(Download& download);
+
+    std::mutex mutex_;
+    std::map<uint64_t, Download> downloads_;
+    uint64_t next_id_ = 1;
+
+    // Chunk being received; only touched by the I/O loop
+    Download* chunk_download_ = nullptr;
+    int64_t chunk_offset_ = 0;
+    int64_t chunk_remaining_ = 0;
+    std::unique_ptr<char[]> buffer_;
+};
+
+#endif
@@ -0,0 +1,303 @@
+#include "file_sender.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+
+#include "../shared/constants.h"
+#include "../shared/lz4_block.h"
+#include "../shared/protocol.h"
+#include "../shared/xxhash64.h"
+
+#ifndef _WIN32
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+#ifdef __linux__
+    #include <sys/sendfile.h>
+#endif
+
+namespace {
+
+// Largest single sendfile() call and mmap() window
+constexpr int64_t SENDFILE_CHUNK = 4 * 1024 * 1024;
+constexpr int64_t MMAP_WINDOW = 64 * 1024 * 1024;
+
+// Each chunk's first block is sampled; above this order-0 entropy (bits
+// per byte) it is most likely already compressed and is sent as is
+constexpr size_t ENTROPY_SAMPLE_SIZE = COMPRESSED_BLOCK_SIZE;
+constexpr double COMPRESSIBLE_ENTROPY = 7.5;
+
+// A compressed chunk that saved less than this fraction turns compression
+// off for the rest of the upload
+constexpr double MIN_COMPRESSION_SAVING = 0.1;
+
+bool send_all(SOCKET socket, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(socket, data, len, 0);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+#ifdef __linux__
+// Zero-copy: the kernel copies page-cache pages straight into the socket.
+// Sets unsupported when the file or socket can't be used with sendfile().
+bool send_with_sendfile(SOCKET socket, int fd, int64_t offset, int64_t length, bool& unsupported) {
+    off_t position = offset;
+    int64_t end = offset + length;
+    unsupported = false;
+
+    while (position < end) {
+        ssize_t sent = sendfile(socket, fd, &position, std::min(SENDFILE_CHUNK, end - position));
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            unsupported = position == offset && (errno == EINVAL || errno == ENOSYS);
+            return false;
+        }
+        if (sent == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+#ifndef _WIN32
+// Map the file a window at a time and hand the kernel large writes
+bool send_with_mmap(SOCKET socket, int fd, int64_t offset, int64_t length) {
+    static const int64_t page_size = sysconf(_SC_PAGESIZE);
+    int64_t position = offset;
+    int64_t end = offset + length;
+
+    while (position < end) {
+        int64_t map_start = position - position % page_size;
+        int64_t map_length = std::min(MMAP_WINDOW, end - map_start);
+
+        void* mapped = mmap(nullptr, map_length, PROT_READ, MAP_PRIVATE, fd, map_start);
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+        madvise(mapped, map_length, MADV_SEQUENTIAL);
+
+        const char* data = static_cast<const char*>(mapped) + (position - map_start);
+        int64_t window_end = map_start + map_length;
+        bool ok = true;
+        while (position < window_end) {
+            size_t chunk = static_cast<size_t>(std::min<int64_t>(SENDFILE_CHUNK, window_end - position));
+            if (!send_all(socket, data, chunk)) {
+                ok = false;
+                break;
+            }
+            data += chunk;
+            position += chunk;
+        }
+
+        munmap(mapped, map_length);
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+#ifdef _WIN32
+// Portable path: buffered reads through std::ifstream
+bool send_with_stream(SOCKET socket, const std::string& filepath, int64_t offset, int64_t length) {
+    std::ifstream file(filepath, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    file.seekg(offset);
+
+    std::unique_ptr<char[]> buffer(new char[FILE_BUFFER_SIZE]);
+    while (length > 0) {
+        file.read(buffer.get(), std::min<int64_t>(FILE_BUFFER_SIZE, length));
+        std::streamsize bytes_read = file.gcount();
+        if (bytes_read <= 0 || !send_all(socket, buffer.get(), bytes_read)) {
+            return false;
+        }
+        length -= bytes_read;
+    }
+    return true;
+}
+#endif
+
+// Order-0 Shannon entropy in bits per byte
+double sample_entropy(const char* data, size_t len) {
+    size_t counts[256] = {};
+    for (size_t i = 0; i < len; i++) {
+        counts[static_cast<unsigned char>(data[i])]++;
+    }
+    double entropy = 0;
+    for (size_t count : counts) {
+        if (count > 0) {
+            double p = static_cast<double>(count) / len;
+            entropy -= p * std::log2(p);
+        }
+    }
+    return entropy;
+}
+
+} // namespace
+
+bool hash_file(const std::string& filepath, uint64_t& hash) {
+    XxHash64 state;
+#ifndef _WIN32
+    int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+
+    bool ok = true;
+    for (int64_t position = 0; position < info.st_size; position += MMAP_WINDOW) {
+        int64_t map_length = std::min<int64_t>(MMAP_WINDOW, info.st_size - position);
+        void* mapped = mmap(nullptr, map_length, PROT_READ, MAP_PRIVATE, fd, position);
+        if (mapped == MAP_FAILED) {
+            ok = false;
+            break;
+        }
+        madvise(mapped, map_length, MADV_SEQUENTIAL);
+        state.update(mapped, static_cast<size_t>(map_length));
+        munmap(mapped, map_length);
+    }
+    close(fd);
+    if (!ok) {
+        return false;
+    }
+#else
+    std::ifstream file(filepath, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    std::unique_ptr<char[]> buffer(new char[FILE_BUFFER_SIZE]);
+    while (file.read(buffer.get(), FILE_BUFFER_SIZE) || file.gcount() > 0) {
+        state.update(buffer.get(), static_cast<size_t>(file.gcount()));
+    }
+#endif
+    hash = state.digest();
+    return true;
+}
+
+bool send_file_range(SOCKET socket, const std::string& filepath, int64_t offset,
+                     int64_t length, std::string* method) {
+#ifndef _WIN32
+    int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = false;
+#ifdef __linux__
+    posix_fadvise(fd, offset, length, POSIX_FADV_SEQUENTIAL);
+
+    bool unsupported = false;
+    ok = send_with_sendfile(socket, fd, offset, length, unsupported);
+    if (ok || !unsupported) {
+        close(fd);
+        if (method) {
+            *method = "sendfile";
+        }
+        return ok;
+    }
+#endif
+
+    ok = send_with_mmap(socket, fd, offset, length);
+    close(fd);
+    if (method) {
+        *method = "mmap";
+    }
+    return ok;
+#else
+    if (method) {
+        *method = "stream";
+    }
+    return send_with_stream(socket, filepath, offset, length);
+#endif
+}
+
+bool read_file_range(const std::string& filepath, int64_t offset, char* out, size_t length) {
+#ifndef _WIN32
+    int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    while (length > 0) {
+        ssize_t bytes_read = pread(fd, out, length, offset);
+        if (bytes_read <= 0) {
+            close(fd);
+            return false;
+        }
+        out += bytes_read;
+        offset += bytes_read;
+        length -= bytes_read;
+    }
+    close(fd);
+    return true;
+#else
+    std::ifstream file(filepath, std::ios::binary);
+    file.seekg(offset);
+    return file.read(out, length) && file.gcount() == static_cast<std::streamsize>(length);
+#endif
+}
+
+void put_chunk_header(char* out, uint64_t transfer_id, int64_t offset, int64_t body_length,
+                      uint8_t flags) {
+    FrameHeader header;
+    header.type = FILE_CHUNK;
+    header.flags = FRAME_FLAG_STREAMED | flags;
+    header.length = static_cast<uint32_t>(STREAMED_META_SIZE + body_length);
+    encode_header(out, header);
+    put_u64(out + FRAME_HEADER_SIZE, transfer_id);
+    put_u64(out + FRAME_HEADER_SIZE + sizeof(uint64_t), static_cast<uint64_t>(offset));
+}
+
+ChunkEncoder::ChunkEncoder() : raw_(new char[FILE_CHUNK_SIZE]) {}
+
+bool ChunkEncoder::encode(const std::string& filepath, int64_t offset, int64_t length,
+                          bool& compressing, std::string& out) {
+    size_t sample = static_cast<size_t>(std::min<int64_t>(ENTROPY_SAMPLE_SIZE, length));
+    if (!compressing || !read_file_range(filepath, offset, raw_.get(), sample) ||
+        sample_entropy(raw_.get(), sample) > COMPRESSIBLE_ENTROPY ||
+        !read_file_range(filepath, offset + sample, raw_.get() + sample, length - sample)) {
+        return false;
+    }
+
+    // Blocks are compressed straight into out
+    size_t start = out.size();
+    size_t blocks = (length + COMPRESSED_BLOCK_SIZE - 1) / COMPRESSED_BLOCK_SIZE;
+    out.resize(start + blocks * (COMPRESSED_BLOCK_HEADER_SIZE + Lz4Block::bound(COMPRESSED_BLOCK_SIZE)));
+    char* block = &out[start];
+    for (int64_t position = 0; position < length; position += COMPRESSED_BLOCK_SIZE) {
+        uint32_t raw_length = static_cast<uint32_t>(std::min<int64_t>(COMPRESSED_BLOCK_SIZE, length - position));
+        char* data = block + COMPRESSED_BLOCK_HEADER_SIZE;
+        size_t stored = codec_.compress(raw_.get() + position, raw_length, data,
+                                        Lz4Block::bound(COMPRESSED_BLOCK_SIZE));
+        if (stored == 0 || stored >= raw_length) {
+            std::memcpy(data, raw_.get() + position, raw_length);
+            stored = raw_length;
+        }
+        put_u32(block, raw_length);
+        put_u32(block + 4, static_cast<uint32_t>(stored));
+        block = data + stored;
+    }
+    out.resize(block - out.data());
+
+    if (out.size() - start > length * (1 - MIN_COMPRESSION_SAVING)) {
+        // The sample was misleading; stop paying for the codec
+        compressing = false;
+    }
+    return true;
+}
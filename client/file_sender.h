@@ -0,0 +1,54 @@
+#ifndef FILE_SENDER_H
+#define FILE_SENDER_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "../shared/constants.h"
+#include "../shared/lz4_block.h"
+#include "../shared/platform.h"
+
+// XXH64 of a file's contents, which the server uses to recognise files it
+// already holds
+bool hash_file(const std::string& filepath, uint64_t& hash);
+
+// Stream bytes [offset, offset + length) of a file to a blocking socket.
+// Uses sendfile() on Linux, a sequentially-advised mmap() on other POSIX
+// systems (or if sendfile() is unsupported), and buffered reads on Windows.
+// method receives the name of the path that was used.
+bool send_file_range(SOCKET socket, const std::string& filepath, int64_t offset,
+                     int64_t length, std::string* method);
+
+// Read bytes [offset, offset + length) of a file
+bool read_file_range(const std::string& filepath, int64_t offset, char* out, size_t length);
+
+// Size of what precedes a FILE_CHUNK's data: frame header, transfer ID and
+// offset
+constexpr int CHUNK_HEADER_SIZE = FRAME_HEADER_SIZE + STREAMED_META_SIZE;
+
+// Encode that header for a chunk whose body is body_length bytes
+void put_chunk_header(char* out, uint64_t transfer_id, int64_t offset, int64_t body_length,
+                      uint8_t flags = 0);
+
+// LZ4-compresses upload chunks that are worth it. A chunk whose first
+// block looks already compressed is left to go out raw (zero-copy), and a
+// compressed chunk that saved too little turns compression off for the
+// rest of its upload.
+class ChunkEncoder {
+public:
+    ChunkEncoder();
+
+    // Append bytes [offset, offset + length) of the file, at most
+    // FILE_CHUNK_SIZE, to out as compressed blocks. Returns false, leaving
+    // out as it was, if the chunk should be sent raw. compressing is the
+    // upload's switch, cleared when compression stops paying.
+    bool encode(const std::string& filepath, int64_t offset, int64_t length,
+                bool& compressing, std::string& out);
+
+private:
+    Lz4Block codec_;
+    std::unique_ptr<char[]> raw_;
+};
+
+#endif
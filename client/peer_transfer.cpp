@@ -0,0 +1,505 @@
+#include "peer_transfer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+
+#include "../shared/constants.h"
+#include "file_downloader.h"
+#include "file_sender.h"
+
+namespace {
+
+// Largest single read of file data from a peer
+constexpr size_t PEER_BUFFER_SIZE = 256 * 1024;
+
+// How long a connected peer may go quiet
+constexpr int PEER_RECEIVE_TIMEOUT_S = 30;
+
+// Status lines share the terminal with the input prompt
+void print_status(const std::string& line) {
+    std::cout << "\r" << line << std::endl;
+    std::cout << "> " << std::flush;
+}
+
+bool send_all(SOCKET socket, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(socket, data, len, 0);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+bool send_frame(SOCKET socket, const std::string& frame) {
+    return send_all(socket, frame.data(), frame.size());
+}
+
+// Block until the next frame from a peer has arrived
+bool read_frame(SOCKET socket, RingBuffer& input, FrameParser& parser, FrameView& frame) {
+    while (true) {
+        ParseResult result = parser.next(input, frame);
+        if (result == ParseResult::FRAME) {
+            return true;
+        }
+        if (result == ParseResult::INVALID) {
+            return false;
+        }
+        input.prepare();
+        ssize_t bytes_received = recv(socket, input.write_ptr(), input.writable(), 0);
+        if (bytes_received <= 0) {
+            return false;
+        }
+        input.commit(bytes_received);
+    }
+}
+
+void set_receive_timeout(SOCKET socket, int seconds) {
+#ifdef _WIN32
+    DWORD timeout = seconds * 1000;
+#else
+    struct timeval timeout = {seconds, 0};
+#endif
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+}
+
+// Connect, giving up after PEER_CONNECT_TIMEOUT_MS
+SOCKET connect_to_peer(const std::string& address, uint16_t port) {
+    struct sockaddr_in peer_address;
+    std::memset(&peer_address, 0, sizeof(peer_address));
+    peer_address.sin_family = AF_INET;
+    peer_address.sin_port = htons(port);
+    if (inet_pton(AF_INET, address.c_str(), &peer_address.sin_addr) <= 0) {
+        return INVALID_SOCKET;
+    }
+
+    SOCKET socket_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (socket_fd == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+    set_nonblocking(socket_fd);
+    if (connect(socket_fd, (struct sockaddr*)&peer_address, sizeof(peer_address)) == SOCKET_ERROR) {
+#ifdef _WIN32
+        bool pending = WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+        bool pending = errno == EINPROGRESS;
+#endif
+        struct pollfd pfd = {socket_fd, POLLOUT, 0};
+        int error = 0;
+        socklen_t error_length = sizeof(error);
+        if (!pending || poll(&pfd, 1, PEER_CONNECT_TIMEOUT_MS) <= 0 ||
+            getsockopt(socket_fd, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&error), &error_length) < 0 ||
+            error != 0) {
+            closesocket(socket_fd);
+            return INVALID_SOCKET;
+        }
+    }
+    set_blocking(socket_fd);
+    return socket_fd;
+}
+
+// Listen on a port of the system's choosing; returns the port, or 0
+uint16_t open_listener(SOCKET& listener) {
+    listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == INVALID_SOCKET) {
+        return 0;
+    }
+    struct sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = 0;
+    socklen_t address_length = sizeof(address);
+    if (bind(listener, (struct sockaddr*)&address, sizeof(address)) == SOCKET_ERROR ||
+        listen(listener, 4) == SOCKET_ERROR ||
+        getsockname(listener, (struct sockaddr*)&address, &address_length) == SOCKET_ERROR) {
+        closesocket(listener);
+        listener = INVALID_SOCKET;
+        return 0;
+    }
+    return ntohs(address.sin_port);
+}
+
+// Names from another client end up as paths in downloads/
+bool safe_file_name(const std::string& filename) {
+    return !filename.empty() && filename[0] != '.' &&
+           filename.find_first_of("/\\") == std::string::npos;
+}
+
+std::string token_frame(uint8_t type, uint64_t token, uint8_t flags = 0) {
+    char payload[sizeof(uint64_t)];
+    put_u64(payload, token);
+    return make_frame(type, payload, sizeof(payload), flags);
+}
+
+double megabytes_per_second(int64_t bytes, std::chrono::steady_clock::time_point start) {
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+    return (bytes / 1024.0 / 1024.0) / (std::max<int64_t>(duration.count(), 1) / 1e6);
+}
+
+} // namespace
+
+PeerTransfers::PeerTransfers(Hooks hooks, bool accept_direct)
+    : hooks_(std::move(hooks)), accept_direct_(accept_direct) {}
+
+PeerTransfers::~PeerTransfers() {
+    stop();
+}
+
+std::string PeerTransfers::offer(const std::string& recipient, const std::string& filepath) {
+    std::ifstream file(filepath, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        std::cerr << "✗ Failed to open file: " << filepath << std::endl;
+        return std::string();
+    }
+
+    Outgoing outgoing;
+    outgoing.recipient = recipient;
+    outgoing.filepath = filepath;
+    outgoing.filename = filepath.substr(filepath.find_last_of("/\\") + 1);
+    outgoing.size = file.tellg();
+
+    // Without a listener the offer carries port 0 and the file is relayed
+    uint16_t port = accept_direct_ ? open_listener(outgoing.listener) : 0;
+
+    uint64_t request_id;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        request_id = next_request_id_++;
+        outgoing_[request_id] = outgoing;
+    }
+
+    // u64 request ID, u64 size, u16 port, recipient, then the file name
+    std::string payload(2 * sizeof(uint64_t) + sizeof(uint16_t), '\0');
+    put_u64(&payload[0], request_id);
+    put_u64(&payload[sizeof(uint64_t)], static_cast<uint64_t>(outgoing.size));
+    put_u16(&payload[2 * sizeof(uint64_t)], port);
+    payload += static_cast<char>(recipient.size());
+    payload += recipient;
+    payload += outgoing.filename;
+    return make_frame(PEER_OFFER, payload);
+}
+
+void PeerTransfers::on_offer_reply(const FrameView& frame) {
+    if (frame.header.length < 2 * sizeof(uint64_t)) {
+        return;
+    }
+    uint64_t request_id = get_u64(frame.payload);
+    uint64_t token = get_u64(frame.payload + sizeof(uint64_t));
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = outgoing_.find(request_id);
+    if (it == outgoing_.end()) {
+        return;
+    }
+    Outgoing& outgoing = it->second;
+    if (token == 0) {
+        std::string reason(frame.payload + 2 * sizeof(uint64_t), frame.header.length - 2 * sizeof(uint64_t));
+        print_status("✗ Can't send " + outgoing.filename + ": " + reason);
+        if (outgoing.listener != INVALID_SOCKET) {
+            closesocket(outgoing.listener);
+        }
+        outgoing_.erase(it);
+        return;
+    }
+
+    outgoing.token = token;
+    print_status("Offered " + outgoing.filename + " to " + outgoing.recipient + "...");
+    if (!stopping_) {
+        threads_.emplace_back(&PeerTransfers::run_sender, this, request_id);
+    }
+}
+
+void PeerTransfers::on_offer(const FrameView& frame) {
+    constexpr size_t fixed = 2 * sizeof(uint64_t) + sizeof(uint16_t);
+    const char* p = frame.payload;
+    const char* end = frame.payload + frame.header.length;
+    if (frame.header.length < fixed) {
+        return;
+    }
+    uint64_t token = get_u64(p);
+    int64_t size = static_cast<int64_t>(get_u64(p + sizeof(uint64_t)));
+    uint16_t port = get_u16(p + 2 * sizeof(uint64_t));
+    p += fixed;
+
+    std::string address;
+    std::string sender;
+    for (std::string* text : {&address, &sender}) {
+        if (p >= end || end - p - 1 < static_cast<unsigned char>(*p)) {
+            return;
+        }
+        size_t length = static_cast<unsigned char>(*p++);
+        text->assign(p, length);
+        p += length;
+    }
+    std::string filename(p, end - p);
+
+    start([=] { run_recipient(token, size, port, address, sender, filename); });
+}
+
+void PeerTransfers::on_relay(const FrameView& frame) {
+    if (frame.header.length != sizeof(uint64_t)) {
+        return;
+    }
+    uint64_t token = get_u64(frame.payload);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (frame.header.flags & FRAME_FLAG_REPLY) {
+        // The sender's upload is on the server: fetch it from there
+        auto it = relayed_.find(token);
+        if (it != relayed_.end() && !stopping_) {
+            std::string filename = it->second;
+            threads_.emplace_back([this, filename] { hooks_.download(filename); });
+            relayed_.erase(it);
+        }
+        return;
+    }
+    for (auto& item : outgoing_) {
+        if (item.second.token == token) {
+            item.second.relay_requested = true;
+        }
+    }
+}
+
+void PeerTransfers::stop() {
+    std::vector<std::thread> threads;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        for (SOCKET socket : sockets_) {
+            shutdown(socket, SHUT_RDWR);
+        }
+        threads.swap(threads_);
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+// Wait for the recipient to connect, or to ask for a relay, and send
+void PeerTransfers::run_sender(uint64_t request_id) {
+    Outgoing outgoing;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        outgoing = outgoing_[request_id];
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(PEER_ACCEPT_TIMEOUT_S);
+    bool relay = false;
+
+    while (!stopping_) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            relay = outgoing_[request_id].relay_requested;
+        }
+        if (relay) {
+            break;
+        }
+        if (std::chrono::steady_clock::now() >= deadline) {
+            print_status("✗ " + outgoing.recipient + " did not pick up " + outgoing.filename);
+            break;
+        }
+
+        // Poll in slices so a relay request is noticed promptly
+        if (outgoing.listener == INVALID_SOCKET) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            continue;
+        }
+        struct pollfd pfd = {outgoing.listener, POLLIN, 0};
+        if (poll(&pfd, 1, 200) <= 0) {
+            continue;
+        }
+        SOCKET peer = accept(outgoing.listener, nullptr, nullptr);
+        if (peer == INVALID_SOCKET) {
+            continue;
+        }
+        bool sent = serve_recipient(track(peer), outgoing);
+        untrack(peer);
+        closesocket(peer);
+        if (sent) {
+            break;
+        }
+    }
+
+    if (outgoing.listener != INVALID_SOCKET) {
+        closesocket(outgoing.listener);
+    }
+    if (relay && !stopping_) {
+        print_status(outgoing.recipient + " can't connect to you; sending " + outgoing.filename +
+                     " through the server");
+        if (hooks_.upload(outgoing.filepath)) {
+            hooks_.send(token_frame(PEER_RELAY, outgoing.token, FRAME_FLAG_REPLY));
+        } else {
+            print_status("✗ Could not relay " + outgoing.filename + " to " + outgoing.recipient);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    outgoing_.erase(request_id);
+}
+
+// One connection to the listener: check the token, then send the file from
+// where the recipient asks. False if the connection wasn't the recipient
+// or broke off.
+bool PeerTransfers::serve_recipient(SOCKET socket, const Outgoing& outgoing) {
+    RingBuffer input;
+    FrameParser parser;
+    FrameView frame;
+    set_receive_timeout(socket, PEER_RECEIVE_TIMEOUT_S);
+
+    if (!read_frame(socket, input, parser, frame) || frame.header.type != FILE_ATTACH ||
+        frame.header.length != 2 * sizeof(uint64_t) || get_u64(frame.payload) != outgoing.token) {
+        return false;
+    }
+    int64_t offset = static_cast<int64_t>(get_u64(frame.payload + sizeof(uint64_t)));
+    if (offset > outgoing.size) {
+        std::string reply(sizeof(uint64_t), '\0');
+        put_u64(&reply[0], outgoing.token);
+        reply += "Partial file is larger than the file";
+        send_frame(socket, make_frame(FILE_ERROR, reply));
+        return false;
+    }
+
+    char ready[3 * sizeof(uint64_t)];
+    put_u64(ready, outgoing.token);
+    put_u64(ready + sizeof(uint64_t), static_cast<uint64_t>(offset));
+    put_u64(ready + 2 * sizeof(uint64_t), static_cast<uint64_t>(outgoing.size));
+    if (!send_frame(socket, make_frame(FILE_READY, ready, sizeof(ready)))) {
+        return false;
+    }
+
+    print_status("Sending " + outgoing.filename + " to " + outgoing.recipient + " directly...");
+    auto start_time = std::chrono::steady_clock::now();
+    std::string method;
+    if (!send_file_range(socket, outgoing.filepath, offset, outgoing.size - offset, &method)) {
+        print_status("✗ Direct transfer of " + outgoing.filename + " to " + outgoing.recipient + " broke off");
+        return false;
+    }
+
+    // The recipient confirms once every byte is written
+    if (!read_frame(socket, input, parser, frame) || frame.header.type != FILE_DONE ||
+        frame.header.length != sizeof(uint64_t) || get_u64(frame.payload) != outgoing.token) {
+        print_status("✗ " + outgoing.recipient + " did not confirm " + outgoing.filename);
+        return false;
+    }
+    print_status("✓ File sent to " + outgoing.recipient + " directly: " + outgoing.filename + " (" +
+                 std::to_string(outgoing.size) + " bytes, " +
+                 std::to_string(megabytes_per_second(outgoing.size - offset, start_time)) +
+                 " MB/s via " + method + ")");
+    return true;
+}
+
+// Fetch an offered file from its sender, or have it relayed
+void PeerTransfers::run_recipient(uint64_t token, int64_t size, uint16_t port, std::string address,
+                                  std::string sender, std::string filename) {
+    if (!safe_file_name(filename)) {
+        print_status("✗ Ignoring a file with an unsafe name from " + sender);
+        return;
+    }
+    print_status(sender + " is sending you " + filename + " (" + std::to_string(size) + " bytes)");
+
+    if (port != 0) {
+        SOCKET socket_fd = connect_to_peer(address, port);
+        if (socket_fd != INVALID_SOCKET) {
+            bool received = receive_direct(track(socket_fd), token, size, sender, filename);
+            untrack(socket_fd);
+            closesocket(socket_fd);
+            if (received) {
+                return;
+            }
+        }
+    }
+    if (stopping_) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        relayed_[token] = filename;
+    }
+    print_status("Can't get " + filename + " from " + sender + " directly; asking the server to relay it");
+    hooks_.send(token_frame(PEER_RELAY, token));
+}
+
+// Receive the file over a direct connection into downloads/, after
+// whatever an earlier attempt left there. False if it should be relayed.
+bool PeerTransfers::receive_direct(SOCKET socket, uint64_t token, int64_t size, const std::string& sender,
+                                   const std::string& filename) {
+    std::string path = std::string(DOWNLOADS_DIR) + "/" + filename;
+    int64_t existing;
+    int fd = open_local_file(path, existing);
+    if (fd < 0) {
+        print_status("✗ Cannot create " + path);
+        return true;
+    }
+
+    RingBuffer input;
+    FrameParser parser;
+    FrameView frame;
+    set_receive_timeout(socket, PEER_RECEIVE_TIMEOUT_S);
+
+    char attach[2 * sizeof(uint64_t)];
+    put_u64(attach, token);
+    put_u64(attach + sizeof(uint64_t), static_cast<uint64_t>(existing));
+    if (!send_frame(socket, make_frame(FILE_ATTACH, attach, sizeof(attach))) ||
+        !read_frame(socket, input, parser, frame) || frame.header.type != FILE_READY ||
+        frame.header.length != 3 * sizeof(uint64_t) || get_u64(frame.payload) != token) {
+        close_local_file(fd);
+        return false;
+    }
+    int64_t position = static_cast<int64_t>(get_u64(frame.payload + sizeof(uint64_t)));
+    size = static_cast<int64_t>(get_u64(frame.payload + 2 * sizeof(uint64_t)));
+    int64_t start_position = position;
+    auto start_time = std::chrono::steady_clock::now();
+
+    // Raw file bytes follow; some may have come in with the reply
+    bool ok = true;
+    if (!input.empty()) {
+        size_t buffered = static_cast<size_t>(std::min<int64_t>(input.size(), size - position));
+        ok = write_at(fd, input.data(), buffered, position);
+        position += buffered;
+    }
+    std::unique_ptr<char[]> buffer(new char[PEER_BUFFER_SIZE]);
+    while (ok && position < size) {
+        size_t want = static_cast<size_t>(std::min<int64_t>(PEER_BUFFER_SIZE, size - position));
+        ssize_t bytes_received = recv(socket, buffer.get(), static_cast<int>(want), 0);
+        if (bytes_received <= 0 || !write_at(fd, buffer.get(), bytes_received, position)) {
+            ok = false;
+            break;
+        }
+        position += bytes_received;
+    }
+    close_local_file(fd);
+
+    if (!ok || !send_frame(socket, token_frame(FILE_DONE, token))) {
+        return false;
+    }
+    print_status("✓ File received from " + sender + " directly: " + path + " (" + std::to_string(size) +
+                 " bytes, " + std::to_string(megabytes_per_second(size - start_position, start_time)) +
+                 " MB/s)");
+    return true;
+}
+
+void PeerTransfers::start(std::function<void()> work) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!stopping_) {
+        threads_.emplace_back(std::move(work));
+    }
+}
+
+SOCKET PeerTransfers::track(SOCKET socket) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sockets_.insert(socket);
+    return socket;
+}
+
+void PeerTransfers::untrack(SOCKET socket) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sockets_.erase(socket);
+}
@@ -0,0 +1,98 @@
+#ifndef PEER_TRANSFER_H
+#define PEER_TRANSFER_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../shared/platform.h"
+#include "../shared/protocol.h"
+
+// How long the sender waits for the recipient to connect or ask for a
+// relay, and how long the recipient tries to reach the sender
+constexpr int PEER_ACCEPT_TIMEOUT_S = 60;
+constexpr int PEER_CONNECT_TIMEOUT_MS = 3000;
+
+// Files sent with /sendto, straight from one client to another. The server
+// only passes on the sender's endpoint and a token (see server/peer.h).
+//
+// The sender listens on a port of its own; the recipient connects, sends
+// FILE_ATTACH with the token and how much of the file it already has, and
+// gets FILE_READY (token, offset, size) followed by the raw bytes, sent
+// with sendfile(). It answers FILE_DONE once they are written.
+//
+// A recipient that can't reach the sender asks the server to relay
+// instead: the sender uploads the file as with /sendfile, then the
+// recipient downloads it as with /getfile, resuming after whatever did
+// arrive directly.
+//
+// Each transfer runs on a thread of its own, so chat goes on meanwhile.
+class PeerTransfers {
+public:
+    // How transfers reach the rest of the client. Called from transfer
+    // threads, never from the I/O loop: upload blocks until it is done.
+    struct Hooks {
+        std::function<bool(const std::string& frame)> send;          // Control frame to the server
+        std::function<bool(const std::string& filepath)> upload;     // As /sendfile
+        std::function<bool(const std::string& filename)> download;   // As /getfile
+    };
+
+    // With accept_direct false nobody is let in, and every file this
+    // client sends goes through the server
+    PeerTransfers(Hooks hooks, bool accept_direct);
+    ~PeerTransfers();
+
+    // Input thread: get ready to send a file. Returns the PEER_OFFER frame
+    // for the server, or an empty string after reporting why not.
+    std::string offer(const std::string& recipient, const std::string& filepath);
+
+    // I/O loop: the server's answer to an offer, an offer to us, and
+    // PEER_RELAY in either direction
+    void on_offer_reply(const FrameView& frame);
+    void on_offer(const FrameView& frame);
+    void on_relay(const FrameView& frame);
+
+    // Abandon every transfer and wait for their threads
+    void stop();
+
+private:
+    struct Outgoing {
+        std::string recipient;
+        std::string filepath;
+        std::string filename;
+        int64_t size = 0;
+        SOCKET listener = INVALID_SOCKET;
+        uint64_t token = 0;
+        bool relay_requested = false;
+    };
+
+    void run_sender(uint64_t request_id);
+    bool serve_recipient(SOCKET socket, const Outgoing& outgoing);
+    void run_recipient(uint64_t token, int64_t size, uint16_t port, std::string address,
+                       std::string sender, std::string filename);
+    bool receive_direct(SOCKET socket, uint64_t token, int64_t size, const std::string& sender,
+                        const std::string& filename);
+
+    void start(std::function<void()> work);
+    SOCKET track(SOCKET socket);
+    void untrack(SOCKET socket);
+
+    Hooks hooks_;
+    bool accept_direct_;
+    std::atomic<bool> stopping_{false};
+
+    std::mutex mutex_;
+    std::map<uint64_t, Outgoing> outgoing_;     // By request ID
+    std::map<uint64_t, std::string> relayed_;   // Token -> file name, awaiting the relay
+    std::set<SOCKET> sockets_;                  // Open peer connections, shut down by stop()
+    std::vector<std::thread> threads_;
+    uint64_t next_request_id_ = 1;
+};
+
+#endif
@@ -0,0 +1,116 @@
+#include "presence.h"
+
+#include <algorithm>
+#include <ctime>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+Roster::Update Roster::apply_snapshot(const FrameView& frame) {
+    constexpr size_t head_size = sizeof(uint64_t) + 2 * sizeof(uint32_t);
+    if (frame.header.length < head_size) {
+        return Update::IGNORED;
+    }
+    uint64_t version = get_u64(frame.payload);
+    uint32_t total = get_u32(frame.payload + sizeof(uint64_t));
+    uint32_t first = get_u32(frame.payload + sizeof(uint64_t) + sizeof(uint32_t));
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (first == 0) {
+        entries_.clear();
+        snapshot_received_ = 0;
+        complete_ = false;
+    } else if (complete_ || first != snapshot_received_) {
+        return Update::IGNORED;
+    }
+
+    const char* p = frame.payload + head_size;
+    const char* end = frame.payload + frame.header.length;
+    RosterEntry entry;
+    while (p < end && decode_roster_entry(p, end, entry)) {
+        entries_[entry.id] = entry;
+        snapshot_received_++;
+    }
+
+    if (snapshot_received_ >= total) {
+        complete_ = true;
+        resyncing_ = false;
+        version_ = version;
+    }
+    return Update::APPLIED;
+}
+
+Roster::Update Roster::apply_delta(const FrameView& frame) {
+    if (frame.header.length < sizeof(uint64_t) + 1) {
+        return Update::IGNORED;
+    }
+    uint64_t version = get_u64(frame.payload);
+    uint8_t kind = static_cast<uint8_t>(frame.payload[sizeof(uint64_t)]);
+    const char* p = frame.payload + sizeof(uint64_t) + 1;
+    const char* end = frame.payload + frame.header.length;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!complete_ || version <= version_) {
+        return Update::IGNORED;
+    }
+    if (version != version_ + 1) {
+        return resyncing_ ? Update::IGNORED : Update::OUT_OF_SYNC;
+    }
+
+    if (kind == PRESENCE_JOIN) {
+        RosterEntry entry;
+        if (!decode_roster_entry(p, end, entry)) {
+            return Update::IGNORED;
+        }
+        entries_[entry.id] = entry;
+    } else {
+        if (end - p < static_cast<ptrdiff_t>(sizeof(uint64_t))) {
+            return Update::IGNORED;
+        }
+        uint64_t id = get_u64(p);
+        if (kind == PRESENCE_LEAVE) {
+            entries_.erase(id);
+        } else {
+            auto it = entries_.find(id);
+            if (it != entries_.end()) {
+                it->second.idle = kind == PRESENCE_IDLE;
+            }
+        }
+    }
+    version_ = version;
+    resyncing_ = false;
+    return Update::APPLIED;
+}
+
+std::string Roster::resync_request() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    resyncing_ = true;
+    char version[sizeof(uint64_t)];
+    put_u64(version, version_);
+    return make_frame(CLIENT_LIST, version, sizeof(version));
+}
+
+std::string Roster::describe() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!complete_) {
+        return "Roster not received yet\n";
+    }
+
+    std::vector<const RosterEntry*> sorted;
+    for (const auto& item : entries_) {
+        sorted.push_back(&item.second);
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const RosterEntry* a, const RosterEntry* b) {
+        return a->name < b->name;
+    });
+
+    std::ostringstream out;
+    out << "Online: " << sorted.size() << " (roster version " << version_ << ")\n";
+    for (const RosterEntry* entry : sorted) {
+        std::time_t since = static_cast<std::time_t>(entry->connected);
+        out << "  " << entry->name << " (" << entry->address << ") since "
+            << std::put_time(std::localtime(&since), "%H:%M:%S")
+            << (entry->idle ? ", idle" : "") << "\n";
+    }
+    return out.str();
+}
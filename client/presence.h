@@ -0,0 +1,41 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "../shared/protocol.h"
+#include "../shared/roster.h"
+
+// Local copy of who is online. The server sends the whole roster when we
+// join and then one versioned PRESENCE delta per change. Frames are applied
+// on the connection's I/O loop; /who reads the roster on the input thread.
+class Roster {
+public:
+    enum class Update { APPLIED, IGNORED, OUT_OF_SYNC };
+
+    // One CLIENT_LIST frame of a snapshot
+    Update apply_snapshot(const FrameView& frame);
+
+    // One PRESENCE frame. OUT_OF_SYNC means a delta was missed: ask for
+    // resync_request() and ignore deltas until the server catches us up.
+    Update apply_delta(const FrameView& frame);
+
+    // CLIENT_LIST asking for everything after the version we hold
+    std::string resync_request();
+
+    // The roster as lines for the terminal
+    std::string describe();
+
+private:
+    std::mutex mutex_;
+    std::map<uint64_t, RosterEntry> entries_;
+    uint64_t version_ = 0;
+    bool complete_ = false;          // A full snapshot has arrived
+    uint32_t snapshot_received_ = 0; // Entries of the snapshot in progress
+    bool resyncing_ = false;         // Asked the server to catch us up
+};
+
+#endif
@@ -0,0 +1,169 @@
+#include "blob_store.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+
+#include <sys/stat.h>
+#ifdef _WIN32
+    #include <direct.h>
+    #include <io.h>
+    #include <windows.h>
+#else
+    #include <dirent.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+#endif
+
+#include "../shared/constants.h"
+#include "../shared/xxhash64.h"
+#include "file_receiver.h"
+
+namespace {
+
+// Read size for hashing when the file can't be mapped
+constexpr size_t HASH_BUFFER_SIZE = 1024 * 1024;
+
+std::atomic<uint64_t> link_counter{0};
+
+std::string blob_path(uint64_t hash, int64_t size) {
+    char name[48];
+    std::snprintf(name, sizeof(name), "/%016llx-%lld",
+                  static_cast<unsigned long long>(hash), static_cast<long long>(size));
+    return BLOBS_DIR + std::string(name);
+}
+
+bool path_exists(const std::string& path) {
+    struct stat info;
+    return stat(path.c_str(), &info) == 0;
+}
+
+bool hard_link(const std::string& target, const std::string& link_path) {
+#ifdef _WIN32
+    return CreateHardLinkA(link_path.c_str(), target.c_str(), nullptr) != 0;
+#else
+    return link(target.c_str(), link_path.c_str()) == 0;
+#endif
+}
+
+#ifndef _WIN32
+// Delete entries of a directory that match a predicate
+template <typename Predicate>
+void sweep_directory(const std::string& dir, Predicate stale) {
+    DIR* listing = opendir(dir.c_str());
+    if (!listing) {
+        return;
+    }
+    while (struct dirent* entry = readdir(listing)) {
+        std::string path = dir + "/" + entry->d_name;
+        struct stat info;
+        if (entry->d_name[0] != '\0' && std::strcmp(entry->d_name, ".") != 0 &&
+            std::strcmp(entry->d_name, "..") != 0 && stat(path.c_str(), &info) == 0 &&
+            S_ISREG(info.st_mode) && stale(entry->d_name, info)) {
+            unlink(path.c_str());
+        }
+    }
+    closedir(listing);
+}
+#endif
+
+} // namespace
+
+bool open_blob_store() {
+#ifdef _WIN32
+    int result = _mkdir(BLOBS_DIR);
+#else
+    int result = mkdir(BLOBS_DIR, 0755);
+#endif
+    if (result != 0 && errno != EEXIST) {
+        return false;
+    }
+
+#ifndef _WIN32
+    // A blob whose only link is its own entry is no longer shared under any name
+    sweep_directory(BLOBS_DIR, [](const char*, const struct stat& info) {
+        return info.st_nlink == 1;
+    });
+    // The transfer table doesn't survive a restart, so neither can these
+    sweep_directory(UPLOADS_DIR, [](const char* name, const struct stat&) {
+        size_t len = std::strlen(name);
+        return name[0] == '.' && len > 5 && std::strcmp(name + len - 5, ".part") == 0;
+    });
+#endif
+    return true;
+}
+
+bool blob_exists(uint64_t hash, int64_t size) {
+    return path_exists(blob_path(hash, size));
+}
+
+bool store_blob(const std::string& source, uint64_t hash, int64_t size) {
+    std::string target = blob_path(hash, size);
+    if (path_exists(target)) {
+        std::remove(source.c_str());
+        return true;
+    }
+    return std::rename(source.c_str(), target.c_str()) == 0;
+}
+
+bool link_blob(const std::string& filename, uint64_t hash, int64_t size) {
+    std::string final_path = std::string(UPLOADS_DIR) + "/" + filename;
+
+    // Link under a private name, then rename over the old name in one step
+    char suffix[32];
+    std::snprintf(suffix, sizeof(suffix), ".link-%llu",
+                  static_cast<unsigned long long>(link_counter++));
+    std::string temp_path = std::string(UPLOADS_DIR) + "/." + filename + suffix;
+
+    if (!hard_link(blob_path(hash, size), temp_path)) {
+        std::cerr << "Cannot link " << final_path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+#ifdef _WIN32
+    // Windows can't replace a file by rename()
+    std::remove(final_path.c_str());
+#endif
+    bool renamed = std::rename(temp_path.c_str(), final_path.c_str()) == 0;
+    // rename() leaves both names alone when they already share the blob
+    std::remove(temp_path.c_str());
+    return renamed;
+}
+
+bool hash_file(int fd, int64_t size, uint64_t& hash) {
+    XxHash64 state;
+
+#ifndef _WIN32
+    if (size > 0) {
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapped != MAP_FAILED) {
+            madvise(mapped, size, MADV_SEQUENTIAL);
+            state.update(mapped, static_cast<size_t>(size));
+            munmap(mapped, size);
+            hash = state.digest();
+            return true;
+        }
+    }
+#endif
+
+    std::unique_ptr<char[]> buffer(new char[HASH_BUFFER_SIZE]);
+    int64_t offset = 0;
+    while (offset < size) {
+        size_t want = static_cast<size_t>(std::min<int64_t>(HASH_BUFFER_SIZE, size - offset));
+#ifdef _WIN32
+        int bytes_read = _lseeki64(fd, offset, SEEK_SET) < 0 ? -1 :
+                         _read(fd, buffer.get(), static_cast<unsigned int>(want));
+#else
+        ssize_t bytes_read = pread(fd, buffer.get(), want, offset);
+#endif
+        if (bytes_read <= 0) {
+            return false;
+        }
+        state.update(buffer.get(), bytes_read);
+        offset += bytes_read;
+    }
+    hash = state.digest();
+    return true;
+}
@@ -0,0 +1,29 @@
+#ifndef BLOB_STORE_H
+#define BLOB_STORE_H
+
+#include <cstdint>
+#include <string>
+
+// Content-addressed store for uploads. Every distinct file body is kept
+// once in uploads/.blobs, named by its XXH64 hash and size, and each
+// uploads/<name> is a hard link to the blob holding its contents. Sharing
+// a file the server already has only adds a link.
+constexpr const char* BLOBS_DIR = "uploads/.blobs";
+
+// Create the blob directory and remove leftovers from earlier runs: blobs
+// no name links to any more and partial uploads nobody can resume
+bool open_blob_store();
+
+bool blob_exists(uint64_t hash, int64_t size);
+
+// Move a verified upload into the store; if an identical blob is already
+// there, the upload is simply deleted
+bool store_blob(const std::string& source, uint64_t hash, int64_t size);
+
+// Point uploads/<filename> at a blob, replacing whatever the name held
+bool link_blob(const std::string& filename, uint64_t hash, int64_t size);
+
+// Hash the first size bytes of an open file
+bool hash_file(int fd, int64_t size, uint64_t& hash);
+
+#endif
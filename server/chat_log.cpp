@@ -0,0 +1,622 @@
+#include "chat_log.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+#ifndef _WIN32
+    #include <dirent.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+#endif
+
+#include "../shared/xxhash64.h"
+#include "metrics.h"
+#include "mpsc_queue.h"
+
+ChatLogConfig chat_log_config;
+
+#ifdef _WIN32
+
+bool open_chat_log() {
+    if (!chat_log_config.dir.empty()) {
+        std::cerr << "Warning: the chat log is not available on Windows" << std::endl;
+        chat_log_config.dir.clear();
+    }
+    return true;
+}
+
+void close_chat_log() {}
+
+void log_chat(const std::shared_ptr<ChatLogBuffer>&, const std::string&, const FrameRef&,
+              History::Clock::time_point) {}
+
+void read_chat_log(const std::string&,
+                   const std::function<void(const char*, size_t, History::Clock::time_point)>&) {}
+
+#else
+
+namespace {
+
+// u32 length | u32 checksum, then the checksummed part: u64 time | u8 room
+// length | room | frame
+constexpr size_t RECORD_PREFIX_SIZE = 8;
+constexpr size_t RECORD_FIXED_SIZE = 9;
+constexpr size_t MIN_RECORD_BODY = RECORD_FIXED_SIZE + FRAME_HEADER_SIZE;
+
+// Rooms log the chat lines they relay, "[username]: message", so no record
+// is bigger than one of those in the longest room name
+constexpr size_t MAX_RECORD_BODY = RECORD_FIXED_SIZE + MAX_ROOM_NAME_LENGTH +
+                                   FRAME_HEADER_SIZE + MAX_CHAT_PAYLOAD;
+
+// Records waiting for the committer beyond this are dropped, so a stalled
+// disk can't take the server's memory with it
+constexpr size_t MAX_PENDING_BYTES = 16 * 1024 * 1024;
+
+// Where one record lives
+struct Location {
+    uint64_t segment;
+    int64_t offset;
+    uint32_t size;     // The whole record, prefix included
+};
+
+// The latest locations of a room, oldest first. Its storage stops growing
+// at the room's limit and is reused from then on, so indexing a record
+// costs no allocation in the steady state.
+class LocationRing {
+public:
+    bool empty() const { return count_ == 0; }
+    const Location& front() const { return slots_[start_]; }
+
+    void pop_front() {
+        start_ = (start_ + 1) % slots_.size();
+        count_--;
+    }
+
+    // Append location, dropping the oldest ones beyond limit
+    void push_back(const Location& location, size_t limit) {
+        while (count_ >= limit && count_ > 0) {
+            pop_front();
+        }
+        if (count_ == slots_.size()) {
+            std::vector<Location> grown = snapshot();
+            grown.resize(std::min(limit, std::max<size_t>(16, 2 * slots_.size())));
+            slots_.swap(grown);
+            start_ = 0;
+        }
+        slots_[(start_ + count_) % slots_.size()] = location;
+        count_++;
+    }
+
+    std::vector<Location> snapshot() const {
+        std::vector<Location> locations;
+        locations.reserve(count_);
+        for (size_t i = 0; i < count_; i++) {
+            locations.push_back(slots_[(start_ + i) % slots_.size()]);
+        }
+        return locations;
+    }
+
+private:
+    std::vector<Location> slots_;
+    size_t start_ = 0;
+    size_t count_ = 0;
+};
+
+// What the bytes at some offset of a segment hold
+enum class RecordState {
+    INTACT,
+    TORN,       // A record running past the end of the data
+    DAMAGED     // Fails its checksum or doesn't add up
+};
+
+// A record decoded in place
+struct Record {
+    size_t size;
+    int64_t time_ms;
+    std::string_view room;
+    const char* frame;
+    size_t frame_length;
+};
+
+// Room buffers holding records, each queued once until the committer has
+// taken them
+MpscQueue<std::shared_ptr<ChatLogBuffer>> ready_buffers;
+std::atomic<size_t> pending_bytes{0};   // Encoded records not yet written
+
+// Posters only lock wake_mutex to wake a committer that waits for work
+std::mutex wake_mutex;
+std::condition_variable wake;
+std::atomic<bool> committer_waiting{false};
+bool stopping = false;
+std::thread committer;
+
+// The segment being appended to; only the committer touches these once
+// the log is open
+int segment_fd = -1;
+uint64_t segment_seq = 0;
+int64_t segment_size = 0;
+
+// The latest records of every room, at most history_config.messages each
+std::mutex index_mutex;
+std::unordered_map<std::string, LocationRing> room_index;
+
+std::string segment_path(uint64_t seq) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "/%016llx.log", static_cast<unsigned long long>(seq));
+    return chat_log_config.dir + name;
+}
+
+uint32_t checksum(const char* data, size_t length) {
+    return static_cast<uint32_t>(XxHash64::hash(data, length));
+}
+
+int64_t to_ms(History::Clock::time_point when) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(when.time_since_epoch()).count();
+}
+
+// Decode the record at the start of data
+RecordState decode_record(const char* data, size_t available, Record& record) {
+    if (available < RECORD_PREFIX_SIZE) {
+        return RecordState::TORN;
+    }
+    uint32_t length = get_u32(data);
+    if (length < MIN_RECORD_BODY) {
+        return RecordState::DAMAGED;
+    }
+    if (length > available - RECORD_PREFIX_SIZE) {
+        return RecordState::TORN;
+    }
+    const char* body = data + RECORD_PREFIX_SIZE;
+    if (checksum(body, length) != get_u32(data + 4)) {
+        return RecordState::DAMAGED;
+    }
+
+    size_t room_length = static_cast<unsigned char>(body[8]);
+    if (RECORD_FIXED_SIZE + room_length + FRAME_HEADER_SIZE > length) {
+        return RecordState::DAMAGED;
+    }
+    record.size = RECORD_PREFIX_SIZE + length;
+    record.time_ms = static_cast<int64_t>(get_u64(body));
+    record.room = std::string_view(body + RECORD_FIXED_SIZE, room_length);
+    record.frame = body + RECORD_FIXED_SIZE + room_length;
+    record.frame_length = length - RECORD_FIXED_SIZE - room_length;
+    return RecordState::INTACT;
+}
+
+// The offset of the first intact record after a damaged one at offset, or
+// size if none follows. Only lengths a record can have are checksummed, so
+// this is cheap over garbage.
+size_t find_next_record(const char* data, size_t size, size_t offset) {
+    Record record;
+    for (size_t next = offset + 1; next + RECORD_PREFIX_SIZE <= size; next++) {
+        uint32_t length = get_u32(data + next);
+        if (length >= MIN_RECORD_BODY && length <= MAX_RECORD_BODY &&
+            decode_record(data + next, size - next, record) == RecordState::INTACT) {
+            return next;
+        }
+    }
+    return size;
+}
+
+// Callers hold index_mutex
+void index_record(const Record& record, uint64_t segment, int64_t offset) {
+    if (history_config.messages == 0) {
+        return;
+    }
+    room_index[std::string(record.room)].push_back(Location{segment, offset, static_cast<uint32_t>(record.size)},
+                                                   history_config.messages);
+}
+
+// Sequence numbers of the segments on disk, oldest first
+std::vector<uint64_t> list_segments() {
+    std::vector<uint64_t> segments;
+    DIR* listing = opendir(chat_log_config.dir.c_str());
+    if (!listing) {
+        return segments;
+    }
+    while (struct dirent* entry = readdir(listing)) {
+        unsigned long long seq;
+        char extra;
+        if (std::strlen(entry->d_name) == 20 &&
+            std::sscanf(entry->d_name, "%16llx.lo%c", &seq, &extra) == 2 && extra == 'g') {
+            segments.push_back(seq);
+        }
+    }
+    closedir(listing);
+    std::sort(segments.begin(), segments.end());
+    return segments;
+}
+
+// Delete the oldest segments past the size or age limit; the one being
+// written is always kept
+void compact() {
+    std::vector<uint64_t> segments = list_segments();
+    std::vector<struct stat> info(segments.size());
+    uint64_t total = 0;
+    for (size_t i = 0; i < segments.size(); i++) {
+        if (stat(segment_path(segments[i]).c_str(), &info[i]) != 0) {
+            info[i].st_size = 0;
+            info[i].st_mtime = 0;
+        }
+        total += info[i].st_size;
+    }
+
+    time_t oldest_allowed = std::time(nullptr) -
+        std::chrono::duration_cast<std::chrono::seconds>(chat_log_config.max_age).count();
+    uint64_t kept_from = 0;
+    for (size_t i = 0; i + 1 < segments.size() && segments[i] != segment_seq; i++) {
+        if (total <= chat_log_config.retention_bytes && info[i].st_mtime >= oldest_allowed) {
+            break;
+        }
+        unlink(segment_path(segments[i]).c_str());
+        total -= info[i].st_size;
+        kept_from = segments[i] + 1;
+    }
+    if (kept_from == 0) {
+        return;
+    }
+
+    // Forget records that went with the deleted segments
+    std::lock_guard<std::mutex> lock(index_mutex);
+    for (auto it = room_index.begin(); it != room_index.end();) {
+        LocationRing& locations = it->second;
+        while (!locations.empty() && locations.front().segment < kept_from) {
+            locations.pop_front();
+        }
+        it = locations.empty() ? room_index.erase(it) : std::next(it);
+    }
+}
+
+bool open_segment(uint64_t seq) {
+    int fd = open(segment_path(seq).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    if (segment_fd >= 0) {
+        close(segment_fd);
+    }
+    struct stat info;
+    segment_fd = fd;
+    segment_seq = seq;
+    segment_size = fstat(fd, &info) == 0 ? info.st_size : 0;
+    return true;
+}
+
+// Index every intact record of a segment. Damaged bytes are skipped up to
+// the next intact record. Only when none follows are they a torn tail, cut
+// off the newest segment so appends continue from a clean end.
+size_t scan_segment(uint64_t seq, bool newest) {
+    std::string path = segment_path(seq);
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    size_t size = static_cast<size_t>(info.st_size);
+    void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+    madvise(mapped, size, MADV_SEQUENTIAL);
+
+    const char* data = static_cast<const char*>(mapped);
+    size_t offset = 0;
+    size_t records = 0;
+    Record record;
+    {
+        std::lock_guard<std::mutex> lock(index_mutex);
+        while (offset < size) {
+            if (decode_record(data + offset, size - offset, record) == RecordState::INTACT) {
+                // Too big to replay to every client; never written since
+                // chat lines have been capped
+                if (record.size - RECORD_PREFIX_SIZE <= MAX_RECORD_BODY) {
+                    index_record(record, seq, static_cast<int64_t>(offset));
+                    records++;
+                }
+                offset += record.size;
+                continue;
+            }
+            size_t next = find_next_record(data, size, offset);
+            if (next == size) {
+                break;
+            }
+            std::cerr << "✗ Chat log " << path << ": " << next - offset << " damaged bytes at byte "
+                      << offset << " skipped" << std::endl;
+            offset = next;
+        }
+    }
+    munmap(mapped, size);
+
+    if (offset < size) {
+        std::cerr << "✗ Chat log " << path << ": torn record at byte " << offset
+                  << (newest ? ", truncated" : ", rest of segment skipped") << std::endl;
+        if (newest && ftruncate(fd, static_cast<off_t>(offset)) != 0) {
+            std::cerr << "✗ Cannot truncate " << path << ": " << strerror(errno) << std::endl;
+        }
+    }
+    close(fd);
+    return records;
+}
+
+// Append whole records to the current segment and make them durable
+void write_records(const char* data, size_t length) {
+    auto start = std::chrono::steady_clock::now();
+
+    size_t written = 0;
+    while (written < length) {
+        ssize_t result = write(segment_fd, data + written, length - written);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            std::cerr << "✗ Chat log write failed: " << strerror(errno) << std::endl;
+            break;
+        }
+        written += result;
+    }
+#ifdef __APPLE__
+    fsync(segment_fd);
+#else
+    fdatasync(segment_fd);
+#endif
+    record_since(Histogram::CHAT_LOG_COMMIT_NS, start);
+    count(Counter::CHAT_LOG_BYTES, written);
+    count(Counter::CHAT_LOG_COMMITS);
+
+    // Records become visible to the index once they are on disk
+    {
+        std::lock_guard<std::mutex> lock(index_mutex);
+        size_t offset = 0;
+        Record record;
+        while (offset < written &&
+               decode_record(data + offset, written - offset, record) == RecordState::INTACT) {
+            index_record(record, segment_seq, segment_size + static_cast<int64_t>(offset));
+            offset += record.size;
+        }
+    }
+    segment_size += written;
+}
+
+// Write one batch, rotating to a new segment whenever the current one
+// fills up; a segment always takes at least one record
+void commit(const std::string& batch) {
+    size_t offset = 0;
+    while (offset < batch.size()) {
+        size_t end = offset;
+        while (end < batch.size()) {
+            size_t record_size = RECORD_PREFIX_SIZE + get_u32(batch.data() + end);
+            if (end > offset &&
+                segment_size + (end - offset) + record_size > chat_log_config.segment_bytes) {
+                break;
+            }
+            end += record_size;
+        }
+        write_records(batch.data() + offset, end - offset);
+        offset = end;
+
+        if (segment_size >= static_cast<int64_t>(chat_log_config.segment_bytes) ||
+            offset < batch.size()) {
+            if (open_segment(segment_seq + 1)) {
+                compact();
+            } else {
+                std::cerr << "✗ Cannot start a new chat log segment: " << strerror(errno) << std::endl;
+            }
+        }
+    }
+}
+
+// Move every queued room buffer into buffers; true if there were any
+bool collect(std::vector<std::shared_ptr<ChatLogBuffer>>& buffers) {
+    std::shared_ptr<ChatLogBuffer> buffer;
+    while (ready_buffers.pop(buffer)) {
+        buffers.push_back(std::move(buffer));
+    }
+    return !buffers.empty();
+}
+
+// Group commit: whatever arrives while one batch is being written and
+// synced, or within the commit interval, goes out in the next batch. Each
+// room's records stay in the order it posted them.
+void run_committer() {
+    std::string batch;
+    std::vector<std::shared_ptr<ChatLogBuffer>> buffers;
+    std::unique_lock<std::mutex> lock(wake_mutex);
+    while (true) {
+        // A poster checks committer_waiting after queueing, so either it
+        // sees the flag and wakes us or collect() sees its buffer
+        committer_waiting.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        wake.wait(lock, [&buffers] { return collect(buffers) || stopping; });
+        committer_waiting.store(false, std::memory_order_relaxed);
+        if (buffers.empty()) {
+            return;
+        }
+        lock.unlock();
+
+        for (const auto& buffer : buffers) {
+            buffer->take(batch);
+        }
+        buffers.clear();
+        pending_bytes.fetch_sub(batch.size(), std::memory_order_relaxed);
+
+        auto window_end = std::chrono::steady_clock::now() + chat_log_config.commit_interval;
+        commit(batch);
+        batch.clear();
+        std::this_thread::sleep_until(window_end);
+
+        lock.lock();
+    }
+}
+
+} // namespace
+
+bool open_chat_log() {
+    if (chat_log_config.dir.empty()) {
+        return true;
+    }
+    if (mkdir(chat_log_config.dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<uint64_t> segments = list_segments();
+    segment_seq = segments.empty() ? 1 : segments.back();
+    compact();
+    segments = list_segments();
+
+    size_t records = 0;
+    for (size_t i = 0; i < segments.size(); i++) {
+        records += scan_segment(segments[i], i + 1 == segments.size());
+    }
+
+    uint64_t seq = segments.empty() ? 1 : segments.back();
+    if (!open_segment(seq)) {
+        return false;
+    }
+    if (segment_size >= static_cast<int64_t>(chat_log_config.segment_bytes) && !open_segment(seq + 1)) {
+        return false;
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+    std::cout << "✓ Chat log: " << records << " messages in " << segments.size()
+              << " segments recovered in " << elapsed.count() << " ms" << std::endl;
+
+    stopping = false;
+    committer = std::thread(run_committer);
+    return true;
+}
+
+void close_chat_log() {
+    if (!committer.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    committer.join();
+    close(segment_fd);
+    segment_fd = -1;
+}
+
+bool ChatLogBuffer::append(const char* head, size_t head_size, const std::string& room, const FrameRef& frame) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    records_.append(head, head_size);
+    records_.append(room);
+    records_.append(frame->data(), frame->size());
+    bool queue = !queued_;
+    queued_ = true;
+    return queue;
+}
+
+void ChatLogBuffer::take(std::string& batch) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    batch.append(records_);
+    records_.clear();
+    queued_ = false;
+}
+
+void log_chat(const std::shared_ptr<ChatLogBuffer>& buffer, const std::string& room, const FrameRef& frame,
+              History::Clock::time_point when) {
+    if (chat_log_config.dir.empty()) {
+        return;
+    }
+
+    uint32_t length = static_cast<uint32_t>(RECORD_FIXED_SIZE + room.size() + frame->size());
+    if (length > MAX_RECORD_BODY) {
+        // Recovery would skip it anyway
+        count(Counter::CHAT_LOG_DROPPED);
+        return;
+    }
+    char head[RECORD_PREFIX_SIZE + RECORD_FIXED_SIZE];
+    put_u32(head, length);
+    put_u64(head + RECORD_PREFIX_SIZE, static_cast<uint64_t>(to_ms(when)));
+    head[RECORD_PREFIX_SIZE + 8] = static_cast<char>(room.size());
+
+    XxHash64 hash;
+    hash.update(head + RECORD_PREFIX_SIZE, RECORD_FIXED_SIZE);
+    hash.update(room.data(), room.size());
+    hash.update(frame->data(), frame->size());
+    put_u32(head + 4, static_cast<uint32_t>(hash.digest()));
+
+    size_t size = RECORD_PREFIX_SIZE + length;
+    if (pending_bytes.fetch_add(size, std::memory_order_relaxed) + size > MAX_PENDING_BYTES) {
+        pending_bytes.fetch_sub(size, std::memory_order_relaxed);
+        count(Counter::CHAT_LOG_DROPPED);
+        return;
+    }
+    if (!buffer->append(head, sizeof(head), room, frame)) {
+        return;
+    }
+
+    ready_buffers.push(buffer);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (committer_waiting.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        wake.notify_one();
+    }
+}
+
+void read_chat_log(const std::string& room,
+                   const std::function<void(const char*, size_t, History::Clock::time_point)>& f) {
+    std::vector<Location> locations;
+    {
+        std::lock_guard<std::mutex> lock(index_mutex);
+        auto found = room_index.find(room);
+        if (found == room_index.end()) {
+            return;
+        }
+        locations = found->second.snapshot();
+    }
+
+    std::vector<char> buffer;
+    int fd = -1;
+    uint64_t open_seq = 0;
+    for (const Location& location : locations) {
+        if (fd < 0 || open_seq != location.segment) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            // Gone if compaction got there first
+            fd = open(segment_path(location.segment).c_str(), O_RDONLY | O_CLOEXEC);
+            open_seq = location.segment;
+            if (fd < 0) {
+                continue;
+            }
+        }
+
+        buffer.resize(location.size);
+        Record record;
+        if (pread(fd, buffer.data(), location.size, location.offset) == static_cast<ssize_t>(location.size) &&
+            decode_record(buffer.data(), buffer.size(), record) == RecordState::INTACT &&
+            record.room == room) {
+            f(record.frame, record.frame_length,
+              History::Clock::time_point(std::chrono::milliseconds(record.time_ms)));
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef CHAT_LOG_H
+#define CHAT_LOG_H
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "frame_buffer.h"
+#include "history.h"
+
+// Durable chat history (POSIX only).
+//
+// Every chat message is appended to a log of segment files named by their
+// sequence number (chatlog/0000000000000001.log, ...). A record is
+//   u32 length | u32 checksum | u64 time (ms since the epoch) | u8 room
+//   length | room | encoded frame
+// where length counts the bytes after the checksum and the checksum is the
+// low half of their XXH64. Senders only copy the record into their room's
+// buffer; a committer thread collects what every room gathered during one
+// commit window and makes it durable with a single fdatasync().
+//
+// At startup the segments are mapped and scanned to rebuild an index of
+// each room's latest records. Damaged records are skipped; only a torn
+// record at the very end of the newest segment is cut off. A room that is created, after a
+// restart or after it emptied out, takes its history from that index.
+// Segments rotate at a fixed size, and the oldest are deleted once the log
+// outgrows its size or age limit.
+struct ChatLogConfig {
+    std::string dir = "chatlog";                   // Empty disables the log
+    std::chrono::milliseconds commit_interval{10}; // Shortest time between fsyncs
+    size_t segment_bytes = 16 * 1024 * 1024;
+    size_t retention_bytes = 256 * 1024 * 1024;
+    std::chrono::hours max_age{7 * 24};
+};
+
+extern ChatLogConfig chat_log_config;
+
+// The records of one room waiting for the committer. The room appends to it
+// under its own lock, and the first record since the last commit hands the
+// buffer to the committer through a lock-free queue, so posts to different
+// rooms never meet on a lock. Only the committer's collecting contends with
+// the room's posts.
+class ChatLogBuffer {
+public:
+    ChatLogBuffer() = default;
+    ChatLogBuffer(const ChatLogBuffer&) = delete;
+    ChatLogBuffer& operator=(const ChatLogBuffer&) = delete;
+
+    // Add an encoded record; true if the buffer has to be queued for the
+    // committer now
+    bool append(const char* head, size_t head_size, const std::string& room, const FrameRef& frame);
+
+    // Move the records into batch; storage is kept for the next ones
+    void take(std::string& batch);
+
+private:
+    std::mutex mutex_;
+    std::string records_;
+    bool queued_ = false;
+};
+
+// Recover the log and start the committer; false if the directory or the
+// newest segment can't be opened
+bool open_chat_log();
+
+// Commit what is still buffered and stop the committer
+void close_chat_log();
+
+// Queue a chat frame of a room for the log; returns at once
+void log_chat(const std::shared_ptr<ChatLogBuffer>& buffer, const std::string& room, const FrameRef& frame,
+              History::Clock::time_point when);
+
+// Call f with each logged frame of the room the index still holds, oldest
+// first
+void read_chat_log(const std::string& room,
+                   const std::function<void(const char* frame, size_t length,
+                                            History::Clock::time_point when)>& f);
+
+#endif
@@ -0,0 +1,394 @@
+#include "disk_writer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#ifdef _WIN32
+    #include <io.h>
+    #include <malloc.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+#include "file_receiver.h"
+#include "metrics.h"
+
+DiskConfig disk_config;
+
+struct DiskBatch::State {
+    std::shared_ptr<DiskFile> file;
+    std::atomic<int> pending{1};          // Queued writes, plus one until finish()
+    std::atomic<bool> failed{false};
+    std::function<void(bool)> done;
+};
+
+namespace {
+
+// A buffer to write at offset, or a call to make
+struct DiskTask {
+    std::shared_ptr<DiskBatch::State> batch;
+    char* buffer;
+    size_t length;
+    int64_t offset;
+    std::function<void()> call;
+};
+
+std::mutex queue_mutex;
+std::condition_variable work_ready;
+std::condition_variable space_ready;
+std::deque<DiskTask> queue;
+std::atomic<size_t> queued_bytes{0};   // Handed over and not yet written; changed under queue_mutex
+bool stopping = false;
+std::vector<std::thread> workers;
+
+thread_local bool on_disk_thread = false;
+thread_local bool never_wait = false;
+
+// Spare write buffers, so a steady upload stops allocating
+std::mutex buffers_mutex;
+std::vector<char*> spare_buffers;
+
+char* take_buffer() {
+    {
+        std::lock_guard<std::mutex> lock(buffers_mutex);
+        if (!spare_buffers.empty()) {
+            char* buffer = spare_buffers.back();
+            spare_buffers.pop_back();
+            return buffer;
+        }
+    }
+#ifdef _WIN32
+    void* buffer = _aligned_malloc(disk_config.write_size, DISK_ALIGNMENT);
+#else
+    void* buffer = nullptr;
+    if (posix_memalign(&buffer, DISK_ALIGNMENT, disk_config.write_size) != 0) {
+        buffer = nullptr;
+    }
+#endif
+    if (!buffer) {
+        throw std::bad_alloc();
+    }
+    return static_cast<char*>(buffer);
+}
+
+void release_buffer(char* buffer) {
+    {
+        // As many as the queue can hold, and one in the making per thread
+        std::lock_guard<std::mutex> lock(buffers_mutex);
+        if (spare_buffers.size() < disk_config.queue_bytes / disk_config.write_size + disk_config.threads) {
+            spare_buffers.push_back(buffer);
+            return;
+        }
+    }
+#ifdef _WIN32
+    _aligned_free(buffer);
+#else
+    std::free(buffer);
+#endif
+}
+
+void release(const std::shared_ptr<DiskBatch::State>& batch) {
+    if (batch->pending.fetch_sub(1, std::memory_order_acq_rel) == 1 && batch->done) {
+        batch->done(!batch->failed.load(std::memory_order_relaxed));
+    }
+}
+
+void execute(DiskTask& task) {
+    if (task.call) {
+        task.call();
+        return;
+    }
+
+    DiskFile& file = *task.batch->file;
+    int fd = file.fd();
+    if (file.direct_fd() >= 0 && task.offset % DISK_ALIGNMENT == 0 && task.length % DISK_ALIGNMENT == 0) {
+        fd = file.direct_fd();
+    }
+    auto start = std::chrono::steady_clock::now();
+    if (write_at(fd, task.buffer, task.length, task.offset)) {
+        record_since(Histogram::DISK_WRITE_NS, start);
+        count(Counter::DISK_WRITES);
+        file.wrote(static_cast<int64_t>(task.length));
+    } else {
+        std::cerr << "Upload write failed: " << strerror(errno) << std::endl;
+        task.batch->failed = true;
+    }
+    release_buffer(task.buffer);
+    release(task.batch);
+}
+
+// Hand a task to the disk threads, waiting while the queue is full unless
+// the caller may not wait; with none running it is done right here
+void submit(DiskTask task) {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    if (stopping || workers.empty()) {
+        lock.unlock();
+        execute(task);
+        return;
+    }
+    // Calls take no queue space and always go ahead
+    auto fits = [&] {
+        return task.length == 0 || queued_bytes == 0 || queued_bytes + task.length <= disk_config.queue_bytes;
+    };
+    if (!never_wait && !fits()) {
+        count(Counter::DISK_QUEUE_WAITS);
+        space_ready.wait(lock, fits);
+    }
+    queued_bytes += task.length;
+    queue.push_back(std::move(task));
+    lock.unlock();
+    work_ready.notify_one();
+}
+
+void run_disk_writer() {
+    on_disk_thread = true;
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    while (true) {
+        work_ready.wait(lock, [] { return stopping || !queue.empty(); });
+        if (queue.empty()) {
+            return;
+        }
+        DiskTask task = std::move(queue.front());
+        queue.pop_front();
+        lock.unlock();
+
+        size_t length = task.length;
+        execute(task);
+        task = DiskTask{};
+
+        lock.lock();
+        if (length > 0) {
+            queued_bytes -= length;
+            space_ready.notify_all();
+        }
+    }
+}
+
+void close_fd(int fd) {
+#ifdef _WIN32
+    _close(fd);
+#else
+    ::close(fd);
+#endif
+}
+
+} // namespace
+
+void start_disk_writers() {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    stopping = false;
+    for (size_t i = 0; i < disk_config.threads; i++) {
+        workers.emplace_back(run_disk_writer);
+    }
+}
+
+void stop_disk_writers() {
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    workers.clear();
+}
+
+void run_on_disk_thread(std::function<void()> task) {
+    submit(DiskTask{nullptr, nullptr, 0, 0, std::move(task)});
+}
+
+void never_wait_for_disk() {
+    never_wait = true;
+}
+
+bool disk_queue_full() {
+    size_t queued = queued_bytes.load(std::memory_order_relaxed);
+    return queued > 0 && queued >= disk_config.queue_bytes;
+}
+
+void sync_directory(const char* path) {
+#ifndef _WIN32
+    if (disk_config.fsync == FsyncPolicy::NONE) {
+        return;
+    }
+    int fd = ::open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        ::close(fd);
+    }
+#else
+    (void)path;
+#endif
+}
+
+// Create the partial file at its final size, so chunks can land anywhere
+std::shared_ptr<DiskFile> DiskFile::create(const std::string& path, int64_t size) {
+#ifdef _WIN32
+    int fd = _open(path.c_str(), _O_RDWR | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+    if (fd >= 0 && _chsize_s(fd, size) != 0) {
+        _close(fd);
+        return nullptr;
+    }
+    if (fd < 0) {
+        return nullptr;
+    }
+#else
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return nullptr;
+    }
+    bool sized = false;
+#ifdef __linux__
+    sized = size == 0 || fallocate(fd, 0, 0, size) == 0;
+#endif
+    if (!sized && ftruncate(fd, size) < 0) {
+        ::close(fd);
+        return nullptr;
+    }
+#endif
+
+    int direct_fd = -1;
+#ifdef __linux__
+    if (disk_config.direct) {
+        direct_fd = ::open(path.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+        static std::atomic<bool> warned{false};
+        if (direct_fd < 0 && !warned.exchange(true)) {
+            std::cerr << "✗ O_DIRECT unavailable for uploads (" << strerror(errno)
+                      << "), writing through the page cache" << std::endl;
+        }
+    }
+#endif
+    return std::shared_ptr<DiskFile>(new DiskFile(fd, direct_fd));
+}
+
+DiskFile::~DiskFile() {
+    close();
+}
+
+void DiskFile::close() {
+    for (int* fd : {&fd_, &direct_fd_}) {
+        if (*fd >= 0) {
+            close_fd(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+bool DiskFile::sync() {
+    if (disk_config.fsync == FsyncPolicy::NONE) {
+        return true;
+    }
+    count(Counter::DISK_SYNCS);
+#ifdef _WIN32
+    return _commit(fd_) == 0;
+#elif defined(__linux__)
+    // Direct writes bypass the page cache but may leave metadata to flush
+    return fdatasync(fd_) == 0;
+#else
+    return fsync(fd_) == 0;
+#endif
+}
+
+void DiskFile::wrote(int64_t bytes) {
+    if (disk_config.fsync != FsyncPolicy::EVERY || disk_config.fsync_every == 0) {
+        return;
+    }
+    int64_t unsynced = unsynced_.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    if (unsynced < static_cast<int64_t>(disk_config.fsync_every) ||
+        !unsynced_.compare_exchange_strong(unsynced, 0, std::memory_order_relaxed)) {
+        return;
+    }
+    if (on_disk_thread) {
+        sync();
+    } else if (!sync_queued_.exchange(true, std::memory_order_relaxed)) {
+        // Never on a network thread, and one at a time: a sync covers
+        // whatever was written before it starts
+        run_on_disk_thread([file = shared_from_this()] {
+            file->sync_queued_.store(false, std::memory_order_relaxed);
+            file->sync();
+        });
+    }
+}
+
+DiskBatch::DiskBatch(std::shared_ptr<DiskFile> file)
+    : file_(std::move(file)), state_(std::make_shared<State>()) {
+    state_->file = file_;
+}
+
+DiskBatch::~DiskBatch() {
+    finish(nullptr);
+}
+
+void DiskBatch::write(const char* data, size_t len, int64_t offset) {
+    if (!file_) {
+        return;
+    }
+    while (len > 0) {
+        size_t room;
+        char* space = reserve(offset, room);
+        size_t take = std::min(len, room);
+        std::memcpy(space, data, take);
+        commit(take);
+        data += take;
+        len -= take;
+        offset += take;
+    }
+}
+
+char* DiskBatch::reserve(int64_t offset, size_t& room) {
+    if (buffer_ && (fill_ == disk_config.write_size || start_ + static_cast<int64_t>(fill_) != offset)) {
+        flush();
+    }
+    if (!buffer_) {
+        buffer_ = take_buffer();
+        start_ = offset;
+        fill_ = 0;
+    }
+    room = disk_config.write_size - fill_;
+    return buffer_ + fill_;
+}
+
+void DiskBatch::commit(size_t len) {
+    fill_ += len;
+    if (fill_ == disk_config.write_size) {
+        flush();
+    }
+}
+
+void DiskBatch::flush() {
+    if (!buffer_) {
+        return;
+    }
+    char* buffer = buffer_;
+    buffer_ = nullptr;
+    if (fill_ == 0) {
+        release_buffer(buffer);
+        return;
+    }
+    state_->pending.fetch_add(1, std::memory_order_relaxed);
+    submit(DiskTask{state_, buffer, fill_, start_, nullptr});
+    fill_ = 0;
+}
+
+void DiskBatch::finish(std::function<void(bool)> done) {
+    if (finished_) {
+        return;
+    }
+    finished_ = true;
+    flush();
+    state_->done = std::move(done);
+    release(state_);
+}
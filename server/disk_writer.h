@@ -0,0 +1,140 @@
+#ifndef DISK_WRITER_H
+#define DISK_WRITER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+// Disk I/O for uploads. Network threads copy chunk bodies into large
+// aligned buffers and hand each full buffer to a pool of disk threads
+// through a bounded queue; the disk threads write it at its file offset.
+// A slow disk then costs the network threads nothing until the queue is
+// full, and only then does a receiving connection pause (and its sender's
+// TCP window close) instead of memory growing. A thread per client waits
+// for room; an event loop, which must keep serving everyone else, queues
+// what it has and stops reading that connection until there is room.
+//
+// Data reaches disk according to the fsync policy: not at all beyond what
+// the kernel does by itself, once an upload is complete, or also every so
+// many bytes while it arrives. Partial files don't survive a restart, so
+// the periodic syncs are about bounding the dirty data a completion has to
+// wait for, not about what a crash keeps.
+enum class FsyncPolicy {
+    NONE,       // Never: fastest, a crash may lose recent uploads
+    COMPLETE,   // Before a finished upload is verified and filed
+    EVERY       // Also every fsync_every bytes written to a file
+};
+
+struct DiskConfig {
+    size_t threads = 2;                       // 0 = write on the receiving thread
+    size_t queue_bytes = 16 * 1024 * 1024;    // Data queued before receivers wait
+    size_t write_size = 1024 * 1024;          // Buffer (and largest write) size
+    bool direct = false;                      // O_DIRECT for aligned writes (Linux)
+    FsyncPolicy fsync = FsyncPolicy::COMPLETE;
+    size_t fsync_every = 0;                   // Bytes between syncs for FsyncPolicy::EVERY
+};
+
+extern DiskConfig disk_config;
+
+// Buffers, offsets and write sizes line up to this for O_DIRECT
+constexpr size_t DISK_ALIGNMENT = 4096;
+
+// Start and stop the disk threads; stopping writes out whatever is queued
+void start_disk_writers();
+void stop_disk_writers();
+
+// Run a task on a disk thread (on the caller's when there are none). Tasks
+// never wait for queue space.
+void run_on_disk_thread(std::function<void()> task);
+
+// Have writes from the calling thread (an event loop) queued without
+// waiting for space. It checks disk_queue_full() before reading more
+// upload data instead, so the queue overshoots only by what each
+// connection had already read.
+void never_wait_for_disk();
+
+// True while the disk threads have a full queue's worth to write
+bool disk_queue_full();
+
+// Flush a directory's entries, so renames in it survive a crash; a no-op
+// under FsyncPolicy::NONE
+void sync_directory(const char* path);
+
+// The partial file of an upload. Writers share it, so it stays open until
+// the last of their queued writes has landed.
+class DiskFile : public std::enable_shared_from_this<DiskFile> {
+public:
+    // Create path at its final size; null if it can't be
+    static std::shared_ptr<DiskFile> create(const std::string& path, int64_t size);
+    ~DiskFile();
+
+    DiskFile(const DiskFile&) = delete;
+    DiskFile& operator=(const DiskFile&) = delete;
+
+    int fd() const { return fd_; }
+
+    // A second descriptor opened with O_DIRECT, or -1
+    int direct_fd() const { return direct_fd_; }
+
+    // Close early, for platforms that can't rename an open file
+    void close();
+
+    // Flush written data to the device; a no-op under FsyncPolicy::NONE
+    bool sync();
+
+    // Account for bytes written to the file, by any path; under
+    // FsyncPolicy::EVERY a sync follows every fsync_every of them
+    void wrote(int64_t bytes);
+
+private:
+    DiskFile(int fd, int direct_fd) : fd_(fd), direct_fd_(direct_fd) {}
+
+    int fd_;
+    int direct_fd_;
+    std::atomic<int64_t> unsynced_{0};
+    std::atomic<bool> sync_queued_{false};   // A sync for wrote() waits for a disk thread
+};
+
+// The writes of one chunk body. Bytes are gathered into a buffer of
+// write_size, which goes to the disk threads once full or once the next
+// bytes are not contiguous with it. finish() queues the rest and calls
+// back, on whichever thread writes last, once everything has landed.
+class DiskBatch {
+public:
+    // A batch without a file drops what it is given
+    explicit DiskBatch(std::shared_ptr<DiskFile> file);
+    ~DiskBatch();
+
+    DiskBatch(const DiskBatch&) = delete;
+    DiskBatch& operator=(const DiskBatch&) = delete;
+
+    // Copy len bytes destined for offset into the batch
+    void write(const char* data, size_t len, int64_t offset);
+
+    // Room for bytes at offset right in the current buffer, for a caller to
+    // recv() into; at most room bytes, then commit() what arrived
+    char* reserve(int64_t offset, size_t& room);
+    void commit(size_t len);
+
+    // Queue what is left and call done(stored) once every write is over;
+    // stored is false if any of them failed. Without pending writes, done
+    // runs on the caller's thread before this returns.
+    void finish(std::function<void(bool)> done);
+
+    struct State;
+
+private:
+    void flush();
+
+    std::shared_ptr<DiskFile> file_;
+    std::shared_ptr<State> state_;
+    char* buffer_ = nullptr;
+    size_t fill_ = 0;
+    int64_t start_ = 0;       // File offset of buffer_[0]
+    bool finished_ = false;
+};
+
+#endif
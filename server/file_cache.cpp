@@ -0,0 +1,162 @@
+#include "file_cache.h"
+
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+#include <sys/stat.h>
+#ifdef _WIN32
+    #include <io.h>
+    #include <fcntl.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+#endif
+
+#include "../shared/constants.h"
+#include "file_receiver.h"
+
+size_t file_cache_bytes = 256 * 1024 * 1024;
+
+namespace {
+
+// Most recently used at the front
+std::mutex cache_mutex;
+std::list<std::shared_ptr<const ServedFile>> lru;
+std::unordered_map<std::string, std::list<std::shared_ptr<const ServedFile>>::iterator> cache_index;
+size_t cached_bytes = 0;
+
+// Drop least recently used files until the cache fits its budget; called
+// with cache_mutex held
+void evict() {
+    while (cached_bytes > file_cache_bytes && !lru.empty()) {
+        const std::shared_ptr<const ServedFile>& oldest = lru.back();
+        cached_bytes -= static_cast<size_t>(oldest->size());
+        cache_index.erase(oldest->name());
+        lru.pop_back();
+    }
+}
+
+std::shared_ptr<const ServedFile> open_uncached(const std::string& filename) {
+    std::string path = std::string(UPLOADS_DIR) + "/" + filename;
+
+#ifdef _WIN32
+    int fd = _open(path.c_str(), _O_RDONLY | _O_BINARY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    int64_t size = _filelengthi64(fd);
+    return std::make_shared<ServedFile>(filename, fd, size, nullptr);
+#else
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat info;
+    if (fstat(fd, &info) < 0 || !S_ISREG(info.st_mode)) {
+        close(fd);
+        return nullptr;
+    }
+    int64_t size = info.st_size;
+
+    // Linux can sendfile() anything too big to keep mapped; elsewhere every
+    // file is mapped and the budget only limits what stays cached
+    bool map = size > 0;
+#ifdef __linux__
+    map = map && static_cast<size_t>(size) <= file_cache_bytes;
+#endif
+    const char* mapping = nullptr;
+    if (map) {
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapped != MAP_FAILED) {
+            madvise(mapped, size, MADV_WILLNEED);
+            mapping = static_cast<const char*>(mapped);
+        }
+    }
+    return std::make_shared<ServedFile>(filename, fd, size, mapping);
+#endif
+}
+
+} // namespace
+
+ServedFile::~ServedFile() {
+#ifdef _WIN32
+    _close(fd_);
+#else
+    if (mapping_) {
+        munmap(const_cast<char*>(mapping_), size_);
+    }
+    close(fd_);
+#endif
+}
+
+bool ServedFile::read_at(char* out, size_t len, int64_t offset) const {
+    if (mapping_) {
+        std::memcpy(out, mapping_ + offset, len);
+        return true;
+    }
+    while (len > 0) {
+#ifdef _WIN32
+        // Windows has no pread(); serialize seek + read on the shared descriptor
+        static std::mutex seek_mutex;
+        std::lock_guard<std::mutex> lock(seek_mutex);
+        int bytes_read = -1;
+        if (_lseeki64(fd_, offset, SEEK_SET) >= 0) {
+            bytes_read = _read(fd_, out, static_cast<unsigned int>(len));
+        }
+#else
+        ssize_t bytes_read = pread(fd_, out, len, offset);
+#endif
+        if (bytes_read <= 0) {
+            return false;
+        }
+        out += bytes_read;
+        len -= bytes_read;
+        offset += bytes_read;
+    }
+    return true;
+}
+
+bool servable_name(const std::string& filename) {
+    return !filename.empty() && filename.size() <= static_cast<size_t>(MAX_FILENAME_LENGTH) &&
+           filename[0] != '.' && filename.find_first_of("/\\") == std::string::npos;
+}
+
+std::shared_ptr<const ServedFile> open_served_file(const std::string& filename) {
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        auto it = cache_index.find(filename);
+        if (it != cache_index.end()) {
+            lru.splice(lru.begin(), lru, it->second);
+            return *it->second;
+        }
+    }
+
+    // Open outside the lock; a racing request for the same cold file just
+    // maps it twice and one copy wins the cache slot
+    std::shared_ptr<const ServedFile> file = open_uncached(filename);
+    if (!file || !file->data()) {
+        return file;
+    }
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (cache_index.count(filename) == 0 && static_cast<size_t>(file->size()) <= file_cache_bytes) {
+        lru.push_front(file);
+        cache_index[filename] = lru.begin();
+        cached_bytes += static_cast<size_t>(file->size());
+        evict();
+    }
+    return file;
+}
+
+void invalidate_served_file(const std::string& filename) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto it = cache_index.find(filename);
+    if (it != cache_index.end()) {
+        cached_bytes -= static_cast<size_t>((*it->second)->size());
+        lru.erase(it->second);
+        cache_index.erase(it);
+    }
+}
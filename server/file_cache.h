@@ -0,0 +1,54 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Bytes of mapped files kept open between downloads (--file-cache)
+extern size_t file_cache_bytes;
+
+// An uploaded file opened for serving. Files that fit in the cache are
+// mapped, and every download of a hot file is written straight from that
+// one mapping; larger files are sent from the descriptor with sendfile().
+class ServedFile {
+public:
+    ServedFile(const std::string& name, int fd, int64_t size, const char* mapping)
+        : name_(name), fd_(fd), size_(size), mapping_(mapping) {}
+    ~ServedFile();
+
+    ServedFile(const ServedFile&) = delete;
+    ServedFile& operator=(const ServedFile&) = delete;
+
+    const std::string& name() const { return name_; }
+    int fd() const { return fd_; }
+    int64_t size() const { return size_; }
+
+    // The mapped contents, or nullptr when the file is not mapped
+    const char* data() const { return mapping_; }
+
+    // Copy part of the file into a buffer, for platforms without mmap()
+    bool read_at(char* out, size_t len, int64_t offset) const;
+
+private:
+    std::string name_;
+    int fd_;
+    int64_t size_;
+    const char* mapping_;
+};
+
+// True for names that may be uploaded to or requested from uploads/: no
+// directories, no hidden (partial) files and at most MAX_FILENAME_LENGTH
+// bytes, so notices and offers naming the file fit any client's frames
+bool servable_name(const std::string& filename);
+
+// Open an uploaded file, from the LRU cache when it is hot. Returns nullptr
+// if it does not exist. Evicted files stay valid for as long as a download
+// still holds them.
+std::shared_ptr<const ServedFile> open_served_file(const std::string& filename);
+
+// Forget a cached file that has just been replaced by a new upload
+void invalidate_served_file(const std::string& filename);
+
+#endif
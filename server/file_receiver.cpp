@@ -0,0 +1,352 @@
+#include "file_receiver.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+
+#include <sys/stat.h>
+#ifdef _WIN32
+    #include <direct.h>
+    #include <io.h>
+#endif
+#ifdef __linux__
+    #include <fcntl.h>
+#endif
+
+#include "../shared/constants.h"
+#include "../shared/lz4_block.h"
+#include "../shared/protocol.h"
+
+UploadIo upload_io = UploadIo::AUTO;
+
+bool create_uploads_dir() {
+#ifdef _WIN32
+    int result = _mkdir(UPLOADS_DIR);
+#else
+    int result = mkdir(UPLOADS_DIR, 0755);
+#endif
+    return result == 0 || errno == EEXIST;
+}
+
+bool write_at(int fd, const char* data, size_t len, int64_t offset) {
+#ifdef _WIN32
+    // No pwrite(): serialize seek + write so concurrent chunks can't interleave
+    static std::mutex seek_mutex;
+    std::lock_guard<std::mutex> lock(seek_mutex);
+    if (_lseeki64(fd, offset, SEEK_SET) < 0) {
+        return false;
+    }
+#endif
+    while (len > 0) {
+#ifdef _WIN32
+        int written = _write(fd, data, static_cast<unsigned int>(std::min<size_t>(len, 1 << 30)));
+#else
+        ssize_t written = pwrite(fd, data, len, offset);
+#endif
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        len -= written;
+        offset += written;
+    }
+    return true;
+}
+
+void FileReceiver::write(const char* data, size_t len) {
+    len = std::min<int64_t>(len, remaining());
+    if (!failed_ && !store(data, len)) {
+        failed_ = true;
+    }
+    received_ += len;
+}
+
+ssize_t FileReceiver::receive(SOCKET socket, size_t max) {
+    if (remaining() == 0) {
+        return 0;
+    }
+    ssize_t moved = transfer(socket, std::min(static_cast<size_t>(remaining()), max));
+    if (moved > 0) {
+        received_ += moved;
+    }
+    return moved;
+}
+
+void FileReceiver::received_elsewhere(size_t len, bool stored) {
+    len = std::min<int64_t>(len, remaining());
+    if (!stored) {
+        failed_ = true;
+    } else if (file_) {
+        file_->wrote(len);
+    }
+    moved_elsewhere_ = true;
+    received_ += len;
+}
+
+void FileReceiver::finish(std::function<void(bool)> done) {
+    release();
+    bool failed = failed_;
+    batch_.finish([done = std::move(done), failed](bool stored) {
+        done(stored && !failed);
+    });
+}
+
+namespace {
+
+// Portable path: recv() straight into the aligned buffers the disk
+// threads write out
+class StreamReceiver : public FileReceiver {
+public:
+    StreamReceiver(std::shared_ptr<DiskFile> file, int64_t offset, int64_t length)
+        : FileReceiver(std::move(file), offset, length) {}
+
+    const char* method() const override { return moved_elsewhere_ ? "io_uring" : "stream"; }
+
+protected:
+    bool store(const char* data, size_t len) override {
+        batch_.write(data, len, position());
+        return true;
+    }
+
+    ssize_t transfer(SOCKET socket, size_t max) override {
+        if (failed_) {
+            return discard(socket, max);
+        }
+        size_t room;
+        char* space = batch_.reserve(position(), room);
+        ssize_t bytes_received = recv(socket, space, static_cast<int>(std::min(max, room)), 0);
+        if (bytes_received > 0) {
+            batch_.commit(bytes_received);
+        }
+        return bytes_received;
+    }
+
+private:
+    // A body that isn't stored is still read off the socket
+    ssize_t discard(SOCKET socket, size_t max) {
+        if (!scratch_) {
+            scratch_.reset(new char[FILE_BUFFER_SIZE]);
+        }
+        size_t want = std::min<size_t>(max, FILE_BUFFER_SIZE);
+        return recv(socket, scratch_.get(), static_cast<int>(want), 0);
+    }
+
+    std::unique_ptr<char[]> scratch_;
+};
+
+// Compressed bodies pass through user space: each block is assembled,
+// decoded and written at the running file position
+class DecompressingReceiver : public FileReceiver {
+public:
+    DecompressingReceiver(std::shared_ptr<DiskFile> file, int64_t offset, int64_t length, int64_t limit)
+        : FileReceiver(std::move(file), offset, length), limit_(limit),
+          buffer_(new char[FILE_BUFFER_SIZE]),
+          block_(new char[COMPRESSED_BLOCK_HEADER_SIZE + COMPRESSED_BLOCK_SIZE]),
+          decoded_block_(new char[COMPRESSED_BLOCK_SIZE]) {}
+
+    int64_t stored() const override { return decoded_; }
+    int raw_fd() const override { return -1; }
+    const char* method() const override { return "lz4"; }
+
+protected:
+    bool store(const char* data, size_t len) override {
+        while (len > 0) {
+            size_t wanted = block_fill_ < COMPRESSED_BLOCK_HEADER_SIZE
+                                ? COMPRESSED_BLOCK_HEADER_SIZE
+                                : COMPRESSED_BLOCK_HEADER_SIZE + stored_length_;
+            size_t take = std::min(len, wanted - block_fill_);
+            std::memcpy(block_.get() + block_fill_, data, take);
+            block_fill_ += take;
+            data += take;
+            len -= take;
+
+            if (block_fill_ == COMPRESSED_BLOCK_HEADER_SIZE && !parse_block_header()) {
+                return false;
+            }
+            if (block_fill_ == COMPRESSED_BLOCK_HEADER_SIZE + stored_length_ && !decode_block()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    ssize_t transfer(SOCKET socket, size_t max) override {
+        size_t want = std::min<size_t>(max, FILE_BUFFER_SIZE);
+        ssize_t bytes_received = recv(socket, buffer_.get(), static_cast<int>(want), 0);
+        if (bytes_received > 0 && !failed_ && !store(buffer_.get(), bytes_received)) {
+            failed_ = true;
+        }
+        return bytes_received;
+    }
+
+private:
+    bool parse_block_header() {
+        raw_length_ = get_u32(block_.get());
+        stored_length_ = get_u32(block_.get() + 4);
+        if (raw_length_ == 0 || raw_length_ > COMPRESSED_BLOCK_SIZE || stored_length_ == 0 ||
+            stored_length_ > raw_length_ || offset() + decoded_ + raw_length_ > limit_) {
+            std::cerr << "Upload rejected: malformed compressed block" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool decode_block() {
+        const char* data = block_.get() + COMPRESSED_BLOCK_HEADER_SIZE;
+        if (stored_length_ < raw_length_) {
+            if (!Lz4Block::decompress(data, stored_length_, decoded_block_.get(), raw_length_)) {
+                std::cerr << "Upload rejected: corrupt compressed block" << std::endl;
+                return false;
+            }
+            data = decoded_block_.get();
+        }
+        batch_.write(data, raw_length_, offset() + decoded_);
+        decoded_ += raw_length_;
+        block_fill_ = 0;
+        stored_length_ = 0;
+        return true;
+    }
+
+    int64_t limit_;
+    std::unique_ptr<char[]> buffer_;
+    std::unique_ptr<char[]> block_;          // Header and stored data of the current block
+    std::unique_ptr<char[]> decoded_block_;
+    size_t block_fill_ = 0;
+    uint32_t raw_length_ = 0;
+    uint32_t stored_length_ = 0;
+    int64_t decoded_ = 0;
+};
+
+#ifdef __linux__
+
+constexpr int SPLICE_PIPE_SIZE = 1024 * 1024;
+
+// Zero-copy path: socket -> pipe -> file with splice(), never touching
+// user space
+class SpliceReceiver : public FileReceiver {
+public:
+    SpliceReceiver(std::shared_ptr<DiskFile> file, int64_t offset, int64_t length)
+        : FileReceiver(std::move(file), offset, length) {
+        if (pipe2(pipe_, O_CLOEXEC) == 0) {
+            // A bigger pipe moves more per splice() pair; best effort
+            fcntl(pipe_[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+        } else {
+            pipe_[0] = pipe_[1] = -1;
+        }
+    }
+
+    ~SpliceReceiver() override {
+        release();
+    }
+
+    bool usable() const { return pipe_[0] >= 0; }
+    const char* method() const override { return moved_elsewhere_ ? "io_uring" : "splice"; }
+
+protected:
+    bool store(const char* data, size_t len) override {
+        batch_.write(data, len, position());
+        return true;
+    }
+
+    ssize_t transfer(SOCKET socket, size_t max) override {
+        if (failed_) {
+            return discard(socket, max);
+        }
+
+        ssize_t moved = splice(socket, nullptr, pipe_[1], nullptr,
+                               std::min<size_t>(max, SPLICE_PIPE_SIZE),
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved < 0 && errno == EINVAL) {
+            // This socket can't be spliced; copy through user space instead
+            return copy(socket, max);
+        }
+        if (moved <= 0) {
+            return moved;
+        }
+
+        // Everything in the pipe goes to the file before the next splice
+        loff_t file_offset = position();
+        size_t left = static_cast<size_t>(moved);
+        while (left > 0) {
+            ssize_t written = splice(pipe_[0], nullptr, file_->fd(), &file_offset, left, SPLICE_F_MOVE);
+            if (written <= 0) {
+                std::cerr << "Upload write failed: " << strerror(errno) << std::endl;
+                failed_ = true;
+                drain_pipe(left);
+                break;
+            }
+            left -= written;
+        }
+        file_->wrote(moved - left);
+        return moved;
+    }
+
+    void release() override {
+        for (int& end : pipe_) {
+            if (end >= 0) {
+                ::close(end);
+                end = -1;
+            }
+        }
+    }
+
+private:
+    ssize_t copy(SOCKET socket, size_t max) {
+        if (!buffer_) {
+            buffer_.reset(new char[FILE_BUFFER_SIZE]);
+        }
+        ssize_t bytes_received = recv(socket, buffer_.get(), std::min<size_t>(max, FILE_BUFFER_SIZE), 0);
+        if (bytes_received > 0 && !store(buffer_.get(), bytes_received)) {
+            failed_ = true;
+        }
+        return bytes_received;
+    }
+
+    // After a write error the body is still read off the socket and dropped
+    ssize_t discard(SOCKET socket, size_t max) {
+        char scratch[4096];
+        return recv(socket, scratch, std::min(max, sizeof(scratch)), 0);
+    }
+
+    void drain_pipe(size_t left) {
+        char scratch[4096];
+        while (left > 0) {
+            ssize_t n = read(pipe_[0], scratch, std::min(left, sizeof(scratch)));
+            if (n <= 0) {
+                break;
+            }
+            left -= n;
+        }
+    }
+
+    int pipe_[2];
+    std::unique_ptr<char[]> buffer_;
+};
+
+#endif
+
+} // namespace
+
+std::unique_ptr<FileReceiver> FileReceiver::open(std::shared_ptr<DiskFile> file, int64_t offset,
+                                                 int64_t length) {
+#ifdef __linux__
+    // splice() writes on the receiving thread, so by default it is only
+    // used when that is where writes happen anyway
+    bool splice_wanted = upload_io == UploadIo::SPLICE ||
+                         (upload_io == UploadIo::AUTO && disk_config.threads == 0);
+    if (file && splice_wanted) {
+        auto receiver = std::make_unique<SpliceReceiver>(file, offset, length);
+        if (receiver->usable()) {
+            return receiver;
+        }
+    }
+#endif
+
+    return std::make_unique<StreamReceiver>(std::move(file), offset, length);
+}
+
+std::unique_ptr<FileReceiver> FileReceiver::open_compressed(std::shared_ptr<DiskFile> file, int64_t offset,
+                                                            int64_t length, int64_t limit) {
+    return std::make_unique<DecompressingReceiver>(std::move(file), offset, length, limit);
+}
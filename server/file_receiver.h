@@ -0,0 +1,97 @@
+#ifndef FILE_RECEIVER_H
+#define FILE_RECEIVER_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "../shared/platform.h"
+#include "disk_writer.h"
+
+// How uploaded file bodies are moved from the socket to disk
+enum class UploadIo {
+    AUTO,     // stream, or splice() where available without disk threads
+    SPLICE,   // socket -> pipe -> file inside the kernel (Linux)
+    STREAM    // recv() into aligned buffers the disk threads write out
+};
+
+extern UploadIo upload_io;
+
+constexpr const char* UPLOADS_DIR = "uploads";
+
+// Create the uploads directory; called once at startup
+bool create_uploads_dir();
+
+// Write a whole buffer at the given file offset without moving a shared
+// file position, so several connections can fill one file at once
+bool write_at(int fd, const char* data, size_t len, int64_t offset);
+
+// Receives one chunk body into an open file at a fixed offset. With no
+// file the body is still consumed, so the connection stays in sync.
+class FileReceiver {
+public:
+    static std::unique_ptr<FileReceiver> open(std::shared_ptr<DiskFile> file, int64_t offset,
+                                              int64_t length);
+
+    // A compressed body of length bytes that decodes to file bytes starting
+    // at offset; blocks reaching past limit are rejected
+    static std::unique_ptr<FileReceiver> open_compressed(std::shared_ptr<DiskFile> file, int64_t offset,
+                                                         int64_t length, int64_t limit);
+    virtual ~FileReceiver() = default;
+
+    // Store body bytes that were already read from the socket
+    void write(const char* data, size_t len);
+
+    // Move up to max (at most remaining()) bytes straight from the socket
+    // into the file. Returns the bytes moved, 0 at end of stream, or -1 on
+    // error (check socket_would_block()).
+    ssize_t receive(SOCKET socket, size_t max = SIZE_MAX);
+
+    // Release per-chunk resources and call done(stored) once every byte
+    // received so far is written, possibly on a disk thread; stored says
+    // whether they all reached the file
+    void finish(std::function<void(bool)> done);
+
+    // For a caller that moves body bytes into the file itself (the io_uring
+    // reactor): the file that raw body bytes go to at position(), or -1
+    // when they must pass through write() (compressed, or not stored)
+    virtual int raw_fd() const { return failed_ ? -1 : file_->fd(); }
+
+    // Account for len body bytes the caller took off the socket; stored
+    // says whether they reached the file
+    void received_elsewhere(size_t len, bool stored);
+
+    // Next file offset to write at
+    int64_t position() const { return offset_ + received_; }
+
+    int64_t offset() const { return offset_; }
+    int64_t received() const { return received_; }
+
+    // File bytes written from offset() on; differs from received() only
+    // for compressed bodies
+    virtual int64_t stored() const { return received_; }
+    int64_t remaining() const { return length_ - received_; }
+    bool complete() const { return received_ == length_; }
+    virtual const char* method() const = 0;
+
+protected:
+    FileReceiver(std::shared_ptr<DiskFile> file, int64_t offset, int64_t length)
+        : file_(std::move(file)), batch_(file_), failed_(!file_), offset_(offset), length_(length) {}
+
+    virtual bool store(const char* data, size_t len) = 0;
+    virtual ssize_t transfer(SOCKET socket, size_t max) = 0;
+    virtual void release() {}
+
+    std::shared_ptr<DiskFile> file_;
+    DiskBatch batch_;           // Writes on their way to the disk threads
+    bool failed_;
+    bool moved_elsewhere_ = false;  // Some of the body came through received_elsewhere()
+
+private:
+    int64_t offset_;
+    int64_t length_;
+    int64_t received_ = 0;
+};
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef FRAME_BUFFER_H
+#define FRAME_BUFFER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <new>
+#include <string_view>
+#include <utility>
+
+#include "../shared/protocol.h"
+#include "slab_pool.h"
+
+class FrameRef;
+
+// An encoded frame (header + payload) in a single immutable, reference-
+// counted allocation from the slab pools. A broadcast is serialized once
+// and the same buffer is queued for every recipient.
+class FrameBuffer {
+public:
+    // Encode a frame whose payload is the concatenation of the given pieces.
+    // For a streamed frame, body_length more payload bytes are sent after
+    // this buffer and are counted in the header but not stored here.
+    static FrameRef create(uint8_t type, std::initializer_list<std::string_view> pieces,
+                           uint8_t flags = 0, uint16_t stream = 0, uint32_t body_length = 0);
+
+    // A buffer for size bytes of frames that are already encoded, such as
+    // a batch of several. The caller fills it through out before sharing it.
+    static FrameRef create_batch(size_t size, char*& out);
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    friend class FrameRef;
+
+    explicit FrameBuffer(size_t size) : size_(size) {}
+
+    void retain() { refs_.fetch_add(1, std::memory_order_relaxed); }
+
+    void release() {
+        if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            this->~FrameBuffer();
+            pool_free(this);
+        }
+    }
+
+    std::atomic<uint32_t> refs_{1};
+    size_t size_;
+    char data_[1];
+};
+
+// Smart pointer to a FrameBuffer; copying only bumps the reference count
+class FrameRef {
+public:
+    FrameRef() = default;
+    FrameRef(const FrameRef& other) : frame_(other.frame_) {
+        if (frame_) {
+            frame_->retain();
+        }
+    }
+    FrameRef(FrameRef&& other) noexcept : frame_(other.frame_) { other.frame_ = nullptr; }
+    ~FrameRef() { reset(); }
+
+    FrameRef& operator=(FrameRef other) noexcept {
+        std::swap(frame_, other.frame_);
+        return *this;
+    }
+
+    void reset() {
+        if (frame_) {
+            frame_->release();
+            frame_ = nullptr;
+        }
+    }
+
+    explicit operator bool() const { return frame_ != nullptr; }
+    const FrameBuffer* operator->() const { return frame_; }
+    const FrameBuffer& operator*() const { return *frame_; }
+
+private:
+    friend class FrameBuffer;
+    explicit FrameRef(FrameBuffer* frame) : frame_(frame) {}
+
+    FrameBuffer* frame_ = nullptr;
+};
+
+inline FrameRef FrameBuffer::create(uint8_t type, std::initializer_list<std::string_view> pieces,
+                                    uint8_t flags, uint16_t stream, uint32_t body_length) {
+    size_t payload_size = 0;
+    for (std::string_view piece : pieces) {
+        payload_size += piece.size();
+    }
+    size_t size = FRAME_HEADER_SIZE + payload_size;
+
+    void* memory = pool_allocate(offsetof(FrameBuffer, data_) + size);
+    FrameBuffer* frame = new (memory) FrameBuffer(size);
+
+    FrameHeader header;
+    header.type = type;
+    header.flags = flags;
+    header.stream = stream;
+    header.length = static_cast<uint32_t>(payload_size) + body_length;
+    encode_header(frame->data_, header);
+
+    char* out = frame->data_ + FRAME_HEADER_SIZE;
+    for (std::string_view piece : pieces) {
+        if (!piece.empty()) {
+            std::memcpy(out, piece.data(), piece.size());
+            out += piece.size();
+        }
+    }
+    return FrameRef(frame);
+}
+
+inline FrameRef FrameBuffer::create_batch(size_t size, char*& out) {
+    void* memory = pool_allocate(offsetof(FrameBuffer, data_) + size);
+    FrameBuffer* frame = new (memory) FrameBuffer(size);
+    out = frame->data_;
+    return FrameRef(frame);
+}
+
+#endif
@@ -0,0 +1,173 @@
+#include "heartbeat.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include "server.h"
+
+HeartbeatConfig heartbeat_config;
+std::atomic<uint64_t> heartbeat_ticks{0};
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+std::mutex wheel_mutex;
+TimerWheel wheel;
+Clock::time_point epoch = Clock::now();   // Tick 0
+
+std::mutex thread_mutex;
+std::condition_variable stop_requested;
+bool stopping = false;
+std::thread ticker;
+
+uint64_t to_ticks(std::chrono::seconds duration) {
+    return static_cast<uint64_t>(duration / HEARTBEAT_TICK);
+}
+
+int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - epoch).count();
+}
+
+void send_ping(ClientInfo& client) {
+    // The payload is only echoed back, so it can simply be the send time
+    uint64_t token = static_cast<uint64_t>(std::max<int64_t>(now_ns(), 1));
+    char payload[sizeof(uint64_t)];
+    put_u64(payload, token);
+    client.heartbeat.ping_token.store(token, std::memory_order_relaxed);
+    count(Counter::PINGS_SENT);
+    deliver(client, FrameBuffer::create(PING, {std::string_view(payload, sizeof(payload))}), false);
+}
+
+// A client's timer went off: disconnect it if it has gone quiet for too
+// long, otherwise ping it, mark it idle when due and set the timer for the
+// next check
+void on_timer(TimerNode& timer) {
+    ClientInfo& client = *static_cast<ClientInfo*>(timer.owner);
+    if (!client.active) {
+        return;
+    }
+
+    uint64_t now = wheel.now();
+    uint64_t heard = std::min(client.heartbeat.last_heard.load(std::memory_order_relaxed), now);
+    uint64_t idle_limit = to_ticks(heartbeat_config.idle_timeout);
+    uint64_t interval = to_ticks(heartbeat_config.ping_interval);
+
+    if (idle_limit > 0 && now - heard >= idle_limit) {
+        std::cerr << "✗ Evicting " << client.username << " (" << client.ip_address
+                  << "): nothing heard for " << heartbeat_config.idle_timeout.count() << "s" << std::endl;
+        count(Counter::IDLE_EVICTIONS);
+        drop_client(client);
+        return;
+    }
+
+    uint64_t next = UINT64_MAX;
+    if (interval > 0) {
+        send_ping(client);
+        next = now + interval;
+    }
+    if (idle_limit > 0) {
+        next = std::min(next, heard + idle_limit);
+    }
+
+    uint64_t idle_after = to_ticks(presence_config.idle_after);
+    if (idle_after > 0 && !client.idle.load(std::memory_order_relaxed)) {
+        uint64_t active = std::min(client.heartbeat.last_active.load(std::memory_order_relaxed), now);
+        if (now - active >= idle_after) {
+            presence_set_idle(client, true);
+        } else {
+            next = std::min(next, active + idle_after);
+        }
+    }
+    if (next == UINT64_MAX) {
+        // Idle with nothing else to time; look again later in case it
+        // became active
+        next = now + idle_after;
+    }
+    wheel.schedule(timer, next);
+}
+
+void run_ticker() {
+    std::unique_lock<std::mutex> lock(thread_mutex);
+    auto next_tick = Clock::now();
+    while (!stopping) {
+        next_tick += HEARTBEAT_TICK;
+        if (stop_requested.wait_until(lock, next_tick, [] { return stopping; })) {
+            return;
+        }
+        uint64_t tick = static_cast<uint64_t>((Clock::now() - epoch) / HEARTBEAT_TICK);
+        heartbeat_ticks.store(tick, std::memory_order_relaxed);
+
+        {
+            std::lock_guard<std::mutex> wheel_lock(wheel_mutex);
+            wheel.advance(tick, on_timer);
+        }
+        expire_sessions();
+    }
+}
+
+} // namespace
+
+void start_heartbeats() {
+    std::lock_guard<std::mutex> lock(thread_mutex);
+    stopping = false;
+    ticker = std::thread(run_ticker);
+}
+
+void stop_heartbeats() {
+    {
+        std::lock_guard<std::mutex> lock(thread_mutex);
+        if (!ticker.joinable()) {
+            return;
+        }
+        stopping = true;
+    }
+    stop_requested.notify_one();
+    ticker.join();
+}
+
+void watch_client(ClientInfo& client) {
+    uint64_t first = UINT64_MAX;
+    for (std::chrono::seconds period : {heartbeat_config.ping_interval, heartbeat_config.idle_timeout,
+                                        presence_config.idle_after}) {
+        if (to_ticks(period) > 0) {
+            first = std::min(first, to_ticks(period));
+        }
+    }
+    if (first == UINT64_MAX) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(wheel_mutex);
+    uint64_t now = wheel.now();
+    client.heartbeat.last_heard.store(now, std::memory_order_relaxed);
+    client.heartbeat.last_active.store(now, std::memory_order_relaxed);
+    client.heartbeat.timer.owner = &client;
+    wheel.schedule(client.heartbeat.timer, now + first);
+}
+
+void unwatch_client(ClientInfo& client) {
+    std::lock_guard<std::mutex> lock(wheel_mutex);
+    wheel.cancel(client.heartbeat.timer);
+}
+
+void handle_ping(ClientInfo& client, const FrameView& frame) {
+    if (!(frame.header.flags & FRAME_FLAG_REPLY)) {
+        deliver(client, FrameBuffer::create(PING, {frame.view()}, FRAME_FLAG_REPLY), false);
+        return;
+    }
+
+    // Answers to anything but the latest PING are stale
+    uint64_t token = client.heartbeat.ping_token.load(std::memory_order_relaxed);
+    if (frame.header.length != sizeof(uint64_t) || token == 0 || get_u64(frame.payload) != token) {
+        return;
+    }
+    client.heartbeat.ping_token.store(0, std::memory_order_relaxed);
+    uint64_t rtt_us = (static_cast<uint64_t>(now_ns()) - token) / 1000;
+    client.heartbeat.rtt_us.store(static_cast<uint32_t>(std::min<uint64_t>(rtt_us, UINT32_MAX)),
+                                  std::memory_order_relaxed);
+    record(Histogram::PING_RTT_US, rtt_us);
+}
@@ -0,0 +1,59 @@
+#ifndef HEARTBEAT_H
+#define HEARTBEAT_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "../shared/protocol.h"
+#include "timer_wheel.h"
+
+struct ClientInfo;
+
+// Server-driven heartbeats. Every chat client is sent a PING each
+// ping_interval and answers it (a PING with FRAME_FLAG_REPLY echoing the
+// payload), which measures its round trip time. A client nothing has been
+// heard from for idle_timeout, not even a PING answer, is disconnected, so
+// connections whose peer vanished without closing them are reclaimed.
+// The same timer marks clients idle on the presence roster.
+struct HeartbeatConfig {
+    std::chrono::seconds ping_interval{15};   // 0 = no PINGs
+    std::chrono::seconds idle_timeout{60};    // 0 = never disconnect idle clients
+};
+
+extern HeartbeatConfig heartbeat_config;
+
+// Resolution of heartbeat timing
+constexpr std::chrono::milliseconds HEARTBEAT_TICK{100};
+
+// Ticks counted by the heartbeat thread
+extern std::atomic<uint64_t> heartbeat_ticks;
+
+// A client's heartbeat state. Its timer sits in one wheel driven by a
+// background thread; receiving only stamps last_heard, so traffic never
+// touches the wheel.
+struct Heartbeat {
+    TimerNode timer;                       // Guarded by the wheel's lock
+    std::atomic<uint64_t> last_heard{0};   // Tick the client last sent anything
+    std::atomic<uint64_t> last_active{0};  // ... anything but a PING answer
+    std::atomic<uint64_t> ping_token{0};   // Payload of the unanswered PING, 0 if none
+    std::atomic<uint32_t> rtt_us{0};       // Last measured round trip
+
+    void heard() {
+        last_heard.store(heartbeat_ticks.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+};
+
+// Run the heartbeat thread, or stop it
+void start_heartbeats();
+void stop_heartbeats();
+
+// Start or stop heartbeats for a registered chat client
+void watch_client(ClientInfo& client);
+void unwatch_client(ClientInfo& client);
+
+// Handle a PING from a client: note the round trip if it answers ours,
+// otherwise answer it
+void handle_ping(ClientInfo& client, const FrameView& frame);
+
+#endif
@@ -0,0 +1,64 @@
+#include "history.h"
+
+#include <cstring>
+
+HistoryConfig history_config;
+
+void History::append(const char* frame, size_t length, Clock::time_point when) {
+    if (history_config.messages == 0 || length > history_config.bytes) {
+        return;
+    }
+    if (!arena_) {
+        arena_.reset(new char[history_config.bytes]);
+        entries_.reset(new Entry[history_config.messages]);
+        capacity_ = history_config.messages;
+    }
+
+    // Frames are never split; one that doesn't fit before the end of the
+    // arena starts again at the beginning
+    if (write_offset_ + length > history_config.bytes) {
+        write_offset_ = 0;
+    }
+
+    // Evict every frame up to the newest one the new frame would overwrite.
+    // Usually that is just the oldest few, but after a wrap the oldest can
+    // sit past the end of the new frame while newer ones are in its way.
+    size_t evict = count_ == capacity_ ? 1 : 0;
+    for (size_t i = count_; i > evict; i--) {
+        const Entry& old = entry(i - 1);
+        if (old.offset < write_offset_ + length && write_offset_ < old.offset + old.length) {
+            evict = i;
+        }
+    }
+    head_ = (head_ + evict) % capacity_;
+    count_ -= evict;
+
+    std::memcpy(arena_.get() + write_offset_, frame, length);
+    entries_[(head_ + count_) % capacity_] = Entry{write_offset_, length, when};
+    count_++;
+    write_offset_ += length;
+}
+
+FrameRef History::replay(Clock::time_point now, Clock::time_point since) const {
+    // Entries are in time order, so skip the ones past the age limit
+    size_t first = 0;
+    while (first < count_ && (now - entry(first).when > history_config.max_age || entry(first).when < since)) {
+        first++;
+    }
+
+    size_t total = 0;
+    for (size_t i = first; i < count_; i++) {
+        total += entry(i).length;
+    }
+    if (total == 0) {
+        return FrameRef();
+    }
+
+    char* out;
+    FrameRef batch = FrameBuffer::create_batch(total, out);
+    for (size_t i = first; i < count_; i++) {
+        std::memcpy(out, arena_.get() + entry(i).offset, entry(i).length);
+        out += entry(i).length;
+    }
+    return batch;
+}
@@ -0,0 +1,53 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+
+#include "frame_buffer.h"
+
+// How much chat each room remembers for people who join it later
+struct HistoryConfig {
+    size_t messages = 50;                          // Most messages replayed (0 = no history)
+    size_t bytes = 64 * 1024;                      // Arena per room
+    std::chrono::seconds max_age{60 * 60};         // Older messages are not replayed
+};
+
+extern HistoryConfig history_config;
+
+// The most recent chat frames of one room, kept encoded and back to back
+// in a fixed arena that is written round and round. The arena and the
+// entry ring are allocated with the first message, so a room's history
+// never uses more than HistoryConfig allows and appending never allocates.
+// Not thread-safe; the room serializes access.
+class History {
+public:
+    using Clock = std::chrono::system_clock;
+
+    // Keep one encoded frame, evicting the oldest to make room
+    void append(const char* frame, size_t length, Clock::time_point when);
+
+    // Every remembered frame younger than the age limit and posted at or
+    // after since, in order, as one buffer that is queued with a single
+    // write; empty if there are none
+    FrameRef replay(Clock::time_point now, Clock::time_point since = Clock::time_point::min()) const;
+
+private:
+    struct Entry {
+        size_t offset;
+        size_t length;
+        Clock::time_point when;
+    };
+
+    const Entry& entry(size_t i) const { return entries_[(head_ + i) % capacity_]; }
+
+    std::unique_ptr<char[]> arena_;
+    std::unique_ptr<Entry[]> entries_;
+    size_t capacity_ = 0;       // Entry slots
+    size_t head_ = 0;           // Oldest entry
+    size_t count_ = 0;
+    size_t write_offset_ = 0;   // Where the next frame goes in the arena
+};
+
+#endif
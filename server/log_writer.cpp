@@ -0,0 +1,133 @@
+#include "log_writer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "metrics.h"
+
+unsigned log_lines_per_second = 100;
+
+namespace {
+
+// Queued lines beyond this are dropped even without a rate limit
+constexpr size_t MAX_PENDING_LINES = 10000;
+
+std::mutex log_mutex;
+std::condition_variable log_ready;
+std::string pending;            // Queued lines, each ending in a newline
+size_t pending_lines = 0;
+uint64_t dropped = 0;          // Since the last summary line
+bool stopping = false;
+std::thread writer;
+
+// Token bucket holding up to one second's worth of lines
+double tokens = 0;
+std::chrono::steady_clock::time_point refilled;
+
+bool take_token() {
+    if (log_lines_per_second == 0) {
+        return true;
+    }
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - refilled).count();
+    refilled = now;
+    tokens = std::min<double>(log_lines_per_second, tokens + elapsed * log_lines_per_second);
+    if (tokens < 1) {
+        return false;
+    }
+    tokens -= 1;
+    return true;
+}
+
+void write_batches() {
+    // Swapped with pending, so both keep their capacity and queueing a
+    // line stops allocating once they have grown
+    std::string text;
+    uint64_t skipped = 0;
+    auto noted = std::chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> lock(log_mutex);
+    while (true) {
+        log_ready.wait_for(lock, std::chrono::seconds(1),
+                           [] { return stopping || pending_lines > 0; });
+        text.swap(pending);
+        pending_lines = 0;
+        skipped += dropped;
+        dropped = 0;
+        bool done = stopping;
+        lock.unlock();
+
+        // Summarize dropped lines at most once a second
+        auto now = std::chrono::steady_clock::now();
+        if (skipped > 0 && (done || now - noted >= std::chrono::seconds(1))) {
+            text += "✗ " + std::to_string(skipped) + " chat lines not logged (over --log-rate)\n";
+            skipped = 0;
+            noted = now;
+        }
+        if (!text.empty()) {
+            std::cout << text << std::flush;
+        }
+        text.clear();
+
+        lock.lock();
+        if (done && pending_lines == 0) {
+            return;
+        }
+    }
+}
+
+} // namespace
+
+void start_log_writer() {
+    std::lock_guard<std::mutex> lock(log_mutex);
+    stopping = false;
+    tokens = log_lines_per_second;
+    refilled = std::chrono::steady_clock::now();
+    writer = std::thread(write_batches);
+}
+
+void stop_log_writer() {
+    {
+        std::lock_guard<std::mutex> lock(log_mutex);
+        if (!writer.joinable()) {
+            return;
+        }
+        stopping = true;
+    }
+    log_ready.notify_one();
+    writer.join();
+}
+
+void log_line(std::initializer_list<std::string_view> pieces) {
+    bool queued = false;
+    {
+        std::lock_guard<std::mutex> lock(log_mutex);
+        if (!writer.joinable()) {
+            for (std::string_view piece : pieces) {
+                std::cout << piece;
+            }
+            std::cout << std::endl;
+            return;
+        }
+        if (pending_lines < MAX_PENDING_LINES && take_token()) {
+            for (std::string_view piece : pieces) {
+                pending += piece;
+            }
+            pending += '\n';
+            pending_lines++;
+            queued = true;
+        } else {
+            dropped++;
+        }
+    }
+    if (queued) {
+        log_ready.notify_one();
+    } else {
+        count(Counter::LOG_LINES_DROPPED);
+    }
+}
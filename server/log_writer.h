@@ -0,0 +1,22 @@
+#ifndef LOG_WRITER_H
+#define LOG_WRITER_H
+
+#include <initializer_list>
+#include <string_view>
+
+// Most chat lines logged per second (--log-rate); 0 logs every line
+extern unsigned log_lines_per_second;
+
+// Per-message console logging. Client threads and the event loop only
+// append to a queue; a background thread writes the lines out in batches,
+// so a slow terminal never stalls message delivery. Lines over the rate
+// are counted and summarized instead of printed.
+void start_log_writer();
+
+// Write out whatever is still queued and stop the thread
+void stop_log_writer();
+
+// Queue the concatenation of pieces as one line
+void log_line(std::initializer_list<std::string_view> pieces);
+
+#endif
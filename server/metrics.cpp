@@ -0,0 +1,196 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+namespace {
+
+constexpr int COUNTER_COUNT = static_cast<int>(Counter::COUNT);
+constexpr int HISTOGRAM_COUNT = static_cast<int>(Histogram::COUNT);
+constexpr int FRAME_TYPE_COUNT = 256;
+
+// Log-linear buckets: values below 8 are exact, then each power of two is
+// split into 8 equal sub-buckets
+constexpr int SUB_BUCKET_BITS = 3;
+constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+constexpr int BUCKET_COUNT = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+const char* const COUNTER_NAMES[COUNTER_COUNT] = {
+    "bytes_in", "bytes_out", "upload_bytes", "log_lines_dropped",
+    "chat_log_bytes", "chat_log_commits", "chat_log_dropped", "uring_enters", "uring_ops",
+    "pings_sent", "idle_evictions", "presence_deltas", "presence_snapshots",
+    "peer_offers", "peer_relays", "transfer_waits", "pool_allocs", "pool_refills",
+    "pool_slabs", "pool_oversize", "sessions_parked", "sessions_resumed", "sessions_expired",
+    "disk_writes", "disk_syncs", "disk_queue_waits",
+};
+
+const char* const HISTOGRAM_NAMES[HISTOGRAM_COUNT] = {
+    "fanout_ns", "registry_lock_wait_ns", "queue_depth_bytes", "upload_kib_per_s",
+    "chat_log_commit_ns", "ping_rtt_us", "disk_write_ns",
+};
+
+const char* frame_type_name(int type) {
+    static const char* const names[] = {
+        nullptr, "MESSAGE", "FILE_TRANSFER", "USERNAME_SET", "DISCONNECT", "PING",
+        "CLIENT_LIST", "FILE_READY", "FILE_CHUNK", "FILE_ATTACH", "FILE_DONE",
+        "FILE_ERROR", "FILE_DOWNLOAD", "STATS", "ROOM_JOIN", "PRESENCE",
+        "PEER_OFFER", "PEER_RELAY", "HELLO",
+    };
+    return type < static_cast<int>(sizeof(names) / sizeof(names[0])) ? names[type] : nullptr;
+}
+
+int bucket_index(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+        return static_cast<int>(value);
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    int sub_bucket = static_cast<int>(value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub_bucket;
+}
+
+// Middle of the range of values a bucket holds
+uint64_t bucket_value(int index) {
+    if (index < 2 * SUB_BUCKETS) {
+        return index;
+    }
+    int exponent = index / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    uint64_t width = uint64_t{1} << (exponent - SUB_BUCKET_BITS);
+    return (SUB_BUCKETS + index % SUB_BUCKETS) * width + width / 2;
+}
+
+// Only the owning thread writes a slot, so updates need no read-modify-write
+void bump(std::atomic<uint64_t>& cell, uint64_t amount) {
+    cell.store(cell.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+struct MetricSlot {
+    std::atomic<uint64_t> counters[COUNTER_COUNT] = {};
+    std::atomic<uint64_t> frames_in[FRAME_TYPE_COUNT] = {};
+    std::atomic<uint64_t> buckets[HISTOGRAM_COUNT][BUCKET_COUNT] = {};
+    std::atomic<uint64_t> maxima[HISTOGRAM_COUNT] = {};
+
+    // Add another slot's values; used for snapshots and retiring threads
+    void add(const MetricSlot& other) {
+        for (int i = 0; i < COUNTER_COUNT; i++) {
+            bump(counters[i], other.counters[i].load(std::memory_order_relaxed));
+        }
+        for (int i = 0; i < FRAME_TYPE_COUNT; i++) {
+            bump(frames_in[i], other.frames_in[i].load(std::memory_order_relaxed));
+        }
+        for (int h = 0; h < HISTOGRAM_COUNT; h++) {
+            for (int b = 0; b < BUCKET_COUNT; b++) {
+                bump(buckets[h][b], other.buckets[h][b].load(std::memory_order_relaxed));
+            }
+            maxima[h].store(std::max(maxima[h].load(std::memory_order_relaxed),
+                                     other.maxima[h].load(std::memory_order_relaxed)),
+                            std::memory_order_relaxed);
+        }
+    }
+};
+
+std::mutex registry_mutex;
+std::vector<MetricSlot*> live_slots;
+MetricSlot retired_totals;
+const auto start_time = std::chrono::steady_clock::now();
+
+// Registers the thread's slot on first use and folds it into the retired
+// totals when the thread exits
+struct SlotOwner {
+    MetricSlot* slot = new MetricSlot();
+
+    SlotOwner() {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        live_slots.push_back(slot);
+    }
+
+    ~SlotOwner() {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        retired_totals.add(*slot);
+        live_slots.erase(std::remove(live_slots.begin(), live_slots.end(), slot), live_slots.end());
+        delete slot;
+    }
+};
+
+MetricSlot& local_slot() {
+    thread_local SlotOwner owner;
+    return *owner.slot;
+}
+
+// Smallest recorded value with at least fraction q of the samples at or below it
+uint64_t percentile(const std::atomic<uint64_t>* buckets, uint64_t total, double q) {
+    uint64_t rank = static_cast<uint64_t>(q * total + 0.5);
+    uint64_t seen = 0;
+    for (int b = 0; b < BUCKET_COUNT; b++) {
+        seen += buckets[b].load(std::memory_order_relaxed);
+        if (seen >= std::max<uint64_t>(rank, 1)) {
+            return bucket_value(b);
+        }
+    }
+    return 0;
+}
+
+} // namespace
+
+void count(Counter counter, uint64_t amount) {
+    bump(local_slot().counters[static_cast<int>(counter)], amount);
+}
+
+void count_frame_in(uint8_t type) {
+    bump(local_slot().frames_in[type], 1);
+}
+
+void record(Histogram histogram, uint64_t value) {
+    MetricSlot& slot = local_slot();
+    int h = static_cast<int>(histogram);
+    bump(slot.buckets[h][bucket_index(value)], 1);
+    if (value > slot.maxima[h].load(std::memory_order_relaxed)) {
+        slot.maxima[h].store(value, std::memory_order_relaxed);
+    }
+}
+
+std::string metrics_report() {
+    // Too large for a thread's stack
+    auto snapshot = std::make_unique<MetricSlot>();
+    MetricSlot& totals = *snapshot;
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        totals.add(retired_totals);
+        for (const MetricSlot* slot : live_slots) {
+            totals.add(*slot);
+        }
+    }
+
+    std::ostringstream out;
+    auto uptime = std::chrono::steady_clock::now() - start_time;
+    out << "uptime_seconds " << std::chrono::duration_cast<std::chrono::seconds>(uptime).count() << "\n";
+
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        out << COUNTER_NAMES[i] << " " << totals.counters[i].load(std::memory_order_relaxed) << "\n";
+    }
+    for (int type = 0; type < FRAME_TYPE_COUNT; type++) {
+        uint64_t frames = totals.frames_in[type].load(std::memory_order_relaxed);
+        if (frames > 0) {
+            const char* name = frame_type_name(type);
+            out << "frames_in." << (name ? name : std::to_string(type)) << " " << frames << "\n";
+        }
+    }
+    for (int h = 0; h < HISTOGRAM_COUNT; h++) {
+        const std::atomic<uint64_t>* buckets = totals.buckets[h];
+        uint64_t samples = 0;
+        for (int b = 0; b < BUCKET_COUNT; b++) {
+            samples += buckets[b].load(std::memory_order_relaxed);
+        }
+        const char* name = HISTOGRAM_NAMES[h];
+        out << name << ".count " << samples << "\n";
+        if (samples > 0) {
+            out << name << ".p50 " << percentile(buckets, samples, 0.5) << "\n"
+                << name << ".p99 " << percentile(buckets, samples, 0.99) << "\n"
+                << name << ".p999 " << percentile(buckets, samples, 0.999) << "\n"
+                << name << ".max " << totals.maxima[h].load(std::memory_order_relaxed) << "\n";
+        }
+    }
+    return out.str();
+}
@@ -0,0 +1,93 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// Server metrics. Every thread that records owns a private slot of
+// counters and histograms and updates it with plain relaxed stores, so
+// recording never contends or takes a lock. A STATS request sums the
+// slots of running threads with the totals left by threads that have
+// exited.
+
+enum class Counter {
+    BYTES_IN,
+    BYTES_OUT,
+    UPLOAD_BYTES,
+    LOG_LINES_DROPPED,
+    CHAT_LOG_BYTES,
+    CHAT_LOG_COMMITS,
+    CHAT_LOG_DROPPED,
+    URING_ENTERS,
+    URING_OPS,
+    PINGS_SENT,
+    IDLE_EVICTIONS,
+    PRESENCE_DELTAS,
+    PRESENCE_SNAPSHOTS,
+    PEER_OFFERS,
+    PEER_RELAYS,
+    TRANSFER_WAITS,
+    POOL_ALLOCS,
+    POOL_REFILLS,
+    POOL_SLABS,
+    POOL_OVERSIZE,
+    SESSIONS_PARKED,
+    SESSIONS_RESUMED,
+    SESSIONS_EXPIRED,
+    DISK_WRITES,
+    DISK_SYNCS,
+    DISK_QUEUE_WAITS,
+    COUNT
+};
+
+// Histograms keep 8 log-linear buckets per power of two (HDR-style), so
+// any recorded value is reported to within about 6%
+enum class Histogram {
+    FANOUT_NS,              // Encoding and queueing one broadcast for its room
+    REGISTRY_LOCK_WAIT_NS,  // Waiting for a client registry or room directory shard
+    QUEUE_DEPTH_BYTES,      // A client's queued output after each push
+    UPLOAD_KIB_PER_S,       // Rate of each completed upload
+    CHAT_LOG_COMMIT_NS,     // Writing and syncing one batch of the chat log
+    PING_RTT_US,            // Round trip of each answered heartbeat PING
+    DISK_WRITE_NS,          // One upload buffer written by a disk thread
+    COUNT
+};
+
+void count(Counter counter, uint64_t amount = 1);
+void count_frame_in(uint8_t type);
+void record(Histogram histogram, uint64_t value);
+
+// Record the nanoseconds since start
+inline void record_since(Histogram histogram, std::chrono::steady_clock::time_point start) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    record(histogram, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+// Every metric as "name value" lines
+std::string metrics_report();
+
+// lock_guard that records how long the mutex took to acquire. The clock is
+// only read when the lock is contended.
+class TimedLock {
+public:
+    TimedLock(std::mutex& mutex, Histogram histogram) : mutex_(mutex) {
+        if (mutex_.try_lock()) {
+            record(histogram, 0);
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        mutex_.lock();
+        record_since(histogram, start);
+    }
+    ~TimedLock() { mutex_.unlock(); }
+
+    TimedLock(const TimedLock&) = delete;
+    TimedLock& operator=(const TimedLock&) = delete;
+
+private:
+    std::mutex& mutex_;
+};
+
+#endif
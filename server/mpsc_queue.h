@@ -0,0 +1,65 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+#include "slab_pool.h"
+
+// Unbounded lock-free queue for many producers and one consumer (Dmitry
+// Vyukov's linked design). A push is one atomic exchange plus a store and
+// never waits for other producers or the consumer. A push that is still
+// linking its node may briefly hide the items behind it from pop(); they
+// show up on the consumer's next attempt.
+template <typename T>
+class MpscQueue {
+public:
+    MpscQueue() : head_(new Node()), tail_(head_.load(std::memory_order_relaxed)) {}
+
+    ~MpscQueue() {
+        T discarded;
+        while (pop(discarded)) {
+        }
+        delete tail_;
+    }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    // Any thread
+    void push(T value) {
+        Node* node = new Node();
+        node->value = std::move(value);
+        Node* previous = head_.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+    }
+
+    // Consumer thread only
+    bool pop(T& value) {
+        Node* tail = tail_;
+        Node* next = tail->next.load(std::memory_order_acquire);
+        if (!next) {
+            return false;
+        }
+        value = std::move(next->value);
+        tail_ = next;
+        delete tail;
+        return true;
+    }
+
+private:
+    struct Node {
+        std::atomic<Node*> next{nullptr};
+        T value;
+
+        // One node per push, so they come from the pools
+        static void* operator new(size_t size) { return pool_allocate(size); }
+        static void operator delete(void* node) { pool_free(node); }
+    };
+
+    alignas(64) std::atomic<Node*> head_;  // Last pushed node
+    alignas(64) Node* tail_;               // Already consumed; its next is the front
+};
+
+#endif
@@ -0,0 +1,241 @@
+#include "outbound.h"
+#include "metrics.h"
+
+#include <cstring>
+
+#ifndef _WIN32
+    #include <sys/uio.h>
+#endif
+#ifdef __linux__
+    #include <sys/sendfile.h>
+#endif
+
+OutboundConfig outbound_config;
+
+OutboundQueue::PushResult OutboundQueue::push(const FrameRef& frame, bool droppable) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (closed_) {
+        return PushResult::DROPPED;
+    }
+    size_t frame_bytes = queued_bytes_ - file_bytes_ + frame->size();
+    if (frame_bytes > outbound_config.high_watermark) {
+        // Frames that can't be dropped still can't pile up for ever
+        if (outbound_config.policy == SlowConsumerPolicy::DISCONNECT ||
+            frame_bytes > outbound_config.hard_limit) {
+            return PushResult::OVERFLOW;
+        }
+        dropping_ = true;
+    }
+    if (dropping_ && droppable) {
+        dropped_frames_++;
+        return PushResult::DROPPED;
+    }
+
+    OutboundItem item;
+    item.frame = frame;
+    append(std::move(item));
+    record(Histogram::QUEUE_DEPTH_BYTES, queued_bytes_);
+    return PushResult::QUEUED;
+}
+
+void OutboundQueue::push_file(const FrameRef& header, const std::shared_ptr<const ServedFile>& file,
+                              int64_t offset, size_t length) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (closed_) {
+        return;
+    }
+
+    OutboundItem head_item;
+    head_item.frame = header;
+    append(std::move(head_item));
+
+    OutboundItem body;
+    body.file = file;
+    body.offset = offset;
+    body.length = length;
+    file_bytes_ += length;
+    append(std::move(body));
+}
+
+void OutboundQueue::append(OutboundItem item) {
+    if (count_ == slots_.size()) {
+        grow();
+    }
+    queued_bytes_ += item.size();
+    slots_[(head_ + count_) & (slots_.size() - 1)] = std::move(item);
+    count_++;
+}
+
+// Double the slot ring, unwrapping the queued frames to the front
+void OutboundQueue::grow() {
+    std::vector<OutboundItem> grown(slots_.empty() ? 16 : slots_.size() * 2);
+    for (size_t i = 0; i < count_; i++) {
+        grown[i] = std::move(slots_[(head_ + i) & (slots_.size() - 1)]);
+    }
+    slots_.swap(grown);
+    head_ = 0;
+}
+
+OutboundQueue::FlushResult OutboundQueue::flush(SOCKET socket) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t mask = slots_.size() - 1;
+
+    while (count_ > 0 && !writing_) {
+        ssize_t sent;
+#ifdef _WIN32
+        // Windows servers queue file data as frames
+        const FrameRef& front = slots_[head_].frame;
+        sent = send(socket, front->data() + front_offset_,
+                    static_cast<int>(front->size() - front_offset_), 0);
+#else
+        const OutboundItem& front = slots_[head_];
+#ifdef __linux__
+        if (!front.frame && !front.file->data()) {
+            // Unmapped file range: straight from the page cache
+            off_t position = front.offset + front_offset_;
+            sent = sendfile(socket, front.file->fd(), &position, front.length - front_offset_);
+        } else
+#endif
+        {
+            struct iovec iov[OUTBOUND_MAX_IOV];
+            int iov_count = 0;
+            for (size_t i = 0; i < count_ && iov_count < OUTBOUND_MAX_IOV; i++) {
+                const OutboundItem& item = slots_[(head_ + i) & mask];
+                const char* data;
+                if (item.frame) {
+                    data = item.frame->data();
+                } else if (item.file->data()) {
+                    data = item.file->data() + item.offset;
+                } else {
+                    break;  // Left for sendfile()
+                }
+                size_t skip = i == 0 ? front_offset_ : 0;
+                iov[iov_count].iov_base = const_cast<char*>(data + skip);
+                iov[iov_count].iov_len = item.size() - skip;
+                iov_count++;
+            }
+            sent = writev(socket, iov, iov_count);
+        }
+#endif
+        if (sent <= 0) {
+            if (sent < 0 && socket_would_block()) {
+                break;
+            }
+            // Nothing written yet nothing pending: the peer is gone, or
+            // sendfile() hit the end of a file that shrank
+            return FlushResult::FAILED;
+        }
+
+        retire(static_cast<size_t>(sent));
+    }
+    return count_ == 0 ? FlushResult::DRAINED : FlushResult::PENDING;
+}
+
+// Drop every item a write covered
+void OutboundQueue::retire(size_t sent) {
+    size_t mask = slots_.size() - 1;
+    count(Counter::BYTES_OUT, sent);
+    queued_bytes_ -= sent;
+    while (sent > 0) {
+        OutboundItem& item = slots_[head_];
+        size_t left = item.size() - front_offset_;
+        if (sent < left) {
+            front_offset_ += sent;
+            if (!item.frame) {
+                file_bytes_ -= sent;
+            }
+            break;
+        }
+        sent -= left;
+        if (!item.frame) {
+            file_bytes_ -= left;
+        }
+        item = OutboundItem();
+        front_offset_ = 0;
+        head_ = (head_ + 1) & mask;
+        count_--;
+    }
+
+    if (dropping_ && queued_bytes_ <= outbound_config.low_watermark) {
+        dropping_ = false;
+    }
+}
+
+#ifndef _WIN32
+OutboundQueue::WriteSetup OutboundQueue::prepare_write(AsyncWrite& write) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (count_ == 0 || writing_) {
+        return WriteSetup::EMPTY;
+    }
+
+    size_t mask = slots_.size() - 1;
+    int iov_count = 0;
+    for (size_t i = 0; i < count_ && iov_count < OUTBOUND_MAX_IOV; i++) {
+        const OutboundItem& item = slots_[(head_ + i) & mask];
+        const char* data;
+        if (item.frame) {
+            data = item.frame->data();
+        } else if (item.file->data()) {
+            data = item.file->data() + item.offset;
+        } else {
+            break;  // Left for sendfile()
+        }
+        size_t skip = i == 0 ? front_offset_ : 0;
+        write.iov[iov_count].iov_base = const_cast<char*>(data + skip);
+        write.iov[iov_count].iov_len = item.size() - skip;
+        write.items[iov_count] = item;
+        iov_count++;
+    }
+    if (iov_count == 0) {
+        return WriteSetup::SYNC;
+    }
+
+    std::memset(&write.message, 0, sizeof(write.message));
+    write.message.msg_iov = write.iov;
+    write.message.msg_iovlen = iov_count;
+    writing_ = true;
+    return WriteSetup::READY;
+}
+
+void OutboundQueue::complete_write(AsyncWrite& write, ssize_t sent) {
+    for (size_t i = 0; i < write.message.msg_iovlen; i++) {
+        write.items[i] = OutboundItem();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    writing_ = false;
+    // A closed queue has already let go of what was written
+    if (sent > 0 && !closed_) {
+        retire(static_cast<size_t>(sent));
+    }
+}
+#endif
+
+void OutboundQueue::close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    while (count_ > 0) {
+        slots_[head_] = OutboundItem();
+        head_ = (head_ + 1) & (slots_.size() - 1);
+        count_--;
+    }
+    front_offset_ = 0;
+    queued_bytes_ = 0;
+    file_bytes_ = 0;
+}
+
+bool OutboundQueue::empty() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return count_ == 0;
+}
+
+size_t OutboundQueue::queued_bytes() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queued_bytes_;
+}
+
+uint64_t OutboundQueue::dropped_frames() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return dropped_frames_;
+}
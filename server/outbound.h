@@ -0,0 +1,120 @@
+#ifndef OUTBOUND_H
+#define OUTBOUND_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "../shared/platform.h"
+#ifndef _WIN32
+    #include <sys/uio.h>
+#endif
+#include "frame_buffer.h"
+#include "file_cache.h"
+
+// What to do with a client whose queue grows past the high watermark
+enum class SlowConsumerPolicy { DROP, DISCONNECT };
+
+struct OutboundConfig {
+    size_t high_watermark = 1024 * 1024;  // Bytes queued before the policy applies
+    size_t low_watermark = 256 * 1024;    // Dropping stops once drained below this
+    size_t hard_limit = 8 * 1024 * 1024;  // Bytes queued past which a client is disconnected
+    SlowConsumerPolicy policy = SlowConsumerPolicy::DROP;
+};
+
+extern OutboundConfig outbound_config;
+
+// How often a thread-per-client handler retries a backed-up queue
+constexpr int OUTBOUND_POLL_INTERVAL_MS = 50;
+
+// Most frames gathered into one vectored write
+constexpr int OUTBOUND_MAX_IOV = 64;
+
+// One queue entry: an encoded frame, or a byte range of a served file that
+// is written straight from its mapping or with sendfile()
+struct OutboundItem {
+    FrameRef frame;
+    std::shared_ptr<const ServedFile> file;
+    int64_t offset = 0;
+    size_t length = 0;
+
+    size_t size() const { return frame ? frame->size() : length; }
+};
+
+#ifndef _WIN32
+// A vectored write that is submitted to the kernel and finishes later (the
+// io_uring reactor). It holds references to the items it covers, so they
+// stay valid even if the queue is closed while the write is in flight.
+struct AsyncWrite {
+    struct msghdr message;
+    struct iovec iov[OUTBOUND_MAX_IOV];
+    OutboundItem items[OUTBOUND_MAX_IOV];
+};
+#endif
+
+// Bounded queue of encoded frames waiting to be written to one client.
+// Any thread may push; writes are non-blocking, so whatever the kernel
+// cannot take stays queued until the socket is writable again. Frames are
+// shared references, and the slot ring only grows, so a steady-state push
+// does not allocate. Queued frames are flushed with one writev() per batch.
+// File ranges ride in the same queue, so they stay in order with the frame
+// headers announcing them, but don't count against the watermarks.
+class OutboundQueue {
+public:
+    enum class PushResult { QUEUED, DROPPED, OVERFLOW };
+    enum class FlushResult { DRAINED, PENDING, FAILED };
+
+    // Queue a frame. Droppable frames (chat, notifications) are discarded
+    // while the client is over its watermark; the others are kept up to the
+    // hard limit. OVERFLOW means the client should be disconnected.
+    PushResult push(const FrameRef& frame, bool droppable = true);
+
+    // Queue a streamed frame header and the file range that is its body,
+    // back to back and regardless of the watermarks
+    void push_file(const FrameRef& header, const std::shared_ptr<const ServedFile>& file,
+                   int64_t offset, size_t length);
+
+    // Write queued frames until the queue is empty or the socket is full
+    FlushResult flush(SOCKET socket);
+
+#ifndef _WIN32
+    enum class WriteSetup { EMPTY, READY, SYNC };
+
+    // Describe the front of the queue in write, for a caller that submits
+    // the write itself. SYNC means the front is a file range that only
+    // flush() can send (with sendfile()). After READY, flush() writes
+    // nothing until complete_write() reports the result.
+    WriteSetup prepare_write(AsyncWrite& write);
+    void complete_write(AsyncWrite& write, ssize_t sent);
+#endif
+
+    // Discard everything and ignore later pushes. Called before the socket
+    // is closed, so a sender holding a stale reference to the client can't
+    // write to a descriptor number that has been reused.
+    void close();
+
+    bool empty();
+    size_t queued_bytes();
+    uint64_t dropped_frames();
+
+private:
+    void grow();
+    void append(OutboundItem item);
+    void retire(size_t sent);
+
+    std::mutex mutex_;
+    std::vector<OutboundItem> slots_;  // Ring of queued items, power-of-two size
+    size_t head_ = 0;
+    size_t count_ = 0;
+    size_t front_offset_ = 0;      // Bytes of the front item already sent
+    size_t queued_bytes_ = 0;
+    size_t file_bytes_ = 0;        // Part of queued_bytes_ that is file ranges
+    bool dropping_ = false;
+    bool closed_ = false;
+    bool writing_ = false;         // An AsyncWrite is in flight
+    uint64_t dropped_frames_ = 0;
+};
+
+#endif
@@ -0,0 +1,141 @@
+#include "peer.h"
+
+#include <iostream>
+#include <map>
+#include <mutex>
+
+#include "server.h"
+
+namespace {
+
+struct PeerOffer {
+    std::weak_ptr<ClientInfo> sender;
+    std::weak_ptr<ClientInfo> recipient;
+    std::string filename;
+    std::chrono::steady_clock::time_point created;
+};
+
+std::mutex offers_mutex;
+std::map<uint64_t, PeerOffer> offers;   // By token
+
+// Pick an unused token and remember the offer under it; the caller holds
+// offers_mutex
+uint64_t add_offer(PeerOffer offer) {
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = offers.begin(); it != offers.end();) {
+        if (now - it->second.created > PEER_OFFER_EXPIRY) {
+            it = offers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    uint64_t token;
+    do {
+        token = random_token();
+    } while (token == 0 || offers.count(token));
+    offer.created = now;
+    offers[token] = std::move(offer);
+    return token;
+}
+
+FrameRef offer_reply(uint64_t request_id, uint64_t token, std::string_view reason) {
+    char head[2 * sizeof(uint64_t)];
+    put_u64(head, request_id);
+    put_u64(head + sizeof(uint64_t), token);
+    return FrameBuffer::create(PEER_OFFER, {std::string_view(head, sizeof(head)), reason}, FRAME_FLAG_REPLY);
+}
+
+} // namespace
+
+bool offer_peer_transfer(const std::shared_ptr<ClientInfo>& sender, const FrameView& frame) {
+    constexpr size_t fixed = 2 * sizeof(uint64_t) + sizeof(uint16_t) + 1;
+    if (frame.header.length < fixed) {
+        return false;
+    }
+    const char* p = frame.payload;
+    uint64_t request_id = get_u64(p);
+    uint64_t size = get_u64(p + sizeof(uint64_t));
+    uint16_t port = get_u16(p + 2 * sizeof(uint64_t));
+    size_t name_length = static_cast<unsigned char>(p[fixed - 1]);
+    if (frame.header.length < fixed + name_length) {
+        return false;
+    }
+    std::string recipient_name(p + fixed, name_length);
+    std::string filename(p + fixed + name_length, frame.header.length - fixed - name_length);
+
+    if (!servable_name(filename)) {
+        deliver(*sender, offer_reply(request_id, 0, "Invalid file name"), false);
+        return true;
+    }
+    std::shared_ptr<ClientInfo> recipient = find_client(recipient_name, sender.get());
+    if (!recipient) {
+        deliver(*sender, offer_reply(request_id, 0, "Nobody called " + recipient_name + " is online"), false);
+        return true;
+    }
+
+    uint64_t token;
+    {
+        std::lock_guard<std::mutex> lock(offers_mutex);
+        token = add_offer(PeerOffer{sender, recipient, filename, {}});
+    }
+    count(Counter::PEER_OFFERS);
+    std::cout << "→ " << sender->username << " offers " << filename << " to "
+              << recipient->username << " (" << size << " bytes)" << std::endl;
+
+    char head[2 * sizeof(uint64_t) + sizeof(uint16_t)];
+    put_u64(head, token);
+    put_u64(head + sizeof(uint64_t), size);
+    put_u16(head + 2 * sizeof(uint64_t), port);
+    std::string endpoints;
+    endpoints += static_cast<char>(sender->ip_address.size());
+    endpoints += sender->ip_address;
+    endpoints += static_cast<char>(sender->username.size());
+    endpoints += sender->username;
+    deliver(*recipient, FrameBuffer::create(PEER_OFFER, {std::string_view(head, sizeof(head)), endpoints,
+                                                         filename}), false);
+    deliver(*sender, offer_reply(request_id, token, ""), false);
+    return true;
+}
+
+bool relay_peer_transfer(ClientInfo& client, const FrameView& frame) {
+    if (frame.header.length != sizeof(uint64_t)) {
+        return false;
+    }
+    uint64_t token = get_u64(frame.payload);
+    bool uploaded = (frame.header.flags & FRAME_FLAG_REPLY) != 0;
+
+    std::shared_ptr<ClientInfo> other;
+    std::string filename;
+    {
+        std::lock_guard<std::mutex> lock(offers_mutex);
+        auto it = offers.find(token);
+        if (it == offers.end()) {
+            notify_client(client, "That file transfer has expired");
+            return true;
+        }
+        // A relay is asked for by the recipient and completed by the sender
+        std::shared_ptr<ClientInfo> asking = (uploaded ? it->second.sender : it->second.recipient).lock();
+        if (asking.get() != &client) {
+            return true;
+        }
+        other = (uploaded ? it->second.recipient : it->second.sender).lock();
+        filename = it->second.filename;
+        if (uploaded || !other) {
+            offers.erase(it);
+        }
+    }
+
+    if (!other || !other->active) {
+        notify_client(client, "The other side of the transfer of " + filename + " has left");
+        return true;
+    }
+    if (!uploaded) {
+        count(Counter::PEER_RELAYS);
+        std::cout << "→ Relaying " << filename << " from " << other->username << " to "
+                  << client.username << std::endl;
+    }
+    deliver(*other, FrameBuffer::create(PEER_RELAY, {frame.view()}, frame.header.flags & FRAME_FLAG_REPLY),
+            false);
+    return true;
+}
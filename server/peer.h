@@ -0,0 +1,39 @@
+#ifndef PEER_H
+#define PEER_H
+
+#include <chrono>
+#include <memory>
+
+#include "../shared/protocol.h"
+
+struct ClientInfo;
+
+// Brokering for /sendto, which sends a file straight from one client to
+// another so its bytes never cross the server's link.
+//
+// The sender listens on a port of its own and sends PEER_OFFER naming the
+// recipient. The server picks a random token and passes the recipient the
+// sender's address as the server sees it, the port and the token. The
+// recipient connects to the sender and presents the token. If it can't
+// reach the sender, it sends PEER_RELAY and the server passes that on: the
+// sender uploads the file as usual and, when done, sends PEER_RELAY with
+// FRAME_FLAG_REPLY, which tells the recipient to download it from the
+// server.
+//
+// Payloads (big-endian):
+//   PEER_OFFER, sender:     u64 request ID | u64 size | u16 port |
+//                           u8 recipient length | recipient | file name
+//   PEER_OFFER, reply:      u64 request ID | u64 token (0 = refused) | reason
+//   PEER_OFFER, recipient:  u64 token | u64 size | u16 port (0 = relay only) |
+//                           u8 address length | address |
+//                           u8 sender length | sender | file name
+//   PEER_RELAY:             u64 token
+
+// Offers are forgotten after this long
+constexpr auto PEER_OFFER_EXPIRY = std::chrono::hours(1);
+
+// Handle PEER_OFFER or PEER_RELAY from a chat client; false if malformed
+bool offer_peer_transfer(const std::shared_ptr<ClientInfo>& sender, const FrameView& frame);
+bool relay_peer_transfer(ClientInfo& client, const FrameView& frame);
+
+#endif
@@ -0,0 +1,177 @@
+#include "presence.h"
+
+#include <deque>
+#include <mutex>
+
+#include "../shared/roster.h"
+#include "server.h"
+
+PresenceConfig presence_config;
+
+namespace {
+
+// Guards everything below. Deltas are queued for their recipients under
+// it, so every client receives them in version order.
+std::mutex presence_mutex;
+std::shared_ptr<const MemberList> roster = std::make_shared<const MemberList>();
+uint64_t version = 0;
+std::deque<FrameRef> recent;   // The latest deltas, ending at version
+
+void encode_entry(std::string& out, const ClientInfo& client) {
+    int64_t connected = std::chrono::duration_cast<std::chrono::seconds>(
+        client.connected_time.time_since_epoch()).count();
+    encode_roster_entry(out, client.id, client.idle.load(std::memory_order_relaxed), connected,
+                        client.username, client.ip_address);
+}
+
+// Record the next change and send it to everyone on the roster but except
+void publish_delta(PresenceKind kind, const ClientInfo& client, const ClientInfo* except) {
+    version++;
+    char head[sizeof(uint64_t) + 1];
+    put_u64(head, version);
+    head[sizeof(uint64_t)] = static_cast<char>(kind);
+
+    std::string body;
+    if (kind == PRESENCE_JOIN) {
+        encode_entry(body, client);
+    } else {
+        body.resize(sizeof(uint64_t));
+        put_u64(&body[0], client.id);
+    }
+
+    FrameRef delta = FrameBuffer::create(PRESENCE, {std::string_view(head, sizeof(head)), body});
+    recent.push_back(delta);
+    if (recent.size() > PRESENCE_LOG_SIZE) {
+        recent.pop_front();
+    }
+    count(Counter::PRESENCE_DELTAS);
+    fan_out(delta, roster, except);
+}
+
+// Queue the whole roster for one client, in as many frames of its max
+// payload as it takes
+void queue_snapshot(ClientInfo& client) {
+    constexpr size_t head_size = sizeof(uint64_t) + 2 * sizeof(uint32_t);
+    const MemberList& members = *roster;
+    std::string entries;
+    size_t index = 0;
+
+    do {
+        size_t first = index;
+        entries.clear();
+        for (; index < members.size(); index++) {
+            size_t before = entries.size();
+            encode_entry(entries, *members[index]);
+            if (head_size + entries.size() > client.max_payload) {
+                entries.resize(before);
+                break;
+            }
+        }
+
+        char head[head_size];
+        put_u64(head, version);
+        put_u32(head + sizeof(uint64_t), static_cast<uint32_t>(members.size()));
+        put_u32(head + sizeof(uint64_t) + sizeof(uint32_t), static_cast<uint32_t>(first));
+        if (client.outbound.push(FrameBuffer::create(CLIENT_LIST, {std::string_view(head, head_size), entries}),
+                                 false) == OutboundQueue::PushResult::OVERFLOW) {
+            drop_client(client);
+            return;
+        }
+    } while (index < members.size());
+    count(Counter::PRESENCE_SNAPSHOTS);
+}
+
+} // namespace
+
+void presence_join(const std::shared_ptr<ClientInfo>& client) {
+    std::lock_guard<std::mutex> lock(presence_mutex);
+    publish_delta(PRESENCE_JOIN, *client, client.get());
+
+    auto members = std::make_shared<MemberList>(*roster);
+    members->push_back(client);
+    roster = std::move(members);
+    client->listed = true;
+    queue_snapshot(*client);
+}
+
+void presence_leave(ClientInfo& client) {
+    std::lock_guard<std::mutex> lock(presence_mutex);
+    if (!client.listed) {
+        return;
+    }
+    client.listed = false;
+
+    auto members = std::make_shared<MemberList>();
+    members->reserve(roster->size());
+    for (const auto& member : *roster) {
+        if (member.get() != &client) {
+            members->push_back(member);
+        }
+    }
+    roster = std::move(members);
+    publish_delta(PRESENCE_LEAVE, client, nullptr);
+}
+
+void presence_take_over(const std::shared_ptr<ClientInfo>& client, ClientInfo& previous) {
+    std::unique_lock<std::mutex> lock(presence_mutex);
+    if (!previous.listed) {
+        lock.unlock();
+        presence_join(client);
+        return;
+    }
+    previous.listed = false;
+
+    auto members = std::make_shared<MemberList>(*roster);
+    for (auto& member : *members) {
+        if (member.get() == &previous) {
+            member = client;
+        }
+    }
+    roster = std::move(members);
+    client->idle.store(previous.idle.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    client->listed = true;
+}
+
+void presence_set_idle(ClientInfo& client, bool idle) {
+    std::lock_guard<std::mutex> lock(presence_mutex);
+    if (!client.listed || client.idle.load(std::memory_order_relaxed) == idle) {
+        return;
+    }
+    client.idle.store(idle, std::memory_order_relaxed);
+    publish_delta(idle ? PRESENCE_IDLE : PRESENCE_ACTIVE, client, nullptr);
+}
+
+void note_activity(ClientInfo& client) {
+    client.heartbeat.last_active.store(heartbeat_ticks.load(std::memory_order_relaxed),
+                                       std::memory_order_relaxed);
+    if (client.idle.load(std::memory_order_relaxed)) {
+        presence_set_idle(client, false);
+    }
+}
+
+void send_roster(ClientInfo& client, const FrameView& request) {
+    {
+        std::lock_guard<std::mutex> lock(presence_mutex);
+        uint64_t oldest = version - recent.size();   // Version before the first delta kept
+        uint64_t since = request.header.length == sizeof(uint64_t) ? get_u64(request.payload) : UINT64_MAX;
+
+        if (since >= oldest && since <= version) {
+            // Caught up from the log; kept even when the client is slow,
+            // or it would only ask again
+            for (size_t i = since - oldest; i < recent.size(); i++) {
+                if (client.outbound.push(recent[i], false) == OutboundQueue::PushResult::OVERFLOW) {
+                    drop_client(client);
+                    break;
+                }
+            }
+        } else {
+            queue_snapshot(client);
+        }
+    }
+    flush_outbound(client);
+}
+
+uint64_t presence_version() {
+    std::lock_guard<std::mutex> lock(presence_mutex);
+    return version;
+}
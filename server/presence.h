@@ -0,0 +1,60 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+
+#include "../shared/protocol.h"
+
+struct ClientInfo;
+
+// Who is online, kept in sync on every client by versioned deltas.
+//
+// Each change to the roster (someone joins, leaves, goes idle or comes
+// back) bumps the roster version by one and is sent to everyone as one
+// small PRESENCE frame, encoded once. A client gets the whole roster as
+// CLIENT_LIST frames when it joins, and again only when it asks: a client
+// that sees a version gap sends CLIENT_LIST with the last version it
+// applied, and gets the deltas it missed from a bounded log, or a fresh
+// snapshot if they have been forgotten. Deltas are droppable for slow
+// clients for that reason; the gap is noticed and repaired.
+//
+// Payloads (big-endian):
+//   entry:       u64 id | u8 state | u64 connected (unix seconds) |
+//                u8 name length | name | u8 address length | address
+//   CLIENT_LIST: u64 version | u32 entries in all | u32 index of the first
+//                entry here | entries      (split across frames as needed)
+//   PRESENCE:    u64 version | u8 kind | JOIN: entry, otherwise u64 id
+struct PresenceConfig {
+    std::chrono::seconds idle_after{300};   // Without chatting; 0 = never idle
+};
+
+extern PresenceConfig presence_config;
+
+// Deltas kept for clients catching up
+constexpr size_t PRESENCE_LOG_SIZE = 1024;
+
+// Put a newly registered client on the roster: it is sent the snapshot,
+// everyone else the JOIN
+void presence_join(const std::shared_ptr<ClientInfo>& client);
+void presence_leave(ClientInfo& client);
+
+// Give a client that resumed a session the roster entry of the previous
+// one, without a delta; it catches up by asking for what it missed. If the
+// previous connection never got onto the roster, the client joins it.
+void presence_take_over(const std::shared_ptr<ClientInfo>& client, ClientInfo& previous);
+
+// Mark a client idle, or active again
+void presence_set_idle(ClientInfo& client, bool idle);
+
+// Note a request from the client, which makes an idle client active
+void note_activity(ClientInfo& client);
+
+// Answer a CLIENT_LIST request: an empty payload asks for a snapshot, a
+// u64 version for everything after it
+void send_roster(ClientInfo& client, const FrameView& request);
+
+uint64_t presence_version();
+
+#endif
@@ -0,0 +1,1214 @@
+// Event loop server modes (Linux only): edge-triggered epoll, or io_uring
+//
+// Each reactor shard is one thread that owns its sockets. Each connection
+// is a small state machine (waiting for its first frame, chatting, carrying
+// upload chunks, or in the middle of a chunk body). Frames are parsed in
+// place from a per-connection RingBuffer whose storage comes from the slab
+// pools and is released whenever it drains, and chunk bodies are moved to
+// disk by a FileReceiver, so idle clients cost only their bookkeeping
+// structures.
+//
+// With --shards=N there are N shards, each with its own SO_REUSEPORT
+// listening socket, so the kernel spreads new connections across them.
+// A shard writes only to its own clients: chat for members on other shards
+// is handed over as one reference-counted frame per shard through that
+// shard's lock-free inbox, and the owner queues it.
+//
+// The io_uring backend drives the same connection state machine from
+// completions instead of readiness. Each socket has a multishot recv that
+// draws from a shared ring of provided buffers, so a silent client pins no
+// receive memory. Output is not written where it is queued: the owning
+// shard collects the clients with something to send and submits all their
+// sendmsg() operations with one io_uring_enter(). A raw chunk body is moved
+// by linked pairs of an all-or-nothing recv and a positional file write.
+//
+// On epoll, output for clients that negotiated CAP_BATCHING is collected
+// the same way: written at the end of each pass over the ready events, one
+// flush per client however many frames were queued for it meanwhile.
+//
+// Uploads are read at most a scheduling quantum at a time before the shard
+// serves its other connections, and transfers that wait for a bandwidth cap
+// are put aside until their buckets refill: on a list the epoll loop times
+// its waits by, or behind an io_uring timeout. An upload whose data goes
+// through the disk threads is put aside the same way while their queue is
+// full, since a shard never waits for the disk.
+
+#ifdef __linux__
+
+#include <cerrno>
+#include <iostream>
+#include <thread>
+#include <unordered_map>
+
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+
+#include "server.h"
+#include "mpsc_queue.h"
+#include "uring.h"
+
+namespace {
+
+constexpr int MAX_EVENTS = 256;
+
+// io_uring backend sizing, per shard
+constexpr unsigned URING_ENTRIES = 1024;
+constexpr unsigned RECV_BUFFERS = 256;           // Provided buffers shared by every socket
+constexpr size_t RECV_BUFFER_SIZE = 16 * 1024;
+constexpr uint16_t RECV_BUFFER_GROUP = 0;
+constexpr size_t BODY_PIECE_SIZE = 256 * 1024;   // Chunk body bytes per linked recv + write
+
+// How often an upload held back by a full disk queue looks again
+constexpr auto DISK_QUEUE_RETRY = std::chrono::milliseconds(2);
+
+using Clock = std::chrono::steady_clock;
+
+enum class ConnState { AWAIT_LOGIN, CHAT, DATA, CHUNK_BODY };
+
+struct Shard;
+
+struct Connection {
+    Shard* shard;
+    SOCKET socket;
+    std::string ip_address;
+    ConnState state = ConnState::AWAIT_LOGIN;
+    bool data_stream = false;      // Opened with FILE_ATTACH rather than a login
+    RingBuffer input{BUFFER_SIZE, &pool_buffer_storage};
+    std::shared_ptr<ClientInfo> info;
+    std::shared_ptr<Transfer> transfer;
+    std::unique_ptr<FileReceiver> chunk;
+
+    // epoll backend: listed in the shard's resumes, to be served again at
+    // resume_at
+    bool resuming = false;
+    Clock::time_point resume_at;
+
+    bool write_wanted = false;     // Listed in the shard's pending writes
+
+    // io_uring backend
+    unsigned ops_in_flight = 0;    // Submitted operations whose final completion is due
+    bool receiving = false;        // The multishot recv is armed
+    bool cancelling = false;       // ... and being cancelled, to move a chunk body
+    bool writing = false;          // A send, or a wait for POLLOUT, is in flight
+    bool closing = false;          // Closed; reaped once its operations finish
+    std::unique_ptr<AsyncWrite> write;
+    std::unique_ptr<char[]> body;  // Chunk body bytes between their recv and write
+    size_t body_length = 0;
+    bool resume_armed = false;     // A timeout to come back to the connection is in flight
+    bool read_paused = false;      // ... and an upload waits for it before reading on
+    __kernel_timespec resume_time;
+};
+
+// A chat frame for the members of a list that live on one shard, or with
+// no frame, a client of the shard that has output to write (io_uring, or a
+// batching client on epoll)
+struct Forward {
+    FrameRef frame;
+    std::shared_ptr<const MemberList> members;
+    const ClientInfo* except = nullptr;
+    SOCKET flush = INVALID_SOCKET;
+};
+
+struct Shard {
+    int index = 0;
+    int epoll_fd = -1;
+    int wakeup_fd = -1;
+    SOCKET listener = INVALID_SOCKET;
+    FrameParser parser;
+    std::unordered_map<SOCKET, std::unique_ptr<Connection>> connections;
+    std::vector<SOCKET> resumes;             // Connections put aside for a while (epoll)
+    std::vector<SOCKET> due_resumes;
+    std::vector<SOCKET> pending_writes;      // Clients to write to at the end of this pass
+
+    MpscQueue<Forward> inbox;
+    std::atomic<bool> wake_pending{false};   // An eventfd write is already on its way
+    std::thread thread;
+
+    // io_uring backend
+    std::unique_ptr<Uring> ring;
+    std::unique_ptr<BufferRing> buffers;
+    std::vector<std::unique_ptr<AsyncWrite>> spare_writes;
+};
+
+std::vector<std::unique_ptr<Shard>> shards;
+thread_local Shard* this_shard = nullptr;
+bool use_uring = false;
+
+// Markers stored in epoll_event.data.ptr for the non-client descriptors
+char listener_tag;
+char wakeup_tag;
+
+// Have the shard write to one of its clients at the end of the current
+// pass: after the batch of completions (io_uring) or of ready events
+void want_write(Shard& shard, SOCKET socket) {
+    auto it = shard.connections.find(socket);
+    if (it == shard.connections.end()) {
+        return;
+    }
+    Connection* conn = it->second.get();
+    if (!conn->write_wanted && !conn->closing) {
+        conn->write_wanted = true;
+        shard.pending_writes.push_back(socket);
+    }
+}
+
+void wake(Shard& shard) {
+    uint64_t one = 1;
+    ssize_t ignored = write(shard.wakeup_fd, &one, sizeof(one));
+    (void)ignored;
+}
+
+// Queue forwarded frames for this shard's own members
+void drain_inbox(Shard& shard) {
+    uint64_t counter;
+    ssize_t ignored = read(shard.wakeup_fd, &counter, sizeof(counter));
+    (void)ignored;
+    shard.wake_pending.store(false, std::memory_order_release);
+
+    Forward forward;
+    while (shard.inbox.pop(forward)) {
+        if (!forward.frame) {
+            want_write(shard, forward.flush);
+            continue;
+        }
+        for (auto& client : *forward.members) {
+            if (client->shard == shard.index && client.get() != forward.except && client->active) {
+                deliver(*client, forward.frame);
+            }
+        }
+    }
+}
+
+// Let the process hold as many sockets as the hard limit allows
+void raise_fd_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+void cancel_resume(Connection* conn);
+
+void close_connection(Connection* conn) {
+    if (conn->closing) {
+        return;
+    }
+    if (conn->chunk) {
+        // Whatever arrived is kept; the sender resumes after it
+        end_chunk(conn->transfer, *conn->chunk);
+    }
+    if (conn->info && !conn->data_stream) {
+        unregister_client(conn->info);
+    }
+    if (use_uring) {
+        // The kernel may still use the socket and this connection's
+        // buffers; shutting the socket down makes every operation finish
+        conn->closing = true;
+        shutdown(conn->socket, SHUT_RDWR);
+        if (conn->resume_armed) {
+            cancel_resume(conn);
+        }
+        if (conn->ops_in_flight > 0) {
+            return;
+        }
+    }
+    closesocket(conn->socket);
+    conn->shard->connections.erase(conn->socket);
+}
+
+// Free a closing connection once nothing in flight refers to it
+void reap(Connection* conn) {
+    if (conn->ops_in_flight == 0) {
+        closesocket(conn->socket);
+        conn->shard->connections.erase(conn->socket);
+    }
+}
+
+void finish_chunk(Connection* conn);
+
+// Handle one frame in the AWAIT_LOGIN, CHAT or DATA state; returns false
+// when the connection should be closed
+bool handle_frame(Connection* conn, const FrameView& frame) {
+    if (conn->state == ConnState::AWAIT_LOGIN) {
+        if (frame.header.type == FILE_ATTACH) {
+            conn->info = make_client(conn->socket, "Unknown", conn->ip_address);
+            conn->info->shard = conn->shard->index;
+            conn->data_stream = true;
+            conn->state = ConnState::DATA;
+            return attach_stream(conn->info, frame);
+        }
+
+        conn->info = open_chat(frame, conn->socket, conn->ip_address, conn->shard->index);
+        if (!conn->info) {
+            std::cerr << "Error handling client Unknown: Expected HELLO or USERNAME_SET message" << std::endl;
+            return false;
+        }
+        conn->state = ConnState::CHAT;
+        return true;
+    }
+
+    const std::string& username = conn->info->username;
+
+    if (frame.header.type == FILE_CHUNK) {
+        conn->chunk = begin_chunk(frame, conn->transfer);
+        if (!conn->chunk) {
+            std::cerr << "Error handling client " << username << ": Chunk outside its file" << std::endl;
+            return false;
+        }
+        conn->state = ConnState::CHUNK_BODY;
+        if (conn->chunk->complete()) {
+            finish_chunk(conn);
+        }
+    }
+    else if (frame.header.type == DISCONNECT) {
+        if (!conn->data_stream) {
+            std::cout << "Client " << username << " disconnecting gracefully" << std::endl;
+            conn->info->leaving = true;
+        }
+        return false;
+    }
+    else if (conn->state == ConnState::DATA) {
+        std::cerr << "Error on upload stream from " << username << ": Unexpected frame on a data stream" << std::endl;
+        return false;
+    }
+
+    if (frame.header.type != PING) {
+        note_activity(*conn->info);
+    }
+    if (frame.header.type == MESSAGE) {
+        post_message(*conn->info, frame.view());
+    }
+    else if (frame.header.type == FILE_DOWNLOAD) {
+        if (!start_download(*conn->info, frame)) {
+            std::cerr << "Error handling client " << username << ": Malformed download request" << std::endl;
+            return false;
+        }
+    }
+    else if (frame.header.type == STATS) {
+        send_stats(*conn->info);
+    }
+    else if (frame.header.type == ROOM_JOIN) {
+        change_room(conn->info, frame);
+    }
+    else if (frame.header.type == PING) {
+        handle_ping(*conn->info, frame);
+    }
+    else if (frame.header.type == CLIENT_LIST) {
+        send_roster(*conn->info, frame);
+    }
+    else if (frame.header.type == PEER_OFFER) {
+        if (!offer_peer_transfer(conn->info, frame)) {
+            std::cerr << "Error handling client " << username << ": Malformed file offer" << std::endl;
+            return false;
+        }
+    }
+    else if (frame.header.type == PEER_RELAY) {
+        if (!relay_peer_transfer(*conn->info, frame)) {
+            std::cerr << "Error handling client " << username << ": Malformed relay request" << std::endl;
+            return false;
+        }
+    }
+    else if (frame.header.type == FILE_TRANSFER) {
+        std::string filename;
+        int64_t file_size;
+        uint64_t content_hash;
+        if (!parse_file_header(frame, filename, file_size, content_hash)) {
+            std::cerr << "Error handling client " << username << ": Malformed file header" << std::endl;
+            return false;
+        }
+        return offer_transfer(conn->info, filename, file_size, content_hash, frame.header.stream);
+    }
+    return true;
+}
+
+// Account for a chunk once its last byte has been written
+void finish_chunk(Connection* conn) {
+    std::unique_ptr<FileReceiver> chunk = std::move(conn->chunk);
+    std::shared_ptr<Transfer> transfer = std::move(conn->transfer);
+    conn->state = conn->data_stream ? ConnState::DATA : ConnState::CHAT;
+    end_chunk(transfer, *chunk);
+}
+
+// Parse and handle every complete frame in the connection's buffer; stops
+// early when a frame switches the connection into CHUNK_BODY
+bool process_input(Connection* conn) {
+    FrameView frame;
+    while (conn->state != ConnState::CHUNK_BODY) {
+        ParseResult result = conn->shard->parser.next(conn->input, frame);
+        if (result == ParseResult::NEED_MORE) {
+            return true;
+        }
+        if (result == ParseResult::INVALID) {
+            std::cerr << "Malformed frame from " << conn->ip_address << std::endl;
+            return false;
+        }
+        count_frame_in(frame.header.type);
+        if (!handle_frame(conn, frame)) {
+            return false;
+        }
+    }
+
+    // Body bytes that arrived behind the header
+    size_t buffered = std::min<int64_t>(conn->input.size(), conn->chunk->remaining());
+    if (buffered > 0) {
+        conn->chunk->write(conn->input.data(), buffered);
+        conn->input.consume(buffered);
+        charge_transfer(*conn->info, buffered);
+        if (conn->chunk->complete()) {
+            finish_chunk(conn);
+        }
+        return process_input(conn);
+    }
+    return true;
+}
+
+// Serve a connection again after delay: an upload that has had its turn or
+// waits for its bandwidth cap, or a download held back by the cap (epoll)
+void resume_after(Connection* conn, Clock::duration delay) {
+    Clock::time_point when = Clock::now() + delay;
+    if (conn->resuming) {
+        conn->resume_at = std::min(conn->resume_at, when);
+        return;
+    }
+    conn->resuming = true;
+    conn->resume_at = when;
+    conn->shard->resumes.push_back(conn->socket);
+}
+
+// Drain the socket until it would block, or until a quantum has been read
+// so the shard's other connections get their turn; returns false to close
+// it
+bool on_readable(Connection* conn) {
+    size_t budget = shaping_config.quantum;
+    while (true) {
+        if (budget == 0) {
+            resume_after(conn, Clock::duration::zero());
+            return true;
+        }
+
+        ssize_t bytes_received;
+        if (conn->state == ConnState::CHUNK_BODY) {
+            if (shaping_enabled()) {
+                Clock::duration delay = transfer_delay(*conn->info);
+                if (delay > Clock::duration::zero()) {
+                    count(Counter::TRANSFER_WAITS);
+                    resume_after(conn, delay);
+                    return true;
+                }
+            }
+            if (disk_queue_full()) {
+                count(Counter::DISK_QUEUE_WAITS);
+                resume_after(conn, DISK_QUEUE_RETRY);
+                return true;
+            }
+            bytes_received = conn->chunk->receive(conn->socket, budget);
+            if (bytes_received > 0) {
+                count(Counter::BYTES_IN, bytes_received);
+                charge_transfer(*conn->info, bytes_received);
+                if (conn->chunk->complete()) {
+                    finish_chunk(conn);
+                }
+            }
+        } else {
+            conn->input.prepare();
+            bytes_received = recv(conn->socket, conn->input.write_ptr(),
+                                  conn->input.writable(), 0);
+            if (bytes_received > 0) {
+                count(Counter::BYTES_IN, bytes_received);
+                conn->input.commit(bytes_received);
+                if (!process_input(conn)) {
+                    return false;
+                }
+            }
+        }
+
+        if (bytes_received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn->input.release();
+                return true;
+            }
+            return false;
+        }
+        if (bytes_received == 0) {
+            return false;
+        }
+
+        budget -= std::min<size_t>(budget, bytes_received);
+        if (conn->info) {
+            conn->info->heartbeat.heard();
+            if (!conn->info->active) {
+                return false;
+            }
+        }
+    }
+}
+
+// Come back to a download its bandwidth cap holds back once the buckets
+// have refilled (epoll)
+void watch_downloads(Connection* conn) {
+    ClientInfo& client = *conn->info;
+    if (client.outbound.empty() && downloads_waiting(client)) {
+        resume_after(conn, transfer_delay(client));
+    }
+}
+
+// How long epoll_wait() may sleep before a connection is due again
+int resume_timeout(const Shard& shard) {
+    if (!shard.pending_writes.empty()) {
+        return 0;   // Queued while writing the last batch
+    }
+    if (shard.resumes.empty()) {
+        return -1;
+    }
+    Clock::time_point first = Clock::time_point::max();
+    for (SOCKET socket : shard.resumes) {
+        auto it = shard.connections.find(socket);
+        if (it != shard.connections.end() && it->second->resuming) {
+            first = std::min(first, it->second->resume_at);
+        }
+    }
+    if (first == Clock::time_point::max()) {
+        return 0;   // Only stale entries, cleared by serve_resumes()
+    }
+    auto wait = std::chrono::ceil<std::chrono::milliseconds>(first - Clock::now());
+    return static_cast<int>(std::max<int64_t>(wait.count(), 0));
+}
+
+// Serve the connections that are due again, in the order they were put
+// aside
+void serve_resumes(Shard& shard) {
+    Clock::time_point now = Clock::now();
+    std::vector<SOCKET> waiting;
+    waiting.swap(shard.resumes);
+    for (SOCKET socket : waiting) {
+        auto it = shard.connections.find(socket);
+        if (it == shard.connections.end() || !it->second->resuming) {
+            continue;
+        }
+        if (it->second->resume_at > now) {
+            shard.resumes.push_back(socket);
+        } else {
+            shard.due_resumes.push_back(socket);
+        }
+    }
+
+    for (SOCKET socket : shard.due_resumes) {
+        auto it = shard.connections.find(socket);
+        if (it == shard.connections.end()) {
+            continue;
+        }
+        Connection* conn = it->second.get();
+        conn->resuming = false;
+        bool keep = !conn->info || flush_outbound(*conn->info);
+        if (keep) {
+            keep = on_readable(conn);
+        }
+        if (keep && conn->info && shaping_enabled()) {
+            watch_downloads(conn);
+        }
+        if (!keep) {
+            close_connection(conn);
+        }
+    }
+    shard.due_resumes.clear();
+}
+
+// Start tracking a newly accepted socket
+Connection* adopt(Shard& shard, SOCKET client_socket) {
+    // Chat lines are small; don't let Nagle hold them back
+    int opt = 1;
+    setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    limit_unsent(client_socket);
+
+    auto conn = std::make_unique<Connection>();
+    conn->shard = &shard;
+    conn->socket = client_socket;
+    conn->ip_address = get_client_ip(client_socket);
+
+    Connection* adopted = conn.get();
+    shard.connections[client_socket] = std::move(conn);
+    return adopted;
+}
+
+void accept_connections(Shard& shard) {
+    while (true) {
+        SOCKET client_socket = accept4(shard.listener, nullptr, nullptr,
+                                       SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket == INVALID_SOCKET) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                std::cerr << "Accept failed: " << get_socket_error() << std::endl;
+            }
+            return;
+        }
+
+        Connection* conn = adopt(shard, client_socket);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(shard.epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+            std::cerr << "epoll_ctl failed: " << get_socket_error() << std::endl;
+            closesocket(client_socket);
+            shard.connections.erase(client_socket);
+        }
+    }
+}
+
+// Another listening socket on the server's port, for shards after the
+// first
+SOCKET open_listener() {
+    SOCKET listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (listener == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+    int opt = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, SOMAXCONN) < 0) {
+        closesocket(listener);
+        return INVALID_SOCKET;
+    }
+    return listener;
+}
+
+void run_shard(Shard& shard) {
+    this_shard = &shard;
+    never_wait_for_disk();
+    struct epoll_event events[MAX_EVENTS];
+    std::vector<SOCKET> writes;
+
+    while (server_running) {
+        int count = epoll_wait(shard.epoll_fd, events, MAX_EVENTS, resume_timeout(shard));
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "epoll_wait failed: " << get_socket_error() << std::endl;
+            server_running = false;
+            request_reactor_stop();
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            void* tag = events[i].data.ptr;
+
+            if (tag == &listener_tag) {
+                accept_connections(shard);
+                continue;
+            }
+            if (tag == &wakeup_tag) {
+                drain_inbox(shard);
+                continue;
+            }
+
+            Connection* conn = static_cast<Connection*>(tag);
+            uint32_t mask = events[i].events;
+            bool keep = true;
+
+            if (mask & (EPOLLERR | EPOLLHUP)) {
+                keep = false;
+            }
+            if (keep && (mask & EPOLLOUT) && conn->info) {
+                keep = flush_outbound(*conn->info);
+            }
+            if (keep && (mask & (EPOLLIN | EPOLLRDHUP))) {
+                keep = on_readable(conn);
+            }
+            if (keep && conn->info && shaping_enabled()) {
+                watch_downloads(conn);
+            }
+
+            if (!keep) {
+                close_connection(conn);
+            }
+        }
+        serve_resumes(shard);
+
+        // Batching clients get everything queued for them during the pass
+        // in one go
+        writes.swap(shard.pending_writes);
+        for (SOCKET socket : writes) {
+            auto it = shard.connections.find(socket);
+            if (it == shard.connections.end() || !it->second->info) {
+                continue;
+            }
+            Connection* conn = it->second.get();
+            conn->write_wanted = false;
+            if (!write_outbound(*conn->info)) {
+                close_connection(conn);
+            } else if (shaping_enabled()) {
+                watch_downloads(conn);
+            }
+        }
+        writes.clear();
+    }
+
+    // Sockets are closed by main() through the client registry; drop the rest
+    for (auto& entry : shard.connections) {
+        if (!entry.second->info || entry.second->data_stream) {
+            closesocket(entry.first);
+        }
+    }
+    shard.connections.clear();
+}
+
+// io_uring backend. Every submission carries the connection (or shard) it
+// belongs to in user_data, with the operation in the low bits.
+// Connections and shards come from new, which aligns them to 16 bytes.
+enum class Op : uint64_t { RECV, SEND, POLL_OUT, BODY_RECV, BODY_WRITE, ACCEPT, WAKEUP, RESUME, IGNORE };
+constexpr uint64_t OP_MASK = 15;
+
+uint64_t tag(const void* owner, Op op) {
+    return reinterpret_cast<uint64_t>(owner) | static_cast<uint64_t>(op);
+}
+
+void arm_accept(Shard& shard) {
+    io_uring_sqe* sqe = shard.ring->get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = shard.listener;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = tag(&shard, Op::ACCEPT);
+}
+
+void arm_wakeup(Shard& shard) {
+    io_uring_sqe* sqe = shard.ring->get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = shard.wakeup_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = tag(&shard, Op::WAKEUP);
+}
+
+void arm_recv(Connection* conn) {
+    io_uring_sqe* sqe = conn->shard->ring->get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = conn->shard->buffers->group();
+    sqe->user_data = tag(conn, Op::RECV);
+    conn->receiving = true;
+    conn->ops_in_flight++;
+}
+
+// Stop the multishot recv so the rest of a chunk body can go straight to
+// the file; its final completion says when it has stopped
+void cancel_recv(Connection* conn) {
+    if (!conn->receiving || conn->cancelling) {
+        return;
+    }
+    io_uring_sqe* sqe = conn->shard->ring->get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = tag(conn, Op::RECV);
+    sqe->user_data = tag(nullptr, Op::IGNORE);
+    conn->cancelling = true;
+}
+
+// Receive the next piece of a raw chunk body and write it to the file. The
+// recv only completes once the whole piece is in, so the write can be
+// linked to it. Exactly one of them reports back: the write, or the recv
+// if it fell short, which cancels the write without a completion.
+void queue_body(Connection* conn) {
+    Uring& ring = *conn->shard->ring;
+    if (!conn->body) {
+        conn->body.reset(new char[BODY_PIECE_SIZE]);
+    }
+    size_t piece = shaping_enabled() ? std::min(BODY_PIECE_SIZE, shaping_config.quantum) : BODY_PIECE_SIZE;
+    conn->body_length = static_cast<size_t>(std::min<int64_t>(conn->chunk->remaining(), piece));
+
+    io_uring_sqe* sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->socket;
+    sqe->addr = reinterpret_cast<uint64_t>(conn->body.get());
+    sqe->len = static_cast<uint32_t>(conn->body_length);
+    sqe->msg_flags = MSG_WAITALL;
+    sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = tag(conn, Op::BODY_RECV);
+
+    sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = conn->chunk->raw_fd();
+    sqe->addr = reinterpret_cast<uint64_t>(conn->body.get());
+    sqe->len = static_cast<uint32_t>(conn->body_length);
+    sqe->off = static_cast<uint64_t>(conn->chunk->position());
+    sqe->user_data = tag(conn, Op::BODY_WRITE);
+    conn->ops_in_flight++;
+}
+
+bool direct_body(const Connection* conn) {
+    return conn->state == ConnState::CHUNK_BODY && conn->chunk->raw_fd() >= 0;
+}
+
+// Come back to the connection after delay, for transfers that wait for
+// their bandwidth cap
+void arm_resume(Connection* conn, Clock::duration delay) {
+    if (conn->resume_armed) {
+        return;
+    }
+    int64_t ns = std::max<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(delay).count(), 1);
+    conn->resume_time.tv_sec = ns / 1000000000;
+    conn->resume_time.tv_nsec = ns % 1000000000;
+
+    io_uring_sqe* sqe = conn->shard->ring->get_sqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = reinterpret_cast<uint64_t>(&conn->resume_time);
+    sqe->len = 1;
+    sqe->user_data = tag(conn, Op::RESUME);
+    conn->resume_armed = true;
+    conn->ops_in_flight++;
+}
+
+void cancel_resume(Connection* conn) {
+    io_uring_sqe* sqe = conn->shard->ring->get_sqe();
+    sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+    sqe->addr = tag(conn, Op::RESUME);
+    sqe->user_data = tag(nullptr, Op::IGNORE);
+}
+
+// True while the connection is in a chunk body that has to wait for its
+// bandwidth cap
+bool body_throttled(Connection* conn) {
+    return conn->state == ConnState::CHUNK_BODY && shaping_enabled() &&
+           transfer_delay(*conn->info) > Clock::duration::zero();
+}
+
+// True while the connection is in a chunk body and the disk threads have a
+// full queue. A raw body is written here, but the multishot recv queues
+// whatever it brought in before it was cancelled, and it is the same disk.
+bool body_backlogged(Connection* conn) {
+    return conn->state == ConnState::CHUNK_BODY && disk_queue_full();
+}
+
+void continue_reading(Connection* conn) {
+    if (body_throttled(conn)) {
+        count(Counter::TRANSFER_WAITS);
+        conn->read_paused = true;
+        arm_resume(conn, transfer_delay(*conn->info));
+    } else if (body_backlogged(conn)) {
+        count(Counter::DISK_QUEUE_WAITS);
+        conn->read_paused = true;
+        arm_resume(conn, DISK_QUEUE_RETRY);
+    } else if (direct_body(conn)) {
+        queue_body(conn);
+    } else {
+        arm_recv(conn);
+    }
+}
+
+// Feed bytes from a provided buffer through the connection's state
+// machine; false when the connection should be closed
+bool consume_received(Connection* conn, const char* data, size_t len) {
+    count(Counter::BYTES_IN, len);
+    if (conn->info) {
+        conn->info->heartbeat.heard();
+    }
+    while (len > 0) {
+        if (conn->state == ConnState::CHUNK_BODY) {
+            // process_input() leaves nothing buffered in this state
+            size_t take = std::min<int64_t>(len, conn->chunk->remaining());
+            conn->chunk->write(data, take);
+            charge_transfer(*conn->info, take);
+            data += take;
+            len -= take;
+            if (conn->chunk->complete()) {
+                finish_chunk(conn);
+            }
+            continue;
+        }
+        conn->input.prepare();
+        size_t take = std::min(len, conn->input.writable());
+        std::memcpy(conn->input.write_ptr(), data, take);
+        conn->input.commit(take);
+        data += take;
+        len -= take;
+        if (!process_input(conn)) {
+            return false;
+        }
+    }
+    conn->input.release();
+    return !conn->info || conn->info->active;
+}
+
+// Submit the next write of the client's queued output, topping the queue
+// up from its pending downloads
+void start_write(Connection* conn) {
+    if (conn->writing || conn->closing || !conn->info) {
+        return;
+    }
+    Shard& shard = *conn->shard;
+    ClientInfo& client = *conn->info;
+    if (!conn->write) {
+        if (shard.spare_writes.empty()) {
+            conn->write = std::make_unique<AsyncWrite>();
+        } else {
+            conn->write = std::move(shard.spare_writes.back());
+            shard.spare_writes.pop_back();
+        }
+    }
+
+    while (true) {
+        switch (client.outbound.prepare_write(*conn->write)) {
+        case OutboundQueue::WriteSetup::EMPTY:
+            if (feed_download(client)) {
+                continue;
+            }
+            if (shaping_enabled() && downloads_waiting(client)) {
+                arm_resume(conn, transfer_delay(client));
+            }
+            shard.spare_writes.push_back(std::move(conn->write));
+            return;
+
+        case OutboundQueue::WriteSetup::READY: {
+            io_uring_sqe* sqe = shard.ring->get_sqe();
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = conn->socket;
+            sqe->addr = reinterpret_cast<uint64_t>(&conn->write->message);
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            sqe->user_data = tag(conn, Op::SEND);
+            conn->writing = true;
+            conn->ops_in_flight++;
+            return;
+        }
+
+        case OutboundQueue::WriteSetup::SYNC:
+            // An unmapped file range goes out with sendfile(); wait for
+            // room whenever the socket fills up
+            switch (client.outbound.flush(conn->socket)) {
+            case OutboundQueue::FlushResult::DRAINED:
+                continue;
+            case OutboundQueue::FlushResult::FAILED:
+                drop_client(client);
+                return;
+            case OutboundQueue::FlushResult::PENDING: {
+                io_uring_sqe* sqe = shard.ring->get_sqe();
+                sqe->opcode = IORING_OP_POLL_ADD;
+                sqe->fd = conn->socket;
+                sqe->poll32_events = POLLOUT;
+                sqe->user_data = tag(conn, Op::POLL_OUT);
+                conn->writing = true;
+                conn->ops_in_flight++;
+                return;
+            }
+            }
+        }
+    }
+}
+
+void on_connection_completion(Connection* conn, Op op, const io_uring_cqe& cqe) {
+    int result = cqe.res;
+
+    switch (op) {
+    case Op::RECV: {
+        bool keep = true;
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            uint16_t id = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            if (result > 0 && !conn->closing) {
+                keep = consume_received(conn, conn->shard->buffers->data(id), result);
+            }
+            conn->shard->buffers->recycle(id);
+        }
+        if (cqe.flags & IORING_CQE_F_MORE) {
+            if (!keep) {
+                close_connection(conn);
+            } else if (direct_body(conn) || body_throttled(conn) || body_backlogged(conn)) {
+                cancel_recv(conn);
+            }
+            return;
+        }
+
+        conn->receiving = false;
+        conn->cancelling = false;
+        conn->ops_in_flight--;
+        if (conn->closing) {
+            reap(conn);
+        } else if (!keep || result == 0 ||
+                   (result < 0 && result != -ENOBUFS && result != -ECANCELED)) {
+            close_connection(conn);
+        } else {
+            continue_reading(conn);
+        }
+        return;
+    }
+
+    case Op::BODY_RECV:
+        // The piece fell short because the peer closed or failed; keep
+        // what did arrive
+        conn->ops_in_flight--;
+        if (conn->closing) {
+            reap(conn);
+            return;
+        }
+        if (result > 0) {
+            count(Counter::BYTES_IN, result);
+            conn->chunk->write(conn->body.get(), result);
+        }
+        close_connection(conn);
+        return;
+
+    case Op::BODY_WRITE:
+        conn->ops_in_flight--;
+        if (conn->closing) {
+            reap(conn);
+            return;
+        }
+        if (result != static_cast<int>(conn->body_length)) {
+            std::cerr << "Upload write failed: "
+                      << (result < 0 ? strerror(-result) : "short write") << std::endl;
+        }
+        count(Counter::BYTES_IN, conn->body_length);
+        charge_transfer(*conn->info, conn->body_length);
+        conn->info->heartbeat.heard();
+        conn->chunk->received_elsewhere(conn->body_length, result == static_cast<int>(conn->body_length));
+        if (conn->chunk->complete()) {
+            finish_chunk(conn);
+        }
+        continue_reading(conn);
+        return;
+
+    case Op::SEND:
+        conn->ops_in_flight--;
+        conn->writing = false;
+        conn->info->outbound.complete_write(*conn->write, result);
+        conn->shard->spare_writes.push_back(std::move(conn->write));
+        if (conn->closing) {
+            reap(conn);
+        } else if (result <= 0) {
+            close_connection(conn);
+        } else {
+            start_write(conn);
+        }
+        return;
+
+    case Op::POLL_OUT:
+        conn->ops_in_flight--;
+        conn->writing = false;
+        if (conn->closing) {
+            reap(conn);
+        } else {
+            start_write(conn);
+        }
+        return;
+
+    case Op::RESUME:
+        conn->ops_in_flight--;
+        conn->resume_armed = false;
+        if (conn->closing) {
+            reap(conn);
+            return;
+        }
+        if (conn->read_paused) {
+            conn->read_paused = false;
+            continue_reading(conn);
+        }
+        start_write(conn);
+        return;
+
+    default:
+        return;
+    }
+}
+
+void on_completion(Shard& shard, const io_uring_cqe& cqe) {
+    Op op = static_cast<Op>(cqe.user_data & OP_MASK);
+    void* owner = reinterpret_cast<void*>(cqe.user_data & ~OP_MASK);
+    bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+
+    switch (op) {
+    case Op::ACCEPT:
+        if (cqe.res >= 0) {
+            arm_recv(adopt(shard, cqe.res));
+        } else if (cqe.res != -ECANCELED) {
+            std::cerr << "Accept failed: " << strerror(-cqe.res) << std::endl;
+        }
+        if (!more && server_running) {
+            arm_accept(shard);
+        }
+        return;
+
+    case Op::WAKEUP:
+        drain_inbox(shard);
+        if (!more && server_running) {
+            arm_wakeup(shard);
+        }
+        return;
+
+    case Op::IGNORE:
+        return;
+
+    default:
+        on_connection_completion(static_cast<Connection*>(owner), op, cqe);
+    }
+}
+
+void run_uring_shard(Shard& shard) {
+    this_shard = &shard;
+    never_wait_for_disk();
+
+    // Rings are created by the thread that submits to them
+    shard.ring = std::make_unique<Uring>();
+    shard.buffers = std::make_unique<BufferRing>();
+    if (!shard.ring->init(URING_ENTRIES) ||
+        !shard.buffers->init(*shard.ring, RECV_BUFFER_GROUP, RECV_BUFFERS, RECV_BUFFER_SIZE)) {
+        std::cerr << "io_uring setup failed: " << strerror(errno) << std::endl;
+        server_running = false;
+        request_reactor_stop();
+        return;
+    }
+
+    arm_accept(shard);
+    arm_wakeup(shard);
+    std::vector<SOCKET> writes;
+
+    while (server_running) {
+        int result = shard.ring->submit(1);
+        if (result < 0 && result != -EINTR && result != -EBUSY) {
+            std::cerr << "io_uring_enter failed: " << strerror(-result) << std::endl;
+            server_running = false;
+            request_reactor_stop();
+            break;
+        }
+
+        shard.ring->for_each_cqe([&shard](const io_uring_cqe& cqe) { on_completion(shard, cqe); });
+
+        // Everything queued while handling the batch goes out with the next
+        // submission
+        writes.swap(shard.pending_writes);
+        for (SOCKET socket : writes) {
+            auto it = shard.connections.find(socket);
+            if (it != shard.connections.end()) {
+                it->second->write_wanted = false;
+                start_write(it->second.get());
+            }
+        }
+        writes.clear();
+    }
+
+    // Tearing down the ring cancels whatever is still in flight
+    shard.buffers.reset();
+    shard.ring.reset();
+    for (auto& entry : shard.connections) {
+        if (!entry.second->info || entry.second->data_stream) {
+            closesocket(entry.first);
+        }
+    }
+    shard.connections.clear();
+}
+
+} // namespace
+
+int current_shard() {
+    return this_shard && shards.size() > 1 ? this_shard->index : -1;
+}
+
+void forward_to_shards(uint64_t targets, const FrameRef& frame,
+                       const std::shared_ptr<const MemberList>& members, const ClientInfo* except) {
+    for (auto& shard : shards) {
+        if (!(targets & (uint64_t{1} << shard->index))) {
+            continue;
+        }
+        shard->inbox.push(Forward{frame, members, except});
+        if (!shard->wake_pending.exchange(true, std::memory_order_acq_rel)) {
+            wake(*shard);
+        }
+    }
+}
+
+bool defer_write(ClientInfo& client) {
+    if ((!use_uring && !(client.capabilities & CAP_BATCHING)) ||
+        client.shard >= static_cast<int>(shards.size())) {
+        return false;
+    }
+    Shard& owner = *shards[client.shard];
+    if (this_shard == &owner) {
+        want_write(owner, client.socket);
+    } else {
+        owner.inbox.push(Forward{FrameRef(), nullptr, nullptr, client.socket});
+        if (!owner.wake_pending.exchange(true, std::memory_order_acq_rel)) {
+            wake(owner);
+        }
+    }
+    return true;
+}
+
+void request_reactor_stop() {
+    for (auto& shard : shards) {
+        if (shard->wakeup_fd >= 0) {
+            wake(*shard);
+        }
+    }
+}
+
+void run_reactor_server(SOCKET server_socket, int shard_count, bool uring) {
+    raise_fd_limit();
+    use_uring = uring;
+
+    for (int i = 0; i < shard_count; i++) {
+        auto shard = std::make_unique<Shard>();
+        shard->index = i;
+        shard->listener = i == 0 ? server_socket : open_listener();
+        shard->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (shard->listener == INVALID_SOCKET || shard->wakeup_fd < 0) {
+            throw std::runtime_error("Reactor setup failed: " + get_socket_error());
+        }
+        set_nonblocking(shard->listener);
+        if (uring) {
+            shards.push_back(std::move(shard));
+            continue;
+        }
+
+        shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (shard->epoll_fd < 0) {
+            throw std::runtime_error("epoll setup failed: " + get_socket_error());
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = &listener_tag;
+        epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->listener, &ev);
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = &wakeup_tag;
+        epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->wakeup_fd, &ev);
+
+        shards.push_back(std::move(shard));
+    }
+
+    // The first shard runs on this thread
+    auto run = uring ? run_uring_shard : run_shard;
+    for (size_t i = 1; i < shards.size(); i++) {
+        shards[i]->thread = std::thread(run, std::ref(*shards[i]));
+    }
+    run(*shards[0]);
+
+    for (auto& shard : shards) {
+        if (shard->thread.joinable()) {
+            shard->thread.join();
+        }
+        if (shard->listener != server_socket) {
+            closesocket(shard->listener);
+        }
+        close(shard->wakeup_fd);
+        if (shard->epoll_fd >= 0) {
+            close(shard->epoll_fd);
+        }
+    }
+    shards.clear();
+    use_uring = false;
+}
+
+#endif
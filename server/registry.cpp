@@ -0,0 +1,201 @@
+#include "registry.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <mutex>
+#include <unordered_map>
+
+#include "server.h"
+
+namespace {
+
+// Padded so shards busy on different cores don't share a cache line
+struct alignas(64) RegistryShard {
+    std::mutex mutex;
+    MemberList clients;
+};
+
+struct alignas(64) DirectoryShard {
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<Room>> rooms;
+};
+
+RegistryShard registry[REGISTRY_SHARDS];
+DirectoryShard directory[ROOM_DIRECTORY_SHARDS];
+std::atomic<uint64_t> next_client_id{1};
+std::atomic<size_t> registered{0};
+std::atomic<size_t> rooms_open{0};
+
+RegistryShard& shard_of(const ClientInfo& client) {
+    return registry[client.id % REGISTRY_SHARDS];
+}
+
+DirectoryShard& shard_of(const std::string& room) {
+    return directory[std::hash<std::string>()(room) % ROOM_DIRECTORY_SHARDS];
+}
+
+} // namespace
+
+std::shared_ptr<const MemberList> Room::post(const FrameRef& frame) {
+    std::lock_guard<std::mutex> lock(history_mutex_);
+    History::Clock::time_point now = History::Clock::now();
+    log_chat(log_buffer_, name_, frame, now);
+    history_.append(frame->data(), frame->size(), now);
+    return members();
+}
+
+void Room::restore() {
+    std::lock_guard<std::mutex> lock(history_mutex_);
+    read_chat_log(name_, [this](const char* frame, size_t length, History::Clock::time_point when) {
+        history_.append(frame, length, when);
+    });
+}
+
+void Room::publish(std::shared_ptr<const MemberList> members, ClientInfo* newcomer,
+                   History::Clock::time_point since) {
+    std::lock_guard<std::mutex> lock(history_mutex_);
+    std::atomic_store(&members_, std::move(members));
+    if (newcomer) {
+        FrameRef replay = history_.replay(History::Clock::now(), since);
+        if (replay) {
+            newcomer->outbound.push(replay);
+        }
+    }
+}
+
+void add_client(const std::shared_ptr<ClientInfo>& client) {
+    if (client->id == 0) {
+        client->id = next_client_id++;
+    }
+    RegistryShard& shard = shard_of(*client);
+
+    TimedLock lock(shard.mutex, Histogram::REGISTRY_LOCK_WAIT_NS);
+    client->registry_index = shard.clients.size();
+    shard.clients.push_back(client);
+    registered++;
+}
+
+void remove_client(ClientInfo& client) {
+    RegistryShard& shard = shard_of(client);
+
+    TimedLock lock(shard.mutex, Histogram::REGISTRY_LOCK_WAIT_NS);
+    size_t index = client.registry_index;
+    if (index >= shard.clients.size() || shard.clients[index].get() != &client) {
+        return;
+    }
+    if (index + 1 != shard.clients.size()) {
+        shard.clients[index] = std::move(shard.clients.back());
+        shard.clients[index]->registry_index = index;
+    }
+    shard.clients.pop_back();
+    registered--;
+}
+
+size_t client_count() {
+    return registered;
+}
+
+void for_each_client(const std::function<void(ClientInfo&)>& f) {
+    for (RegistryShard& shard : registry) {
+        TimedLock lock(shard.mutex, Histogram::REGISTRY_LOCK_WAIT_NS);
+        for (auto& client : shard.clients) {
+            f(*client);
+        }
+    }
+}
+
+std::shared_ptr<ClientInfo> find_client(const std::string& username, const ClientInfo* except) {
+    for (RegistryShard& shard : registry) {
+        TimedLock lock(shard.mutex, Histogram::REGISTRY_LOCK_WAIT_NS);
+        for (auto& client : shard.clients) {
+            if (client.get() != except && client->active && client->username == username) {
+                return client;
+            }
+        }
+    }
+    return nullptr;
+}
+
+bool valid_room_name(const std::string& name) {
+    if (name.size() < 2 || name.size() > MAX_ROOM_NAME_LENGTH || name[0] != '#') {
+        return false;
+    }
+    return std::all_of(name.begin() + 1, name.end(), [](unsigned char c) {
+        return std::isalnum(c) || c == '-' || c == '_';
+    });
+}
+
+std::shared_ptr<Room> join_room(const std::shared_ptr<ClientInfo>& client, const std::string& name,
+                                bool replay) {
+    if (client->room && client->room->name() == name) {
+        return client->room;
+    }
+    leave_room(*client);
+
+    DirectoryShard& shard = shard_of(name);
+    TimedLock lock(shard.mutex, Histogram::REGISTRY_LOCK_WAIT_NS);
+
+    std::shared_ptr<Room>& room = shard.rooms[name];
+    if (!room) {
+        room = std::make_shared<Room>(name);
+        room->restore();
+        rooms_open++;
+    }
+
+    auto members = std::make_shared<MemberList>(*room->members());
+    members->push_back(client);
+    room->publish(std::move(members), replay ? client.get() : nullptr);
+    client->room = room;
+    return room;
+}
+
+void leave_room(ClientInfo& client) {
+    std::shared_ptr<Room> room = std::move(client.room);
+    if (!room) {
+        return;
+    }
+
+    DirectoryShard& shard = shard_of(room->name());
+    TimedLock lock(shard.mutex, Histogram::REGISTRY_LOCK_WAIT_NS);
+
+    auto members = std::make_shared<MemberList>();
+    const MemberList& current = *room->members();
+    members->reserve(current.size());
+    for (const auto& member : current) {
+        if (member.get() != &client) {
+            members->push_back(member);
+        }
+    }
+
+    if (members->empty() && room->name() != DEFAULT_ROOM) {
+        shard.rooms.erase(room->name());
+        rooms_open--;
+    }
+    room->publish(std::move(members));
+}
+
+void take_over_room(const std::shared_ptr<ClientInfo>& client, ClientInfo& previous,
+                    History::Clock::time_point since) {
+    std::shared_ptr<Room> room = std::move(previous.room);
+    if (!room) {
+        join_room(client, DEFAULT_ROOM);
+        return;
+    }
+
+    DirectoryShard& shard = shard_of(room->name());
+    TimedLock lock(shard.mutex, Histogram::REGISTRY_LOCK_WAIT_NS);
+
+    auto members = std::make_shared<MemberList>(*room->members());
+    for (auto& member : *members) {
+        if (member.get() == &previous) {
+            member = client;
+        }
+    }
+    room->publish(std::move(members), client.get(), since);
+    client->room = std::move(room);
+}
+
+size_t room_count() {
+    return rooms_open;
+}
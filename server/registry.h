@@ -0,0 +1,112 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "chat_log.h"
+#include "history.h"
+
+struct ClientInfo;
+
+// Connected clients and the rooms they chat in.
+//
+// The client registry is split into shards by client ID, each behind its
+// own lock, so arrivals and departures on different shards never wait for
+// each other. Every client remembers its slot in the shard and is removed
+// by swapping in the shard's last entry, not by searching.
+//
+// A room publishes its members as an immutable list. A message is fanned
+// out from whatever list is current without taking any lock; joining or
+// leaving copies the list and publishes the new one (read-copy-update),
+// so both cost time proportional to the room, not to the whole server.
+// Rooms are found through a directory that is lock-striped by name.
+//
+// Each room also remembers its recent chat (see History), which someone
+// joining the room is sent before anything else. Chat is also written to
+// the durable chat log, which a new room's history is loaded from.
+
+constexpr size_t REGISTRY_SHARDS = 16;
+constexpr size_t ROOM_DIRECTORY_SHARDS = 16;
+
+using MemberList = std::vector<std::shared_ptr<ClientInfo>>;
+
+class Room {
+public:
+    explicit Room(const std::string& name)
+        : name_(name), members_(std::make_shared<const MemberList>()),
+          log_buffer_(std::make_shared<ChatLogBuffer>()) {}
+
+    const std::string& name() const { return name_; }
+
+    // The current members; the list never changes once published
+    std::shared_ptr<const MemberList> members() const { return std::atomic_load(&members_); }
+
+    // Remember a chat frame and return the members it should go to. A
+    // client joining at the same moment gets the frame either live or in
+    // its replay, never both and never neither.
+    std::shared_ptr<const MemberList> post(const FrameRef& frame);
+
+private:
+    friend void leave_room(ClientInfo& client);
+    friend std::shared_ptr<Room> join_room(const std::shared_ptr<ClientInfo>& client,
+                                           const std::string& name, bool replay);
+    friend void take_over_room(const std::shared_ptr<ClientInfo>& client, ClientInfo& previous,
+                               History::Clock::time_point since);
+
+    // Load the room's history from the chat log when it is created
+    void restore();
+
+    // Callers hold the room's directory shard lock. A newcomer given here
+    // has the history (from since on) queued ahead of anything posted
+    // after the change.
+    void publish(std::shared_ptr<const MemberList> members, ClientInfo* newcomer = nullptr,
+                 History::Clock::time_point since = History::Clock::time_point::min());
+
+    std::string name_;
+    std::shared_ptr<const MemberList> members_;
+
+    std::mutex history_mutex_;    // Orders posts against membership changes
+    History history_;
+    std::shared_ptr<ChatLogBuffer> log_buffer_;   // Posts not yet in the chat log
+};
+
+// Add a client to the registry and give it its ID, unless it resumes a
+// session and has the ID already
+void add_client(const std::shared_ptr<ClientInfo>& client);
+void remove_client(ClientInfo& client);
+
+size_t client_count();
+
+// Call f for every registered client, one shard at a time
+void for_each_client(const std::function<void(ClientInfo&)>& f);
+
+// A registered client with the given name other than except, if any
+std::shared_ptr<ClientInfo> find_client(const std::string& username, const ClientInfo* except = nullptr);
+
+bool valid_room_name(const std::string& name);
+
+// Move a client into the named room, creating it if needed, and return it.
+// The room's recent history is queued for the client as one batch (the
+// caller flushes it). Callers of this and the two below hold the client's
+// room_mutex.
+std::shared_ptr<Room> join_room(const std::shared_ptr<ClientInfo>& client, const std::string& name,
+                                bool replay = true);
+
+// Take a client out of its room; empty rooms other than the default are
+// forgotten
+void leave_room(ClientInfo& client);
+
+// Put a client that resumed a session in place of the previous one in its
+// room, queueing it the room's history from since on; the default room if
+// the previous one had none yet. Callers hold both clients' room_mutex.
+void take_over_room(const std::shared_ptr<ClientInfo>& client, ClientInfo& previous,
+                    History::Clock::time_point since);
+
+size_t room_count();
+
+#endif
@@ -2,7 +2,6 @@
 #include <string>
 #include <vector>
 #include <algorithm>
-#include <fstream>
 #include <memory>
 #include <thread>
 #include <mutex>
@@ -10,26 +9,16 @@
 #include <chrono>
 #include <cstring>
 #include <csignal>
+#include <cstdlib>
+#include <random>
 
-// Platform-specific includes
-#ifdef _WIN32
-    #include <winsock2.h>
-    #include <ws2tcpip.h>
-    #pragma comment(lib, "ws2_32.lib")
-    typedef int socklen_t;
-#else
-    #include <sys/socket.h>
-    #include <netinet/in.h>
-    #include <arpa/inet.h>
-    #include <unistd.h>
-    #include <fcntl.h>
-    #define SOCKET int
-    #define INVALID_SOCKET -1
-    #define SOCKET_ERROR -1
-    #define closesocket close
+#ifdef __linux__
+    #include <sys/random.h>
 #endif
 
-#include "../shared/constants.h"
+#include "server.h"
+#include "uring.h"
+#include "../shared/hello.h"
 
 // Cross-platform socket initialization
 class SocketInitializer {
@@ -50,24 +39,27 @@ public:
     }
 };
 
-// Client information structure
-struct ClientInfo {
-    SOCKET socket;
-    std::string username;
-    std::string ip_address;
-    std::chrono::system_clock::time_point connected_time;
-    std::atomic<bool> active{true};
-    
-    ClientInfo(SOCKET s, const std::string& name, const std::string& ip) 
-        : socket(s), username(name), ip_address(ip), 
-          connected_time(std::chrono::system_clock::now()) {}
-};
-
 // Global state
-std::vector<std::shared_ptr<ClientInfo>> clients;
-std::mutex clients_mutex;
 std::atomic<bool> server_running{true};
 
+// Server configuration from the command line
+enum class ServerMode { THREADS, EPOLL, URING };
+
+struct ServerConfig {
+    ServerMode mode = ServerMode::THREADS;
+    size_t shards = 1;           // Reactor threads in epoll mode; 0 = one per core
+};
+
+// Listening sockets are spread over at most this many reactor shards
+constexpr size_t MAX_SHARDS = 64;
+
+// Bounds of --quantum: a piece is one FILE_CHUNK frame
+constexpr size_t MIN_QUANTUM = 4 * 1024;
+constexpr size_t MAX_QUANTUM = 16 * 1024 * 1024;
+
+// Capabilities granted to a client that asks for them
+constexpr uint32_t SERVER_CAPABILITIES = CAP_COMPRESSION | CAP_BATCHING | CAP_RESUME;
+
 // Utility function to get error message
 std::string get_socket_error() {
 #ifdef _WIN32
@@ -77,86 +69,498 @@ std::string get_socket_error() {
 #endif
 }
 
-// Broadcast message to all clients except sender
-void broadcast(SOCKET sender, const std::string& message, const std::string& sender_username) {
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    std::string formatted_message = "[" + sender_username + "]: " + message;
-    
-    for (auto& client : clients) {
-        if (client->socket != sender && client->active) {
-            ssize_t sent = send(client->socket, formatted_message.c_str(), 
-                               formatted_message.size(), 0);
-            if (sent <= 0) {
-                client->active = false;
-            }
+// Stop serving a client; its owner notices the shutdown and cleans up
+void drop_client(ClientInfo& client) {
+    client.active = false;
+    shutdown(client.socket, SHUT_RDWR);
+}
+
+// File bytes queued for a client per turn: the quantum, or its receive
+// window if that is smaller
+size_t download_quantum(const ClientInfo& client) {
+    if (client.receive_window == 0) {
+        return shaping_config.quantum;
+    }
+    return std::clamp(client.receive_window, MIN_QUANTUM, shaping_config.quantum);
+}
+
+// Queue the next piece of the client's downloads once everything ahead of
+// it has been written, so chat and control frames never wait behind more
+// than a piece. Downloads take turns, a quantum each, and wait while the
+// user's or the server's bandwidth cap is used up. True if anything was
+// queued.
+bool feed_download(ClientInfo& client) {
+    std::lock_guard<std::mutex> lock(client.download_mutex);
+    if (client.downloads.empty() || !client.outbound.empty()) {
+        return false;
+    }
+    if (shaping_enabled() && transfer_delay(client) > std::chrono::steady_clock::duration::zero()) {
+        // The connection's owner comes back once the buckets refill
+        count(Counter::TRANSFER_WAITS);
+        return false;
+    }
+
+    Download& download = client.downloads.front();
+    int64_t length = std::min<int64_t>(download_quantum(client), download.end - download.next);
+    if (length > 0) {
+        char meta[STREAMED_META_SIZE];
+        put_u64(meta, download.id);
+        put_u64(meta + sizeof(uint64_t), static_cast<uint64_t>(download.next));
+#ifdef _WIN32
+        // No mmap() or sendfile(): read the piece into the frame itself
+        std::string piece(static_cast<size_t>(length), '\0');
+        if (!download.file->read_at(&piece[0], piece.size(), download.next)) {
+            client.outbound.push(transfer_error_frame(download.id, "Read failed"), false);
+            client.downloads.pop_front();
+            return true;
         }
+        client.outbound.push(FrameBuffer::create(FILE_CHUNK, {std::string_view(meta, sizeof(meta)), piece},
+                                                 FRAME_FLAG_STREAMED), false);
+#else
+        FrameRef header = FrameBuffer::create(FILE_CHUNK, {std::string_view(meta, sizeof(meta))},
+                                              FRAME_FLAG_STREAMED, 0, static_cast<uint32_t>(length));
+        client.outbound.push_file(header, download.file, download.next, static_cast<size_t>(length));
+#endif
+        download.next += length;
+        charge_transfer(client, static_cast<size_t>(length));
+    }
+
+    if (download.next == download.end) {
+        client.outbound.push(transfer_done_frame(download.id), false);
+        client.downloads.pop_front();
+    } else if (client.downloads.size() > 1) {
+        client.downloads.push_back(std::move(download));
+        client.downloads.pop_front();
     }
+    return true;
 }
 
-// Broadcast system notification to all clients
-void broadcast_notification(const std::string& notification) {
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    std::string formatted = "*** " + notification + " ***";
-    
-    for (auto& client : clients) {
-        if (client->active) {
-            ssize_t sent = send(client->socket, formatted.c_str(), 
-                               formatted.size(), 0);
-            if (sent <= 0) {
-                client->active = false;
+// True while the client has downloads to send, including ones held back by
+// a bandwidth cap
+bool downloads_waiting(ClientInfo& client) {
+    std::lock_guard<std::mutex> lock(client.download_mutex);
+    return !client.downloads.empty();
+}
+
+// Write as much of the client's queued output as the socket accepts, or
+// leave that to the shard that owns it
+bool flush_outbound(ClientInfo& client) {
+    if (defer_write(client)) {
+        return true;
+    }
+    return write_outbound(client);
+}
+
+// Write queued output now, topping it up from pending downloads whenever
+// it drains
+bool write_outbound(ClientInfo& client) {
+    while (true) {
+        OutboundQueue::FlushResult result = client.outbound.flush(client.socket);
+        if (result == OutboundQueue::FlushResult::FAILED) {
+            drop_client(client);
+            return false;
+        }
+        if (result != OutboundQueue::FlushResult::DRAINED || !feed_download(client)) {
+            return true;
+        }
+    }
+}
+
+// Queue a frame for a client and push it out without blocking
+bool deliver(ClientInfo& client, const FrameRef& frame, bool droppable) {
+    switch (client.outbound.push(frame, droppable)) {
+    case OutboundQueue::PushResult::QUEUED:
+        return flush_outbound(client);
+    case OutboundQueue::PushResult::DROPPED:
+        return true;
+    case OutboundQueue::PushResult::OVERFLOW:
+        std::cerr << "✗ Disconnecting slow client " << client.username
+                  << " (" << client.outbound.queued_bytes() << " bytes queued)" << std::endl;
+        drop_client(client);
+        return false;
+    }
+    return false;
+}
+
+// Queue a frame for every active member but one. On a sharded reactor only
+// this shard's members are written here; each other shard that has members
+// gets the frame and the list once, through its inbox.
+void fan_out(const FrameRef& frame, const std::shared_ptr<const MemberList>& members,
+             const ClientInfo* except) {
+    int shard = current_shard();
+    uint64_t remote_shards = 0;
+
+    for (auto& client : *members) {
+        if (client.get() == except || !client->active) {
+            continue;
+        }
+        if (shard < 0 || client->shard == shard) {
+            deliver(*client, frame);
+        } else {
+            remote_shards |= uint64_t{1} << client->shard;
+        }
+    }
+    if (remote_shards) {
+        forward_to_shards(remote_shards, frame, members, except);
+    }
+}
+
+// Broadcast a chat message to the sender's room and keep it in the room's
+// history. The member list is a published snapshot, so no lock is held
+// while frames are queued. Lines over MAX_MESSAGE_LENGTH are never relayed,
+// so the frame fits every client (MAX_CHAT_PAYLOAD).
+void broadcast(ClientInfo& sender, std::string_view message) {
+    if (message.size() > static_cast<size_t>(MAX_MESSAGE_LENGTH)) {
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    // Encoded once; every recipient queues a reference to the same buffer
+    FrameRef formatted_message = FrameBuffer::create(MESSAGE, {"[", sender.username, "]: ", message});
+
+    std::shared_ptr<const MemberList> members;
+    {
+        std::lock_guard<std::mutex> lock(sender.room_mutex);
+        if (!sender.room) {
+            return;    // Replaced by a resumed session
+        }
+        members = sender.room->post(formatted_message);
+    }
+    fan_out(formatted_message, members, &sender);
+    record_since(Histogram::FANOUT_NS, start);
+}
+
+// Refuse a chat line over MAX_MESSAGE_LENGTH, or log and broadcast it
+void post_message(ClientInfo& sender, std::string_view message) {
+    if (message.size() > static_cast<size_t>(MAX_MESSAGE_LENGTH)) {
+        notify_client(sender, "Message not sent: longer than " + std::to_string(MAX_MESSAGE_LENGTH) +
+                                  " characters");
+        return;
+    }
+    log_line({"[", sender.username, "]: ", message});
+    broadcast(sender, message);
+}
+
+// A system notification frame; text that could not fit the smallest
+// frame a client takes is cut short
+FrameRef notice_frame(std::string_view notification) {
+    constexpr size_t MAX_NOTICE = MIN_FRAME_PAYLOAD - 8;
+    return FrameBuffer::create(MESSAGE, {"*** ", notification.substr(0, MAX_NOTICE), " ***"});
+}
+
+// System notification for the members of one room; joins, departures and
+// shared files are announced this way, so they cost the room's size and
+// take no registry lock
+void notify_room(const Room& room, const std::string& notification, const ClientInfo* except) {
+    auto start = std::chrono::steady_clock::now();
+    fan_out(notice_frame(notification), room.members(), except);
+    record_since(Histogram::FANOUT_NS, start);
+}
+
+// System notification for one client, such as the answer to a command
+void notify_client(ClientInfo& client, const std::string& notification) {
+    deliver(client, notice_frame(notification), false);
+}
+
+std::shared_ptr<Room> current_room(ClientInfo& client) {
+    std::lock_guard<std::mutex> lock(client.room_mutex);
+    return client.room;
+}
+
+// Start or resume an upload and tell the client where to continue from.
+// Contents the server already holds are shared without sending a byte.
+// The reply is tagged with the request's stream, so a client with several
+// uploads starting at once can tell which one it answers.
+bool offer_transfer(const std::shared_ptr<ClientInfo>& client, const std::string& filename,
+                    int64_t file_size, uint64_t content_hash, uint16_t stream) {
+    // Refused before a byte is sent: the name becomes a path in uploads/,
+    // and downloads could never serve it anyway
+    if (!servable_name(filename)) {
+        return deliver(*client, transfer_error_frame(0, "Invalid file name", stream), false);
+    }
+    if (blob_exists(content_hash, file_size)) {
+        if (!link_blob(filename, content_hash, file_size)) {
+            return deliver(*client, transfer_error_frame(0, "Server could not store the file", stream), false);
+        }
+        invalidate_served_file(filename);
+        std::cout << "✓ File received from " << client->username << ": " << filename
+                  << " (" << file_size << " bytes, deduplicated)" << std::endl;
+        if (!deliver(*client, transfer_done_frame(0, stream), false)) {
+            return false;
+        }
+        if (std::shared_ptr<Room> room = current_room(*client)) {
+            notify_room(*room, client->username + " shared file: " + filename);
+        }
+        return true;
+    }
+
+    bool resumed = false;
+    std::shared_ptr<Transfer> transfer = begin_transfer(client->username, filename, file_size,
+                                                        content_hash, resumed);
+    if (!transfer) {
+        return deliver(*client, transfer_error_frame(0, "Server could not create the file", stream), false);
+    }
+
+    int64_t offset = resumed ? transfer->resume_offset() : 0;
+    transfer->attach_owner(client);
+    if (resumed) {
+        std::cout << "↻ Resuming upload of " << filename << " from " << client->username
+                  << " at byte " << offset << std::endl;
+    }
+    if (!deliver(*client, transfer_ready_frame(transfer->id(), offset, stream), false)) {
+        return false;
+    }
+
+    // An empty file has no chunks to wait for
+    if (transfer->record(0, 0, 0, "stream")) {
+        complete_transfer(transfer);
+    }
+    return true;
+}
+
+// Bind a new connection to a transfer as one more data stream
+bool attach_stream(const std::shared_ptr<ClientInfo>& stream, const FrameView& frame) {
+    uint64_t id = 0;
+    std::shared_ptr<Transfer> transfer;
+    if (parse_transfer_id(frame, id)) {
+        transfer = find_transfer(id);
+    }
+    if (!transfer) {
+        deliver(*stream, transfer_error_frame(id, "Unknown transfer"), false);
+        return false;
+    }
+
+    stream->username = transfer->owner();
+    stream->bandwidth = user_bucket(stream->username);
+    return deliver(*stream, transfer_ready_frame(id, transfer->resume_offset()), false);
+}
+
+// Wait until the socket has input, flushing queued output whenever it
+// becomes writable; returns false once the client is gone
+bool wait_for_input(SOCKET client_socket, ClientInfo* client) {
+    while (server_running) {
+        struct pollfd pfd;
+        pfd.fd = client_socket;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (client && !client->outbound.empty()) {
+            pfd.events |= POLLOUT;
+        }
+
+        // The timeout picks up output queued by other threads after a
+        // previous write hit a full socket buffer, and downloads that were
+        // waiting for their bandwidth cap
+        int ready = poll(&pfd, 1, OUTBOUND_POLL_INTERVAL_MS);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            return false;
+        }
+
+        if (client && (!client->outbound.empty() || downloads_waiting(*client)) &&
+            !flush_outbound(*client)) {
+            return false;
+        }
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            return true;
         }
     }
+    return false;
 }
 
-// Handle file transfer
-bool handle_file_transfer(SOCKET client_socket, const std::string& filename, 
-                         int64_t file_size, const std::string& username) {
-    // Create uploads directory if it doesn't exist
-#ifdef _WIN32
-    system("if not exist uploads mkdir uploads");
-#else
-    system("mkdir -p uploads");
-#endif
-    
-    std::string filepath = "uploads/" + filename;
-    std::ofstream file(filepath, std::ios::binary);
-    
-    if (!file.is_open()) {
-        std::cerr << "Failed to create file: " << filepath << std::endl;
+// Parse a FILE_DOWNLOAD frame: u64 ID, u64 offset, u64 length, file name
+bool parse_download_request(const FrameView& frame, uint64_t& id, int64_t& offset,
+                            int64_t& length, std::string& filename) {
+    const size_t fixed = 3 * sizeof(uint64_t);
+    if (frame.header.length <= fixed) {
+        return false;
+    }
+    id = get_u64(frame.payload);
+    offset = static_cast<int64_t>(get_u64(frame.payload + sizeof(uint64_t)));
+    length = static_cast<int64_t>(get_u64(frame.payload + 2 * sizeof(uint64_t)));
+    filename = std::string(frame.payload + fixed, frame.header.length - fixed);
+    return offset >= 0 && length >= 0;
+}
+
+bool start_download(ClientInfo& client, const FrameView& frame) {
+    uint64_t id;
+    int64_t offset;
+    int64_t length;
+    std::string filename;
+    if (!parse_download_request(frame, id, offset, length, filename)) {
         return false;
     }
 
-    char buffer[FILE_BUFFER_SIZE];
-    int64_t total_bytes_received = 0;
+    std::shared_ptr<const ServedFile> file;
+    if (servable_name(filename)) {
+        file = open_served_file(filename);
+    }
+    if (!file) {
+        deliver(client, transfer_error_frame(id, "No such file"), false);
+        return true;
+    }
+    if (offset > file->size()) {
+        deliver(client, transfer_error_frame(id, "Offset past the end of the file"), false);
+        return true;
+    }
+
+    int64_t end = file->size();
+    if (length > 0 && length < end - offset) {
+        end = offset + length;
+    }
+
+    std::cout << "→ Sending " << filename << " to " << client.username << " (bytes "
+              << offset << "-" << end << " of " << file->size()
+              << (file->data() ? ", cached)" : ", sendfile)") << std::endl;
+
+    // FILE_READY carries the file size so the client knows what it is getting
+    char sizes[2 * sizeof(uint64_t)];
+    put_u64(sizes, static_cast<uint64_t>(offset));
+    put_u64(sizes + sizeof(uint64_t), static_cast<uint64_t>(file->size()));
+    char encoded_id[sizeof(uint64_t)];
+    put_u64(encoded_id, id);
+    FrameRef ready = FrameBuffer::create(FILE_READY, {std::string_view(encoded_id, sizeof(encoded_id)),
+                                                      std::string_view(sizes, sizeof(sizes))});
+    if (client.outbound.push(ready, false) == OutboundQueue::PushResult::OVERFLOW) {
+        drop_client(client);
+        return true;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(client.download_mutex);
+        client.downloads.push_back(Download{id, file, offset, end});
+    }
+    flush_outbound(client);
+    return true;
+}
+
+// Answer a STATS request with the server metrics and each client's
+// output queue and round trip time
+void send_stats(ClientInfo& client) {
+    std::string report = metrics_report();
+    report += "clients " + std::to_string(client_count()) + "\n";
+    report += "rooms " + std::to_string(room_count()) + "\n";
+    report += "presence_version " + std::to_string(presence_version()) + "\n";
+    report += pool_report();
+    for_each_client([&report](ClientInfo& other) {
+        report += "queue_bytes." + other.username + " " +
+                  std::to_string(other.outbound.queued_bytes()) + "\n";
+        report += "rtt_us." + other.username + " " +
+                  std::to_string(other.heartbeat.rtt_us.load(std::memory_order_relaxed)) + "\n";
+    });
+
+    // Keep to one frame, cutting at a line
+    if (report.size() > client.max_payload) {
+        report.resize(report.rfind('\n', client.max_payload - 1) + 1);
+    }
+    deliver(client, FrameBuffer::create(STATS, {report}), false);
+}
+
+void change_room(const std::shared_ptr<ClientInfo>& client, const FrameView& frame) {
+    std::string name = frame.header.length > 0 ? frame.text() : DEFAULT_ROOM;
+    if (!valid_room_name(name)) {
+        notify_client(*client, "Room names are # followed by up to " + std::to_string(MAX_ROOM_NAME_LENGTH - 1) +
+                               " letters, digits, - or _");
+        return;
+    }
+    std::shared_ptr<Room> previous;
+    std::shared_ptr<Room> room;
+    {
+        std::lock_guard<std::mutex> lock(client->room_mutex);
+        if (client->replaced) {
+            return;
+        }
+        if (client->room && client->room->name() == name) {
+            notify_client(*client, "You are already in " + name);
+            return;
+        }
+        previous = client->room;
+        room = join_room(client, name);
+    }
+    flush_outbound(*client);
+    if (previous) {
+        notify_room(*previous, client->username + " left " + previous->name());
+    }
+    notify_room(*room, client->username + " joined " + name, client.get());
+    notify_client(*client, "You are now in " + name + " (" +
+                           std::to_string(room->members()->size()) + " here)");
+}
+
+// Hold an upload back while its bandwidth cap is used up, still flushing
+// the client's output; false once the client is gone
+bool wait_for_tokens(ClientInfo& client) {
+    if (!shaping_enabled()) {
+        return true;
+    }
+    bool waited = false;
+    while (server_running && client.active) {
+        auto delay = std::chrono::ceil<std::chrono::milliseconds>(transfer_delay(client));
+        if (delay.count() <= 0) {
+            return true;
+        }
+        if (!waited) {
+            count(Counter::TRANSFER_WAITS);
+            waited = true;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = client.socket;
+        pfd.events = client.outbound.empty() ? 0 : POLLOUT;
+        pfd.revents = 0;
+        int timeout = static_cast<int>(std::min<int64_t>(delay.count(), OUTBOUND_POLL_INTERVAL_MS));
+        if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+            return false;
+        }
+        if (!client.outbound.empty() && !flush_outbound(client)) {
+            return false;
+        }
+    }
+    return false;
+}
+
+// Receive one FILE_CHUNK body into its transfer
+bool handle_file_chunk(ClientInfo& client, RingBuffer& input, const FrameView& frame) {
+    std::shared_ptr<Transfer> transfer;
+    std::unique_ptr<FileReceiver> receiver = begin_chunk(frame, transfer);
+    if (!receiver) {
+        throw std::runtime_error("Chunk outside its file");
+    }
     
-    auto start_time = std::chrono::steady_clock::now();
+    // The body may already have started arriving behind the header
+    if (!input.empty()) {
+        size_t buffered = std::min<int64_t>(input.size(), receiver->remaining());
+        receiver->write(input.data(), buffered);
+        input.consume(buffered);
+        charge_transfer(client, buffered);
+    }
     
-    while (total_bytes_received < file_size) {
-        int bytes_to_receive = std::min(static_cast<int64_t>(FILE_BUFFER_SIZE), 
-                                       file_size - total_bytes_received);
-        ssize_t bytes_received = recv(client_socket, buffer, bytes_to_receive, 0);
+    while (!receiver->complete()) {
+        if (!wait_for_tokens(client)) {
+            end_chunk(transfer, *receiver);
+            return false;
+        }
+        // Under a cap, read no more than a quantum into the bucket's debt
+        ssize_t bytes_received = receiver->receive(client.socket,
+                                                   shaping_enabled() ? shaping_config.quantum : SIZE_MAX);
+        if (bytes_received > 0) {
+            count(Counter::BYTES_IN, bytes_received);
+            charge_transfer(client, bytes_received);
+            client.heartbeat.heard();
+        }
         
+        if (bytes_received < 0 && socket_would_block()) {
+            if (wait_for_input(client.socket, &client)) {
+                continue;
+            }
+        }
         if (bytes_received <= 0) {
-            std::cerr << "Error receiving file data" << std::endl;
-            file.close();
+            // Whatever arrived is kept; the sender resumes after it
+            end_chunk(transfer, *receiver);
             return false;
         }
-        
-        file.write(buffer, bytes_received);
-        total_bytes_received += bytes_received;
     }
     
-    file.close();
-    
-    auto end_time = std::chrono::steady_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
-    double speed = (total_bytes_received / 1024.0 / 1024.0) / (duration.count() / 1000.0);
-    
-    std::cout << "✓ File received from " << username << ": " << filename 
-              << " (" << total_bytes_received << " bytes, " 
-              << speed << " MB/s)" << std::endl;
-    
+    end_chunk(transfer, *receiver);
     return true;
 }
 
@@ -171,87 +575,345 @@ std::string get_client_ip(SOCKET socket) {
     return "unknown";
 }
 
+uint64_t random_token() {
+#ifdef __linux__
+    uint64_t token;
+    if (getrandom(&token, sizeof(token), 0) == static_cast<ssize_t>(sizeof(token))) {
+        return token;
+    }
+#endif
+    // A fresh draw from the system source each time, 32 bits at a time
+    std::random_device source;
+    return (static_cast<uint64_t>(source()) << 32) | source();
+}
+
+// Parse a USERNAME_SET frame
+bool parse_username(const FrameView& frame, std::string& username) {
+    if (frame.header.length == 0 || frame.header.length > MAX_USERNAME_LENGTH) {
+        return false;
+    }
+    username = frame.text();
+    return true;
+}
+
+// Parse a FILE_TRANSFER frame: u64 file size, u64 content hash, then the
+// file name
+bool parse_file_header(const FrameView& frame, std::string& filename, int64_t& file_size,
+                       uint64_t& content_hash) {
+    constexpr size_t fixed = 2 * sizeof(uint64_t);
+    if (frame.header.length <= fixed) {
+        return false;
+    }
+    file_size = static_cast<int64_t>(get_u64(frame.payload));
+    content_hash = get_u64(frame.payload + sizeof(uint64_t));
+    filename = std::string(frame.payload + fixed, frame.header.length - fixed);
+    return file_size >= 0;
+}
+
+// Block until the next complete frame has been received
+bool receive_frame(SOCKET client_socket, ClientInfo* client, RingBuffer& input,
+                   FrameParser& parser, FrameView& frame) {
+    while (true) {
+        ParseResult result = parser.next(input, frame);
+        if (result == ParseResult::FRAME) {
+            count_frame_in(frame.header.type);
+            return true;
+        }
+        if (result == ParseResult::INVALID) {
+            throw std::runtime_error("Malformed frame");
+        }
+
+        input.prepare();
+        ssize_t bytes_received = recv(client_socket, input.write_ptr(), input.writable(), 0);
+        if (bytes_received < 0 && socket_would_block()) {
+            if (!wait_for_input(client_socket, client)) {
+                return false;
+            }
+            continue;
+        }
+        if (bytes_received <= 0) {
+            return false;
+        }
+        count(Counter::BYTES_IN, bytes_received);
+        input.commit(bytes_received);
+        if (client) {
+            client->heartbeat.heard();
+        }
+    }
+}
+
+// Add a client to the shared list and announce it
+void register_client(const std::shared_ptr<ClientInfo>& client_info) {
+    client_info->bandwidth = user_bucket(client_info->username);
+    add_client(client_info);
+    watch_client(*client_info);
+    std::shared_ptr<Room> room;
+    {
+        // Once its HELLO reply is out, a resume may take the session over
+        // before this is done; then the successor joins in its place
+        std::lock_guard<std::mutex> lock(client_info->room_mutex);
+        if (client_info->replaced) {
+            return;
+        }
+        room = join_room(client_info, DEFAULT_ROOM);
+        presence_join(client_info);
+    }
+    flush_outbound(*client_info);
+
+    std::cout << "✓ New client connected: " << client_info->username 
+             << " (" << client_info->ip_address << ")" << std::endl;
+
+    // Announced to the room, the newcomer included
+    notify_room(*room, client_info->username + " joined the chat");
+}
+
+// Put a client that resumed its session in the place of the one it had:
+// same ID, room and roster entry, and no announcements. It is sent the chat
+// its room had since the previous connection was lost.
+void resume_client(const std::shared_ptr<ClientInfo>& client_info, ClientInfo& previous,
+                   History::Clock::time_point since) {
+    client_info->id = previous.id;
+    client_info->connected_time = previous.connected_time;
+    client_info->bandwidth = user_bucket(client_info->username);
+    add_client(client_info);
+    watch_client(*client_info);
+    {
+        // The previous connection may still be winding down on its own
+        // thread; under its lock it is either done with its room or never
+        // touches it again
+        std::scoped_lock lock(previous.room_mutex, client_info->room_mutex);
+        previous.replaced = true;
+        take_over_room(client_info, previous, since);
+        presence_take_over(client_info, previous);
+    }
+    flush_outbound(*client_info);
+
+    std::cout << "✓ Client resumed: " << client_info->username
+             << " (" << client_info->ip_address << ")" << std::endl;
+}
+
+std::shared_ptr<ClientInfo> open_chat(const FrameView& frame, SOCKET socket, const std::string& ip_address,
+                                      int shard) {
+    Hello hello;
+    if (frame.header.type == USERNAME_SET) {
+        if (!parse_username(frame, hello.username)) {
+            return nullptr;
+        }
+        auto client_info = make_client(socket, hello.username, ip_address);
+        client_info->shard = shard;
+        register_client(client_info);
+        return client_info;
+    }
+    if (frame.header.type != HELLO || !decode_hello(frame, hello) || hello.username.empty() ||
+        hello.username.size() > MAX_USERNAME_LENGTH) {
+        return nullptr;
+    }
+    if (hello.version < MIN_PROTOCOL_VERSION) {
+        // Told which version this server speaks, so it can say why
+        std::string reply = encode_hello(Hello(), true);
+        std::string refusal = make_frame(HELLO, reply.data(), reply.size(), FRAME_FLAG_REPLY);
+        send(socket, refusal.data(), static_cast<int>(refusal.size()), 0);
+        std::cerr << "✗ Refused " << hello.username << " (" << ip_address << "): protocol version "
+                  << hello.version << ", at least " << MIN_PROTOCOL_VERSION << " needed" << std::endl;
+        return nullptr;
+    }
+
+    auto client_info = make_client(socket, hello.username, ip_address);
+    client_info->shard = shard;
+    client_info->capabilities = hello.capabilities & SERVER_CAPABILITIES;
+    client_info->max_payload = std::clamp(hello.max_payload, MIN_FRAME_PAYLOAD, MAX_FRAME_PAYLOAD);
+    client_info->receive_window = hello.receive_window;
+
+    std::shared_ptr<ClientInfo> previous;
+    History::Clock::time_point since;
+    if (hello.session != 0 && (client_info->capabilities & CAP_RESUME)) {
+        previous = claim_session(client_info, hello.session, since);
+    }
+    if (!previous) {
+        open_session(client_info);
+    }
+
+    // The reply goes ahead of everything else, the history replay included
+    Hello reply;
+    reply.capabilities = client_info->capabilities;
+    reply.max_payload = client_info->max_payload;
+    reply.receive_window = static_cast<uint32_t>(download_quantum(*client_info));
+    reply.session = client_info->session;
+    reply.resumed = previous != nullptr;
+    client_info->outbound.push(FrameBuffer::create(HELLO, {encode_hello(reply, true)}, FRAME_FLAG_REPLY),
+                               false);
+
+    if (previous) {
+        resume_client(client_info, *previous, since);
+    } else {
+        register_client(client_info);
+    }
+    return client_info;
+}
+
+// Take a client's connection out of service. Its departure is announced
+// unless its session waits for a reconnect or has already been taken over.
+void unregister_client(const std::shared_ptr<ClientInfo>& client_info) {
+    client_info->active = false;
+
+    unwatch_client(*client_info);
+    remove_client(*client_info);
+    client_info->outbound.close();
+
+    switch (end_session(client_info)) {
+    case SessionEnd::CLOSED:
+        announce_departure(client_info);
+        break;
+    case SessionEnd::PARKED:
+        std::cerr << "✗ Connection lost: " << client_info->username << " (" << client_info->ip_address
+                  << "), session kept for " << session_config.grace.count() << "s" << std::endl;
+        break;
+    case SessionEnd::REPLACED:
+        break;
+    }
+}
+
+void announce_departure(const std::shared_ptr<ClientInfo>& client_info) {
+    std::shared_ptr<Room> room;
+    {
+        std::lock_guard<std::mutex> lock(client_info->room_mutex);
+        room = client_info->room;
+        leave_room(*client_info);
+        presence_leave(*client_info);
+    }
+
+    std::cout << "✗ Client disconnected: " << client_info->username 
+             << " (" << client_info->ip_address << ")" << std::endl;
+
+    if (room) {
+        notify_room(*room, client_info->username + " left the chat");
+    }
+}
+
+// Serve a data connection opened with FILE_ATTACH: chunks until it closes
+void receive_stream(ClientInfo& stream, RingBuffer& input, FrameParser& parser) {
+    FrameView frame;
+    
+    try {
+        while (server_running && stream.active) {
+            if (!receive_frame(stream.socket, &stream, input, parser, frame)) {
+                break;
+            }
+            if (frame.header.type == FILE_CHUNK) {
+                if (!handle_file_chunk(stream, input, frame)) {
+                    break;
+                }
+            }
+            else if (frame.header.type == DISCONNECT) {
+                break;
+            }
+            else {
+                throw std::runtime_error("Unexpected frame on a data stream");
+            }
+        }
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error on upload stream from " << stream.username << ": " << e.what() << std::endl;
+    }
+}
+
 // Handle individual client
 void handle_client(SOCKET client_socket) {
     std::string username = "Unknown";
     std::string client_ip = get_client_ip(client_socket);
     std::shared_ptr<ClientInfo> client_info;
     
-    char buffer[BUFFER_SIZE];
+    RingBuffer input;
+    FrameParser parser;
+    FrameView frame;
+    
+    // Writes from other threads must never block, so reads wait in poll()
+    set_nonblocking(client_socket);
+    limit_unsent(client_socket);
     
     try {
-        // First, receive username
-        ssize_t bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
-        if (bytes_received <= 0) {
+        // First, the login
+        if (!receive_frame(client_socket, nullptr, input, parser, frame)) {
             throw std::runtime_error("Failed to receive username");
         }
         
-        int32_t message_type;
-        std::memcpy(&message_type, buffer, sizeof(int32_t));
-        
-        if (message_type == USERNAME_SET) {
-            int32_t username_length;
-            std::memcpy(&username_length, buffer + sizeof(int32_t), sizeof(int32_t));
-            
-            if (username_length > 0 && username_length <= MAX_USERNAME_LENGTH) {
-                username = std::string(buffer + sizeof(int32_t) * 2, username_length);
-                
-                // Create and add client to list
-                client_info = std::make_shared<ClientInfo>(client_socket, username, client_ip);
-                {
-                    std::lock_guard<std::mutex> lock(clients_mutex);
-                    clients.push_back(client_info);
-                }
-                
-                std::cout << "✓ New client connected: " << username 
-                         << " (" << client_ip << ")" << std::endl;
-                
-                // Notify all other clients
-                broadcast_notification(username + " joined the chat");
-            } else {
-                throw std::runtime_error("Invalid username length");
+        if (frame.header.type == FILE_ATTACH) {
+            // An extra data stream for an upload; never joins the chat
+            auto stream = make_client(client_socket, username, client_ip);
+            if (attach_stream(stream, frame)) {
+                receive_stream(*stream, input, parser);
             }
-        } else {
-            throw std::runtime_error("Expected USERNAME_SET message");
+            closesocket(client_socket);
+            return;
+        }
+        
+        client_info = open_chat(frame, client_socket, client_ip, 0);
+        if (!client_info) {
+            throw std::runtime_error("Expected HELLO or USERNAME_SET message");
         }
+        username = client_info->username;
 
         // Main message loop
         while (server_running && client_info->active) {
-            bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
-            
-            if (bytes_received <= 0) {
+            if (!receive_frame(client_socket, client_info.get(), input, parser, frame)) {
                 break;
             }
 
-            std::memcpy(&message_type, buffer, sizeof(int32_t));
+            if (frame.header.type != PING) {
+                note_activity(*client_info);
+            }
 
-            if (message_type == MESSAGE) {
-                std::string message(buffer + sizeof(int32_t), 
-                                  bytes_received - sizeof(int32_t));
-                std::cout << "[" << username << "]: " << message << std::endl;
-                broadcast(client_socket, message, username);
+            if (frame.header.type == MESSAGE) {
+                post_message(*client_info, frame.view());
             } 
-            else if (message_type == FILE_TRANSFER) {
-                int32_t filename_length;
-                std::memcpy(&filename_length, buffer + sizeof(int32_t), sizeof(int32_t));
-                
-                std::string filename(buffer + sizeof(int32_t) * 2, filename_length);
-
+            else if (frame.header.type == FILE_TRANSFER) {
+                std::string filename;
                 int64_t file_size;
-                std::memcpy(&file_size, buffer + sizeof(int32_t) * 2 + filename_length, 
-                           sizeof(int64_t));
-
-                // Send acknowledgment
-                std::string ack = "READY";
-                send(client_socket, ack.c_str(), ack.size(), 0);
-                
-                // Handle file transfer
-                if (handle_file_transfer(client_socket, filename, file_size, username)) {
-                    broadcast_notification(username + " shared file: " + filename);
+                uint64_t content_hash;
+                if (!parse_file_header(frame, filename, file_size, content_hash)) {
+                    throw std::runtime_error("Malformed file header");
+                }
+
+                // Reply with the transfer ID and where to start sending
+                if (!offer_transfer(client_info, filename, file_size, content_hash, frame.header.stream)) {
+                    break;
+                }
+            }
+            else if (frame.header.type == FILE_CHUNK) {
+                if (!handle_file_chunk(*client_info, input, frame)) {
+                    break;
+                }
+            }
+            else if (frame.header.type == FILE_DOWNLOAD) {
+                if (!start_download(*client_info, frame)) {
+                    throw std::runtime_error("Malformed download request");
+                }
+            }
+            else if (frame.header.type == STATS) {
+                send_stats(*client_info);
+            }
+            else if (frame.header.type == ROOM_JOIN) {
+                change_room(client_info, frame);
+            }
+            else if (frame.header.type == PING) {
+                handle_ping(*client_info, frame);
+            }
+            else if (frame.header.type == CLIENT_LIST) {
+                send_roster(*client_info, frame);
+            }
+            else if (frame.header.type == PEER_OFFER) {
+                if (!offer_peer_transfer(client_info, frame)) {
+                    throw std::runtime_error("Malformed file offer");
                 }
             }
-            else if (message_type == DISCONNECT) {
+            else if (frame.header.type == PEER_RELAY) {
+                if (!relay_peer_transfer(*client_info, frame)) {
+                    throw std::runtime_error("Malformed relay request");
+                }
+            }
+            else if (frame.header.type == DISCONNECT) {
                 std::cout << "Client " << username << " disconnecting gracefully" << std::endl;
+                client_info->leaving = true;
                 break;
             }
         }
@@ -262,21 +924,7 @@ void handle_client(SOCKET client_socket) {
 
     // Cleanup
     if (client_info) {
-        client_info->active = false;
-        
-        std::lock_guard<std::mutex> lock(clients_mutex);
-        clients.erase(
-            std::remove_if(clients.begin(), clients.end(),
-                [client_socket](const std::shared_ptr<ClientInfo>& c) {
-                    return c->socket == client_socket;
-                }),
-            clients.end()
-        );
-        
-        std::cout << "✗ Client disconnected: " << username 
-                 << " (" << client_ip << ")" << std::endl;
-        
-        broadcast_notification(username + " left the chat");
+        unregister_client(client_info);
     }
     
     closesocket(client_socket);
@@ -286,9 +934,348 @@ void handle_client(SOCKET client_socket) {
 void signal_handler(int signal) {
     std::cout << "\n✗ Server shutting down..." << std::endl;
     server_running = false;
+#ifdef __linux__
+    request_reactor_stop();
+#endif
+}
+
+// Display command line usage
+void show_usage(const char* program) {
+    std::cout << "Usage: " << program << " [options]" << std::endl;
+    std::cout << "  --mode=threads             One thread per client (default, portable)" << std::endl;
+    std::cout << "  --mode=epoll               Edge-triggered event loop (Linux)" << std::endl;
+    std::cout << "  --mode=uring               io_uring event loop (Linux 6.0+, else epoll)" << std::endl;
+    std::cout << "  --shards=N                 Event loop threads (default 1, 0 = one per core)" << std::endl;
+    std::cout << "  --ping-interval=SECONDS    Heartbeat PING to each client (default 15, 0 = off)" << std::endl;
+    std::cout << "  --idle-timeout=SECONDS     Disconnect clients silent this long (default 60, 0 = never)" << std::endl;
+    std::cout << "  --presence-idle=SECONDS    Show clients as idle after this long without chatting" << std::endl;
+    std::cout << "                             (default 300, 0 = never)" << std::endl;
+    std::cout << "  --session-grace=SECONDS    How long a lost client may reconnect without rejoining" << std::endl;
+    std::cout << "                             (default 30, 0 = no resuming)" << std::endl;
+    std::cout << "  --queue-high=BYTES         Per-client output queue limit (default 1M)" << std::endl;
+    std::cout << "  --queue-low=BYTES          Queue level at which dropping stops (default 256K)" << std::endl;
+    std::cout << "  --queue-max=BYTES          Queue level at which a client is always disconnected" << std::endl;
+    std::cout << "                             (default 8M)" << std::endl;
+    std::cout << "  --slow-policy=drop|disconnect" << std::endl;
+    std::cout << "                             What to do with clients over the limit" << std::endl;
+    std::cout << "  --upload-io=auto|splice|stream" << std::endl;
+    std::cout << "                             How file bodies reach disk (splice is Linux only)" << std::endl;
+    std::cout << "  --disk-threads=N           Threads writing uploads to disk (default 2, 0 = the" << std::endl;
+    std::cout << "                             receiving thread writes)" << std::endl;
+    std::cout << "  --disk-queue=BYTES         Upload data queued for disk before receiving waits" << std::endl;
+    std::cout << "                             (default 16M)" << std::endl;
+    std::cout << "  --disk-write=BYTES         Size of each upload write, a multiple of 4K (default 1M)" << std::endl;
+    std::cout << "  --direct-io=on|off         Write uploads with O_DIRECT (Linux, default off)" << std::endl;
+    std::cout << "  --fsync=none|complete|BYTES" << std::endl;
+    std::cout << "                             Sync uploads never, once complete (default), or also" << std::endl;
+    std::cout << "                             every BYTES written" << std::endl;
+    std::cout << "  --file-cache=BYTES         Hot files kept mapped for downloads (default 256M)" << std::endl;
+    std::cout << "  --quantum=BYTES            File data a transfer moves per turn; chat waits behind" << std::endl;
+    std::cout << "                             at most this much (default 128K)" << std::endl;
+    std::cout << "  --user-rate=BYTES          File traffic per second for each user (default 0 = no cap)" << std::endl;
+    std::cout << "  --server-rate=BYTES        File traffic per second for everyone (default 0 = no cap)" << std::endl;
+    std::cout << "  --log-rate=N               Chat lines logged per second (default 100, 0 = all)" << std::endl;
+    std::cout << "  --history=N                Messages replayed to people joining a room (default 50)" << std::endl;
+    std::cout << "  --history-minutes=N        Only replay messages this recent (default 60)" << std::endl;
+    std::cout << "  --history-bytes=BYTES      History kept per room (default 64K)" << std::endl;
+    std::cout << "  --chat-log=DIR|off         Durable chat log directory (default chatlog)" << std::endl;
+    std::cout << "  --chat-log-commit-ms=N     Shortest time between log fsyncs (default 10)" << std::endl;
+    std::cout << "  --chat-log-segment=BYTES   Log segment size (default 16M)" << std::endl;
+    std::cout << "  --chat-log-retention=BYTES Log kept on disk (default 256M)" << std::endl;
+    std::cout << "  --chat-log-max-age=HOURS   Delete log segments older than this (default 168)" << std::endl;
+}
+
+// Parse a byte count with an optional K/M/G suffix
+bool parse_size(const std::string& text, size_t& value) {
+    char* end = nullptr;
+    unsigned long long number = std::strtoull(text.c_str(), &end, 10);
+    if (end == text.c_str()) {
+        return false;
+    }
+
+    std::string suffix(end);
+    if (suffix == "K" || suffix == "k") {
+        number <<= 10;
+    } else if (suffix == "M" || suffix == "m") {
+        number <<= 20;
+    } else if (suffix == "G" || suffix == "g") {
+        number <<= 30;
+    } else if (!suffix.empty()) {
+        return false;
+    }
+    value = static_cast<size_t>(number);
+    return true;
+}
+
+// Parse a plain non-negative number
+bool parse_count(const std::string& text, size_t& value) {
+    char* end = nullptr;
+    unsigned long long number = std::strtoull(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0') {
+        return false;
+    }
+    value = static_cast<size_t>(number);
+    return true;
+}
+
+// Match "--name=value" and return the value part
+bool option_value(const std::string& arg, const std::string& name, std::string& value) {
+    if (arg.compare(0, name.size() + 1, name + "=") != 0) {
+        return false;
+    }
+    value = arg.substr(name.size() + 1);
+    return true;
+}
+
+// Parse command line options into a server configuration
+bool parse_args(int argc, char* argv[], ServerConfig& config) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        std::string value;
+
+        if (arg == "--mode=threads") {
+            config.mode = ServerMode::THREADS;
+        }
+        else if (arg == "--mode=epoll") {
+#ifdef __linux__
+            config.mode = ServerMode::EPOLL;
+#else
+            std::cerr << "epoll mode is only available on Linux" << std::endl;
+            return false;
+#endif
+        }
+        else if (arg == "--mode=uring") {
+#ifdef __linux__
+            config.mode = ServerMode::URING;
+#else
+            std::cerr << "io_uring mode is only available on Linux" << std::endl;
+            return false;
+#endif
+        }
+        else if (option_value(arg, "--queue-high", value)) {
+            if (!parse_size(value, outbound_config.high_watermark)) {
+                return false;
+            }
+        }
+        else if (option_value(arg, "--queue-low", value)) {
+            if (!parse_size(value, outbound_config.low_watermark)) {
+                return false;
+            }
+        }
+        else if (option_value(arg, "--queue-max", value)) {
+            if (!parse_size(value, outbound_config.hard_limit)) {
+                return false;
+            }
+        }
+        else if (option_value(arg, "--slow-policy", value)) {
+            if (value == "drop") {
+                outbound_config.policy = SlowConsumerPolicy::DROP;
+            } else if (value == "disconnect") {
+                outbound_config.policy = SlowConsumerPolicy::DISCONNECT;
+            } else {
+                return false;
+            }
+        }
+        else if (option_value(arg, "--file-cache", value)) {
+            if (!parse_size(value, file_cache_bytes)) {
+                return false;
+            }
+        }
+        else if (option_value(arg, "--quantum", value)) {
+            if (!parse_size(value, shaping_config.quantum) || shaping_config.quantum < MIN_QUANTUM ||
+                shaping_config.quantum > MAX_QUANTUM) {
+                return false;
+            }
+        }
+        else if (option_value(arg, "--user-rate", value)) {
+            if (!parse_size(value, shaping_config.user_rate)) {
+                return false;
+            }
+        }
+        else if (option_value(arg, "--server-rate", value)) {
+            if (!parse_size(value, shaping_config.server_rate)) {
+                return false;
+            }
+        }
+        else if (option_value(arg, "--shards", value)) {
+            if (!parse_count(value, config.shards) || config.shards > MAX_SHARDS) {
+                return false;
+            }
+        }
+        else if (option_value(arg, "--ping-interval", value)) {
+            size_t seconds;
+            if (!parse_count(value, seconds)) {
+                return false;
+            }
+            heartbeat_config.ping_interval = std::chrono::seconds(seconds);
+        }
+        else if (option_value(arg, "--idle-timeout", value)) {
+            size_t seconds;
+            if (!parse_count(value, seconds)) {
+                return false;
+            }
+            heartbeat_config.idle_timeout = std::chrono::seconds(seconds);
+        }
+        else if (option_value(arg, "--presence-idle", value)) {
+            size_t seconds;
+            if (!parse_count(value, seconds)) {
+                return false;
+            }
+            presence_config.idle_after = std::chrono::seconds(seconds);
+        }
+        else if (option_value(arg, "--session-grace", value)) {
+            size_t seconds;
+            if (!parse_count(value, seconds)) {
+                return false;
+            }
+            session_config.grace = std::chrono::seconds(seconds);
+        }
+        else if (option_value(arg, "--log-rate", value)) {
+            size_t rate;
+            if (!parse_count(value, rate)) {
+                return false;
+            }
+            log_lines_per_second = static_cast<unsigned>(rate);
+        }
+        else if (option_value(arg, "--history", value)) {
+            if (!parse_count(value, history_config.messages)) {
+                return false;
+            }
+        }
+        else if (option_value(arg, "--history-minutes", value)) {
+            size_t minutes;
+            if (!parse_count(value, minutes)) {
+                return false;
+            }
+            history_config.max_age = std::chrono::minutes(minutes);
+        }
+        else if (option_value(arg, "--history-bytes", value)) {
+            if (!parse_size(value, history_config.bytes)) {
+                return false;
+            }
+        }
+        else if (option_value(arg, "--chat-log", value)) {
+            if (value.empty()) {
+                return false;
+            }
+            chat_log_config.dir = value == "off" ? "" : value;
+        }
+        else if (option_value(arg, "--chat-log-commit-ms", value)) {
+            size_t ms;
+            if (!parse_count(value, ms)) {
+                return false;
+            }
+            chat_log_config.commit_interval = std::chrono::milliseconds(ms);
+        }
+        else if (option_value(arg, "--chat-log-segment", value)) {
+            if (!parse_size(value, chat_log_config.segment_bytes) || chat_log_config.segment_bytes == 0) {
+                return false;
+            }
+        }
+        else if (option_value(arg, "--chat-log-retention", value)) {
+            if (!parse_size(value, chat_log_config.retention_bytes)) {
+                return false;
+            }
+        }
+        else if (option_value(arg, "--chat-log-max-age", value)) {
+            size_t hours;
+            if (!parse_count(value, hours)) {
+                return false;
+            }
+            chat_log_config.max_age = std::chrono::hours(hours);
+        }
+        else if (option_value(arg, "--upload-io", value)) {
+            if (value == "auto") {
+                upload_io = UploadIo::AUTO;
+            } else if (value == "splice") {
+#ifdef __linux__
+                upload_io = UploadIo::SPLICE;
+#else
+                std::cerr << "splice uploads are only available on Linux" << std::endl;
+                return false;
+#endif
+            } else if (value == "stream") {
+                upload_io = UploadIo::STREAM;
+            } else {
+                return false;
+            }
+        }
+        else if (option_value(arg, "--disk-threads", value)) {
+            if (!parse_count(value, disk_config.threads)) {
+                return false;
+            }
+        }
+        else if (option_value(arg, "--disk-queue", value)) {
+            if (!parse_size(value, disk_config.queue_bytes)) {
+                return false;
+            }
+        }
+        else if (option_value(arg, "--disk-write", value)) {
+            if (!parse_size(value, disk_config.write_size) || disk_config.write_size == 0 ||
+                disk_config.write_size % DISK_ALIGNMENT != 0) {
+                return false;
+            }
+        }
+        else if (option_value(arg, "--direct-io", value)) {
+            if (value == "on") {
+#ifdef __linux__
+                disk_config.direct = true;
+#else
+                std::cerr << "O_DIRECT uploads are only available on Linux" << std::endl;
+                return false;
+#endif
+            } else if (value == "off") {
+                disk_config.direct = false;
+            } else {
+                return false;
+            }
+        }
+        else if (option_value(arg, "--fsync", value)) {
+            if (value == "none") {
+                disk_config.fsync = FsyncPolicy::NONE;
+            } else if (value == "complete") {
+                disk_config.fsync = FsyncPolicy::COMPLETE;
+            } else if (parse_size(value, disk_config.fsync_every) && disk_config.fsync_every > 0) {
+                disk_config.fsync = FsyncPolicy::EVERY;
+            } else {
+                return false;
+            }
+        }
+        else {
+            return false;
+        }
+    }
+
+    if (outbound_config.low_watermark > outbound_config.high_watermark) {
+        std::cerr << "--queue-low must not exceed --queue-high" << std::endl;
+        return false;
+    }
+    if (outbound_config.hard_limit < outbound_config.high_watermark) {
+        std::cerr << "--queue-max must not be below --queue-high" << std::endl;
+        return false;
+    }
+    return true;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    ServerConfig config;
+    if (!parse_args(argc, argv, config)) {
+        show_usage(argv[0]);
+        return 1;
+    }
+#ifdef __linux__
+    // Kernels without everything the io_uring loop needs get the epoll one
+    if (config.mode == ServerMode::URING && !Uring::supported()) {
+        std::cerr << "✗ io_uring unavailable (" << strerror(errno) << "), using epoll" << std::endl;
+        config.mode = ServerMode::EPOLL;
+    }
+#endif
+    if (config.mode == ServerMode::THREADS) {
+        config.shards = 1;
+    } else if (config.shards == 0) {
+        config.shards = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, MAX_SHARDS);
+    }
+
     std::cout << "╔════════════════════════════════════════════════╗" << std::endl;
     std::cout << "║  LAN Chat Room Server v2.0                     ║" << std::endl;
     std::cout << "║  Cross-platform Edition                        ║" << std::endl;
@@ -298,11 +1285,23 @@ int main() {
     // Setup signal handlers
     std::signal(SIGINT, signal_handler);
     std::signal(SIGTERM, signal_handler);
+#ifndef _WIN32
+    // Failed writes are reported through send() instead
+    std::signal(SIGPIPE, SIG_IGN);
+#endif
     
     try {
         // Initialize sockets
         SocketInitializer socket_init;
         
+        if (!create_uploads_dir() || !open_blob_store()) {
+            throw std::runtime_error("Cannot create uploads directory: " + std::string(strerror(errno)));
+        }
+        if (!open_chat_log()) {
+            throw std::runtime_error("Cannot open chat log in " + chat_log_config.dir + ": " +
+                                     std::string(strerror(errno)));
+        }
+        
         // Create server socket
         SOCKET server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
         if (server_socket == INVALID_SOCKET) {
@@ -315,6 +1314,14 @@ int main() {
                       (char*)&opt, sizeof(opt)) < 0) {
             std::cerr << "Warning: Failed to set SO_REUSEADDR" << std::endl;
         }
+#ifdef __linux__
+        // Every reactor shard listens on the port with a socket of its own
+        if (config.mode != ServerMode::THREADS && config.shards > 1 &&
+            setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+            std::cerr << "Warning: Failed to set SO_REUSEPORT; using one shard" << std::endl;
+            config.shards = 1;
+        }
+#endif
 
         // Bind socket
         struct sockaddr_in server_addr;
@@ -328,25 +1335,48 @@ int main() {
             throw std::runtime_error("Bind failed: " + get_socket_error());
         }
 
-        // Listen for connections
-        if (listen(server_socket, MAX_CLIENTS) == SOCKET_ERROR) {
+        // Listen for connections; the event loop absorbs join storms, so
+        // let the kernel queue as many as it allows
+        int backlog = config.mode != ServerMode::THREADS ? SOMAXCONN : MAX_CLIENTS;
+        if (listen(server_socket, backlog) == SOCKET_ERROR) {
             throw std::runtime_error("Listen failed: " + get_socket_error());
         }
 
         std::cout << "✓ Server started successfully" << std::endl;
         std::cout << "✓ Listening on port " << PORT << std::endl;
-        std::cout << "✓ Max clients: " << MAX_CLIENTS << std::endl;
+        if (config.mode != ServerMode::THREADS) {
+            std::cout << "✓ Mode: " << (config.mode == ServerMode::URING ? "io_uring" : "epoll")
+                      << " event loop";
+            if (config.shards > 1) {
+                std::cout << " (" << config.shards << " shards)";
+            }
+            std::cout << std::endl;
+        } else {
+            std::cout << "✓ Mode: thread per client" << std::endl;
+            std::cout << "✓ Max clients: " << MAX_CLIENTS << std::endl;
+        }
         std::cout << "✓ Press Ctrl+C to stop the server" << std::endl;
         std::cout << "\n" << std::string(50, '=') << std::endl;
 
+        start_log_writer();
+        start_disk_writers();
+        start_heartbeats();
+
         // Set socket to non-blocking mode on Linux
 #ifndef _WIN32
         int flags = fcntl(server_socket, F_GETFL, 0);
         fcntl(server_socket, F_SETFL, flags | O_NONBLOCK);
 #endif
 
+#ifdef __linux__
+        if (config.mode != ServerMode::THREADS) {
+            run_reactor_server(server_socket, static_cast<int>(config.shards),
+                               config.mode == ServerMode::URING);
+        }
+#endif
+
         // Accept client connections
-        while (server_running) {
+        while (server_running && config.mode == ServerMode::THREADS) {
             struct sockaddr_in client_addr;
             socklen_t client_len = sizeof(client_addr);
             
@@ -375,16 +1405,17 @@ int main() {
 
         // Cleanup
         closesocket(server_socket);
+        stop_heartbeats();
         
         // Disconnect all clients
-        {
-            std::lock_guard<std::mutex> lock(clients_mutex);
-            for (auto& client : clients) {
-                closesocket(client->socket);
-            }
-            clients.clear();
-        }
+        for_each_client([](ClientInfo& client) {
+            client.outbound.close();
+            closesocket(client.socket);
+        });
         
+        stop_disk_writers();
+        stop_log_writer();
+        close_chat_log();
         std::cout << "✓ Server stopped" << std::endl;
         return 0;
     }
@@ -0,0 +1,181 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <cstring>
+#include <stdexcept>
+
+#include "../shared/platform.h"
+#include "../shared/constants.h"
+#include "../shared/protocol.h"
+#include "outbound.h"
+#include "disk_writer.h"
+#include "file_receiver.h"
+#include "transfer.h"
+#include "blob_store.h"
+#include "metrics.h"
+#include "log_writer.h"
+#include "registry.h"
+#include "chat_log.h"
+#include "heartbeat.h"
+#include "presence.h"
+#include "peer.h"
+#include "shaper.h"
+#include "slab_pool.h"
+#include "session.h"
+
+// A file being streamed to a client in pieces of a scheduling quantum
+struct Download {
+    uint64_t id;
+    std::shared_ptr<const ServedFile> file;
+    int64_t next;       // Offset of the next piece to queue
+    int64_t end;
+};
+
+// Client information structure
+struct ClientInfo {
+    SOCKET socket;
+    std::string username;
+    std::string ip_address;
+    std::chrono::system_clock::time_point connected_time;
+    std::atomic<bool> active{true};
+
+    uint64_t id = 0;              // Assigned when the client joins the registry
+    size_t registry_index = 0;    // Slot in its registry shard, under the shard lock
+    // Its room. The client's own connection changes it, and so does a
+    // connection resuming its session, from another thread, while this one
+    // may still be winding down; both hold room_mutex, under which the
+    // roster entry changes hands too.
+    std::mutex room_mutex;
+    std::shared_ptr<Room> room;
+    bool replaced = false;        // Session taken over: joins nothing more
+    int shard = 0;                // Reactor shard that owns the socket (epoll mode)
+    Heartbeat heartbeat;          // PINGs, round trip time and idleness (chat clients)
+    std::atomic<bool> idle{false};  // Shown as idle on the roster
+    bool listed = false;          // On the presence roster; under its lock
+
+    // Frames waiting for the (non-blocking) socket to accept them
+    OutboundQueue outbound;
+
+    // Requested downloads, taking turns a piece at a time as the queue drains
+    std::mutex download_mutex;
+    std::deque<Download> downloads;
+
+    // Token bucket of the user's file traffic; null without a per-user cap
+    std::shared_ptr<TokenBucket> bandwidth;
+
+    // Negotiated in HELLO; a client that sent a bare USERNAME_SET has none
+    // of the capabilities
+    uint32_t capabilities = 0;
+    uint32_t max_payload = MAX_FRAME_PAYLOAD;   // Largest frame payload it takes
+    size_t receive_window = 0;                  // File bytes queued per turn, 0 = the quantum
+    uint64_t session = 0;                       // Token to resume with, 0 if none
+    bool leaving = false;                       // Sent DISCONNECT: its session ends too
+
+    ClientInfo(SOCKET s, const std::string& name, const std::string& ip)
+        : socket(s), username(name), ip_address(ip),
+          connected_time(std::chrono::system_clock::now()) {}
+};
+
+// Client records come from the slab pools, together with their reference
+// counts
+inline std::shared_ptr<ClientInfo> make_client(SOCKET socket, const std::string& username,
+                                               const std::string& ip_address) {
+    return std::allocate_shared<ClientInfo>(PoolAllocator<ClientInfo>(), socket, username, ip_address);
+}
+
+// Global state
+extern std::atomic<bool> server_running;
+
+std::string get_socket_error();
+std::string get_client_ip(SOCKET socket);
+
+// 64 bits from the system's random source, for tokens that grant access
+// to something and must not be guessable from others handed out
+uint64_t random_token();
+
+// Message delivery
+bool deliver(ClientInfo& client, const FrameRef& frame, bool droppable = true);
+bool flush_outbound(ClientInfo& client);
+bool write_outbound(ClientInfo& client);
+bool feed_download(ClientInfo& client);
+bool downloads_waiting(ClientInfo& client);
+void drop_client(ClientInfo& client);
+void broadcast(ClientInfo& sender, std::string_view message);
+void post_message(ClientInfo& sender, std::string_view message);
+void notify_room(const Room& room, const std::string& notification, const ClientInfo* except = nullptr);
+void notify_client(ClientInfo& client, const std::string& notification);
+
+// The client's room, null once its session has been taken over
+std::shared_ptr<Room> current_room(ClientInfo& client);
+void fan_out(const FrameRef& frame, const std::shared_ptr<const MemberList>& members,
+             const ClientInfo* except = nullptr);
+
+// Protocol parsing and client registration shared by both server modes
+bool parse_username(const FrameView& frame, std::string& username);
+bool parse_file_header(const FrameView& frame, std::string& filename, int64_t& file_size,
+                       uint64_t& content_hash);
+void register_client(const std::shared_ptr<ClientInfo>& client_info);
+void unregister_client(const std::shared_ptr<ClientInfo>& client_info);
+
+// Log a client in from the first frame of its connection: HELLO, or a bare
+// USERNAME_SET from older clients. Returns the registered (or resumed)
+// client, or null if the frame is neither.
+std::shared_ptr<ClientInfo> open_chat(const FrameView& frame, SOCKET socket, const std::string& ip_address,
+                                      int shard);
+
+// Take a client out of its room and off the roster and tell everyone it
+// left
+void announce_departure(const std::shared_ptr<ClientInfo>& client_info);
+
+// Upload control shared by both server modes: answer a FILE_TRANSFER on a
+// chat connection, or a FILE_ATTACH that opens an extra data connection
+bool offer_transfer(const std::shared_ptr<ClientInfo>& client, const std::string& filename,
+                    int64_t file_size, uint64_t content_hash, uint16_t stream);
+bool attach_stream(const std::shared_ptr<ClientInfo>& stream, const FrameView& frame);
+
+// Answer a FILE_DOWNLOAD: the file follows as FILE_CHUNK frames, then
+// FILE_DONE. Returns false only for a malformed request.
+bool start_download(ClientInfo& client, const FrameView& frame);
+
+// Answer a STATS request
+void send_stats(ClientInfo& client);
+
+// Answer a ROOM_JOIN: move the client and tell both rooms
+void change_room(const std::shared_ptr<ClientInfo>& client, const FrameView& frame);
+
+#ifdef __linux__
+// Event loop server with shard_count reactor threads (the caller's thread
+// is the first), on epoll or io_uring; returns when server_running is
+// cleared or request_reactor_stop() is called
+void run_reactor_server(SOCKET server_socket, int shard_count, bool uring);
+void request_reactor_stop();
+
+// With the io_uring backend, or on epoll for a client that negotiated
+// CAP_BATCHING, have the shard that owns the client write its queued
+// output at the end of its current pass; false when the caller should
+// write it itself
+bool defer_write(ClientInfo& client);
+
+// Index of the reactor shard running this thread, or -1 when the caller
+// may write to any client itself (thread mode, or a single shard)
+int current_shard();
+
+// Hand a frame to each shard in the targets bitmask, to be queued for the
+// members that shard owns
+void forward_to_shards(uint64_t targets, const FrameRef& frame,
+                       const std::shared_ptr<const MemberList>& members, const ClientInfo* except);
+#else
+inline int current_shard() { return -1; }
+inline bool defer_write(ClientInfo&) { return false; }
+inline void forward_to_shards(uint64_t, const FrameRef&, const std::shared_ptr<const MemberList>&,
+                              const ClientInfo*) {}
+#endif
+
+#endif
@@ -0,0 +1,113 @@
+#include "session.h"
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "server.h"
+
+SessionConfig session_config;
+
+namespace {
+
+struct Session {
+    std::shared_ptr<ClientInfo> client;   // On the current connection, or the lost one
+    bool parked = false;
+    std::chrono::steady_clock::time_point expires{};
+    History::Clock::time_point lost{};
+};
+
+std::mutex sessions_mutex;
+std::map<uint64_t, Session> sessions;   // By token
+size_t parked_count = 0;
+
+} // namespace
+
+void open_session(const std::shared_ptr<ClientInfo>& client) {
+    if (session_config.grace.count() == 0 || !(client->capabilities & CAP_RESUME)) {
+        client->capabilities &= ~CAP_RESUME;
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(sessions_mutex);
+    uint64_t token;
+    do {
+        token = random_token();
+    } while (token == 0 || sessions.count(token));
+    sessions[token] = Session{client};
+    client->session = token;
+}
+
+std::shared_ptr<ClientInfo> claim_session(const std::shared_ptr<ClientInfo>& client, uint64_t token,
+                                          History::Clock::time_point& since) {
+    std::shared_ptr<ClientInfo> previous;
+    {
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        auto it = sessions.find(token);
+        if (it == sessions.end() || it->second.client->username != client->username) {
+            return nullptr;
+        }
+        previous = std::move(it->second.client);
+        since = it->second.parked ? it->second.lost : History::Clock::now();
+        if (it->second.parked) {
+            parked_count--;
+        }
+        it->second = Session{client};
+    }
+    client->session = token;
+
+    // Still connected as far as the server can tell; its connection ends
+    // without touching the session
+    if (previous->active) {
+        drop_client(*previous);
+    }
+    count(Counter::SESSIONS_RESUMED);
+    return previous;
+}
+
+SessionEnd end_session(const std::shared_ptr<ClientInfo>& client) {
+    if (client->session == 0) {
+        return SessionEnd::CLOSED;
+    }
+
+    std::lock_guard<std::mutex> lock(sessions_mutex);
+    auto it = sessions.find(client->session);
+    if (it == sessions.end() || it->second.client != client) {
+        return SessionEnd::REPLACED;
+    }
+    if (client->leaving || !server_running) {
+        sessions.erase(it);
+        return SessionEnd::CLOSED;
+    }
+    it->second.parked = true;
+    parked_count++;
+    it->second.expires = std::chrono::steady_clock::now() + session_config.grace;
+    it->second.lost = History::Clock::now();
+    count(Counter::SESSIONS_PARKED);
+    return SessionEnd::PARKED;
+}
+
+void expire_sessions() {
+    std::vector<std::shared_ptr<ClientInfo>> expired;
+    {
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        if (parked_count == 0) {
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        for (auto it = sessions.begin(); it != sessions.end();) {
+            if (it->second.parked && it->second.expires <= now) {
+                expired.push_back(std::move(it->second.client));
+                it = sessions.erase(it);
+                parked_count--;
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    for (const auto& client : expired) {
+        count(Counter::SESSIONS_EXPIRED);
+        announce_departure(client);
+    }
+}
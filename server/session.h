@@ -0,0 +1,54 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <chrono>
+#include <memory>
+
+#include "history.h"
+
+struct ClientInfo;
+
+// Sessions that outlive their connection, for clients that negotiated
+// CAP_RESUME in HELLO.
+//
+// Such a client is given a random token in the HELLO reply. If its
+// connection is lost, rather than closed with DISCONNECT, the session is
+// parked for the grace period: the client stays in its room and on the
+// roster and nobody is told it left. A HELLO carrying the token within
+// that time takes the session over without the join path: same ID, room
+// and roster entry, no announcements, and the room's chat since the
+// connection was lost is replayed. A connection the server still thinks
+// is alive (the network changed under it, say) is dropped in favour of the
+// new one. Once the grace period runs out, the departure is announced as
+// it would have been straight away.
+struct SessionConfig {
+    std::chrono::seconds grace{30};   // 0 = sessions end with their connection
+};
+
+extern SessionConfig session_config;
+
+// Give a client that asked for CAP_RESUME a new session, or take the
+// capability away when sessions are off
+void open_session(const std::shared_ptr<ClientInfo>& client);
+
+// Hand the session with this token to a client logging in under the same
+// name. Returns the client it belonged to, whose place the new one takes,
+// with since set to when its connection was lost; null if the token is
+// unknown, expired or someone else's.
+std::shared_ptr<ClientInfo> claim_session(const std::shared_ptr<ClientInfo>& client, uint64_t token,
+                                          History::Clock::time_point& since);
+
+enum class SessionEnd {
+    CLOSED,     // Gone: announce the departure
+    PARKED,     // Waiting for a reconnect
+    REPLACED    // Already taken over by a newer connection
+};
+
+// Called as a chat client's connection ends
+SessionEnd end_session(const std::shared_ptr<ClientInfo>& client);
+
+// Announce the departure of parked clients whose grace period is over;
+// run by the heartbeat thread every tick
+void expire_sessions();
+
+#endif
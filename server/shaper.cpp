@@ -0,0 +1,100 @@
+#include "shaper.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+#ifdef __linux__
+    #include <netinet/tcp.h>
+#endif
+
+#include "server.h"
+
+ShapingConfig shaping_config;
+
+namespace {
+
+std::mutex users_mutex;
+std::unordered_map<std::string, std::weak_ptr<TokenBucket>> user_buckets;
+
+// Created on first use, once the configuration is known
+TokenBucket* server_bucket() {
+    static TokenBucket bucket(shaping_config.server_rate);
+    return shaping_config.server_rate > 0 ? &bucket : nullptr;
+}
+
+} // namespace
+
+TokenBucket::TokenBucket(size_t rate)
+    : rate_(static_cast<double>(rate)),
+      capacity_(rate_ * std::chrono::duration<double>(TOKEN_BUCKET_BURST).count()),
+      tokens_(capacity_),
+      last_refill_(Clock::now()) {}
+
+void TokenBucket::refill(Clock::time_point now) {
+    double elapsed = std::chrono::duration<double>(now - last_refill_).count();
+    tokens_ = std::min(capacity_, tokens_ + elapsed * rate_);
+    last_refill_ = now;
+}
+
+void TokenBucket::charge(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    refill(Clock::now());
+    tokens_ -= static_cast<double>(bytes);
+}
+
+TokenBucket::Clock::duration TokenBucket::delay() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    refill(Clock::now());
+    if (tokens_ >= 0) {
+        return Clock::duration::zero();
+    }
+    return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(-tokens_ / rate_));
+}
+
+std::shared_ptr<TokenBucket> user_bucket(const std::string& username) {
+    if (shaping_config.user_rate == 0) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(users_mutex);
+    std::weak_ptr<TokenBucket>& slot = user_buckets[username];
+    std::shared_ptr<TokenBucket> bucket = slot.lock();
+    if (!bucket) {
+        // Forget users whose connections have all gone
+        for (auto it = user_buckets.begin(); it != user_buckets.end();) {
+            it = it->second.expired() && it->first != username ? user_buckets.erase(it) : std::next(it);
+        }
+        bucket = std::make_shared<TokenBucket>(shaping_config.user_rate);
+        slot = bucket;
+    }
+    return bucket;
+}
+
+void charge_transfer(ClientInfo& client, size_t bytes) {
+    if (client.bandwidth) {
+        client.bandwidth->charge(bytes);
+    }
+    if (TokenBucket* server = server_bucket()) {
+        server->charge(bytes);
+    }
+}
+
+std::chrono::steady_clock::duration transfer_delay(ClientInfo& client) {
+    auto delay = std::chrono::steady_clock::duration::zero();
+    if (client.bandwidth) {
+        delay = client.bandwidth->delay();
+    }
+    if (TokenBucket* server = server_bucket()) {
+        delay = std::max(delay, server->delay());
+    }
+    return delay;
+}
+
+void limit_unsent(SOCKET socket) {
+#ifdef TCP_NOTSENT_LOWAT
+    int limit = static_cast<int>(shaping_config.quantum);
+    setsockopt(socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &limit, sizeof(limit));
+#else
+    (void)socket;
+#endif
+}
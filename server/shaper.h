@@ -0,0 +1,83 @@
+#ifndef SHAPER_H
+#define SHAPER_H
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "../shared/platform.h"
+
+struct ClientInfo;
+
+// Scheduling of file traffic around chat.
+//
+// Chat and control frames have strict priority: a client's file data is
+// queued only once everything else for it has been written, a quantum at a
+// time, so a frame that turns up meanwhile waits behind at most one
+// quantum. The kernel is kept from hoarding more than a quantum of unsent
+// file data as well (TCP_NOTSENT_LOWAT). A client's downloads take turns,
+// one quantum each, and the event loops read at most a quantum from an
+// upload before serving other connections.
+//
+// File bytes in either direction are also charged to token buckets, one
+// per user (shared by all of that user's connections) and one for the whole
+// server. A bucket may go into debt by one read or piece; a transfer whose
+// bucket is in debt waits until it has refilled. Chat is never charged.
+struct ShapingConfig {
+    size_t quantum = 128 * 1024;   // File bytes a transfer moves per turn
+    size_t user_rate = 0;          // File bytes per second for each user, 0 = no cap
+    size_t server_rate = 0;        // ... for everyone together
+};
+
+extern ShapingConfig shaping_config;
+
+// A bucket holds this much traffic at its rate, so a transfer that was
+// woken a little late catches up
+constexpr std::chrono::milliseconds TOKEN_BUCKET_BURST{250};
+
+class TokenBucket {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit TokenBucket(size_t rate);
+
+    // Take bytes out, going into debt if there aren't enough
+    void charge(size_t bytes);
+
+    // How long until the bucket is out of debt; zero when it is not in debt
+    Clock::duration delay();
+
+private:
+    void refill(Clock::time_point now);
+
+    std::mutex mutex_;
+    double rate_;           // Bytes per second
+    double capacity_;
+    double tokens_;
+    Clock::time_point last_refill_;
+};
+
+// True when any bandwidth cap is configured
+inline bool shaping_enabled() {
+    return shaping_config.user_rate > 0 || shaping_config.server_rate > 0;
+}
+
+// The bucket shared by every connection of a user, or null when users are
+// not capped. Called as a connection learns whose it is.
+std::shared_ptr<TokenBucket> user_bucket(const std::string& username);
+
+// Charge file bytes moved for a client to its user's and the server's
+// buckets
+void charge_transfer(ClientInfo& client, size_t bytes);
+
+// How long the client's file traffic has to wait for its buckets; zero
+// when it may go on
+std::chrono::steady_clock::duration transfer_delay(ClientInfo& client);
+
+// Let a socket hold at most a quantum of unsent data, so chat queued
+// behind file data is not stuck behind the whole send buffer
+void limit_unsent(SOCKET socket);
+
+#endif
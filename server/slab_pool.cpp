@@ -0,0 +1,264 @@
+#include "slab_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+#include "metrics.h"
+
+namespace {
+
+constexpr size_t BLOCK_HEADER_SIZE = 16;    // Keeps blocks 16-byte aligned
+constexpr size_t MIN_BLOCK_SHIFT = 6;       // 64 bytes
+constexpr int CLASS_COUNT = 13;             // ... up to 256 KB
+constexpr uint32_t OVERSIZE = UINT32_MAX;   // Class of blocks from the heap
+
+// A thread keeps about this much per class, and at least two blocks
+constexpr size_t CACHE_BYTES = 64 * 1024;
+
+// New slabs are at least this big and hold at least four blocks
+constexpr size_t SLAB_BYTES = 256 * 1024;
+
+size_t block_size(int size_class) {
+    return size_t{1} << (MIN_BLOCK_SHIFT + size_class);
+}
+
+size_t cache_limit(int size_class) {
+    return std::max<size_t>(2, CACHE_BYTES / block_size(size_class));
+}
+
+struct FreeBlock {
+    FreeBlock* next;
+};
+
+struct FreeList {
+    FreeBlock* head = nullptr;
+    size_t count = 0;
+
+    void push(FreeBlock* block) {
+        block->next = head;
+        head = block;
+        count++;
+    }
+
+    FreeBlock* pop() {
+        FreeBlock* block = head;
+        head = block->next;
+        count--;
+        return block;
+    }
+
+    // Move up to n blocks onto other
+    void move_to(FreeList& other, size_t n) {
+        while (n-- > 0 && head) {
+            other.push(pop());
+        }
+    }
+};
+
+struct Depot {
+    std::mutex mutex;
+    FreeList blocks;
+};
+
+Depot depots[CLASS_COUNT];
+std::atomic<uint64_t> reserved_bytes{0};
+
+// Plain data, so it stays usable while the thread's other thread_local
+// objects are destroyed; ThreadCacheOwner hands it back at thread exit
+struct ThreadCache {
+    FreeList lists[CLASS_COUNT];
+    bool exited;
+};
+
+thread_local ThreadCache cache;
+
+struct ThreadCacheOwner {
+    ~ThreadCacheOwner() {
+        for (int c = 0; c < CLASS_COUNT; c++) {
+            std::lock_guard<std::mutex> lock(depots[c].mutex);
+            cache.lists[c].move_to(depots[c].blocks, SIZE_MAX);
+        }
+        cache.exited = true;
+    }
+};
+
+thread_local ThreadCacheOwner cache_owner;
+
+// Naming the owner constructs it on a thread's first use of the pools, so
+// its destructor is sure to run
+void touch_owner() {
+    (void)&cache_owner;
+}
+
+int class_of(size_t size) {
+    size_t needed = size + BLOCK_HEADER_SIZE;
+    int size_class = 0;
+    while (size_class < CLASS_COUNT && block_size(size_class) < needed) {
+        size_class++;
+    }
+    return size_class;
+}
+
+void* to_user(char* block, uint32_t size_class) {
+    std::memcpy(block, &size_class, sizeof(size_class));
+    return block + BLOCK_HEADER_SIZE;
+}
+
+// Take a batch from the depot, or carve a new slab, into list
+void refill(int size_class, FreeList& list) {
+    size_t batch = cache_limit(size_class) / 2 + 1;
+    {
+        std::lock_guard<std::mutex> lock(depots[size_class].mutex);
+        depots[size_class].blocks.move_to(list, batch);
+    }
+    if (list.head) {
+        count(Counter::POOL_REFILLS);
+        return;
+    }
+
+    size_t size = block_size(size_class);
+    size_t slab_size = std::max(SLAB_BYTES, 4 * size);
+    char* slab = static_cast<char*>(::operator new(slab_size));
+    for (size_t offset = 0; offset < slab_size; offset += size) {
+        list.push(reinterpret_cast<FreeBlock*>(slab + offset));
+    }
+    reserved_bytes.fetch_add(slab_size, std::memory_order_relaxed);
+    count(Counter::POOL_SLABS);
+}
+
+} // namespace
+
+void* pool_allocate(size_t size) {
+    int size_class = class_of(size);
+    if (size_class == CLASS_COUNT) {
+        count(Counter::POOL_OVERSIZE);
+        return to_user(static_cast<char*>(::operator new(size + BLOCK_HEADER_SIZE)), OVERSIZE);
+    }
+
+    count(Counter::POOL_ALLOCS);
+    if (cache.exited) {
+        // Past the thread's cache teardown: through a list of its own,
+        // whose leftovers go back to the depot
+        FreeList list;
+        refill(size_class, list);
+        void* block = to_user(reinterpret_cast<char*>(list.pop()), size_class);
+        std::lock_guard<std::mutex> lock(depots[size_class].mutex);
+        list.move_to(depots[size_class].blocks, SIZE_MAX);
+        return block;
+    }
+
+    touch_owner();
+    FreeList& list = cache.lists[size_class];
+    if (!list.head) {
+        refill(size_class, list);
+    }
+    return to_user(reinterpret_cast<char*>(list.pop()), size_class);
+}
+
+void pool_free(void* user) {
+    if (!user) {
+        return;
+    }
+    char* block = static_cast<char*>(user) - BLOCK_HEADER_SIZE;
+    uint32_t size_class;
+    std::memcpy(&size_class, block, sizeof(size_class));
+    if (size_class == OVERSIZE) {
+        ::operator delete(block);
+        return;
+    }
+
+    FreeBlock* freed = reinterpret_cast<FreeBlock*>(block);
+    if (cache.exited) {
+        std::lock_guard<std::mutex> lock(depots[size_class].mutex);
+        depots[size_class].blocks.push(freed);
+        return;
+    }
+
+    touch_owner();
+    FreeList& list = cache.lists[size_class];
+    list.push(freed);
+    size_t limit = cache_limit(size_class);
+    if (list.count > limit) {
+        std::lock_guard<std::mutex> lock(depots[size_class].mutex);
+        list.move_to(depots[size_class].blocks, list.count - limit / 2);
+    }
+}
+
+namespace {
+
+char* allocate_buffer(size_t size) {
+    return static_cast<char*>(pool_allocate(size));
+}
+
+void free_buffer(char* data) {
+    pool_free(data);
+}
+
+// Heap allocation counting. Threads spread their increments over striped
+// counters, each on a cache line of its own.
+constexpr size_t ALLOCATION_STRIPES = 16;
+
+struct alignas(64) Stripe {
+    std::atomic<uint64_t> allocations{0};
+};
+
+Stripe stripes[ALLOCATION_STRIPES];
+std::atomic<size_t> next_stripe{0};
+
+Stripe& local_stripe() {
+    thread_local size_t index = next_stripe.fetch_add(1, std::memory_order_relaxed) % ALLOCATION_STRIPES;
+    return stripes[index];
+}
+
+} // namespace
+
+const BufferStorage pool_buffer_storage = {allocate_buffer, free_buffer};
+
+uint64_t heap_allocations() {
+    uint64_t total = 0;
+    for (const Stripe& stripe : stripes) {
+        total += stripe.allocations.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+std::string pool_report() {
+    std::string report = "heap_allocs " + std::to_string(heap_allocations()) + "\n";
+    report += "pool_reserved_bytes " + std::to_string(reserved_bytes.load(std::memory_order_relaxed)) + "\n";
+    size_t depot_bytes = 0;
+    for (int c = 0; c < CLASS_COUNT; c++) {
+        std::lock_guard<std::mutex> lock(depots[c].mutex);
+        depot_bytes += depots[c].blocks.count * block_size(c);
+    }
+    report += "pool_depot_bytes " + std::to_string(depot_bytes) + "\n";
+    return report;
+}
+
+void* operator new(size_t size) {
+    local_stripe().allocations.fetch_add(1, std::memory_order_relaxed);
+    if (size == 0) {
+        size = 1;
+    }
+    while (true) {
+        if (void* memory = std::malloc(size)) {
+            return memory;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    std::free(memory);
+}
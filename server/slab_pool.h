@@ -0,0 +1,55 @@
+#ifndef SLAB_POOL_H
+#define SLAB_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "../shared/protocol.h"
+
+// Size-classed slab pools for what the message path allocates: frame
+// buffers, receive buffers, queue nodes and client records.
+//
+// Blocks come in power-of-two classes from 64 bytes to 256 KB, each with a
+// small header naming its class. Every thread keeps a free list per class
+// and allocates and frees without locking. Frames are usually freed by a
+// different thread than the one that encoded them, so a list that grows
+// past its limit hands a batch to a shared depot, and a thread that runs
+// dry takes a batch back, one lock per class and batch. Only when the
+// depot is empty as well is a new slab carved from the heap. Slabs are
+// kept for the life of the process, so once traffic has warmed the pools
+// up, the message path stops touching the heap. Larger requests go to the
+// heap directly.
+void* pool_allocate(size_t size);
+void pool_free(void* block);
+
+// Pool-backed storage for RingBuffer
+extern const BufferStorage pool_buffer_storage;
+
+// STL allocator over the pools, for allocate_shared()
+template <typename T>
+struct PoolAllocator {
+    using value_type = T;
+
+    PoolAllocator() = default;
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>&) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(pool_allocate(n * sizeof(T))); }
+    void deallocate(T* p, size_t) { pool_free(p); }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U>&) const { return true; }
+    template <typename U>
+    bool operator!=(const PoolAllocator<U>&) const { return false; }
+};
+
+// Calls to operator new by the whole process so far. The server replaces
+// the global operator new to count them, spread over striped counters so
+// the count itself doesn't contend.
+uint64_t heap_allocations();
+
+// "name value" lines for STATS: heap allocations and what the pools hold
+std::string pool_report();
+
+#endif
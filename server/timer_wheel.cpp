@@ -0,0 +1,68 @@
+#include "timer_wheel.h"
+
+TimerWheel::TimerWheel(uint64_t now) : now_(now) {
+    for (auto& level : slots_) {
+        for (TimerNode& slot : level) {
+            slot.prev = slot.next = &slot;
+        }
+    }
+}
+
+void TimerWheel::schedule(TimerNode& timer, uint64_t deadline) {
+    if (timer.scheduled()) {
+        unlink(timer);
+    }
+    if (deadline <= now_) {
+        deadline = now_ + 1;
+    } else if (deadline - now_ >= SPAN) {
+        deadline = now_ + SPAN - 1;
+    }
+    timer.deadline = deadline;
+    link(timer);
+}
+
+void TimerWheel::cancel(TimerNode& timer) {
+    if (timer.scheduled()) {
+        unlink(timer);
+    }
+}
+
+// File a timer by its distance from now: level L holds distances below
+// SLOTS^(L+1), indexed by the deadline's L-th group of SLOT_BITS bits
+void TimerWheel::link(TimerNode& timer) {
+    uint64_t distance = timer.deadline - now_;
+    int level = 0;
+    while (level < LEVELS - 1 && distance >= uint64_t{1} << (SLOT_BITS * (level + 1))) {
+        level++;
+    }
+
+    TimerNode& slot = slots_[level][(timer.deadline >> (SLOT_BITS * level)) & (SLOTS - 1)];
+    timer.prev = slot.prev;
+    timer.next = &slot;
+    slot.prev->next = &timer;
+    slot.prev = &timer;
+    size_++;
+}
+
+void TimerWheel::unlink(TimerNode& timer) {
+    timer.prev->next = timer.next;
+    timer.next->prev = timer.prev;
+    timer.prev = timer.next = nullptr;
+    size_--;
+}
+
+// When the levels below have come full circle, the slot of the level above
+// that starts now holds timers that are close enough to file lower down
+void TimerWheel::cascade() {
+    for (int level = 1; level < LEVELS; level++) {
+        if (now_ & ((uint64_t{1} << (SLOT_BITS * level)) - 1)) {
+            return;
+        }
+        TimerNode& slot = slots_[level][(now_ >> (SLOT_BITS * level)) & (SLOTS - 1)];
+        while (slot.next != &slot) {
+            TimerNode& timer = *slot.next;
+            unlink(timer);
+            link(timer);
+        }
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <cstddef>
+#include <cstdint>
+
+// A timer kept in a TimerWheel. The node is embedded in whatever it times,
+// so scheduling never allocates.
+struct TimerNode {
+    TimerNode* prev = nullptr;
+    TimerNode* next = nullptr;
+    uint64_t deadline = 0;     // Tick it fires on
+    void* owner = nullptr;     // For the expiry callback
+
+    bool scheduled() const { return prev != nullptr; }
+};
+
+// Hierarchical timing wheel: LEVELS wheels of SLOTS lists, each level's
+// slots SLOTS times as wide as the one below. A timer is filed in the
+// lowest level whose span covers its distance, and moved down a level
+// whenever the wheel below comes round to it, so scheduling, cancelling
+// and each tick cost O(1) however many timers are waiting; a tick only
+// touches the timers due in it and, now and then, one slot being moved
+// down. Not thread-safe.
+class TimerWheel {
+public:
+    static constexpr int SLOT_BITS = 6;
+    static constexpr int SLOTS = 1 << SLOT_BITS;
+    static constexpr int LEVELS = 4;
+
+    // Farthest a timer can be set; later deadlines fire this far out
+    static constexpr uint64_t SPAN = uint64_t{1} << (SLOT_BITS * LEVELS);
+
+    explicit TimerWheel(uint64_t now = 0);
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    uint64_t now() const { return now_; }
+    size_t size() const { return size_; }
+
+    // Set (or move) a timer to fire on the given tick; deadlines already
+    // passed fire on the next one
+    void schedule(TimerNode& timer, uint64_t deadline);
+
+    void cancel(TimerNode& timer);
+
+    // Advance the clock to tick `to`, calling expire(TimerNode&) for each
+    // timer as it falls due. The timer is unscheduled first, so the
+    // callback may set it again.
+    template <typename F>
+    void advance(uint64_t to, F expire) {
+        while (now_ < to) {
+            if (size_ == 0) {
+                now_ = to;
+                return;
+            }
+            now_++;
+            cascade();
+
+            TimerNode& slot = slots_[0][now_ & (SLOTS - 1)];
+            while (slot.next != &slot) {
+                TimerNode& timer = *slot.next;
+                unlink(timer);
+                expire(timer);
+            }
+        }
+    }
+
+private:
+    void link(TimerNode& timer);
+    void unlink(TimerNode& timer);
+    void cascade();
+
+    TimerNode slots_[LEVELS][SLOTS];   // Heads of circular lists
+    uint64_t now_;
+    size_t size_ = 0;
+};
+
+#endif
@@ -0,0 +1,349 @@
+#include "transfer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <iterator>
+#include <unordered_map>
+#include <vector>
+
+#include "server.h"
+
+namespace {
+
+std::mutex transfers_mutex;
+std::unordered_map<uint64_t, std::shared_ptr<Transfer>> transfers;
+
+// Unfinished uploads are hidden files next to the finished ones
+std::string partial_path(uint64_t id) {
+    char name[32];
+    std::snprintf(name, sizeof(name), ".%016llx.part", static_cast<unsigned long long>(id));
+    return std::string(UPLOADS_DIR) + "/" + name;
+}
+
+std::string final_path(const std::string& filename) {
+    return std::string(UPLOADS_DIR) + "/" + filename;
+}
+
+// Drop partial uploads nobody has touched for TRANSFER_EXPIRY; called with
+// transfers_mutex held
+void expire_transfers() {
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = transfers.begin(); it != transfers.end();) {
+        if (now - it->second->last_activity() > TRANSFER_EXPIRY) {
+            std::cout << "✗ Discarding abandoned upload " << it->second->filename()
+                      << " from " << it->second->owner() << std::endl;
+            std::remove(partial_path(it->first).c_str());
+            it = transfers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+FrameRef transfer_frame(MessageType type, uint64_t id, std::string_view extra, uint16_t stream) {
+    char encoded_id[sizeof(uint64_t)];
+    put_u64(encoded_id, id);
+    return FrameBuffer::create(type, {std::string_view(encoded_id, sizeof(encoded_id)), extra}, 0, stream);
+}
+
+} // namespace
+
+Transfer::Transfer(uint64_t id, const std::string& owner, const std::string& filename,
+                   int64_t size, uint64_t content_hash, std::shared_ptr<DiskFile> file)
+    : id_(id), owner_(owner), filename_(filename), size_(size), content_hash_(content_hash),
+      file_(std::move(file)), session_start_(std::chrono::steady_clock::now()), last_activity_(session_start_) {}
+
+Transfer::~Transfer() = default;
+
+int64_t Transfer::contiguous_prefix() const {
+    auto first = ranges_.begin();
+    return first != ranges_.end() && first->first == 0 ? first->second : 0;
+}
+
+int64_t Transfer::resume_offset() {
+    int64_t prefix;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        prefix = contiguous_prefix();
+    }
+    // Ranges are recorded once written, so everything in the snapshot is
+    // on disk once this returns
+    if (!file_->sync()) {
+        return 0;
+    }
+    return prefix;
+}
+
+void Transfer::attach_owner(const std::shared_ptr<ClientInfo>& client) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    owner_client_ = client;
+    room_ = current_room(*client);
+    session_start_ = std::chrono::steady_clock::now();
+    last_activity_ = session_start_;
+    session_bytes_ = 0;
+    session_wire_bytes_ = 0;
+}
+
+bool Transfer::record(int64_t offset, int64_t length, int64_t wire_length, const char* method) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    last_activity_ = std::chrono::steady_clock::now();
+    session_wire_bytes_ += wire_length;
+
+    if (length > 0) {
+        session_bytes_ += length;
+        method_ = method;
+
+        // Merge [start, end) with every stored run it touches
+        int64_t start = offset;
+        int64_t end = offset + length;
+        auto it = ranges_.upper_bound(start);
+        if (it != ranges_.begin()) {
+            auto previous = std::prev(it);
+            if (previous->second >= start) {
+                start = previous->first;
+                end = std::max(end, previous->second);
+                stored_ -= previous->second - previous->first;
+                it = ranges_.erase(previous);
+            }
+        }
+        while (it != ranges_.end() && it->first <= end) {
+            end = std::max(end, it->second);
+            stored_ -= it->second - it->first;
+            it = ranges_.erase(it);
+        }
+        ranges_[start] = end;
+        stored_ += end - start;
+    }
+
+    if (finished_ || stored_ < size_) {
+        return false;
+    }
+    finished_ = true;
+    return true;
+}
+
+bool Transfer::finished() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return finished_;
+}
+
+std::weak_ptr<ClientInfo> Transfer::owner_client() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return owner_client_;
+}
+
+std::shared_ptr<Room> Transfer::room() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return room_;
+}
+
+std::chrono::steady_clock::time_point Transfer::last_activity() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return last_activity_;
+}
+
+int64_t Transfer::session_bytes() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return session_bytes_;
+}
+
+int64_t Transfer::session_wire_bytes() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return session_wire_bytes_;
+}
+
+std::chrono::steady_clock::time_point Transfer::session_start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return session_start_;
+}
+
+const char* Transfer::method() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return method_;
+}
+
+std::shared_ptr<Transfer> begin_transfer(const std::string& owner, const std::string& filename,
+                                         int64_t size, uint64_t content_hash, bool& resumed) {
+    std::lock_guard<std::mutex> lock(transfers_mutex);
+    expire_transfers();
+
+    for (auto& entry : transfers) {
+        Transfer& pending = *entry.second;
+        if (pending.owner() == owner && pending.filename() == filename &&
+            pending.size() == size && pending.content_hash() == content_hash &&
+            !pending.finished()) {
+            resumed = true;
+            return entry.second;
+        }
+    }
+
+    uint64_t id;
+    do {
+        id = random_token();
+    } while (id == 0 || transfers.count(id) > 0);
+
+    std::shared_ptr<DiskFile> file = DiskFile::create(partial_path(id), size);
+    if (!file) {
+        std::cerr << "Failed to create file: " << final_path(filename) << std::endl;
+        return nullptr;
+    }
+
+    resumed = false;
+    auto transfer = std::make_shared<Transfer>(id, owner, filename, size, content_hash, std::move(file));
+    transfers[id] = transfer;
+    return transfer;
+}
+
+std::shared_ptr<Transfer> find_transfer(uint64_t id) {
+    std::lock_guard<std::mutex> lock(transfers_mutex);
+    auto it = transfers.find(id);
+    return it != transfers.end() ? it->second : nullptr;
+}
+
+void complete_transfer(const std::shared_ptr<Transfer>& transfer) {
+    {
+        std::lock_guard<std::mutex> lock(transfers_mutex);
+        transfers.erase(transfer->id());
+    }
+
+    std::string source = partial_path(transfer->id());
+    const char* failure = nullptr;
+    uint64_t received_hash = 0;
+    const std::shared_ptr<DiskFile>& file = transfer->file();
+    if (!file->sync() || !hash_file(file->fd(), transfer->size(), received_hash)) {
+        failure = "Server could not store the file";
+    } else if (received_hash != transfer->content_hash()) {
+        // Never file corrupt contents under a hash other uploads will trust
+        failure = "Content hash mismatch";
+    }
+#ifdef _WIN32
+    // Windows can't rename an open file
+    file->close();
+#endif
+    if (!failure && (!store_blob(source, transfer->content_hash(), transfer->size()) ||
+                     !link_blob(transfer->filename(), transfer->content_hash(), transfer->size()))) {
+        failure = "Server could not store the file";
+    }
+    if (!failure) {
+        // The renames that filed it must survive a crash as well as its data
+        sync_directory(BLOBS_DIR);
+        sync_directory(UPLOADS_DIR);
+    }
+    if (failure) {
+        std::cerr << "Failed to store upload " << final_path(transfer->filename()) << ": "
+                  << failure << std::endl;
+        std::remove(source.c_str());
+        if (auto owner = transfer->owner_client().lock()) {
+            deliver(*owner, transfer_error_frame(transfer->id(), failure), false);
+        }
+        return;
+    }
+
+    // Downloads from now on see the new contents
+    invalidate_served_file(transfer->filename());
+
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - transfer->session_start());
+    double seconds = std::max<int64_t>(duration.count(), 1) / 1e6;
+    double speed = (transfer->session_bytes() / 1024.0 / 1024.0) / seconds;
+    record(Histogram::UPLOAD_KIB_PER_S, static_cast<uint64_t>(transfer->session_bytes() / 1024.0 / seconds));
+
+    std::cout << "✓ File received from " << transfer->owner() << ": " << transfer->filename()
+              << " (" << transfer->size() << " bytes, "
+              << speed << " MB/s via " << transfer->method();
+    int64_t wire_bytes = transfer->session_wire_bytes();
+    if (wire_bytes > 0 && wire_bytes < transfer->session_bytes()) {
+        // Compressed chunks: how much smaller they were and the link rate
+        std::cout << ", " << static_cast<double>(transfer->session_bytes()) / wire_bytes
+                  << "x compressed, " << (wire_bytes / 1024.0 / 1024.0) / seconds << " MB/s on the wire";
+    }
+    std::cout << ")" << std::endl;
+
+    if (auto owner = transfer->owner_client().lock()) {
+        deliver(*owner, transfer_done_frame(transfer->id()), false);
+    }
+    if (std::shared_ptr<Room> room = transfer->room()) {
+        notify_room(*room, transfer->owner() + " shared file: " + transfer->filename());
+    }
+}
+
+FrameRef transfer_ready_frame(uint64_t id, int64_t offset, uint16_t stream) {
+    char encoded_offset[sizeof(uint64_t)];
+    put_u64(encoded_offset, static_cast<uint64_t>(offset));
+    return transfer_frame(FILE_READY, id, std::string_view(encoded_offset, sizeof(encoded_offset)), stream);
+}
+
+FrameRef transfer_done_frame(uint64_t id, uint16_t stream) {
+    return transfer_frame(FILE_DONE, id, {}, stream);
+}
+
+FrameRef transfer_error_frame(uint64_t id, std::string_view reason, uint16_t stream) {
+    return transfer_frame(FILE_ERROR, id, reason, stream);
+}
+
+bool parse_transfer_id(const FrameView& frame, uint64_t& id) {
+    if (frame.header.length != sizeof(uint64_t)) {
+        return false;
+    }
+    id = get_u64(frame.payload);
+    return true;
+}
+
+bool parse_chunk_header(const FrameView& frame, uint64_t& id, int64_t& offset) {
+    if (!frame.streamed()) {
+        return false;
+    }
+    id = get_u64(frame.payload);
+    offset = static_cast<int64_t>(get_u64(frame.payload + sizeof(uint64_t)));
+    return offset >= 0;
+}
+
+std::unique_ptr<FileReceiver> begin_chunk(const FrameView& frame,
+                                          std::shared_ptr<Transfer>& transfer) {
+    uint64_t id;
+    int64_t offset;
+    if (!parse_chunk_header(frame, id, offset)) {
+        return nullptr;
+    }
+
+    // A compressed body's extent in the file is only known as it decodes
+    bool compressed = (frame.header.flags & FRAME_FLAG_COMPRESSED) != 0;
+    int64_t extent = compressed ? 0 : static_cast<int64_t>(frame.body_length);
+
+    transfer = find_transfer(id);
+    if (transfer && offset > transfer->size() - extent) {
+        return nullptr;
+    }
+    if (!transfer || transfer->finished()) {
+        // A stripe still sending after the last gap was filled elsewhere
+        transfer.reset();
+        return FileReceiver::open(nullptr, offset, frame.body_length);
+    }
+    if (compressed) {
+        return FileReceiver::open_compressed(transfer->file(), offset, frame.body_length,
+                                             transfer->size());
+    }
+    return FileReceiver::open(transfer->file(), offset, frame.body_length);
+}
+
+void end_chunk(const std::shared_ptr<Transfer>& transfer, FileReceiver& receiver) {
+    if (!transfer) {
+        receiver.finish([](bool) {});
+        return;
+    }
+    int64_t offset = receiver.offset();
+    int64_t stored = receiver.stored();
+    int64_t received = receiver.received();
+    const char* method = receiver.method();
+    receiver.finish([transfer, offset, stored, received, method](bool landed) {
+        if (!landed) {
+            return;
+        }
+        count(Counter::UPLOAD_BYTES, stored);
+        if (transfer->record(offset, stored, received, method)) {
+            // Syncing and hashing the whole file is no job for a network thread
+            run_on_disk_thread([transfer] { complete_transfer(transfer); });
+        }
+    });
+}
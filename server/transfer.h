@@ -0,0 +1,123 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "../shared/protocol.h"
+#include "frame_buffer.h"
+#include "file_receiver.h"
+#include "disk_writer.h"
+
+struct ClientInfo;
+class Room;
+
+// Abandoned partial uploads are deleted after this long without progress
+constexpr auto TRANSFER_EXPIRY = std::chrono::hours(1);
+
+// One upload in progress. Its bytes arrive as offset-addressed chunks,
+// possibly over several connections at once, and are written in place into
+// a partial file in uploads/ by the disk threads. Once every byte is on
+// disk the contents are checked against the hash the client announced and
+// moved into the blob store.
+// A transfer outlives the connections feeding it, so a client that
+// reconnects picks it up again from resume_offset().
+class Transfer {
+public:
+    Transfer(uint64_t id, const std::string& owner, const std::string& filename,
+             int64_t size, uint64_t content_hash, std::shared_ptr<DiskFile> file);
+    ~Transfer();
+
+    Transfer(const Transfer&) = delete;
+    Transfer& operator=(const Transfer&) = delete;
+
+    uint64_t id() const { return id_; }
+    const std::string& owner() const { return owner_; }
+    const std::string& filename() const { return filename_; }
+    int64_t size() const { return size_; }
+    uint64_t content_hash() const { return content_hash_; }
+    const std::shared_ptr<DiskFile>& file() const { return file_; }
+
+    // Flush what has been written and return the end of the contiguous
+    // prefix now on disk; a sender resumes from there
+    int64_t resume_offset();
+
+    // Restart the rate measurement and remember the connection to notify,
+    // and its room for the announcement; called on the owner's thread
+    void attach_owner(const std::shared_ptr<ClientInfo>& client);
+
+    // Record a range that has been written and the chunk bytes that carried
+    // it; true exactly once, for the call that makes the file complete
+    bool record(int64_t offset, int64_t length, int64_t wire_length, const char* method);
+
+    bool finished();
+    std::weak_ptr<ClientInfo> owner_client();
+    std::shared_ptr<Room> room();
+    std::chrono::steady_clock::time_point last_activity();
+
+    // Rate reporting for the current session
+    int64_t session_bytes();
+    int64_t session_wire_bytes();
+    std::chrono::steady_clock::time_point session_start();
+    const char* method();
+
+private:
+    int64_t contiguous_prefix() const;
+
+    const uint64_t id_;
+    const std::string owner_;
+    const std::string filename_;
+    const int64_t size_;
+    const uint64_t content_hash_;
+    const std::shared_ptr<DiskFile> file_;
+
+    std::mutex mutex_;
+    std::map<int64_t, int64_t> ranges_;     // Start -> end of each stored run
+    int64_t stored_ = 0;
+    bool finished_ = false;
+    std::weak_ptr<ClientInfo> owner_client_;
+    std::shared_ptr<Room> room_;            // Where the owner offered the upload
+    std::chrono::steady_clock::time_point session_start_;
+    std::chrono::steady_clock::time_point last_activity_;
+    int64_t session_bytes_ = 0;
+    int64_t session_wire_bytes_ = 0;
+    const char* method_ = "stream";
+};
+
+// Begin an upload, or pick up the unfinished one with the same owner, name
+// and contents. Returns nullptr if the partial file cannot be created.
+std::shared_ptr<Transfer> begin_transfer(const std::string& owner, const std::string& filename,
+                                         int64_t size, uint64_t content_hash, bool& resumed);
+std::shared_ptr<Transfer> find_transfer(uint64_t id);
+
+// Verify a complete upload, store it under its name, report it and tell
+// everyone; run on a disk thread
+void complete_transfer(const std::shared_ptr<Transfer>& transfer);
+
+// Transfer control frames: the transfer ID followed by an optional offset
+// or reason. A reply to FILE_TRANSFER carries the request's stream ID.
+FrameRef transfer_ready_frame(uint64_t id, int64_t offset, uint16_t stream = 0);
+FrameRef transfer_done_frame(uint64_t id, uint16_t stream = 0);
+FrameRef transfer_error_frame(uint64_t id, std::string_view reason, uint16_t stream = 0);
+
+// Parse the metadata of a FILE_ATTACH frame or a streamed FILE_CHUNK frame
+bool parse_transfer_id(const FrameView& frame, uint64_t& id);
+bool parse_chunk_header(const FrameView& frame, uint64_t& id, int64_t& offset);
+
+// Start receiving a FILE_CHUNK body. Chunks for transfers that are already
+// complete are consumed and dropped. Returns nullptr if the chunk lies
+// outside its file, which is a protocol error.
+std::unique_ptr<FileReceiver> begin_chunk(const FrameView& frame,
+                                          std::shared_ptr<Transfer>& transfer);
+
+// Account for a chunk body once it has been received (or the connection
+// carrying it has dropped): once its writes have landed the range is
+// recorded, and if it was the last the transfer is completed on a disk
+// thread
+void end_chunk(const std::shared_ptr<Transfer>& transfer, FileReceiver& receiver);
+
+#endif
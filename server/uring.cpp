@@ -0,0 +1,251 @@
+#include "uring.h"
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+namespace {
+
+int io_uring_setup(unsigned entries, io_uring_params* params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                                    nullptr, 0));
+}
+
+// Completions can back up behind a burst of submissions; NODROP keeps any
+// overflow in the kernel, this just makes it rare
+constexpr unsigned CQ_ENTRIES_PER_SQ_ENTRY = 4;
+
+// Operations the reactor submits
+constexpr uint8_t REQUIRED_OPS[] = {
+    IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_WRITE,
+    IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL,
+};
+
+// Multishot recv, the newest feature used, arrived in Linux 6.0
+bool kernel_at_least(int major, int minor) {
+    struct utsname name;
+    int found_major = 0;
+    int found_minor = 0;
+    if (uname(&name) != 0 || sscanf(name.release, "%d.%d", &found_major, &found_minor) != 2) {
+        return false;
+    }
+    return found_major > major || (found_major == major && found_minor >= minor);
+}
+
+} // namespace
+
+Uring::~Uring() {
+    if (sqes_) {
+        munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ && cq_ring_ != sq_ring_) {
+        munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_) {
+        munmap(sq_ring_, sq_ring_size_);
+    }
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+bool Uring::supported() {
+    if (!kernel_at_least(6, 0)) {
+        errno = ENOSYS;
+        return false;
+    }
+
+    Uring ring;
+    if (!ring.init(8)) {
+        return false;
+    }
+
+    constexpr unsigned PROBE_OPS = 256;
+    std::unique_ptr<char[]> storage(new char[sizeof(io_uring_probe) + PROBE_OPS * sizeof(io_uring_probe_op)]());
+    io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(storage.get());
+    int result = ring.register_op(IORING_REGISTER_PROBE, probe, PROBE_OPS);
+    if (result < 0) {
+        errno = -result;
+        return false;
+    }
+    for (uint8_t op : REQUIRED_OPS) {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            errno = EOPNOTSUPP;
+            return false;
+        }
+    }
+
+    // Registering a provided buffer ring is the last thing that can fail
+    BufferRing buffers;
+    return buffers.init(ring, 0, 1, 64);
+}
+
+bool Uring::init(unsigned entries) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    params.cq_entries = entries * CQ_ENTRIES_PER_SQ_ENTRY;
+
+    // Completions are only reaped by the thread that submits, inside
+    // io_uring_enter(), so the kernel needn't interrupt it to post them
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+                   IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    fd_ = io_uring_setup(entries, &params);
+    if (fd_ < 0 && errno == EINVAL) {
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+        fd_ = io_uring_setup(entries, &params);
+    }
+    if (fd_ < 0) {
+        return false;
+    }
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+        sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+        sq_ring_ = nullptr;
+        return false;
+    }
+    if (single_mmap) {
+        cq_ring_ = sq_ring_;
+    } else {
+        cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        fd_, IORING_OFF_CQ_RING);
+        if (cq_ring_ == MAP_FAILED) {
+            cq_ring_ = nullptr;
+            return false;
+        }
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return false;
+    }
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+    char* sq = static_cast<char*>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    sq_entries_ = params.sq_entries;
+    sq_local_tail_ = *sq_tail_;
+
+    // Entries are always used in ring order
+    for (unsigned i = 0; i < sq_entries_; i++) {
+        sq_array_[i] = i;
+    }
+
+    char* cq = static_cast<char*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+}
+
+io_uring_sqe* Uring::get_sqe() {
+    if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_) {
+        submit(0);
+    }
+    io_uring_sqe* sqe = &sqes_[sq_local_tail_ & *sq_mask_];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_local_tail_++;
+    return sqe;
+}
+
+int Uring::submit(unsigned wait_nr) {
+    __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+    unsigned to_submit = sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+
+    int result;
+    do {
+        result = io_uring_enter(fd_, to_submit, wait_nr, IORING_ENTER_GETEVENTS);
+    } while (result < 0 && errno == EINTR && wait_nr == 0);
+    count(Counter::URING_ENTERS);
+    if (result < 0) {
+        return -errno;
+    }
+    count(Counter::URING_OPS, result);
+    return result;
+}
+
+int Uring::register_op(unsigned opcode, void* arg, unsigned count) {
+    int result = static_cast<int>(syscall(__NR_io_uring_register, fd_, opcode, arg, count));
+    return result < 0 ? -errno : result;
+}
+
+BufferRing::~BufferRing() {
+    if (entries_) {
+        io_uring_buf_reg reg;
+        std::memset(&reg, 0, sizeof(reg));
+        reg.bgid = group_;
+        ring_->register_op(IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(entries_, entries_size_);
+    }
+}
+
+bool BufferRing::init(Uring& ring, uint16_t group, unsigned count, size_t size) {
+    entries_size_ = count * sizeof(io_uring_buf);
+    void* entries = mmap(nullptr, entries_size_, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (entries == MAP_FAILED) {
+        return false;
+    }
+
+    io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(entries);
+    reg.ring_entries = count;
+    reg.bgid = group;
+    int result = ring.register_op(IORING_REGISTER_PBUF_RING, &reg, 1);
+    if (result < 0) {
+        munmap(entries, entries_size_);
+        errno = -result;
+        return false;
+    }
+
+    ring_ = &ring;
+    entries_ = static_cast<io_uring_buf_ring*>(entries);
+    buffers_.reset(new char[count * size]);
+    count_ = count;
+    size_ = size;
+    group_ = group;
+    for (unsigned id = 0; id < count; id++) {
+        recycle(static_cast<uint16_t>(id));
+    }
+    return true;
+}
+
+void BufferRing::recycle(uint16_t id) {
+    // Not entries_->bufs: in C++ the header's flex array macro moves it
+    // past an empty struct, off the kernel's layout
+    io_uring_buf& entry = reinterpret_cast<io_uring_buf*>(entries_)[tail_ & (count_ - 1)];
+    entry.addr = reinterpret_cast<uint64_t>(data(id));
+    entry.len = static_cast<uint32_t>(size_);
+    entry.bid = id;
+    tail_++;
+    __atomic_store_n(&entries_->tail, tail_, __ATOMIC_RELEASE);
+}
+
+#endif
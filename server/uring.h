@@ -0,0 +1,116 @@
+#ifndef URING_H
+#define URING_H
+
+#ifdef __linux__
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include <linux/io_uring.h>
+
+// Thin io_uring wrapper over the raw system calls (no liburing).
+//
+// A Uring is a submission and completion queue pair owned by one thread.
+// Operations are prepared in submission entries, handed to the kernel in
+// batches by submit(), and their results read back with for_each_cqe().
+// A BufferRing is a group of receive buffers the kernel picks from itself,
+// so a multishot recv on an idle socket pins no memory.
+class Uring {
+public:
+    Uring() = default;
+    ~Uring();
+
+    Uring(const Uring&) = delete;
+    Uring& operator=(const Uring&) = delete;
+
+    // True when this kernel has everything the io_uring reactor uses
+    // (multishot accept and recv, provided buffer rings, linked
+    // operations); otherwise errno says why not
+    static bool supported();
+
+    // Create a ring with room for `entries` submissions; false with errno
+    // set on failure
+    bool init(unsigned entries);
+
+    int fd() const { return fd_; }
+
+    // A cleared submission entry; flushes queued ones to the kernel first
+    // when the ring is full
+    io_uring_sqe* get_sqe();
+
+    // Hand every queued entry to the kernel and wait for at least wait_nr
+    // completions; returns entries submitted or -errno
+    int submit(unsigned wait_nr);
+
+    // Call f(const io_uring_cqe&) for every completion that is ready
+    template <typename F>
+    unsigned for_each_cqe(F f) {
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        unsigned seen = 0;
+        for (; head != tail; head++, seen++) {
+            f(cqes_[head & *cq_mask_]);
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        return seen;
+    }
+
+    // io_uring_register(); returns its result or -errno
+    int register_op(unsigned opcode, void* arg, unsigned count);
+
+private:
+    int fd_ = -1;
+    void* sq_ring_ = nullptr;
+    size_t sq_ring_size_ = 0;
+    void* cq_ring_ = nullptr;
+    size_t cq_ring_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_mask_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned sq_entries_ = 0;
+    unsigned sq_local_tail_ = 0;   // Entries prepared but not yet published
+
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned* cq_mask_ = nullptr;
+    io_uring_cqe* cqes_ = nullptr;
+};
+
+class BufferRing {
+public:
+    BufferRing() = default;
+    ~BufferRing();
+
+    BufferRing(const BufferRing&) = delete;
+    BufferRing& operator=(const BufferRing&) = delete;
+
+    // Register `count` (a power of two) buffers of `size` bytes as buffer
+    // group `group` of the ring
+    bool init(Uring& ring, uint16_t group, unsigned count, size_t size);
+
+    uint16_t group() const { return group_; }
+    size_t buffer_size() const { return size_; }
+    const char* data(uint16_t id) const { return buffers_.get() + static_cast<size_t>(id) * size_; }
+
+    // Give a buffer back to the kernel once its data has been used
+    void recycle(uint16_t id);
+
+private:
+    Uring* ring_ = nullptr;
+    io_uring_buf_ring* entries_ = nullptr;
+    size_t entries_size_ = 0;
+    std::unique_ptr<char[]> buffers_;
+    unsigned count_ = 0;
+    size_t size_ = 0;
+    uint16_t group_ = 0;
+    uint16_t tail_ = 0;
+};
+
+#endif
+
+#endif
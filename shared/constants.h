@@ -10,6 +10,36 @@ constexpr int MAX_CLIENTS = 100;           // Support more clients
 constexpr int FILE_BUFFER_SIZE = 65536;    // 64KB for faster file transfers
 constexpr int MAX_USERNAME_LENGTH = 32;
 constexpr int MAX_MESSAGE_LENGTH = 2048;
+constexpr int MAX_FILENAME_LENGTH = 255;    // Longest name a shared file may have
+
+// Chat rooms: "#" then letters, digits, '-' or '_'. Everyone starts in the
+// default room and returns to it on /part.
+constexpr const char* DEFAULT_ROOM = "#lobby";
+constexpr int MAX_ROOM_NAME_LENGTH = 32;
+
+// Framing: every message is an 8-byte header followed by its payload
+//   u8 type | u8 flags | u16 stream | u32 payload length   (big-endian)
+constexpr int FRAME_HEADER_SIZE = 8;
+constexpr uint32_t MAX_FRAME_PAYLOAD = 65536;  // Largest accepted payload
+
+// Frame flags
+constexpr uint8_t FRAME_FLAG_STREAMED = 0x01;  // Body is consumed straight off the socket
+constexpr uint8_t FRAME_FLAG_COMPRESSED = 0x02;  // Chunk body is a sequence of LZ4 blocks
+constexpr uint8_t FRAME_FLAG_REPLY = 0x04;       // PING or HELLO answering one from the other side
+
+// Streamed frames start with this many bytes of metadata; the rest of the
+// payload is bulk data that is never buffered in full
+constexpr int STREAMED_META_SIZE = 16;
+
+// File transfers are split into offset-addressed chunks
+constexpr int64_t FILE_CHUNK_SIZE = 8 * 1024 * 1024;
+constexpr int MAX_TRANSFER_STREAMS = 16;
+
+// A compressed chunk body is a run of blocks, each covering up to this many
+// file bytes: u32 raw length | u32 stored length | data. Blocks that didn't
+// shrink are stored as is (stored length == raw length).
+constexpr uint32_t COMPRESSED_BLOCK_SIZE = 64 * 1024;
+constexpr int COMPRESSED_BLOCK_HEADER_SIZE = 8;
 
 // Message types
 enum MessageType : int32_t {
@@ -17,11 +47,46 @@ enum MessageType : int32_t {
     FILE_TRANSFER = 2,
     USERNAME_SET = 3,
     DISCONNECT = 4,
-    PING = 5,
-    CLIENT_LIST = 6
+    PING = 5,                  // Echoed back with FRAME_FLAG_REPLY; the server sends one periodically
+    CLIENT_LIST = 6,           // Roster snapshot; a request is empty or the u64 version to catch up from
+    FILE_READY = 7,            // Transfer ID and offset to resume from
+    FILE_CHUNK = 8,            // Transfer ID, offset, then the chunk data
+    FILE_ATTACH = 9,           // Join a connection to a transfer as an extra stream
+    FILE_DONE = 10,            // Every byte of the transfer is stored
+    FILE_ERROR = 11,           // Transfer refused; payload is the reason
+    FILE_DOWNLOAD = 12,        // Download ID, offset, length (0 = to the end), file name
+    STATS = 13,                // Empty request; the reply is "name value" lines
+    ROOM_JOIN = 14,            // Move to the named room; an empty name returns to the default
+    PRESENCE = 15,             // One roster change: version, kind, then the entry or client ID
+    PEER_OFFER = 16,           // /sendto: the sender's endpoint and a token, brokered by the server
+    PEER_RELAY = 17,           // Token of a /sendto to carry through the server instead
+    HELLO = 18                 // Opens a chat connection: version, capabilities, session (see hello.h)
+};
+
+// Kinds of PRESENCE change
+enum PresenceKind : uint8_t {
+    PRESENCE_JOIN = 1,
+    PRESENCE_LEAVE = 2,
+    PRESENCE_IDLE = 3,
+    PRESENCE_ACTIVE = 4
 };
 
 // Protocol constants
-constexpr int PROTOCOL_VERSION = 2;
+constexpr int PROTOCOL_VERSION = 12;
+constexpr int MIN_PROTOCOL_VERSION = 12;   // Oldest a HELLO may offer: the first with HELLO
+
+// Capabilities a client offers in HELLO; the reply has those the server
+// grants for the connection
+constexpr uint32_t CAP_COMPRESSION = 0x01;   // Upload chunks may be LZ4-compressed
+constexpr uint32_t CAP_BATCHING = 0x02;      // Output may wait for the end of an event loop pass
+constexpr uint32_t CAP_RESUME = 0x04;        // A session token to reconnect with, without rejoining
+
+// Smallest max payload a HELLO may ask for
+constexpr uint32_t MIN_FRAME_PAYLOAD = 4096;
+
+// Largest chat line the server relays, "[username]: " and the message. It
+// fits the smallest max payload, so every client can take any of them.
+constexpr uint32_t MAX_CHAT_PAYLOAD = MAX_USERNAME_LENGTH + 4 + MAX_MESSAGE_LENGTH;
+static_assert(MAX_CHAT_PAYLOAD <= MIN_FRAME_PAYLOAD, "chat lines must fit every client's frames");
 
 #endif
\ No newline at end of file
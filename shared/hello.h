@@ -0,0 +1,76 @@
+#ifndef HELLO_H
+#define HELLO_H
+
+// HELLO payloads. A chat connection opens with HELLO (older clients send a
+// bare USERNAME_SET instead and get none of the capabilities); the server
+// answers with HELLO and FRAME_FLAG_REPLY before anything else.
+//   request: u16 version | u32 capabilities | u32 max payload |
+//            u32 receive window | u64 session token (0 = new) | username
+//   reply:   u16 version | u32 capabilities granted | u32 max payload |
+//            u32 receive window | u64 session token (0 = none) | u8 resumed
+// The max payload is the largest frame payload the client takes, the
+// receive window how much file data it wants queued per turn (0 = as the
+// server schedules). The reply carries the values the server uses.
+//
+// The reply always carries the server's protocol version, which the
+// connection speaks from then on. A client older than the server's
+// MIN_PROTOCOL_VERSION is refused: its reply grants nothing and the server
+// hangs up. A newer client either falls back to the server's version or
+// hangs up itself if it no longer speaks it.
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "protocol.h"
+
+struct Hello {
+    uint16_t version = PROTOCOL_VERSION;
+    uint32_t capabilities = 0;
+    uint32_t max_payload = MAX_FRAME_PAYLOAD;
+    uint32_t receive_window = 0;
+    uint64_t session = 0;
+    bool resumed = false;     // Reply only
+    std::string username;     // Request only
+};
+
+constexpr size_t HELLO_FIXED_SIZE = sizeof(uint16_t) + 3 * sizeof(uint32_t) + sizeof(uint64_t);
+
+inline std::string encode_hello(const Hello& hello, bool reply) {
+    std::string out(HELLO_FIXED_SIZE, '\0');
+    char* p = &out[0];
+    put_u16(p, hello.version);
+    put_u32(p + 2, hello.capabilities);
+    put_u32(p + 6, hello.max_payload);
+    put_u32(p + 10, hello.receive_window);
+    put_u64(p + 14, hello.session);
+    if (reply) {
+        out += static_cast<char>(hello.resumed ? 1 : 0);
+    } else {
+        out += hello.username;
+    }
+    return out;
+}
+
+// Decode a HELLO frame, a reply if it carries FRAME_FLAG_REPLY
+inline bool decode_hello(const FrameView& frame, Hello& hello) {
+    if (frame.header.length < HELLO_FIXED_SIZE) {
+        return false;
+    }
+    const char* p = frame.payload;
+    hello.version = get_u16(p);
+    hello.capabilities = get_u32(p + 2);
+    hello.max_payload = get_u32(p + 6);
+    hello.receive_window = get_u32(p + 10);
+    hello.session = get_u64(p + 14);
+
+    size_t rest = frame.header.length - HELLO_FIXED_SIZE;
+    if (frame.header.flags & FRAME_FLAG_REPLY) {
+        hello.resumed = rest > 0 && p[HELLO_FIXED_SIZE] != 0;
+    } else {
+        hello.username.assign(p + HELLO_FIXED_SIZE, rest);
+    }
+    return true;
+}
+
+#endif
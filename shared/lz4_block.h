@@ -0,0 +1,212 @@
+#ifndef LZ4_BLOCK_H
+#define LZ4_BLOCK_H
+
+// LZ4 block format (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md),
+// re-implemented from the published specification. A greedy single-probe
+// match finder keeps compression at several hundred MB/s per core, and
+// decoding is a bounds-checked copy loop, safe on untrusted input.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+class Lz4Block {
+public:
+    Lz4Block() { std::memset(table_, 0, sizeof(table_)); }
+
+    // Worst-case compressed size of n bytes
+    static size_t bound(size_t n) { return n + n / 255 + 16; }
+
+    // Compress src into dst; returns the compressed size, or 0 if it does
+    // not fit in capacity. Inputs up to 64 KiB use the full match window.
+    size_t compress(const char* source, size_t n, char* destination, size_t capacity) {
+        const unsigned char* src = reinterpret_cast<const unsigned char*>(source);
+        const unsigned char* ip = src;
+        const unsigned char* anchor = src;
+        const unsigned char* end = src + n;
+        unsigned char* op = reinterpret_cast<unsigned char*>(destination);
+        unsigned char* op_end = op + capacity;
+
+        if (n > MF_LIMIT) {
+            // Matches may not start in the last MF_LIMIT bytes or run into
+            // the last LAST_LITERALS
+            const unsigned char* match_limit = end - MF_LIMIT;
+            const unsigned char* extend_limit = end - LAST_LITERALS;
+
+            while (ip < match_limit) {
+                uint32_t sequence = read32(ip);
+                uint32_t& slot = table_[hash(sequence)];
+                const unsigned char* candidate = src + slot;
+                slot = static_cast<uint32_t>(ip - src);
+
+                // The table is shared between calls, so verify every hit
+                if (candidate >= ip || ip - candidate > MAX_OFFSET || read32(candidate) != sequence) {
+                    // Skip faster through data that isn't matching
+                    ip += 1 + ((ip - anchor) >> SKIP_SHIFT);
+                    continue;
+                }
+
+                // Extend backwards over literals, then forwards
+                while (ip > anchor && candidate > src && ip[-1] == candidate[-1]) {
+                    ip--;
+                    candidate--;
+                }
+                const unsigned char* match_end = ip + MIN_MATCH;
+                const unsigned char* candidate_end = candidate + MIN_MATCH;
+                while (match_end < extend_limit && *match_end == *candidate_end) {
+                    match_end++;
+                    candidate_end++;
+                }
+
+                op = emit(op, op_end, anchor, ip - anchor, ip - candidate, match_end - ip);
+                if (!op) {
+                    return 0;
+                }
+                ip = match_end;
+                anchor = ip;
+                if (ip - 2 > src) {
+                    table_[hash(read32(ip - 2))] = static_cast<uint32_t>(ip - 2 - src);
+                }
+            }
+        }
+
+        op = emit(op, op_end, anchor, end - anchor, 0, 0);
+        return op ? static_cast<size_t>(op - reinterpret_cast<unsigned char*>(destination)) : 0;
+    }
+
+    // Decompress exactly raw_size bytes; false if the input is malformed or
+    // does not decode to that size
+    static bool decompress(const char* source, size_t n, char* destination, size_t raw_size) {
+        const unsigned char* ip = reinterpret_cast<const unsigned char*>(source);
+        const unsigned char* ip_end = ip + n;
+        unsigned char* dst = reinterpret_cast<unsigned char*>(destination);
+        unsigned char* op = dst;
+        unsigned char* op_end = dst + raw_size;
+
+        while (ip < ip_end) {
+            unsigned token = *ip++;
+
+            size_t literals = token >> 4;
+            if (literals == 15 && !read_length(ip, ip_end, literals)) {
+                return false;
+            }
+            if (literals > static_cast<size_t>(ip_end - ip) ||
+                literals > static_cast<size_t>(op_end - op)) {
+                return false;
+            }
+            std::memcpy(op, ip, literals);
+            ip += literals;
+            op += literals;
+
+            // The last sequence has no match
+            if (ip == ip_end) {
+                break;
+            }
+
+            if (ip_end - ip < 2) {
+                return false;
+            }
+            size_t offset = ip[0] | (ip[1] << 8);
+            ip += 2;
+            if (offset == 0 || offset > static_cast<size_t>(op - dst)) {
+                return false;
+            }
+
+            size_t length = token & 15;
+            if (length == 15 && !read_length(ip, ip_end, length)) {
+                return false;
+            }
+            length += MIN_MATCH;
+            if (length > static_cast<size_t>(op_end - op)) {
+                return false;
+            }
+
+            const unsigned char* match = op - offset;
+            if (offset == 1) {
+                std::memset(op, *match, length);
+            } else if (offset >= length) {
+                std::memcpy(op, match, length);
+            } else {
+                // Overlapping copy repeats the last offset bytes
+                for (size_t i = 0; i < length; i++) {
+                    op[i] = match[i];
+                }
+            }
+            op += length;
+        }
+        return op == op_end;
+    }
+
+private:
+    static constexpr int HASH_BITS = 14;
+    static constexpr int SKIP_SHIFT = 6;
+    static constexpr size_t MIN_MATCH = 4;
+    static constexpr size_t MF_LIMIT = 12;
+    static constexpr size_t LAST_LITERALS = 5;
+    static constexpr ptrdiff_t MAX_OFFSET = 65535;
+
+    static uint32_t read32(const unsigned char* p) {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static uint32_t hash(uint32_t sequence) {
+        return (sequence * 2654435761U) >> (32 - HASH_BITS);
+    }
+
+    // Lengths of 15 or more continue in bytes of 255 until a smaller one
+    static unsigned char* write_length(unsigned char* op, size_t length) {
+        while (length >= 255) {
+            *op++ = 255;
+            length -= 255;
+        }
+        *op++ = static_cast<unsigned char>(length);
+        return op;
+    }
+
+    static bool read_length(const unsigned char*& ip, const unsigned char* ip_end, size_t& length) {
+        unsigned char byte;
+        do {
+            if (ip >= ip_end) {
+                return false;
+            }
+            byte = *ip++;
+            length += byte;
+        } while (byte == 255);
+        return true;
+    }
+
+    // One sequence: literals, then a match (none when match_length is 0).
+    // Returns nullptr if it doesn't fit.
+    static unsigned char* emit(unsigned char* op, unsigned char* op_end, const unsigned char* literals,
+                               size_t literal_count, ptrdiff_t offset, size_t match_length) {
+        size_t worst = 1 + literal_count / 255 + 1 + literal_count + 2 + match_length / 255 + 1;
+        if (worst > static_cast<size_t>(op_end - op)) {
+            return nullptr;
+        }
+
+        size_t match_code = match_length > 0 ? match_length - MIN_MATCH : 0;
+        unsigned char* token = op++;
+        *token = static_cast<unsigned char>((literal_count < 15 ? literal_count : 15) << 4);
+        if (literal_count >= 15) {
+            op = write_length(op, literal_count - 15);
+        }
+        std::memcpy(op, literals, literal_count);
+        op += literal_count;
+
+        if (match_length > 0) {
+            *op++ = static_cast<unsigned char>(offset & 0xFF);
+            *op++ = static_cast<unsigned char>(offset >> 8);
+            *token |= static_cast<unsigned char>(match_code < 15 ? match_code : 15);
+            if (match_code >= 15) {
+                op = write_length(op, match_code - 15);
+            }
+        }
+        return op;
+    }
+
+    uint32_t table_[1 << HASH_BITS];
+};
+
+#endif
@@ -0,0 +1,236 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <memory>
+
+#include "constants.h"
+
+// Big-endian integer helpers for frame headers and payload fields
+inline void put_u16(char* p, uint16_t v) {
+    p[0] = static_cast<char>(v >> 8);
+    p[1] = static_cast<char>(v);
+}
+
+inline void put_u32(char* p, uint32_t v) {
+    put_u16(p, static_cast<uint16_t>(v >> 16));
+    put_u16(p + 2, static_cast<uint16_t>(v));
+}
+
+inline void put_u64(char* p, uint64_t v) {
+    put_u32(p, static_cast<uint32_t>(v >> 32));
+    put_u32(p + 4, static_cast<uint32_t>(v));
+}
+
+inline uint16_t get_u16(const char* p) {
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+    return static_cast<uint16_t>((u[0] << 8) | u[1]);
+}
+
+inline uint32_t get_u32(const char* p) {
+    return (static_cast<uint32_t>(get_u16(p)) << 16) | get_u16(p + 2);
+}
+
+inline uint64_t get_u64(const char* p) {
+    return (static_cast<uint64_t>(get_u32(p)) << 32) | get_u32(p + 4);
+}
+
+struct FrameHeader {
+    uint8_t type = 0;
+    uint8_t flags = 0;
+    uint16_t stream = 0;     // Logical stream, 0 for the control stream
+    uint32_t length = 0;     // Payload bytes following the header
+};
+
+inline void encode_header(char* out, const FrameHeader& header) {
+    out[0] = static_cast<char>(header.type);
+    out[1] = static_cast<char>(header.flags);
+    put_u16(out + 2, header.stream);
+    put_u32(out + 4, header.length);
+}
+
+inline FrameHeader decode_header(const char* in) {
+    FrameHeader header;
+    header.type = static_cast<uint8_t>(in[0]);
+    header.flags = static_cast<uint8_t>(in[1]);
+    header.stream = get_u16(in + 2);
+    header.length = get_u32(in + 4);
+    return header;
+}
+
+// Encode a complete frame (header + payload) into one buffer
+inline std::string make_frame(uint8_t type, const void* payload, size_t len,
+                              uint8_t flags = 0, uint16_t stream = 0) {
+    FrameHeader header;
+    header.type = type;
+    header.flags = flags;
+    header.stream = stream;
+    header.length = static_cast<uint32_t>(len);
+
+    std::string frame(FRAME_HEADER_SIZE + len, '\0');
+    encode_header(&frame[0], header);
+    if (len > 0) {
+        std::memcpy(&frame[FRAME_HEADER_SIZE], payload, len);
+    }
+    return frame;
+}
+
+inline std::string make_frame(uint8_t type, const std::string& payload = std::string()) {
+    return make_frame(type, payload.data(), payload.size());
+}
+
+// Where a RingBuffer gets its storage; without one it uses the heap. The
+// server hands its connections storage from its slab pools.
+struct BufferStorage {
+    char* (*allocate)(size_t size);
+    void (*deallocate)(char* data);
+};
+
+// Receive buffer for a byte stream. Bytes are written at the tail and
+// consumed from the head; instead of splitting data across the wrap point,
+// unread bytes are slid back to the start when the tail runs out of room,
+// so every buffered frame is contiguous and can be parsed in place.
+class RingBuffer {
+public:
+    explicit RingBuffer(size_t initial_capacity = BUFFER_SIZE, const BufferStorage* storage = nullptr)
+        : storage_(nullptr, Deleter{storage}), initial_capacity_(initial_capacity) {}
+
+    const char* data() const { return storage_.get() + head_; }
+    size_t size() const { return tail_ - head_; }
+    bool empty() const { return head_ == tail_; }
+    size_t capacity() const { return capacity_; }
+
+    // Ensure at least min_free contiguous bytes are writable at the tail.
+    // Invalidates pointers previously obtained from data().
+    void prepare(size_t min_free = 1) {
+        if (capacity_ - tail_ >= min_free) {
+            return;
+        }
+        if (head_ > 0) {
+            std::memmove(storage_.get(), storage_.get() + head_, size());
+            tail_ -= head_;
+            head_ = 0;
+            if (capacity_ - tail_ >= min_free) {
+                return;
+            }
+        }
+
+        size_t new_capacity = capacity_ ? capacity_ * 2 : initial_capacity_;
+        while (new_capacity - tail_ < min_free) {
+            new_capacity *= 2;
+        }
+        const BufferStorage* source = storage_.get_deleter().source;
+        std::unique_ptr<char[], Deleter> grown(source ? source->allocate(new_capacity) : new char[new_capacity],
+                                               Deleter{source});
+        if (tail_ > 0) {
+            std::memcpy(grown.get(), storage_.get(), tail_);
+        }
+        storage_ = std::move(grown);
+        capacity_ = new_capacity;
+    }
+
+    char* write_ptr() { return storage_.get() + tail_; }
+    size_t writable() const { return capacity_ - tail_; }
+    void commit(size_t bytes) { tail_ += bytes; }
+
+    void consume(size_t bytes) {
+        head_ += bytes;
+        if (head_ == tail_) {
+            head_ = tail_ = 0;
+        }
+    }
+
+    // Drop the storage of an empty buffer so idle connections cost nothing
+    void release() {
+        if (empty()) {
+            storage_.reset();
+            capacity_ = 0;
+        }
+    }
+
+private:
+    struct Deleter {
+        const BufferStorage* source;
+        void operator()(char* data) const {
+            if (source) {
+                source->deallocate(data);
+            } else {
+                delete[] data;
+            }
+        }
+    };
+
+    std::unique_ptr<char[], Deleter> storage_;
+    size_t capacity_ = 0;
+    size_t head_ = 0;
+    size_t tail_ = 0;
+    size_t initial_capacity_;
+};
+
+// A frame parsed in place; payload points into the RingBuffer and stays
+// valid until the next call to FrameParser::next() or RingBuffer::prepare().
+// For streamed frames payload holds only the STREAMED_META_SIZE metadata
+// bytes, and body_length bytes of data follow on the stream.
+struct FrameView {
+    FrameHeader header;
+    const char* payload = nullptr;
+    uint32_t body_length = 0;
+
+    bool streamed() const { return (header.flags & FRAME_FLAG_STREAMED) != 0; }
+
+    std::string text() const { return std::string(payload, header.length); }
+    std::string_view view() const { return std::string_view(payload, header.length); }
+};
+
+enum class ParseResult { FRAME, NEED_MORE, INVALID };
+
+// Incremental frame parser: yields every complete frame buffered so far
+// and leaves partial ones in place until the rest arrives. Streamed frames
+// are yielded as soon as their metadata is buffered, leaving the caller to
+// consume the body.
+class FrameParser {
+public:
+    explicit FrameParser(uint32_t max_payload = MAX_FRAME_PAYLOAD)
+        : max_payload_(max_payload) {}
+
+    ParseResult next(RingBuffer& buffer, FrameView& frame) {
+        if (buffer.size() < static_cast<size_t>(FRAME_HEADER_SIZE)) {
+            return ParseResult::NEED_MORE;
+        }
+
+        FrameHeader header = decode_header(buffer.data());
+        uint32_t buffered_length = header.length;
+        uint32_t body_length = 0;
+        if (header.flags & FRAME_FLAG_STREAMED) {
+            if (header.length < static_cast<uint32_t>(STREAMED_META_SIZE)) {
+                return ParseResult::INVALID;
+            }
+            buffered_length = STREAMED_META_SIZE;
+            body_length = header.length - STREAMED_META_SIZE;
+        }
+        else if (header.length > max_payload_) {
+            return ParseResult::INVALID;
+        }
+
+        size_t total = FRAME_HEADER_SIZE + buffered_length;
+        if (buffer.size() < total) {
+            // Make sure the next read has room for the whole frame
+            buffer.prepare(total - buffer.size());
+            return ParseResult::NEED_MORE;
+        }
+
+        frame.header = header;
+        frame.payload = buffer.data() + FRAME_HEADER_SIZE;
+        frame.body_length = body_length;
+        buffer.consume(total);
+        return ParseResult::FRAME;
+    }
+
+private:
+    uint32_t max_payload_;
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef ROSTER_H
+#define ROSTER_H
+
+// Roster entries as carried by CLIENT_LIST and PRESENCE frames:
+//   u64 id | u8 idle | u64 connected (unix seconds) | u8 name length |
+//   name | u8 address length | address
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+
+#include "protocol.h"
+
+struct RosterEntry {
+    uint64_t id = 0;
+    bool idle = false;
+    int64_t connected = 0;
+    std::string name;
+    std::string address;
+};
+
+// Names and addresses are short (MAX_USERNAME_LENGTH, dotted quads)
+constexpr size_t MAX_ROSTER_ENTRY_SIZE = 2 * sizeof(uint64_t) + 3 + 2 * 255;
+
+inline void encode_roster_entry(std::string& out, uint64_t id, bool idle, int64_t connected,
+                                const std::string& name, const std::string& address) {
+    char fixed[2 * sizeof(uint64_t) + 1];
+    put_u64(fixed, id);
+    fixed[sizeof(uint64_t)] = idle ? 1 : 0;
+    put_u64(fixed + sizeof(uint64_t) + 1, static_cast<uint64_t>(connected));
+    out.append(fixed, sizeof(fixed));
+
+    size_t name_length = std::min<size_t>(name.size(), 255);
+    out += static_cast<char>(name_length);
+    out.append(name, 0, name_length);
+    size_t address_length = std::min<size_t>(address.size(), 255);
+    out += static_cast<char>(address_length);
+    out.append(address, 0, address_length);
+}
+
+// Decode the entry at p, advancing p past it; false if it runs past end
+inline bool decode_roster_entry(const char*& p, const char* end, RosterEntry& entry) {
+    constexpr size_t fixed = 2 * sizeof(uint64_t) + 1;
+    if (static_cast<size_t>(end - p) < fixed + 1) {
+        return false;
+    }
+    entry.id = get_u64(p);
+    entry.idle = p[sizeof(uint64_t)] != 0;
+    entry.connected = static_cast<int64_t>(get_u64(p + sizeof(uint64_t) + 1));
+    p += fixed;
+
+    for (std::string* text : {&entry.name, &entry.address}) {
+        if (p >= end) {
+            return false;
+        }
+        size_t length = static_cast<unsigned char>(*p++);
+        if (static_cast<size_t>(end - p) < length) {
+            return false;
+        }
+        text->assign(p, length);
+        p += length;
+    }
+    return true;
+}
+
+#endif
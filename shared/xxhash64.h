@@ -0,0 +1,167 @@
+#ifndef XXHASH64_H
+#define XXHASH64_H
+
+// XXH64 (https://github.com/Cyan4973/xxHash), re-implemented from the
+// published algorithm. Four independent 64-bit lanes consume 32-byte
+// stripes, so the compiler keeps them all in flight at once; it hashes at
+// memory speed and identifies upload contents.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+class XxHash64 {
+public:
+    explicit XxHash64(uint64_t seed = 0) { reset(seed); }
+
+    void reset(uint64_t seed = 0) {
+        lanes_[0] = seed + PRIME1 + PRIME2;
+        lanes_[1] = seed + PRIME2;
+        lanes_[2] = seed;
+        lanes_[3] = seed - PRIME1;
+        seed_ = seed;
+        total_ = 0;
+        buffered_ = 0;
+    }
+
+    void update(const void* data, size_t len) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        total_ += len;
+
+        // Top up a partial stripe left by the previous call
+        if (buffered_ > 0) {
+            size_t take = len < STRIPE - buffered_ ? len : STRIPE - buffered_;
+            std::memcpy(buffer_ + buffered_, p, take);
+            buffered_ += take;
+            p += take;
+            len -= take;
+            if (buffered_ < STRIPE) {
+                return;
+            }
+            consume_stripe(buffer_);
+            buffered_ = 0;
+        }
+
+        // Lanes live in registers for the bulk loop
+        uint64_t v1 = lanes_[0], v2 = lanes_[1], v3 = lanes_[2], v4 = lanes_[3];
+        while (len >= STRIPE) {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+            p += STRIPE;
+            len -= STRIPE;
+        }
+        lanes_[0] = v1;
+        lanes_[1] = v2;
+        lanes_[2] = v3;
+        lanes_[3] = v4;
+
+        if (len > 0) {
+            std::memcpy(buffer_, p, len);
+            buffered_ = len;
+        }
+    }
+
+    uint64_t digest() const {
+        uint64_t h;
+        if (total_ >= STRIPE) {
+            h = rotl(lanes_[0], 1) + rotl(lanes_[1], 7) + rotl(lanes_[2], 12) + rotl(lanes_[3], 18);
+            for (uint64_t lane : lanes_) {
+                h = merge(h, lane);
+            }
+        } else {
+            h = seed_ + PRIME5;
+        }
+        h += total_;
+
+        const unsigned char* p = buffer_;
+        size_t len = buffered_;
+        while (len >= 8) {
+            h ^= round(0, read64(p));
+            h = rotl(h, 27) * PRIME1 + PRIME4;
+            p += 8;
+            len -= 8;
+        }
+        if (len >= 4) {
+            h ^= static_cast<uint64_t>(read32(p)) * PRIME1;
+            h = rotl(h, 23) * PRIME2 + PRIME3;
+            p += 4;
+            len -= 4;
+        }
+        while (len > 0) {
+            h ^= *p * PRIME5;
+            h = rotl(h, 11) * PRIME1;
+            p++;
+            len--;
+        }
+
+        h ^= h >> 33;
+        h *= PRIME2;
+        h ^= h >> 29;
+        h *= PRIME3;
+        h ^= h >> 32;
+        return h;
+    }
+
+    static uint64_t hash(const void* data, size_t len, uint64_t seed = 0) {
+        XxHash64 state(seed);
+        state.update(data, len);
+        return state.digest();
+    }
+
+private:
+    static constexpr uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+    static constexpr uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+    static constexpr uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+    static constexpr uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+    static constexpr uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+    static constexpr size_t STRIPE = 32;
+
+    static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+    // Little-endian loads, whatever the host byte order
+    static uint64_t read64(const unsigned char* p) {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        v = __builtin_bswap64(v);
+#endif
+        return v;
+    }
+
+    static uint32_t read32(const unsigned char* p) {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        v = __builtin_bswap32(v);
+#endif
+        return v;
+    }
+
+    static uint64_t round(uint64_t acc, uint64_t input) {
+        acc += input * PRIME2;
+        acc = rotl(acc, 31);
+        return acc * PRIME1;
+    }
+
+    static uint64_t merge(uint64_t acc, uint64_t lane) {
+        acc ^= round(0, lane);
+        return acc * PRIME1 + PRIME4;
+    }
+
+    void consume_stripe(const unsigned char* p) {
+        lanes_[0] = round(lanes_[0], read64(p));
+        lanes_[1] = round(lanes_[1], read64(p + 8));
+        lanes_[2] = round(lanes_[2], read64(p + 16));
+        lanes_[3] = round(lanes_[3], read64(p + 24));
+    }
+
+    uint64_t lanes_[4];
+    uint64_t seed_;
+    uint64_t total_;
+    unsigned char buffer_[STRIPE];
+    size_t buffered_;
+};
+
+#endif
@@ -0,0 +1,84 @@
+// Steady-state chat must not touch the heap: once a room's traffic has
+// warmed up the pools and buffers, relaying and logging more of the same
+// messages may not call operator new (heap_allocs in STATS) more than a
+// few times in all.
+
+#include <cstdio>
+
+#include "harness.h"
+
+namespace {
+
+constexpr int RECEIVERS = 8;
+constexpr int BURST = 100;              // Messages sent before the room drains them
+constexpr int WARMUP_MESSAGES = 3000;
+constexpr int MEASURED_MESSAGES = 10000;
+
+// Stray allocations allowed per MEASURED_MESSAGES, for things that don't
+// scale with traffic (a timer tick, a log segment rotating)
+constexpr int64_t ALLOWED_ALLOCATIONS = 10;
+
+// The server's heap_allocs, or -1
+int64_t heap_allocs(TestClient& client) {
+    TestClient::Frame reply;
+    if (!client.send(STATS, "") || !client.wait_for(STATS, reply)) {
+        return -1;
+    }
+    size_t line = reply.payload.find("heap_allocs ");
+    return line == std::string::npos ? -1 : std::stoll(reply.payload.substr(line + 12));
+}
+
+// Send count messages of one size, every receiver reading each one
+bool chat(TestClient& sender, std::vector<TestClient>& receivers, int count, int& sequence) {
+    for (int sent = 0; sent < count; sent += BURST) {
+        std::string last;
+        for (int i = 0; i < BURST; i++) {
+            char line[64];
+            std::snprintf(line, sizeof(line), "steady message %08d", sequence++);
+            if (!sender.send(MESSAGE, line)) {
+                return false;
+            }
+            last = line;
+        }
+        for (TestClient& receiver : receivers) {
+            if (!receiver.wait_for_message(last)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::string mode = argc > 1 ? argv[1] : "threads";
+    TestServer server(mode);
+
+    TestClient sender;
+    std::vector<TestClient> receivers(RECEIVERS);
+    CHECK(sender.login("sender"));
+    CHECK(sender.wait_for_message("sender joined the chat"));
+    for (int i = 0; i < RECEIVERS; i++) {
+        std::string name = "receiver" + std::to_string(i);
+        CHECK(receivers[i].login(name));
+        CHECK(receivers[i].wait_for_message(name + " joined the chat"));
+    }
+
+    int sequence = 0;
+    CHECK(chat(sender, receivers, WARMUP_MESSAGES, sequence));
+
+    // Two STATS back to back give what answering one costs
+    int64_t before = heap_allocs(sender);
+    int64_t start = heap_allocs(sender);
+    CHECK(chat(sender, receivers, MEASURED_MESSAGES, sequence));
+    int64_t end = heap_allocs(sender);
+    CHECK(before >= 0 && start >= 0 && end >= 0);
+
+    int64_t allocations = (end - start) - (start - before);
+    std::cout << "  " << allocations << " heap allocations for " << MEASURED_MESSAGES << " messages to "
+              << RECEIVERS << " receivers" << std::endl;
+    CHECK(allocations <= ALLOWED_ALLOCATIONS);
+
+    return test_result("allocation_test", mode);
+}
@@ -0,0 +1,92 @@
+// Chat log recovery: a segment holding a valid record too big to replay,
+// garbage between records and a torn record at its end. A restart must
+// keep every intact chat line, skip the rest and cut off only the tail.
+
+#include "harness.h"
+#include "../shared/xxhash64.h"
+
+namespace {
+
+const std::string SEGMENT = "chatlog/0000000000000001.log";
+constexpr size_t RECORD_PREFIX_SIZE = 8;
+constexpr size_t RECORD_FIXED_SIZE = 9;
+
+// Split a segment into its records, by their length fields
+std::vector<std::string> split_records(const std::string& segment) {
+    std::vector<std::string> records;
+    size_t offset = 0;
+    while (offset + RECORD_PREFIX_SIZE <= segment.size()) {
+        size_t size = RECORD_PREFIX_SIZE + get_u32(segment.data() + offset);
+        records.push_back(segment.substr(offset, size));
+        offset += size;
+    }
+    return records;
+}
+
+// A well-formed record of a chat line, as the server writes them
+std::string make_record(const std::string& room, const std::string& line, uint64_t time_ms) {
+    std::string body(RECORD_FIXED_SIZE, '\0');
+    put_u64(&body[0], time_ms);
+    body[8] = static_cast<char>(room.size());
+    body += room;
+    body += make_frame(MESSAGE, line.data(), line.size());
+
+    std::string record(RECORD_PREFIX_SIZE, '\0');
+    put_u32(&record[0], static_cast<uint32_t>(body.size()));
+    put_u32(&record[4], static_cast<uint32_t>(XxHash64::hash(body.data(), body.size())));
+    return record + body;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::string mode = argc > 1 ? argv[1] : "threads";
+    TestServer server(mode);
+
+    TestClient alice;
+    TestClient bob;
+    CHECK(alice.login("alice"));
+    CHECK(bob.login("bob"));
+    CHECK(bob.wait_for_message("bob joined the chat"));
+    for (const char* line : {"one", "two", "three"}) {
+        CHECK(alice.send(MESSAGE, line));
+        CHECK(bob.wait_for_message(std::string("[alice]: ") + line));
+    }
+    alice.close();
+    bob.close();
+    server.stop();
+
+    std::vector<std::string> records = split_records(read_file(server.path(SEGMENT)));
+    CHECK(records.size() == 3);
+    if (records.size() != 3) {
+        return test_result("chat_log_recovery_test", mode);
+    }
+
+    // A record older builds could write: a full-size payload from a user
+    // and room with the longest names
+    uint64_t time_ms = get_u64(records[0].data() + RECORD_PREFIX_SIZE);
+    std::string long_name(MAX_USERNAME_LENGTH, 'u');
+    std::string long_room = "#" + std::string(MAX_ROOM_NAME_LENGTH - 1, 'r');
+    std::string oversized = make_record(long_room, "[" + long_name + "]: " + std::string(MAX_FRAME_PAYLOAD, 'x'),
+                                        time_ms);
+
+    std::string garbage(100, '\xa5');
+    std::string torn = records[2].substr(0, records[2].size() / 2);
+    std::string kept = oversized + records[0] + garbage + records[1] + records[2];
+    {
+        std::ofstream segment(server.path(SEGMENT), std::ios::binary | std::ios::trunc);
+        segment << kept << torn;
+    }
+
+    server.start();
+    CHECK(bob.login("bob"));
+    for (const char* line : {"one", "two", "three"}) {
+        CHECK(bob.wait_for_message(std::string("[alice]: ") + line));
+    }
+    CHECK(bob.wait_for_message("bob joined the chat"));
+
+    // Only the torn tail is gone
+    CHECK(read_file(server.path(SEGMENT)) == kept);
+
+    return test_result("chat_log_recovery_test", mode);
+}
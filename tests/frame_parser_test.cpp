@@ -0,0 +1,170 @@
+// Frame parser: a stream of frames read in pieces of every size, from one
+// byte at a time to all of it at once, parses into the same frames in the
+// same order. Streamed bodies are left for the caller, and oversized or
+// truncated headers are rejected.
+
+#include "harness.h"
+
+namespace {
+
+struct Parsed {
+    uint8_t type;
+    uint16_t stream;
+    std::string payload;
+    std::string body;   // Streamed frames only
+};
+
+// Append bytes at the buffer's tail, as a read would
+void feed(RingBuffer& buffer, const char* data, size_t length) {
+    buffer.prepare(length);
+    std::memcpy(buffer.write_ptr(), data, length);
+    buffer.commit(length);
+}
+
+// Parse the stream fed piece bytes at a time; false if the parser
+// rejected it
+bool parse_in_pieces(const std::string& stream, size_t piece, std::vector<Parsed>& frames) {
+    RingBuffer buffer(64);
+    FrameParser parser;
+    size_t body_left = 0;
+    for (size_t fed = 0; fed < stream.size() || !buffer.empty();) {
+        if (fed < stream.size()) {
+            size_t length = std::min(piece, stream.size() - fed);
+            feed(buffer, stream.data() + fed, length);
+            fed += length;
+        }
+
+        while (true) {
+            if (body_left > 0) {
+                // The caller's part: take the streamed body off the buffer
+                size_t take = std::min(body_left, buffer.size());
+                frames.back().body.append(buffer.data(), take);
+                buffer.consume(take);
+                body_left -= take;
+                if (body_left > 0) {
+                    break;
+                }
+            }
+
+            FrameView frame;
+            ParseResult result = parser.next(buffer, frame);
+            if (result == ParseResult::INVALID) {
+                return false;
+            }
+            if (result == ParseResult::NEED_MORE) {
+                break;
+            }
+            std::string payload(frame.payload, frame.header.length - frame.body_length);
+            frames.push_back(Parsed{frame.header.type, frame.header.stream, payload, std::string()});
+            body_left = frame.body_length;
+        }
+
+        if (fed == stream.size() && !buffer.empty() && body_left == 0) {
+            return false;   // Left over bytes that never make a frame
+        }
+    }
+    return body_left == 0;
+}
+
+// What a stream parses into when read one piece size at a time, for
+// every piece size up to its length
+bool parses_the_same(const std::string& stream, const std::vector<Parsed>& expected) {
+    bool same = true;
+    for (size_t piece = 1; piece <= stream.size(); piece++) {
+        std::vector<Parsed> frames;
+        bool parsed = parse_in_pieces(stream, piece, frames) && frames.size() == expected.size();
+        for (size_t i = 0; parsed && i < frames.size(); i++) {
+            parsed = frames[i].type == expected[i].type && frames[i].stream == expected[i].stream &&
+                     frames[i].payload == expected[i].payload && frames[i].body == expected[i].body;
+        }
+        if (!parsed) {
+            std::cerr << "  misparsed in pieces of " << piece << " bytes" << std::endl;
+            same = false;
+        }
+    }
+    return same;
+}
+
+// A streamed FILE_CHUNK: header and metadata, then the body raw
+std::string streamed_frame(const std::string& meta, const std::string& body, uint16_t stream) {
+    FrameHeader header;
+    header.type = FILE_CHUNK;
+    header.flags = FRAME_FLAG_STREAMED;
+    header.stream = stream;
+    header.length = static_cast<uint32_t>(meta.size() + body.size());
+    char encoded[FRAME_HEADER_SIZE];
+    encode_header(encoded, header);
+    return std::string(encoded, sizeof(encoded)) + meta + body;
+}
+
+} // namespace
+
+int main() {
+    std::vector<Parsed> expected;
+    std::string stream;
+    auto add = [&](uint8_t type, const std::string& payload, uint16_t stream_id) {
+        expected.push_back(Parsed{type, stream_id, payload, std::string()});
+        stream += make_frame(type, payload.data(), payload.size(), 0, stream_id);
+    };
+
+    // Empty, short and larger than the buffer's first allocation, with a
+    // streamed chunk in between
+    add(PING, "", 0);
+    add(MESSAGE, "hello", 0);
+    add(MESSAGE, std::string(300, 'x'), 0);
+    std::string meta = encode_u64(7) + encode_u64(0);
+    std::string body(200, 'b');
+    expected.push_back(Parsed{FILE_CHUNK, 3, meta, body});
+    stream += streamed_frame(meta, body, 3);
+    add(STATS, "", 5);
+    add(MESSAGE, "bye", 0);
+    CHECK(parses_the_same(stream, expected));
+
+    // A streamed chunk with no body at all
+    expected.clear();
+    stream.clear();
+    expected.push_back(Parsed{FILE_CHUNK, 1, meta, std::string()});
+    stream += streamed_frame(meta, "", 1);
+    add(MESSAGE, "after", 0);
+    CHECK(parses_the_same(stream, expected));
+
+    // A payload up to the parser's limit is a frame, one byte more is not
+    {
+        RingBuffer buffer;
+        FrameParser parser(100);
+        FrameView frame;
+        std::string largest = make_frame(MESSAGE, std::string(100, 'm'));
+        feed(buffer, largest.data(), largest.size());
+        CHECK(parser.next(buffer, frame) == ParseResult::FRAME && frame.header.length == 100);
+
+        std::string oversized = make_frame(MESSAGE, std::string(101, 'm'));
+        feed(buffer, oversized.data(), FRAME_HEADER_SIZE);   // The header alone is enough
+        CHECK(parser.next(buffer, frame) == ParseResult::INVALID);
+    }
+
+    // A streamed frame too short for its metadata
+    {
+        RingBuffer buffer;
+        FrameParser parser;
+        FrameView frame;
+        std::string truncated = streamed_frame(std::string(STREAMED_META_SIZE - 1, 'm'), "", 0);
+        feed(buffer, truncated.data(), truncated.size());
+        CHECK(parser.next(buffer, frame) == ParseResult::INVALID);
+    }
+
+    // Half a frame asks for room for the rest of it
+    {
+        RingBuffer buffer(16);
+        FrameParser parser;
+        FrameView frame;
+        std::string large = make_frame(MESSAGE, std::string(1000, 'l'));
+        feed(buffer, large.data(), 10);
+        CHECK(parser.next(buffer, frame) == ParseResult::NEED_MORE);
+        CHECK(buffer.writable() >= large.size() - 10);
+        feed(buffer, large.data() + 10, large.size() - 10);
+        CHECK(parser.next(buffer, frame) == ParseResult::FRAME && frame.text() == std::string(1000, 'l'));
+        CHECK(buffer.empty());
+    }
+
+    return test_result("frame_parser_test", "unit");
+}
@@ -0,0 +1,338 @@
+#ifndef HARNESS_H
+#define HARNESS_H
+
+// Loopback test harness. A test program starts the server binary in a
+// scratch directory, talks to it over plain sockets in raw frames and
+// checks what comes back with CHECK. It exits non-zero if any check
+// failed, keeping the scratch directory (and the server's log in it) for
+// a look. POSIX only: the server is run with fork() and exec().
+//
+// Every loopback test takes the server mode to run as its only argument;
+// make test runs each one against every mode. Unit tests use only CHECK
+// and test_result, on server or shared code built into them.
+
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+
+#include "../shared/platform.h"
+#include "../shared/constants.h"
+#include "../shared/protocol.h"
+#include "../shared/hello.h"
+
+using Clock = std::chrono::steady_clock;
+
+// How long a reply may take before a check gives up on it
+constexpr auto REPLY_TIMEOUT = std::chrono::seconds(5);
+
+inline int failures = 0;
+
+#define CHECK(condition)                                                             \
+    do {                                                                             \
+        if (!(condition)) {                                                          \
+            std::cerr << "✗ " << __FILE__ << ":" << __LINE__ << ": " #condition      \
+                      << std::endl;                                                  \
+            failures++;                                                              \
+        }                                                                            \
+    } while (0)
+
+// Report the outcome of a test program as its exit status
+inline int test_result(const char* name, const std::string& mode) {
+    if (failures > 0) {
+        std::cerr << "✗ " << name << " (" << mode << "): " << failures << " failed" << std::endl;
+        return 1;
+    }
+    std::cout << "✓ " << name << " (" << mode << ")" << std::endl;
+    return 0;
+}
+
+inline std::string encode_u64(uint64_t value) {
+    char encoded[sizeof(uint64_t)];
+    put_u64(encoded, value);
+    return std::string(encoded, sizeof(encoded));
+}
+
+// A server process on PORT, running in its own scratch directory. The
+// binary is $CHAT_SERVER, or ../server/server.
+class TestServer {
+public:
+    TestServer(const std::string& mode, const std::vector<std::string>& options = {}) {
+        const char* binary = std::getenv("CHAT_SERVER");
+        args_ = {std::filesystem::absolute(binary ? binary : "../server/server").string(), "--mode=" + mode};
+        args_.insert(args_.end(), options.begin(), options.end());
+
+        char scratch[] = "/tmp/chat-test-XXXXXX";
+        if (!mkdtemp(scratch)) {
+            throw std::runtime_error("Cannot create a scratch directory");
+        }
+        dir_ = scratch;
+        start();
+    }
+
+    ~TestServer() {
+        stop();
+        std::error_code ignored;
+        if (failures == 0) {
+            std::filesystem::remove_all(dir_, ignored);
+        } else {
+            std::cerr << "  server directory kept: " << dir_ << std::endl;
+        }
+    }
+
+    TestServer(const TestServer&) = delete;
+    TestServer& operator=(const TestServer&) = delete;
+
+    // Run the server, again after stop() to restart it on what it left
+    void start() {
+        wait_until_port_free();
+        std::vector<std::string> args = args_;
+        pid_ = fork();
+        if (pid_ < 0) {
+            throw std::runtime_error("fork() failed");
+        }
+        if (pid_ == 0) {
+            std::vector<char*> argv;
+            for (std::string& arg : args) {
+                argv.push_back(&arg[0]);
+            }
+            argv.push_back(nullptr);
+            FILE* log = std::fopen((dir_ + "/server.log").c_str(), "a");
+            if (chdir(dir_.c_str()) != 0 || !log) {
+                _exit(127);
+            }
+            dup2(fileno(log), STDOUT_FILENO);
+            dup2(fileno(log), STDERR_FILENO);
+            execv(argv[0], argv.data());
+            _exit(127);
+        }
+        wait_until_listening();
+    }
+
+    // Shut the server down as SIGTERM does; the directory stays
+    void stop() {
+        if (pid_ > 0) {
+            kill(pid_, SIGTERM);
+            waitpid(pid_, nullptr, 0);
+            pid_ = -1;
+        }
+    }
+
+    std::string path(const std::string& relative) const { return dir_ + "/" + relative; }
+
+private:
+    void wait_until_port_free();
+    void wait_until_listening();
+
+    std::vector<std::string> args_;
+    std::string dir_;
+    pid_t pid_ = -1;
+};
+
+// A blocking connection speaking raw frames
+class TestClient {
+public:
+    TestClient() = default;
+    ~TestClient() { close(); }
+
+    TestClient(const TestClient&) = delete;
+    TestClient& operator=(const TestClient&) = delete;
+
+    struct Frame {
+        FrameHeader header;
+        std::string payload;
+    };
+
+    bool connect() {
+        close();
+        struct sockaddr_in address;
+        std::memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(PORT);
+        inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+
+        socket_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (socket_ == INVALID_SOCKET ||
+            ::connect(socket_, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0) {
+            close();
+            return false;
+        }
+        int nodelay = 1;
+        setsockopt(socket_, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        return true;
+    }
+
+    // Drop the connection without a DISCONNECT, as a crash or a lost
+    // network would
+    void close() {
+        if (socket_ != INVALID_SOCKET) {
+            ::closesocket(socket_);
+            socket_ = INVALID_SOCKET;
+        }
+        input_ = RingBuffer();
+    }
+
+    bool connected() const { return socket_ != INVALID_SOCKET; }
+
+    bool send_raw(const char* data, size_t len) {
+        while (len > 0) {
+            ssize_t sent = ::send(socket_, data, len, MSG_NOSIGNAL);
+            if (sent <= 0) {
+                return false;
+            }
+            data += sent;
+            len -= sent;
+        }
+        return true;
+    }
+
+    bool send(uint8_t type, const std::string& payload, uint8_t flags = 0, uint16_t stream = 0) {
+        std::string frame = make_frame(type, payload.data(), payload.size(), flags, stream);
+        return send_raw(frame.data(), frame.size());
+    }
+
+    // Log in the old way, with USERNAME_SET alone
+    bool login(const std::string& username) {
+        return connect() && send(USERNAME_SET, username);
+    }
+
+    // Log in with HELLO and wait for the server's reply
+    bool hello(const std::string& username, uint32_t capabilities, uint64_t session, Hello& reply,
+               int version = PROTOCOL_VERSION) {
+        Hello request;
+        request.version = version;
+        request.capabilities = capabilities;
+        request.session = session;
+        request.username = username;
+        Frame frame;
+        if (!connect() || !send(HELLO, encode_hello(request, false)) || !wait_for(HELLO, frame)) {
+            return false;
+        }
+        FrameView view;
+        view.header = frame.header;
+        view.payload = frame.payload.data();
+        return decode_hello(view, reply);
+    }
+
+    // The header and as much of the body of a FILE_CHUNK as given; a body
+    // shorter than length leaves the chunk unfinished
+    bool send_chunk(uint64_t id, int64_t offset, const char* body, size_t sent, size_t length) {
+        std::string meta = encode_u64(id) + encode_u64(static_cast<uint64_t>(offset));
+        FrameHeader header;
+        header.type = FILE_CHUNK;
+        header.flags = FRAME_FLAG_STREAMED;
+        header.length = static_cast<uint32_t>(STREAMED_META_SIZE + length);
+        char encoded[FRAME_HEADER_SIZE];
+        encode_header(encoded, header);
+        return send_raw(encoded, sizeof(encoded)) && send_raw(meta.data(), meta.size()) &&
+               send_raw(body, sent);
+    }
+
+    // The next frame, or false once the connection closes or nothing
+    // arrives in time
+    bool receive(Frame& frame, Clock::duration timeout = REPLY_TIMEOUT) {
+        auto deadline = Clock::now() + timeout;
+        FrameView view;
+        while (true) {
+            ParseResult result = parser_.next(input_, view);
+            if (result == ParseResult::FRAME) {
+                frame.header = view.header;
+                frame.payload = view.text();
+                return true;
+            }
+            if (result == ParseResult::INVALID || socket_ == INVALID_SOCKET) {
+                return false;
+            }
+
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now());
+            struct pollfd pfd = {socket_, POLLIN, 0};
+            if (left.count() <= 0 || poll(&pfd, 1, static_cast<int>(left.count())) <= 0) {
+                return false;
+            }
+            input_.prepare();
+            ssize_t received = recv(socket_, input_.write_ptr(), input_.writable(), 0);
+            if (received <= 0) {
+                return false;
+            }
+            input_.commit(received);
+        }
+    }
+
+    // Skip ahead to the next frame of a type
+    bool wait_for(uint8_t type, Frame& frame, Clock::duration timeout = REPLY_TIMEOUT) {
+        auto deadline = Clock::now() + timeout;
+        while (receive(frame, deadline - Clock::now())) {
+            if (frame.header.type == type) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Skip ahead to a MESSAGE containing text
+    bool wait_for_message(const std::string& text, Clock::duration timeout = REPLY_TIMEOUT) {
+        auto deadline = Clock::now() + timeout;
+        Frame frame;
+        while (wait_for(MESSAGE, frame, deadline - Clock::now())) {
+            if (frame.payload.find(text) != std::string::npos) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    SOCKET socket_ = INVALID_SOCKET;
+    RingBuffer input_;
+    FrameParser parser_;
+};
+
+// A server that just stopped can leave its listening socket behind for a
+// moment (io_uring closes its files after the process is gone)
+inline void TestServer::wait_until_port_free() {
+    auto deadline = Clock::now() + REPLY_TIMEOUT;
+    TestClient probe;
+    while (probe.connect()) {
+        probe.close();
+        if (Clock::now() >= deadline) {
+            throw std::runtime_error("Something else is listening on the server port");
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+}
+
+inline void TestServer::wait_until_listening() {
+    auto deadline = Clock::now() + REPLY_TIMEOUT;
+    TestClient probe;
+    while (!probe.connect()) {
+        int status;
+        if (waitpid(pid_, &status, WNOHANG) == pid_) {
+            pid_ = -1;
+            throw std::runtime_error("Server exited on startup, see " + path("server.log"));
+        }
+        if (Clock::now() >= deadline) {
+            throw std::runtime_error("Server is not listening, see " + path("server.log"));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+}
+
+// Contents of a file, empty if it can't be read
+inline std::string read_file(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+#endif
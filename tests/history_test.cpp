@@ -0,0 +1,77 @@
+// Room history arena: frames of mixed sizes appended round and round a
+// small arena. After every append the replay must be whole frames, in the
+// order they were posted, ending with the newest one.
+
+#include <random>
+
+#include "harness.h"
+#include "../server/history.h"
+
+namespace {
+
+// A frame of exactly size bytes whose payload tells it apart
+std::string numbered_frame(size_t size, int number) {
+    std::string payload = std::to_string(number);
+    payload.resize(size - FRAME_HEADER_SIZE, '.');
+    return make_frame(MESSAGE, payload.data(), payload.size());
+}
+
+// Check that the replay is the newest frames posted, in order
+bool replays_suffix(const History& history, const std::vector<std::string>& posted) {
+    FrameRef replay = history.replay(History::Clock::now());
+    if (!replay) {
+        return posted.empty();
+    }
+
+    std::vector<std::string> frames;
+    const char* p = replay->data();
+    const char* end = p + replay->size();
+    while (end - p >= static_cast<ptrdiff_t>(FRAME_HEADER_SIZE)) {
+        size_t size = FRAME_HEADER_SIZE + decode_header(p).length;
+        if (static_cast<size_t>(end - p) < size) {
+            return false;
+        }
+        frames.emplace_back(p, size);
+        p += size;
+    }
+    if (p != end || frames.empty() || frames.size() > posted.size()) {
+        return false;
+    }
+    return std::equal(frames.begin(), frames.end(), posted.end() - frames.size());
+}
+
+} // namespace
+
+int main() {
+    history_config.bytes = 100;
+    history_config.messages = 50;
+
+    // A frame evicts the oldest, at the end of the arena, while a newer
+    // one at the start is still in its way
+    {
+        History history;
+        std::vector<std::string> posted;
+        int number = 0;
+        for (size_t size : {30, 30, 30, 10, 60, 50}) {
+            posted.push_back(numbered_frame(size, number++));
+            history.append(posted.back().data(), posted.back().size(), History::Clock::now());
+            CHECK(replays_suffix(history, posted));
+        }
+    }
+
+    // Random sizes, with the entry ring the limit as often as the arena
+    for (size_t messages : {3, 50}) {
+        history_config.messages = messages;
+        History history;
+        std::vector<std::string> posted;
+        std::mt19937 random(1);
+        std::uniform_int_distribution<size_t> size(FRAME_HEADER_SIZE, history_config.bytes);
+        for (int number = 0; number < 2000; number++) {
+            posted.push_back(numbered_frame(size(random), number));
+            history.append(posted.back().data(), posted.back().size(), History::Clock::now());
+            CHECK(replays_suffix(history, posted));
+        }
+    }
+
+    return test_result("history_test", "unit");
+}
@@ -0,0 +1,136 @@
+// LZ4 block codec: inputs of every kind round-trip through one codec whose
+// match table carries over between calls, and hand-made blocks decode as
+// the format says. Truncated, corrupt and random blocks are rejected or
+// decoded without a byte written outside the output, and compression
+// gives up rather than overrun a buffer that is too small.
+
+#include <random>
+
+#include "harness.h"
+#include "../shared/lz4_block.h"
+
+namespace {
+
+// Bytes past each buffer that no call may touch
+constexpr size_t GUARD = 64;
+constexpr char CANARY = '\x5A';
+
+bool guard_intact(const std::string& buffer, size_t used) {
+    return buffer.find_first_not_of(CANARY, used) == std::string::npos;
+}
+
+// Decompress into exactly raw_size bytes followed by a guard
+bool decompress_guarded(const std::string& block, size_t raw_size, std::string& out) {
+    std::string buffer(raw_size + GUARD, CANARY);
+    bool decoded = Lz4Block::decompress(block.data(), block.size(), &buffer[0], raw_size);
+    CHECK(guard_intact(buffer, raw_size));
+    out = buffer.substr(0, raw_size);
+    return decoded;
+}
+
+bool round_trips(Lz4Block& codec, const std::string& input) {
+    std::string block(Lz4Block::bound(input.size()) + GUARD, CANARY);
+    size_t size = codec.compress(input.data(), input.size(), &block[0], Lz4Block::bound(input.size()));
+    if (size == 0 || !guard_intact(block, Lz4Block::bound(input.size()))) {
+        return false;
+    }
+    block.resize(size);
+
+    std::string output;
+    return decompress_guarded(block, input.size(), output) && output == input;
+}
+
+std::string random_bytes(std::mt19937& random, size_t size) {
+    std::string bytes(size, '\0');
+    for (char& c : bytes) {
+        c = static_cast<char>(random());
+    }
+    return bytes;
+}
+
+std::string text(size_t size) {
+    static const std::string line = "[alice]: the build is green again, shipping the chat log fix\n";
+    std::string out;
+    while (out.size() < size) {
+        out += line;
+    }
+    out.resize(size);
+    return out;
+}
+
+} // namespace
+
+int main() {
+    std::mt19937 random(1);
+    Lz4Block codec;
+
+    // Sizes around the match limits, then whole chunks and beyond the
+    // 64 KiB window
+    for (size_t size : {0, 1, 4, 5, 12, 13, 16, 17, 100, 65536, 65537, 300000}) {
+        CHECK(round_trips(codec, std::string(size, '\0')));
+        CHECK(round_trips(codec, text(size)));
+        CHECK(round_trips(codec, random_bytes(random, size)));
+    }
+
+    // Compressible runs between incompressible stretches, and long
+    // literal and match lengths that need continuation bytes
+    std::string mixed;
+    for (int i = 0; i < 20; i++) {
+        mixed += random_bytes(random, random() % 2000);
+        mixed += std::string(random() % 5000, static_cast<char>('a' + i));
+        mixed += text(random() % 3000);
+    }
+    CHECK(round_trips(codec, mixed));
+
+    // Repeats that overlap their own source
+    CHECK(round_trips(codec, text(64).substr(0, 3) + std::string(1000, '.') + "ab" + std::string(998, 'b')));
+
+    // Hand-made blocks: a literal repeated by an offset-1 match, and two
+    // literals by an overlapping offset-2 match, each ending in an empty
+    // last sequence
+    std::string output;
+    CHECK(decompress_guarded(std::string("\x13" "a" "\x01\x00" "\x00", 5), 8, output) && output == "aaaaaaaa");
+    CHECK(decompress_guarded(std::string("\x22" "ab" "\x02\x00" "\x00", 6), 8, output) && output == "abababab");
+    // Literal length 15 + 255 + 3 in continuation bytes
+    std::string long_literals = std::string("\xF0\xFF\x03", 3) + std::string(273, 'L');
+    CHECK(decompress_guarded(long_literals, 273, output) && output == std::string(273, 'L'));
+
+    // Malformed blocks
+    CHECK(!decompress_guarded(std::string("\x13" "a" "\x00\x00" "\x00", 5), 8, output));   // Offset 0
+    CHECK(!decompress_guarded(std::string("\x13" "a" "\x02\x00" "\x00", 5), 8, output));   // Before the output
+    CHECK(!decompress_guarded(std::string("\x1F" "a" "\x01\x00" "\xFF\xFF", 6), 8, output));   // Length cut off
+    CHECK(!decompress_guarded(std::string("\x1F" "a" "\x01\x00" "\x40", 5), 8, output));   // Past the output
+    CHECK(!decompress_guarded(std::string("\x50" "abc", 4), 5, output));   // Literals past the input
+    CHECK(!decompress_guarded(std::string("\xF0\xFF", 2), 300, output));   // Literal length cut off
+    CHECK(!decompress_guarded(std::string("\x13" "a" "\x01", 3), 8, output));   // Offset cut off
+    CHECK(!decompress_guarded(std::string("\x30" "abc", 4), 4, output));   // Short of the size
+
+    // Every truncation of a real block fails, as does the wrong size
+    std::string input = mixed.substr(0, 20000);
+    std::string block(Lz4Block::bound(input.size()), '\0');
+    block.resize(codec.compress(input.data(), input.size(), &block[0], block.size()));
+    CHECK(!block.empty());
+    for (size_t length = 0; length < block.size(); length++) {
+        CHECK(!decompress_guarded(block.substr(0, length), input.size(), output));
+    }
+    CHECK(!decompress_guarded(block, input.size() - 1, output));
+    CHECK(!decompress_guarded(block, input.size() + 1, output));
+
+    // Corrupt bytes anywhere and random garbage stay inside the output
+    for (int i = 0; i < 20000; i++) {
+        std::string corrupt = block;
+        corrupt[random() % corrupt.size()] = static_cast<char>(random());
+        decompress_guarded(corrupt, input.size(), output);
+        decompress_guarded(random_bytes(random, random() % 64), random() % 256, output);
+    }
+
+    // Too small a buffer: nothing written past it, and 0 back
+    std::string incompressible = random_bytes(random, 5000);
+    for (size_t capacity : {0, 1, 100, 4999}) {
+        std::string small(capacity + GUARD, CANARY);
+        CHECK(codec.compress(incompressible.data(), incompressible.size(), &small[0], capacity) == 0);
+        CHECK(guard_intact(small, capacity));
+    }
+
+    return test_result("lz4_block_test", "unit");
+}
@@ -0,0 +1,181 @@
+// Session resume: a client that loses its connection and logs in again
+// with its token inside the grace period gets its room, its roster entry
+// and the chat it missed back, and nobody is told it left. A token is
+// refused under another name and once the grace period is over, and a
+// resume drops a connection the server still thinks is alive. A HELLO from
+// too old a protocol version is answered with the server's and refused.
+
+#include "harness.h"
+#include "../shared/roster.h"
+
+namespace {
+
+// The value of a STATS counter, or -1
+int64_t counter(TestClient& client, const std::string& name) {
+    TestClient::Frame reply;
+    if (!client.send(STATS, "") || !client.wait_for(STATS, reply)) {
+        return -1;
+    }
+    size_t line = reply.payload.find(name + " ");
+    return line == std::string::npos ? -1 : std::stoll(reply.payload.substr(line + name.size() + 1));
+}
+
+// Wait until the server has parked a session; a lost connection is only
+// noticed once its socket reports the close
+bool wait_until_parked(TestClient& client, int64_t parked) {
+    auto deadline = Clock::now() + REPLY_TIMEOUT;
+    while (counter(client, "sessions_parked") < parked) {
+        if (Clock::now() >= deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    return true;
+}
+
+// Skip ahead to a MESSAGE containing text; false if one containing
+// unwanted comes first
+bool wait_for_message_without(TestClient& client, const std::string& text, const std::string& unwanted) {
+    TestClient::Frame frame;
+    while (client.wait_for(MESSAGE, frame)) {
+        if (frame.payload.find(unwanted) != std::string::npos) {
+            return false;
+        }
+        if (frame.payload.find(text) != std::string::npos) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The roster from a fresh snapshot, which fits one frame here
+std::vector<RosterEntry> roster(TestClient& client) {
+    std::vector<RosterEntry> entries;
+    TestClient::Frame frame;
+    if (!client.send(CLIENT_LIST, "") || !client.wait_for(CLIENT_LIST, frame)) {
+        return entries;
+    }
+    constexpr size_t head_size = sizeof(uint64_t) + 2 * sizeof(uint32_t);
+    const char* p = frame.payload.data() + std::min(head_size, frame.payload.size());
+    const char* end = frame.payload.data() + frame.payload.size();
+    RosterEntry entry;
+    while (p < end && decode_roster_entry(p, end, entry)) {
+        entries.push_back(entry);
+    }
+    return entries;
+}
+
+// The ID the roster lists a name under, or 0
+uint64_t roster_id(TestClient& client, const std::string& name) {
+    uint64_t id = 0;
+    for (const RosterEntry& entry : roster(client)) {
+        if (entry.name == name) {
+            CHECK(id == 0);
+            id = entry.id;
+        }
+    }
+    return id;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::string mode = argc > 1 ? argv[1] : "threads";
+
+    {
+        TestServer server(mode);
+
+        TestClient bob;
+        CHECK(bob.login("bob"));
+        CHECK(bob.send(ROOM_JOIN, "#x"));
+        CHECK(bob.wait_for_message("You are now in #x"));
+
+        TestClient alice;
+        Hello reply;
+        CHECK(alice.hello("alice", CAP_RESUME, 0, reply));
+        CHECK((reply.capabilities & CAP_RESUME) && reply.session != 0 && !reply.resumed);
+        uint64_t token = reply.session;
+        CHECK(alice.send(ROOM_JOIN, "#x"));
+        CHECK(alice.wait_for_message("You are now in #x"));
+        CHECK(bob.wait_for_message("alice joined #x"));
+        uint64_t id = roster_id(alice, "alice");
+        CHECK(id != 0);
+
+        // Lost without a DISCONNECT; the room chats on meanwhile
+        alice.close();
+        CHECK(wait_until_parked(bob, 1));
+        CHECK(bob.send(MESSAGE, "while you were away"));
+
+        // Someone else's token is not a way in
+        TestClient mallory;
+        CHECK(mallory.hello("mallory", CAP_RESUME, token, reply));
+        CHECK(!reply.resumed && reply.session != token);
+        CHECK(mallory.wait_for_message("mallory joined the chat"));
+
+        // Back within the grace period: same session, missed chat replayed
+        CHECK(alice.hello("alice", CAP_RESUME, token, reply));
+        CHECK(reply.resumed && reply.session == token);
+        CHECK(alice.wait_for_message("[bob]: while you were away"));
+
+        // Still in #x, and nobody heard about a departure
+        CHECK(alice.send(MESSAGE, "back again"));
+        CHECK(wait_for_message_without(bob, "[alice]: back again", "alice left"));
+        CHECK(alice.send(ROOM_JOIN, "#x"));
+        CHECK(alice.wait_for_message("You are already in #x"));
+
+        // The same roster entry, listed once
+        CHECK(roster_id(alice, "alice") == id);
+        CHECK(counter(bob, "sessions_resumed") == 1);
+
+        // A resume while the server still has the old connection open
+        // takes the session over and drops the old one
+        TestClient successor;
+        CHECK(successor.hello("alice", CAP_RESUME, token, reply));
+        CHECK(reply.resumed && reply.session == token);
+        auto deadline = Clock::now() + REPLY_TIMEOUT;
+        TestClient::Frame frame;
+        while (alice.receive(frame, deadline - Clock::now())) {
+        }
+        CHECK(Clock::now() < deadline);
+        CHECK(successor.send(MESSAGE, "taken over"));
+        CHECK(wait_for_message_without(bob, "[alice]: taken over", "alice left"));
+        CHECK(roster_id(successor, "alice") == id);
+
+        // Too old to talk to: told the server's version, given nothing,
+        // hung up on and never announced
+        TestClient elder;
+        CHECK(elder.hello("elder", CAP_RESUME, 0, reply, MIN_PROTOCOL_VERSION - 1));
+        CHECK(reply.version == PROTOCOL_VERSION && reply.capabilities == 0 && reply.session == 0);
+        deadline = Clock::now() + REPLY_TIMEOUT;
+        while (elder.receive(frame, deadline - Clock::now())) {
+        }
+        CHECK(Clock::now() < deadline);
+        CHECK(successor.send(MESSAGE, "still here"));
+        CHECK(wait_for_message_without(bob, "[alice]: still here", "elder joined"));
+    }
+
+    {
+        TestServer server(mode, {"--session-grace=1"});
+
+        TestClient bob;
+        CHECK(bob.login("bob"));
+        CHECK(bob.wait_for_message("bob joined the chat"));
+
+        TestClient alice;
+        Hello reply;
+        CHECK(alice.hello("alice", CAP_RESUME, 0, reply));
+        uint64_t token = reply.session;
+        CHECK(token != 0);
+        CHECK(bob.wait_for_message("alice joined the chat"));
+
+        // Past the grace period the departure is announced and the token
+        // is no good any more
+        alice.close();
+        CHECK(bob.wait_for_message("alice left the chat"));
+        CHECK(alice.hello("alice", CAP_RESUME, token, reply));
+        CHECK(!reply.resumed && reply.session != token);
+        CHECK(bob.wait_for_message("alice joined the chat"));
+    }
+
+    return test_result("session_resume_test", mode);
+}
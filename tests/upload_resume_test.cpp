@@ -0,0 +1,167 @@
+// Resuming a striped upload: a stream dies halfway through a chunk while
+// another has already stored a later one. Reconnecting must resume from the
+// end of the contiguous prefix (the partial chunk included, the later chunk
+// not), and once the gaps are filled the stored file must match. Then a
+// file striped over several streams, each sending its chunks out of order,
+// must be stored as sent.
+
+#include <algorithm>
+#include <random>
+
+#include "harness.h"
+#include "../shared/xxhash64.h"
+
+namespace {
+
+constexpr size_t PIECE = 1024 * 1024;
+constexpr size_t FILE_SIZE = 3 * PIECE + 12345;
+const std::string FILE_NAME = "resume.bin";
+
+// The striped upload: chunks of STRIPE_CHUNK over STRIPES streams
+constexpr size_t STRIPES = 4;
+constexpr size_t STRIPE_CHUNK = 64 * 1024;
+constexpr size_t STRIPED_SIZE = 40 * STRIPE_CHUNK + 4321;
+const std::string STRIPED_NAME = "striped.bin";
+
+std::string random_contents(size_t size, uint64_t seed = 7) {
+    std::mt19937_64 random(seed);
+    std::string contents(size, '\0');
+    for (char& c : contents) {
+        c = static_cast<char>(random());
+    }
+    return contents;
+}
+
+bool parse_ready(const TestClient::Frame& frame, uint64_t& id, int64_t& offset) {
+    if (frame.header.type != FILE_READY || frame.payload.size() != 2 * sizeof(uint64_t)) {
+        return false;
+    }
+    id = get_u64(frame.payload.data());
+    offset = static_cast<int64_t>(get_u64(frame.payload.data() + sizeof(uint64_t)));
+    return true;
+}
+
+// Offer the upload on a chat connection; the reply's transfer ID and offset
+bool offer(TestClient& owner, const std::string& contents, uint64_t& id, int64_t& offset,
+           const std::string& name = FILE_NAME) {
+    std::string header = encode_u64(contents.size()) +
+                         encode_u64(XxHash64::hash(contents.data(), contents.size())) + name;
+    TestClient::Frame frame;
+    return owner.send(FILE_TRANSFER, header) && owner.wait_for(FILE_READY, frame) &&
+           parse_ready(frame, id, offset);
+}
+
+// Open an extra stream for the upload; the offset it is told to resume from
+bool attach(TestClient& stream, uint64_t id, int64_t& offset) {
+    uint64_t replied_id = 0;
+    TestClient::Frame frame;
+    return stream.connect() && stream.send(FILE_ATTACH, encode_u64(id)) && stream.receive(frame) &&
+           parse_ready(frame, replied_id, offset) && replied_id == id;
+}
+
+bool send_range(TestClient& stream, uint64_t id, const std::string& contents, size_t start, size_t end) {
+    return stream.send_chunk(id, start, contents.data() + start, end - start, end - start);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::string mode = argc > 1 ? argv[1] : "threads";
+    const std::string contents = random_contents(FILE_SIZE);
+    TestServer server(mode);
+
+    TestClient owner;
+    uint64_t id = 0;
+    int64_t offset = -1;
+    CHECK(owner.login("uploader"));
+    CHECK(offer(owner, contents, id, offset));
+    CHECK(id != 0);
+    CHECK(offset == 0);
+
+    // The first piece over the chat connection, the third over a stream of
+    // its own, and half of the second over a stream that then dies
+    TestClient stream;
+    TestClient doomed;
+    CHECK(attach(stream, id, offset));
+    CHECK(attach(doomed, id, offset));
+    CHECK(send_range(owner, id, contents, 0, PIECE));
+    CHECK(send_range(stream, id, contents, 2 * PIECE, 3 * PIECE));
+    CHECK(doomed.send_chunk(id, PIECE, contents.data() + PIECE, PIECE / 2, PIECE));
+    doomed.close();
+
+    // What arrived of the cut chunk is kept; the third piece is not part of
+    // the prefix. Chunks land asynchronously, so ask until they have.
+    const int64_t prefix = PIECE + PIECE / 2;
+    auto deadline = Clock::now() + REPLY_TIMEOUT;
+    do {
+        TestClient probe;
+        CHECK(attach(probe, id, offset));
+        CHECK(offset <= prefix);
+        if (offset == prefix) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    } while (Clock::now() < deadline);
+    CHECK(offset == prefix);
+
+    // The whole client reconnects and offers the file again
+    owner.close();
+    stream.close();
+    uint64_t resumed_id = 0;
+    CHECK(owner.login("uploader"));
+    CHECK(offer(owner, contents, resumed_id, offset));
+    CHECK(resumed_id == id);
+    CHECK(offset == prefix);
+
+    // Fill both gaps, over two streams again
+    CHECK(attach(stream, id, offset));
+    CHECK(offset == prefix);
+    CHECK(send_range(stream, id, contents, prefix, 2 * PIECE));
+    CHECK(send_range(owner, id, contents, 3 * PIECE, FILE_SIZE));
+
+    TestClient::Frame done;
+    CHECK(owner.wait_for(FILE_DONE, done));
+    CHECK(done.payload == encode_u64(id));
+
+    std::string stored = read_file(server.path("uploads/" + FILE_NAME));
+    CHECK(stored.size() == FILE_SIZE);
+    CHECK(XxHash64::hash(stored.data(), stored.size()) == XxHash64::hash(contents.data(), contents.size()));
+    CHECK(stored == contents);
+
+    // A fresh upload over the chat connection and three streams. Each
+    // chunk goes to a random stream and they are sent in a shuffled order,
+    // so every stream delivers its share out of order and the last chunk
+    // can land before the first.
+    const std::string striped = random_contents(STRIPED_SIZE, 11);
+    uint64_t striped_id = 0;
+    CHECK(offer(owner, striped, striped_id, offset, STRIPED_NAME));
+    CHECK(striped_id != 0 && striped_id != id);
+    CHECK(offset == 0);
+
+    std::vector<TestClient> stripes(STRIPES - 1);
+    std::vector<TestClient*> streams = {&owner};
+    for (TestClient& stripe : stripes) {
+        CHECK(attach(stripe, striped_id, offset));
+        CHECK(offset == 0);
+        streams.push_back(&stripe);
+    }
+
+    std::vector<size_t> chunks;
+    for (size_t start = 0; start < STRIPED_SIZE; start += STRIPE_CHUNK) {
+        chunks.push_back(start);
+    }
+    std::mt19937 random(3);
+    std::shuffle(chunks.begin(), chunks.end(), random);
+    for (size_t start : chunks) {
+        size_t end = std::min(start + STRIPE_CHUNK, STRIPED_SIZE);
+        CHECK(send_range(*streams[random() % streams.size()], striped_id, striped, start, end));
+    }
+
+    CHECK(owner.wait_for(FILE_DONE, done));
+    CHECK(done.payload == encode_u64(striped_id));
+    stored = read_file(server.path("uploads/" + STRIPED_NAME));
+    CHECK(stored.size() == STRIPED_SIZE);
+    CHECK(stored == striped);
+
+    return test_result("upload_resume_test", mode);
+}
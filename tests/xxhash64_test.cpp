@@ -0,0 +1,78 @@
+// XXH64: the published reference hashes, lengths either side of every
+// tail and stripe boundary with and without a seed, and the same hash
+// however the input is split across update() calls.
+
+#include "harness.h"
+#include "../shared/xxhash64.h"
+
+namespace {
+
+struct Vector {
+    size_t length;
+    uint64_t hash;
+    uint64_t seeded;   // With SEED
+};
+
+constexpr uint64_t SEED = 0x9E3779B97F4A7C15ULL;
+
+// Hashes of the first length bytes of pattern(), from the xxHash
+// specification's algorithm
+const Vector VECTORS[] = {
+    {1, 0xE934A84ADB052768ULL, 0x126BB57A12364AA5ULL},
+    {3, 0xE5D2BE4AE4B3469AULL, 0x14551DF805BF04F2ULL},
+    {4, 0x3B4D7F7C6BD1AE90ULL, 0x6F79BC2062402943ULL},
+    {7, 0xF952F1901A5AFC9BULL, 0xD5D902E89B5CA4C3ULL},
+    {8, 0x506834122CB7B4D0ULL, 0x55FD7982D8C9EC98ULL},
+    {15, 0x235FAE1DCFEFFCDDULL, 0x424B6F33A9463009ULL},
+    {31, 0x5836F08607DBDA19ULL, 0xC3B22AA521ACD976ULL},
+    {32, 0xB3F0EC9D8D216DEAULL, 0xC5AAC757FDBCE98EULL},
+    {33, 0xC480DB428C35AB3EULL, 0x6EFFA97C58BE21D7ULL},
+    {63, 0x9522A419D60828F2ULL, 0x7E3BAB0A6CBD79C9ULL},
+    {64, 0x28BF42BB281AF2EEULL, 0xF94E1E7BC96B25E8ULL},
+    {100, 0xCD8C24467B8382ADULL, 0xFEED9DE9C78C9AF0ULL},
+    {1000, 0xD1BEE8E4F0603BBFULL, 0x959ED7070E81EDBBULL},
+};
+
+std::string pattern() {
+    std::string data(1000, '\0');
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = static_cast<char>(i * 31 % 251);
+    }
+    return data;
+}
+
+} // namespace
+
+int main() {
+    // Published reference values
+    CHECK(XxHash64::hash("", 0) == 0xEF46DB3751D8E999ULL);
+    CHECK(XxHash64::hash("a", 1) == 0xD24EC4F1A98C6E5BULL);
+    CHECK(XxHash64::hash("abc", 3) == 0x44BC2CF5AD770999ULL);
+    std::string fox = "The quick brown fox jumps over the lazy dog";
+    CHECK(XxHash64::hash(fox.data(), fox.size()) == 0x0B242D361FDA71BCULL);
+
+    std::string data = pattern();
+    for (const Vector& vector : VECTORS) {
+        CHECK(XxHash64::hash(data.data(), vector.length) == vector.hash);
+        CHECK(XxHash64::hash(data.data(), vector.length, SEED) == vector.seeded);
+    }
+
+    // Fed in pieces of every size, so that some calls top up a buffered
+    // partial stripe and others go straight to the bulk loop
+    for (size_t piece = 1; piece <= 100; piece++) {
+        XxHash64 hasher(SEED);
+        for (size_t offset = 0; offset < data.size(); offset += piece) {
+            hasher.update(data.data() + offset, std::min(piece, data.size() - offset));
+        }
+        CHECK(hasher.digest() == 0x959ED7070E81EDBBULL);
+    }
+
+    // reset() starts over
+    XxHash64 hasher;
+    hasher.update(fox.data(), fox.size());
+    hasher.reset();
+    hasher.update("abc", 3);
+    CHECK(hasher.digest() == 0x44BC2CF5AD770999ULL);
+
+    return test_result("xxhash64_test", "unit");
+}